@@ -0,0 +1,57 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define NS_PER_SEC 1000000000ULL
+#define BENCH_MAX_CPUS 1024
+
+/**
+ * Shared by the benchmarks built with make bench.
+ *
+ * Latencies are collected into a fixed size histogram of raw samples,
+ * sorted once at the end for exact percentiles. Hardware counters are
+ * read through perf_event_open for the calling thread, and reported as
+ * unavailable rather than failing the run when the kernel or the
+ * sandbox doesn't allow them, perf_event_paranoid must be 1 or lower
+ * to count without root.
+ */
+
+enum perf_counter_id {
+  PERF_CYCLES,
+  PERF_INSTRUCTIONS,
+  PERF_CACHE_MISSES,
+  PERF_CONTEXT_SWITCHES,
+  PERF_COUNTERS
+};
+
+struct perf_counters {
+  int fds[PERF_COUNTERS];
+  uint64_t values[PERF_COUNTERS];
+};
+
+struct bench_hist {
+  uint64_t* samples;
+  size_t count;
+  size_t cap;
+  uint64_t overflow; // samples past cap, not kept
+};
+
+uint64_t bench_now_ns();
+int bench_pin(int cpu);
+
+int parse_cpu_list(const char* list, int* cpus, int max);
+int read_cpu_list(const char* path, int* cpus, int max);
+
+int hist_init(struct bench_hist* hist, size_t cap);
+void hist_add(struct bench_hist* hist, uint64_t sample);
+void hist_report(const char* label, struct bench_hist* hist);
+void hist_cleanup(struct bench_hist* hist);
+
+void perf_start(struct perf_counters* perf, bool inherit);
+void perf_stop(struct perf_counters* perf);
+void perf_report(const char* label, const struct perf_counters* perf, uint64_t ops);
+
+#endif // BENCH_H
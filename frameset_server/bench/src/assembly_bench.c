@@ -0,0 +1,356 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "assembler.h"
+#include "bench.h"
+#include "spsc_queue.h"
+#include "stream_mgr.h"
+
+/**
+ * Drives the frameset assembly loop with synthetic cameras.
+ *
+ * Usage: assembly_bench [-c cams] [-f fps] [-s seconds] [-j jitter_us]
+ *                       [-d drop_permille] [-t timeout_ms]
+ *
+ * A thread per camera stands in for its decoder, delivering a frame per
+ * scheduled capture into the camera's filled queue, late by a random
+ * jitter of up to jitter_us, and skipping a capture now and then when
+ * drop_permille is set. The main thread runs the same loop as the
+ * server's main.c, draining the queues into the assembler and sleeping
+ * on the queue events and the deadline timer through epoll, but hands
+ * each frameset's buffers straight back rather than publishing them to
+ * shared memory.
+ *
+ * Reports framesets per second, how many were complete, partial or
+ * dropped, the latency from the capture schedule to the frameset being
+ * emitted, and the main loop's hardware counters per frameset.
+ */
+
+#define DEFAULT_CAMS 8
+#define DEFAULT_FPS 30
+#define DEFAULT_SECONDS 10
+#define DEFAULT_JITTER_US 2000
+#define DEFAULT_TIMEOUT_MS 100
+#define FRAME_BUFS_PER_CAM 64
+#define START_DELAY_NS 100000000ULL // lets every thread start before the first capture
+
+struct cam_thread {
+  uint32_t cam;
+  uint64_t start_ts;
+  uint64_t frame_dur;
+  uint64_t jitter_ns;
+  uint32_t drop_permille;
+  struct producer_q* filled_q;
+  struct consumer_q* empty_q;
+  struct spsc_event* filled_ev;
+  uint64_t delivered;
+  uint64_t starved; // no free buffer, the main loop is behind
+};
+
+static atomic_bool running = true;
+
+static void* cam_fn(void* ptr) {
+  struct cam_thread* ct = (struct cam_thread*)ptr;
+  uint32_t seed = ct->cam * 2654435761u + 1;
+
+  for (uint64_t n = 0; atomic_load_explicit(&running, memory_order_relaxed); n++) {
+    uint64_t timestamp = ct->start_ts + n * ct->frame_dur;
+    uint64_t arrival = timestamp;
+    if (ct->jitter_ns)
+      arrival += rand_r(&seed) % ct->jitter_ns;
+
+    struct timespec ts = {
+      .tv_sec = arrival / NS_PER_SEC,
+      .tv_nsec = arrival % NS_PER_SEC
+    };
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+
+    if (ct->drop_permille && (uint32_t)(rand_r(&seed) % 1000) < ct->drop_permille)
+      continue;
+
+    struct ts_frame_buf* frame = spsc_dequeue(ct->empty_q);
+    if (!frame) {
+      ct->starved++;
+      continue;
+    }
+
+    frame->timestamp = timestamp;
+    frame->sensor_ts = timestamp;
+    spsc_enqueue(ct->filled_q, frame);
+    spsc_notify(ct->filled_ev);
+    ct->delivered++;
+  }
+
+  return NULL;
+}
+
+int main(int argc, char** argv) {
+  uint32_t cam_count = DEFAULT_CAMS;
+  uint32_t fps = DEFAULT_FPS;
+  uint32_t seconds = DEFAULT_SECONDS;
+  uint64_t jitter_us = DEFAULT_JITTER_US;
+  uint32_t drop_permille = 0;
+  uint64_t timeout_ms = DEFAULT_TIMEOUT_MS;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "c:f:s:j:d:t:")) != -1) {
+    switch (opt) {
+      case 'c': cam_count = strtoul(optarg, NULL, 10); break;
+      case 'f': fps = strtoul(optarg, NULL, 10); break;
+      case 's': seconds = strtoul(optarg, NULL, 10); break;
+      case 'j': jitter_us = strtoull(optarg, NULL, 10); break;
+      case 'd': drop_permille = strtoul(optarg, NULL, 10); break;
+      case 't': timeout_ms = strtoull(optarg, NULL, 10); break;
+      default:
+        fprintf(
+          stderr,
+          "Usage: assembly_bench [-c cams] [-f fps] [-s seconds] [-j jitter_us] "
+          "[-d drop_permille] [-t timeout_ms]\n"
+        );
+        return EXIT_FAILURE;
+    }
+  }
+
+  if (cam_count == 0 || cam_count > ASSEMBLER_MAX_CAMS || fps == 0 || seconds == 0) {
+    fprintf(stderr, "Need 1 to %d cameras, and nonzero fps and seconds\n", ASSEMBLER_MAX_CAMS);
+    return EXIT_FAILURE;
+  }
+
+  uint64_t frame_dur = NS_PER_SEC / fps;
+  uint64_t start_ts = bench_now_ns() + START_DELAY_NS;
+
+  struct ts_frame_buf* bufs = calloc(cam_count * FRAME_BUFS_PER_CAM, sizeof(struct ts_frame_buf));
+  void** q_bufs = aligned_alloc(CACHE_LINE_SIZE, sizeof(void*) * cam_count * FRAME_BUFS_PER_CAM * 2);
+  struct producer_q* filled_pqs = calloc(cam_count, sizeof(struct producer_q));
+  struct consumer_q* filled_cqs = calloc(cam_count, sizeof(struct consumer_q));
+  struct producer_q* empty_pqs = calloc(cam_count, sizeof(struct producer_q));
+  struct consumer_q* empty_cqs = calloc(cam_count, sizeof(struct consumer_q));
+  struct spsc_event* filled_evs = aligned_alloc(CACHE_LINE_SIZE, sizeof(struct spsc_event) * cam_count);
+  struct cam_thread* cams = calloc(cam_count, sizeof(struct cam_thread));
+  pthread_t* threads = calloc(cam_count, sizeof(pthread_t));
+  struct ts_frame_buf** frames = calloc(cam_count, sizeof(struct ts_frame_buf*));
+  struct epoll_event* events = calloc(cam_count + 1, sizeof(struct epoll_event));
+  uint32_t* cam_fps = calloc(cam_count, sizeof(uint32_t));
+  if (!bufs || !q_bufs || !filled_pqs || !filled_cqs || !empty_pqs || !empty_cqs ||
+      !filled_evs || !cams || !threads || !frames || !events || !cam_fps) {
+    fprintf(stderr, "Failed to allocate\n");
+    return EXIT_FAILURE;
+  }
+
+  int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (epoll_fd == -1 || timer_fd == -1) {
+    fprintf(stderr, "Error creating epoll or timer fd: %s\n", strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  for (uint32_t i = 0; i < cam_count; i++) {
+    spsc_queue_init(
+      &filled_pqs[i],
+      &filled_cqs[i],
+      q_bufs + i * 2 * FRAME_BUFS_PER_CAM,
+      FRAME_BUFS_PER_CAM
+    );
+    spsc_queue_init(
+      &empty_pqs[i],
+      &empty_cqs[i],
+      q_bufs + (i * 2 + 1) * FRAME_BUFS_PER_CAM,
+      FRAME_BUFS_PER_CAM
+    );
+    for (uint32_t j = 0; j < FRAME_BUFS_PER_CAM - 1; j++) {
+      bufs[i * FRAME_BUFS_PER_CAM + j].idx = i * FRAME_BUFS_PER_CAM + j;
+      spsc_enqueue(&empty_pqs[i], &bufs[i * FRAME_BUFS_PER_CAM + j]);
+    }
+
+    if (spsc_event_init(&filled_evs[i])) {
+      fprintf(stderr, "Error creating queue eventfd: %s\n", strerror(errno));
+      return EXIT_FAILURE;
+    }
+  }
+
+  for (uint32_t i = 0; i <= cam_count; i++) {
+    struct epoll_event ev = {
+      .events = EPOLLIN,
+      .data.u32 = i // cam_count is the timer
+    };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, i < cam_count ? filled_evs[i].fd : timer_fd, &ev) == -1) {
+      fprintf(stderr, "Error adding fd to epoll: %s\n", strerror(errno));
+      return EXIT_FAILURE;
+    }
+  }
+
+  for (uint32_t i = 0; i < cam_count; i++)
+    cam_fps[i] = fps;
+
+  struct assembler assembler;
+  if (init_assembler(
+    &assembler,
+    cam_count,
+    start_ts,
+    cam_fps,
+    timeout_ms * 1000000ULL,
+    true,
+    empty_pqs
+  )) {
+    fprintf(stderr, "Failed to create the assembler\n");
+    return EXIT_FAILURE;
+  }
+
+  for (uint32_t i = 0; i < cam_count; i++) {
+    cams[i] = (struct cam_thread){
+      .cam = i,
+      .start_ts = start_ts,
+      .frame_dur = frame_dur,
+      .jitter_ns = jitter_us * 1000,
+      .drop_permille = drop_permille,
+      .filled_q = &filled_pqs[i],
+      .empty_q = &empty_cqs[i],
+      .filled_ev = &filled_evs[i]
+    };
+    int ret = pthread_create(&threads[i], NULL, cam_fn, &cams[i]);
+    if (ret) {
+      fprintf(stderr, "Error spawning camera thread: %s\n", strerror(ret));
+      return EXIT_FAILURE;
+    }
+  }
+
+  struct bench_hist latency;
+  if (hist_init(&latency, (size_t)fps * seconds + ASSEMBLER_SLOTS)) {
+    fprintf(stderr, "Failed to allocate the histogram\n");
+    return EXIT_FAILURE;
+  }
+
+  uint64_t framesets = 0;
+  uint64_t complete = 0;
+  uint64_t wakeups = 0;
+  uint64_t armed_deadline = UINT64_MAX;
+  uint64_t end_ts = start_ts + (uint64_t)seconds * NS_PER_SEC;
+
+  struct perf_counters perf;
+  perf_start(&perf, false);
+
+  while (true) {
+    uint64_t now = bench_now_ns();
+    if (now >= end_ts)
+      break;
+
+    bool received = false;
+    for (uint32_t i = 0; i < cam_count; i++) {
+      struct ts_frame_buf* frame;
+      while ((frame = spsc_dequeue(&filled_cqs[i])) != NULL) {
+        assembler_add(&assembler, i, frame, now);
+        received = true;
+      }
+    }
+
+    uint64_t frameset_ts;
+    uint64_t cam_mask;
+    bool published = false;
+    while (assembler_next(&assembler, now, frames, &frameset_ts, &cam_mask)) {
+      hist_add(&latency, bench_now_ns() - frameset_ts);
+      framesets++;
+      if (cam_mask == assembler.full_mask)
+        complete++;
+
+      for (uint32_t i = 0; i < cam_count; i++) {
+        if (frames[i])
+          spsc_enqueue(&empty_pqs[i], frames[i]);
+      }
+      published = true;
+    }
+
+    if (received || published)
+      continue;
+
+    uint64_t deadline = assembler_deadline(&assembler);
+    if (deadline > end_ts)
+      deadline = end_ts; // wake up to finish the run
+    if (deadline != armed_deadline) {
+      struct itimerspec its = { 0 };
+      its.it_value.tv_sec = deadline / NS_PER_SEC;
+      its.it_value.tv_nsec = deadline % NS_PER_SEC;
+      timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+      armed_deadline = deadline;
+    }
+
+    bool parked = true;
+    for (uint32_t i = 0; i < cam_count && parked; i++) {
+      if (!spsc_park(&filled_evs[i], &filled_cqs[i])) {
+        parked = false;
+        for (uint32_t j = 0; j < i; j++)
+          atomic_store_explicit(&filled_evs[j].parked, false, memory_order_relaxed);
+      }
+    }
+    if (!parked)
+      continue;
+
+    wakeups++;
+    int ready = epoll_wait(epoll_fd, events, cam_count + 1, -1);
+    for (int i = 0; i < ready; i++) {
+      uint32_t id = events[i].data.u32;
+      if (id == cam_count) {
+        uint64_t expirations;
+        ssize_t len = read(timer_fd, &expirations, sizeof(expirations));
+        (void)len;
+        armed_deadline = UINT64_MAX;
+      } else {
+        spsc_unpark(&filled_evs[id]);
+      }
+    }
+
+    for (uint32_t i = 0; i < cam_count; i++)
+      atomic_store_explicit(&filled_evs[i].parked, false, memory_order_relaxed);
+  }
+
+  perf_stop(&perf);
+  atomic_store_explicit(&running, false, memory_order_relaxed);
+
+  uint64_t delivered = 0;
+  uint64_t starved = 0;
+  for (uint32_t i = 0; i < cam_count; i++) {
+    pthread_join(threads[i], NULL);
+    delivered += cams[i].delivered;
+    starved += cams[i].starved;
+  }
+
+  printf(
+    "assembly, %u cams x %u fps for %us, jitter %lu us, drops %u/1000, timeout %lu ms\n",
+    cam_count,
+    fps,
+    seconds,
+    jitter_us,
+    drop_permille,
+    timeout_ms
+  );
+  printf("  %-28s %lu, %.1f/s\n", "frames delivered", delivered, (double)delivered / seconds);
+  printf("  %-28s %lu, %.1f/s\n", "framesets emitted", framesets, (double)framesets / seconds);
+  printf(
+    "  %-28s %lu complete, %lu partial, %lu dropped\n",
+    "framesets",
+    complete,
+    assembler.partial,
+    assembler.dropped
+  );
+  printf("  %-28s %lu\n", "frames without a buffer", starved);
+  printf("  %-28s %lu, %.2f per frameset\n", "main loop wakeups", wakeups, framesets ? (double)wakeups / framesets : 0.0);
+  hist_report("capture to frameset", &latency);
+  perf_report("main loop per frameset", &perf, framesets);
+
+  hist_cleanup(&latency);
+  cleanup_assembler(&assembler);
+  for (uint32_t i = 0; i < cam_count; i++)
+    spsc_event_cleanup(&filled_evs[i]);
+  close(timer_fd);
+  close(epoll_fd);
+
+  return 0;
+}
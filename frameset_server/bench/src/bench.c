@@ -0,0 +1,243 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+uint64_t bench_now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+int bench_pin(int cpu) {
+  /**
+   * Pins the calling thread to a cpu
+   *
+   * Returns:
+   * - int: 0 on success, or a negative error code
+   */
+  cpu_set_t cpuset;
+  CPU_ZERO(&cpuset);
+  CPU_SET(cpu, &cpuset);
+  if (sched_setaffinity(0, sizeof(cpuset), &cpuset) == -1)
+    return -errno;
+
+  return 0;
+}
+
+int parse_cpu_list(const char* list, int* cpus, int max) {
+  /**
+   * Parses a cpu list in the kernel's format, like "0-3,8,10-11"
+   *
+   * Parameters:
+   * - const char* list: the list
+   * - int* cpus: receives the cpus, in the order listed
+   * - int max: capacity of cpus
+   *
+   * Returns:
+   * - int: the number of cpus, or -EINVAL if the list is malformed
+   */
+  int count = 0;
+  const char* c = list;
+  while (*c && *c != '\n') {
+    char* end;
+    long first = strtol(c, &end, 10);
+    if (end == c || first < 0)
+      return -EINVAL;
+
+    long last = first;
+    if (*end == '-') {
+      c = end + 1;
+      last = strtol(c, &end, 10);
+      if (end == c || last < first)
+        return -EINVAL;
+    }
+
+    for (long cpu = first; cpu <= last && count < max; cpu++)
+      cpus[count++] = (int)cpu;
+
+    c = end;
+    if (*c == ',')
+      c++;
+  }
+
+  return count;
+}
+
+int read_cpu_list(const char* path, int* cpus, int max) {
+  /**
+   * Reads a cpu list from sysfs, see parse_cpu_list
+   *
+   * Returns:
+   * - int: the number of cpus, or a negative error code
+   */
+  FILE* file = fopen(path, "r");
+  if (!file)
+    return -errno;
+
+  char list[4096];
+  char* line = fgets(list, sizeof(list), file);
+  fclose(file);
+  if (!line)
+    return -EIO;
+
+  return parse_cpu_list(list, cpus, max);
+}
+
+int hist_init(struct bench_hist* hist, size_t cap) {
+  hist->samples = malloc(sizeof(uint64_t) * cap);
+  if (!hist->samples)
+    return -ENOMEM;
+
+  hist->count = 0;
+  hist->cap = cap;
+  hist->overflow = 0;
+  return 0;
+}
+
+void hist_add(struct bench_hist* hist, uint64_t sample) {
+  if (hist->count == hist->cap) {
+    hist->overflow++;
+    return;
+  }
+  hist->samples[hist->count++] = sample;
+}
+
+static int cmp_u64(const void* a, const void* b) {
+  uint64_t x = *(const uint64_t*)a;
+  uint64_t y = *(const uint64_t*)b;
+  return x < y ? -1 : x > y;
+}
+
+static uint64_t percentile(const struct bench_hist* hist, double p) {
+  size_t idx = (size_t)(p * (hist->count - 1) + 0.5);
+  return hist->samples[idx];
+}
+
+void hist_report(const char* label, struct bench_hist* hist) {
+  /**
+   * Prints the sample count and p50, p99, p99.9 and max in us
+   *
+   * Sorts the samples in place, so it's meant to be called once
+   * the run is over.
+   */
+  if (hist->count == 0) {
+    printf("  %-28s no samples\n", label);
+    return;
+  }
+
+  qsort(hist->samples, hist->count, sizeof(uint64_t), cmp_u64);
+  printf(
+    "  %-28s n=%-9zu p50 %9.2f us  p99 %9.2f us  p99.9 %9.2f us  max %9.2f us\n",
+    label,
+    hist->count,
+    percentile(hist, 0.5) / 1000.0,
+    percentile(hist, 0.99) / 1000.0,
+    percentile(hist, 0.999) / 1000.0,
+    hist->samples[hist->count - 1] / 1000.0
+  );
+  if (hist->overflow)
+    printf("  %-28s %lu samples past the histogram's capacity not kept\n", "", hist->overflow);
+}
+
+void hist_cleanup(struct bench_hist* hist) {
+  free(hist->samples);
+  hist->samples = NULL;
+}
+
+static const struct {
+  uint32_t type;
+  uint64_t config;
+} perf_events[PERF_COUNTERS] = {
+  { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+  { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+  { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+  { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES }
+};
+
+void perf_start(struct perf_counters* perf, bool inherit) {
+  /**
+   * Starts counting for the calling thread
+   *
+   * Parameters:
+   * - struct perf_counters* perf: the counters
+   * - bool inherit: also count threads the caller creates from now on,
+   *                 their counts are added in as they exit
+   */
+  for (int i = 0; i < PERF_COUNTERS; i++) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = perf_events[i].type;
+    attr.config = perf_events[i].config;
+    attr.disabled = 1;
+    attr.inherit = inherit;
+    // context switches happen in the kernel, excluding it counts none
+    attr.exclude_kernel = perf_events[i].type != PERF_TYPE_SOFTWARE;
+    attr.exclude_hv = 1;
+
+    perf->values[i] = 0;
+    perf->fds[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+  }
+
+  for (int i = 0; i < PERF_COUNTERS; i++) {
+    if (perf->fds[i] >= 0) {
+      ioctl(perf->fds[i], PERF_EVENT_IOC_RESET, 0);
+      ioctl(perf->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+  }
+}
+
+void perf_stop(struct perf_counters* perf) {
+  for (int i = 0; i < PERF_COUNTERS; i++) {
+    if (perf->fds[i] < 0)
+      continue;
+
+    ioctl(perf->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+    if (read(perf->fds[i], &perf->values[i], sizeof(uint64_t)) != sizeof(uint64_t)) {
+      close(perf->fds[i]);
+      perf->fds[i] = -1;
+      continue;
+    }
+    close(perf->fds[i]);
+    perf->fds[i] = -2; // counted, only the value is left
+  }
+}
+
+void perf_report(const char* label, const struct perf_counters* perf, uint64_t ops) {
+  /**
+   * Prints the counters per op, and instructions per cycle
+   */
+  bool cycles = perf->fds[PERF_CYCLES] == -2;
+  bool instructions = perf->fds[PERF_INSTRUCTIONS] == -2;
+  bool misses = perf->fds[PERF_CACHE_MISSES] == -2;
+  bool switches = perf->fds[PERF_CONTEXT_SWITCHES] == -2;
+  if (!cycles && !instructions && !misses && !switches) {
+    printf("  %-28s perf counters unavailable\n", label);
+    return;
+  }
+  if (ops == 0)
+    ops = 1;
+
+  printf("  %-28s", label);
+  if (cycles)
+    printf(" cycles/op %8.1f", (double)perf->values[PERF_CYCLES] / ops);
+  if (instructions)
+    printf("  insns/op %8.1f", (double)perf->values[PERF_INSTRUCTIONS] / ops);
+  if (cycles && instructions && perf->values[PERF_CYCLES])
+    printf("  IPC %5.2f", (double)perf->values[PERF_INSTRUCTIONS] / perf->values[PERF_CYCLES]);
+  if (misses)
+    printf("  cache misses/op %7.3f", (double)perf->values[PERF_CACHE_MISSES] / ops);
+  if (switches)
+    printf("  context switches %lu", perf->values[PERF_CONTEXT_SWITCHES]);
+  printf("\n");
+}
@@ -0,0 +1,564 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <libavcodec/avcodec.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "ingest.h"
+#include "parse_conf.h"
+#include "spsc_queue.h"
+#include "stream_mgr.h"
+
+/**
+ * Replays recorded H.264 streams through the server's decode pool.
+ *
+ * Usage: replay_bench [-w workers] [-f fps] [-W width] [-H height] <stream.h264>...
+ *
+ * Each file is a camera's raw Annex B stream, as picam encodes it. A
+ * container recording can be converted with
+ *   ffmpeg -i in.mp4 -c:v copy -bsf:v h264_mp4toannexb -f h264 out.h264
+ * The streams are split into packets up front, then a feeder thread
+ * standing in for the ingest thread hands them to stream_mgr's workers
+ * through the same queues and events the server sets up, paced at fps
+ * per camera, or as fast as the decoders take them with -f 0. The
+ * main thread takes the decoded frames and hands the buffers straight
+ * back, like the assembler does with a frameset nobody holds.
+ *
+ * Reports decoded frames per second, the latency from a packet being
+ * queued to its frame coming out of the pool, and the hardware
+ * counters of the whole process per frame, decode workers included.
+ * Every stream is decoded at width x height, 1280x720 by default.
+ *
+ * Needs the same CUDA capable GPU as the server, and only builds the
+ * host memory frame path, not CUDA_FRAMESETS.
+ */
+
+#define DEFAULT_WORKERS 4
+#define DEFAULT_FPS 30
+#define FRAME_BUFS_PER_CAM 16
+#define DRAIN_TIMEOUT_NS 1000000000ULL // the decoders keep a few frames, stop waiting on them
+
+struct au {
+  uint32_t offset;
+  uint32_t size;
+  bool keyframe;
+};
+
+struct replay_stream {
+  const char* path;
+  uint8_t* data;
+  struct au* aus;
+  uint32_t au_count;
+  uint64_t* queued_ns; // when each packet was handed to the pool
+  uint64_t decoded;
+};
+
+struct feeder {
+  struct replay_stream* streams;
+  uint32_t stream_count;
+  uint32_t fps;
+  struct producer_q* filled_pkts;
+  struct consumer_q* empty_pkts;
+  struct spsc_event* empty_pkt_evs;
+  struct pool_event* work_ev;
+  uint64_t start_ts;
+  uint64_t frame_dur;
+  atomic_bool done;
+};
+
+static atomic_bool running = true;
+
+static void stop_handler(int signum) {
+  (void)signum;
+  atomic_store_explicit(&running, false, memory_order_relaxed);
+}
+
+static int load_stream(struct replay_stream* stream) {
+  /**
+   * Reads a stream into memory and splits it into access units
+   *
+   * Returns:
+   * - int: 0 on success, or a negative error code
+   */
+  int fd = open(stream->path, O_RDONLY);
+  if (fd < 0)
+    return -errno;
+
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    close(fd);
+    return -errno;
+  }
+
+  stream->data = malloc(st.st_size + AV_INPUT_BUFFER_PADDING_SIZE);
+  if (!stream->data) {
+    close(fd);
+    return -ENOMEM;
+  }
+  memset(stream->data + st.st_size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+
+  size_t total = 0;
+  while (total < (size_t)st.st_size) {
+    ssize_t len = read(fd, stream->data + total, st.st_size - total);
+    if (len <= 0) {
+      close(fd);
+      return len < 0 ? -errno : -EIO;
+    }
+    total += len;
+  }
+  close(fd);
+
+  const AVCodec* codec = avcodec_find_decoder(AV_CODEC_ID_H264);
+  AVCodecParserContext* parser = av_parser_init(AV_CODEC_ID_H264);
+  AVCodecContext* ctx = codec ? avcodec_alloc_context3(codec) : NULL;
+  if (!parser || !ctx) {
+    if (parser)
+      av_parser_close(parser);
+    return -ENODEV;
+  }
+
+  // access units are copied out of the parser into a packed buffer
+  // of their own, since its output may point into its own buffer
+  uint8_t* packed = malloc(total + AV_INPUT_BUFFER_PADDING_SIZE);
+  size_t packed_size = 0;
+  size_t packed_cap = total;
+  size_t cap = 1024;
+  stream->aus = malloc(sizeof(struct au) * cap);
+  stream->au_count = 0;
+
+  int ret = packed && stream->aus ? 0 : -ENOMEM;
+  size_t pos = 0;
+  while (!ret) {
+    uint8_t* out;
+    int out_size;
+    bool flushing = pos == total;
+    int used = av_parser_parse2(
+      parser,
+      ctx,
+      &out,
+      &out_size,
+      flushing ? NULL : stream->data + pos,
+      (int)(total - pos),
+      AV_NOPTS_VALUE,
+      AV_NOPTS_VALUE,
+      0
+    );
+    pos += used;
+
+    if (out_size > 0) {
+      if (out_size > ENCODED_FRAME_MAX_SIZE) {
+        fprintf(
+          stderr,
+          "%s has a %d byte packet, larger than the server's %d byte limit\n",
+          stream->path,
+          out_size,
+          ENCODED_FRAME_MAX_SIZE
+        );
+        ret = -EMSGSIZE;
+        break;
+      }
+
+      if (stream->au_count == cap) {
+        cap *= 2;
+        struct au* aus = realloc(stream->aus, sizeof(struct au) * cap);
+        if (!aus) {
+          ret = -ENOMEM;
+          break;
+        }
+        stream->aus = aus;
+      }
+
+      if (packed_size + out_size > packed_cap) {
+        packed_cap = (packed_size + out_size) * 2;
+        uint8_t* grown = realloc(packed, packed_cap + AV_INPUT_BUFFER_PADDING_SIZE);
+        if (!grown) {
+          ret = -ENOMEM;
+          break;
+        }
+        packed = grown;
+      }
+
+      memcpy(packed + packed_size, out, out_size);
+      stream->aus[stream->au_count++] = (struct au){
+        (uint32_t)packed_size,
+        (uint32_t)out_size,
+        parser->key_frame == 1
+      };
+      packed_size += out_size;
+    }
+
+    if (flushing && out_size == 0)
+      break;
+  }
+
+  av_parser_close(parser);
+  avcodec_free_context(&ctx);
+  free(stream->data);
+  stream->data = packed;
+  if (ret)
+    return ret;
+
+  stream->queued_ns = calloc(stream->au_count, sizeof(uint64_t));
+  return stream->queued_ns ? 0 : -ENOMEM;
+}
+
+static void* feeder_fn(void* ptr) {
+  /**
+   * Hands packets to the decode pool like the ingest thread, round
+   * robin across the streams, one packet per stream per frame interval
+   */
+  struct feeder* feeder = (struct feeder*)ptr;
+
+  uint32_t max_aus = 0;
+  for (uint32_t i = 0; i < feeder->stream_count; i++) {
+    if (feeder->streams[i].au_count > max_aus)
+      max_aus = feeder->streams[i].au_count;
+  }
+
+  for (uint32_t n = 0; n < max_aus && atomic_load_explicit(&running, memory_order_relaxed); n++) {
+    if (feeder->fps) {
+      uint64_t due = feeder->start_ts + n * feeder->frame_dur;
+      struct timespec ts = {
+        .tv_sec = due / NS_PER_SEC,
+        .tv_nsec = due % NS_PER_SEC
+      };
+      clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+    }
+
+    for (uint32_t i = 0; i < feeder->stream_count; i++) {
+      struct replay_stream* stream = &feeder->streams[i];
+      if (n >= stream->au_count)
+        continue;
+
+      struct enc_packet* pkt;
+      while ((pkt = spsc_dequeue(&feeder->empty_pkts[i])) == NULL) {
+        // with a timeout, so a stop that lands before parking isn't missed
+        if (spsc_park(&feeder->empty_pkt_evs[i], &feeder->empty_pkts[i])) {
+          struct pollfd pfd = { .fd = feeder->empty_pkt_evs[i].fd, .events = POLLIN };
+          poll(&pfd, 1, 100);
+          spsc_unpark(&feeder->empty_pkt_evs[i]);
+        }
+        if (!atomic_load_explicit(&running, memory_order_relaxed))
+          goto done;
+      }
+
+      struct au* au = &stream->aus[n];
+      memcpy(pkt->data, stream->data + au->offset, au->size);
+      pkt->size = au->size;
+      pkt->timestamp = feeder->start_ts + n * feeder->frame_dur;
+      pkt->sensor_ts = pkt->timestamp;
+      pkt->end_of_stream = false;
+      pkt->keyframe = au->keyframe;
+      pkt->reset = false;
+
+      stream->queued_ns[n] = bench_now_ns();
+      spsc_enqueue(&feeder->filled_pkts[i], pkt);
+      pool_notify(feeder->work_ev);
+    }
+  }
+
+done:
+  atomic_store_explicit(&feeder->done, true, memory_order_release);
+  return NULL;
+}
+
+int main(int argc, char** argv) {
+#ifdef CUDA_FRAMESETS
+  (void)argc;
+  (void)argv;
+  fprintf(stderr, "replay_bench only decodes into host memory, build it without CUDA_FRAMESETS\n");
+  return EXIT_FAILURE;
+#else
+  uint32_t worker_count = DEFAULT_WORKERS;
+  uint32_t fps = DEFAULT_FPS;
+  uint32_t width = CAM_DEFAULT_WIDTH;
+  uint32_t height = CAM_DEFAULT_HEIGHT;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "w:f:W:H:")) != -1) {
+    switch (opt) {
+      case 'w': worker_count = strtoul(optarg, NULL, 10); break;
+      case 'f': fps = strtoul(optarg, NULL, 10); break;
+      case 'W': width = strtoul(optarg, NULL, 10); break;
+      case 'H': height = strtoul(optarg, NULL, 10); break;
+      default:
+        fprintf(stderr, "Usage: replay_bench [-w workers] [-f fps] [-W width] [-H height] <stream.h264>...\n");
+        return EXIT_FAILURE;
+    }
+  }
+
+  uint32_t cam_count = argc - optind;
+  if (cam_count == 0 || cam_count > 64 || worker_count == 0 || width == 0 || height == 0) {
+    fprintf(stderr, "Usage: replay_bench [-w workers] [-f fps] [-W width] [-H height] <stream.h264>...\n");
+    return EXIT_FAILURE;
+  }
+  if (worker_count > cam_count)
+    worker_count = cam_count;
+
+  struct sigaction sa = { .sa_handler = stop_handler };
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL); // a failing worker signals the main thread
+
+  struct replay_stream streams[cam_count];
+  uint64_t total_aus = 0;
+  uint32_t max_au_size = 0;
+  for (uint32_t i = 0; i < cam_count; i++) {
+    memset(&streams[i], 0, sizeof(streams[i]));
+    streams[i].path = argv[optind + i];
+    int ret = load_stream(&streams[i]);
+    if (ret) {
+      fprintf(stderr, "Failed to load %s: %s\n", streams[i].path, strerror(-ret));
+      return EXIT_FAILURE;
+    }
+    total_aus += streams[i].au_count;
+    for (uint32_t j = 0; j < streams[i].au_count; j++) {
+      if (streams[i].aus[j].size > max_au_size)
+        max_au_size = streams[i].aus[j].size;
+    }
+  }
+
+  size_t frame_size = (size_t)width * height * 3 / 2;
+  size_t frame_bufs_count = (size_t)cam_count * FRAME_BUFS_PER_CAM;
+  uint8_t* frame_pool = aligned_alloc(CACHE_LINE_SIZE, frame_size * frame_bufs_count);
+  struct ts_frame_buf ts_frame_bufs[frame_bufs_count];
+  struct enc_packet packets[cam_count * PACKETS_PER_CAM];
+  // sized for the largest packet up front, so the feeder never grows one
+  uint8_t* pkt_data = malloc((size_t)max_au_size * cam_count * PACKETS_PER_CAM);
+  void** q_bufs = aligned_alloc(
+    CACHE_LINE_SIZE,
+    sizeof(void*) * cam_count * (FRAME_BUFS_PER_CAM * 2 + PACKET_Q_SIZE * 2)
+  );
+  if (!frame_pool || !pkt_data || !q_bufs) {
+    fprintf(stderr, "Failed to allocate buffers\n");
+    return EXIT_FAILURE;
+  }
+
+  struct producer_q filled_frame_pqs[cam_count];
+  struct consumer_q filled_frame_cqs[cam_count];
+  struct producer_q empty_frame_pqs[cam_count];
+  struct consumer_q empty_frame_cqs[cam_count];
+  struct producer_q filled_pkt_pqs[cam_count];
+  struct consumer_q filled_pkt_cqs[cam_count];
+  struct producer_q empty_pkt_pqs[cam_count];
+  struct consumer_q empty_pkt_cqs[cam_count];
+  struct spsc_event filled_evs[cam_count];
+  struct spsc_event empty_pkt_evs[cam_count];
+  cam_conf confs[cam_count];
+
+  void** q_buf = q_bufs;
+  for (uint32_t i = 0; i < cam_count; i++) {
+    spsc_queue_init(&filled_frame_pqs[i], &filled_frame_cqs[i], q_buf, FRAME_BUFS_PER_CAM);
+    q_buf += FRAME_BUFS_PER_CAM;
+    spsc_queue_init(&empty_frame_pqs[i], &empty_frame_cqs[i], q_buf, FRAME_BUFS_PER_CAM);
+    q_buf += FRAME_BUFS_PER_CAM;
+    spsc_queue_init(&filled_pkt_pqs[i], &filled_pkt_cqs[i], q_buf, PACKET_Q_SIZE);
+    q_buf += PACKET_Q_SIZE;
+    spsc_queue_init(&empty_pkt_pqs[i], &empty_pkt_cqs[i], q_buf, PACKET_Q_SIZE);
+    q_buf += PACKET_Q_SIZE;
+
+    for (uint32_t j = 0; j < FRAME_BUFS_PER_CAM - 1; j++) {
+      struct ts_frame_buf* buf = &ts_frame_bufs[i * FRAME_BUFS_PER_CAM + j];
+      buf->idx = i * FRAME_BUFS_PER_CAM + j;
+      buf->frame_buf = frame_pool + frame_size * buf->idx;
+      spsc_enqueue(&empty_frame_pqs[i], buf);
+    }
+
+    for (uint32_t j = 0; j < PACKETS_PER_CAM; j++) {
+      struct enc_packet* pkt = &packets[i * PACKETS_PER_CAM + j];
+      pkt->cap = max_au_size;
+      pkt->data = pkt_data + (size_t)max_au_size * (i * PACKETS_PER_CAM + j);
+      spsc_enqueue(&empty_pkt_pqs[i], pkt);
+    }
+
+    if (spsc_event_init(&filled_evs[i]) || spsc_event_init(&empty_pkt_evs[i])) {
+      fprintf(stderr, "Error creating queue eventfd: %s\n", strerror(errno));
+      return EXIT_FAILURE;
+    }
+
+    memset(&confs[i], 0, sizeof(confs[i]));
+    snprintf(confs[i].name, sizeof(confs[i].name), "replay%02u", i);
+    confs[i].width = width;
+    confs[i].height = height;
+    confs[i].live_width = width;
+    confs[i].live_height = height;
+    confs[i].fps = fps ? fps : CAM_DEFAULT_FPS;
+  }
+
+  // the decoders record into these as they would into the metrics page
+  struct metrics_cam metrics[cam_count];
+  memset(metrics, 0, sizeof(metrics));
+
+  struct stream_ctx decode_streams[cam_count];
+  for (uint32_t i = 0; i < cam_count; i++) {
+    decode_streams[i].conf = &confs[i];
+    decode_streams[i].filled_pkts = &filled_pkt_cqs[i];
+    decode_streams[i].empty_pkts = &empty_pkt_pqs[i];
+    decode_streams[i].empty_pkt_ev = &empty_pkt_evs[i];
+    decode_streams[i].filled_bufs = &filled_frame_pqs[i];
+    decode_streams[i].empty_bufs = &empty_frame_cqs[i];
+    decode_streams[i].filled_ev = &filled_evs[i];
+    decode_streams[i].metrics = &metrics[i];
+  }
+
+  struct decode_pool pool;
+  if (init_decode_pool(&pool, decode_streams, cam_count, pthread_self())) {
+    fprintf(stderr, "Failed to create the decode pool, see the log for why\n");
+    return EXIT_FAILURE;
+  }
+
+  // every worker takes every stream, so they share one event
+  struct pool_event work_ev;
+  pool_event_init(&work_ev);
+
+  struct bench_hist latency;
+  if (hist_init(&latency, total_aus)) {
+    fprintf(stderr, "Failed to allocate the histogram\n");
+    return EXIT_FAILURE;
+  }
+
+  // counts the workers and the feeder as well, they're created after
+  struct perf_counters perf;
+  perf_start(&perf, true);
+
+  struct thread_ctx ctxs[worker_count];
+  pthread_t workers[worker_count];
+  for (uint32_t i = 0; i < worker_count; i++) {
+    ctxs[i].pool = &pool;
+    ctxs[i].core = i + 1; // the feeder and main thread share core 0
+    ctxs[i].first_stream = 0;
+    ctxs[i].stream_count = cam_count;
+    ctxs[i].work_ev = &work_ev;
+    int ret = pthread_create(&workers[i], NULL, stream_mgr_fn, &ctxs[i]);
+    if (ret) {
+      fprintf(stderr, "Error spawning decode worker: %s\n", strerror(ret));
+      return EXIT_FAILURE;
+    }
+  }
+
+  struct feeder feeder = {
+    .streams = streams,
+    .stream_count = cam_count,
+    .fps = fps,
+    .filled_pkts = filled_pkt_pqs,
+    .empty_pkts = empty_pkt_cqs,
+    .empty_pkt_evs = empty_pkt_evs,
+    .work_ev = &work_ev,
+    .start_ts = bench_now_ns(),
+    .frame_dur = fps ? NS_PER_SEC / fps : NS_PER_SEC / DEFAULT_FPS
+  };
+  atomic_init(&feeder.done, false);
+
+  uint64_t start = bench_now_ns();
+  pthread_t feeder_thread;
+  if (pthread_create(&feeder_thread, NULL, feeder_fn, &feeder)) {
+    fprintf(stderr, "Error spawning feeder thread\n");
+    return EXIT_FAILURE;
+  }
+
+  uint64_t decoded = 0;
+  uint64_t last_frame_ns = start;
+  uint64_t feed_done_ns = 0;
+  while (atomic_load_explicit(&running, memory_order_relaxed)) {
+    bool received = false;
+    for (uint32_t i = 0; i < cam_count; i++) {
+      struct ts_frame_buf* frame;
+      while ((frame = spsc_dequeue(&filled_frame_cqs[i])) != NULL) {
+        uint64_t now = bench_now_ns();
+        uint64_t n = (frame->timestamp - feeder.start_ts) / feeder.frame_dur;
+        if (n < streams[i].au_count)
+          hist_add(&latency, now - streams[i].queued_ns[n]);
+        streams[i].decoded++;
+        decoded++;
+        last_frame_ns = now;
+        spsc_enqueue(&empty_frame_pqs[i], frame);
+        received = true;
+      }
+    }
+
+    if (received) {
+      pool_notify(&work_ev);
+      continue;
+    }
+
+    if (decoded == total_aus)
+      break;
+
+    uint64_t now = bench_now_ns();
+    if (atomic_load_explicit(&feeder.done, memory_order_acquire)) {
+      if (!feed_done_ns)
+        feed_done_ns = now;
+      if (now - (last_frame_ns > feed_done_ns ? last_frame_ns : feed_done_ns) > DRAIN_TIMEOUT_NS)
+        break;
+    }
+
+    // sleep on every filled queue at once, waking at least every 10ms
+    struct pollfd pfds[cam_count];
+    bool parked = true;
+    for (uint32_t i = 0; i < cam_count; i++) {
+      pfds[i] = (struct pollfd){ .fd = filled_evs[i].fd, .events = POLLIN };
+      if (parked && !spsc_park(&filled_evs[i], &filled_frame_cqs[i]))
+        parked = false;
+    }
+    if (parked)
+      poll(pfds, cam_count, 10);
+    for (uint32_t i = 0; i < cam_count; i++)
+      spsc_unpark(&filled_evs[i]);
+  }
+  uint64_t elapsed = last_frame_ns - start;
+
+  atomic_store_explicit(&running, false, memory_order_relaxed);
+  pthread_join(feeder_thread, NULL);
+
+  for (uint32_t i = 0; i < worker_count; i++)
+    pthread_kill(workers[i], SIGUSR2);
+  pool_event_close(&work_ev);
+  for (uint32_t i = 0; i < worker_count; i++)
+    pthread_join(workers[i], NULL);
+  perf_stop(&perf);
+
+  printf(
+    "replay, %u streams, %u workers, %s\n",
+    cam_count,
+    worker_count,
+    fps ? "paced" : "unpaced"
+  );
+  if (fps)
+    printf("  %-28s %u fps per stream\n", "pace", fps);
+  for (uint32_t i = 0; i < cam_count; i++)
+    printf("  %-28s %lu of %u packets decoded\n", streams[i].path, streams[i].decoded, streams[i].au_count);
+  printf(
+    "  %-28s %lu, %.1f frames/s\n",
+    "frames decoded",
+    decoded,
+    elapsed ? decoded / (elapsed / (double)NS_PER_SEC) : 0.0
+  );
+  hist_report("queued to decoded", &latency);
+  perf_report("process per frame", &perf, decoded);
+
+  hist_cleanup(&latency);
+  cleanup_decode_pool(&pool);
+  for (uint32_t i = 0; i < cam_count; i++) {
+    spsc_event_cleanup(&filled_evs[i]);
+    spsc_event_cleanup(&empty_pkt_evs[i]);
+    free(streams[i].data);
+    free(streams[i].aus);
+    free(streams[i].queued_ns);
+  }
+  free(q_bufs);
+  free(pkt_data);
+  free(frame_pool);
+
+  return 0;
+#endif
+}
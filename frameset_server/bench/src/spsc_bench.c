@@ -0,0 +1,343 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "spsc_queue.h"
+
+/**
+ * Measures spsc_queue.h between a pair of pinned threads.
+ *
+ * Usage: spsc_bench [-n ops] [-l samples] [-q slots] [-c cpu,cpu]...
+ *
+ * For each pair of cpus, the producer pushes ops items through a
+ * queue of the given slots as fast as the consumer takes them, for
+ * throughput, then the pair ping-pongs single items through two
+ * queues, for the one way handoff latency at p50, p99 and p99.9,
+ * taken as half of each round trip. Both sides' hardware counters are
+ * reported for the throughput run.
+ *
+ * Without -c, the pairs are taken from cpu 0's topology in sysfs, an
+ * SMT sibling for same core, another cpu sharing its L3 for same CCD,
+ * and a cpu outside its L3 for cross CCD, skipping whichever the
+ * machine doesn't have.
+ */
+
+#define DEFAULT_OPS 50000000
+#define DEFAULT_SAMPLES 1000000
+#define DEFAULT_SLOTS 1024
+#define MAX_PAIRS 16
+
+struct pair {
+  const char* name;
+  int cpus[2];
+};
+
+struct run {
+  int cpu;
+  uint64_t ops;
+  uint64_t samples;
+  struct producer_q* pq[2]; // ping, pong
+  struct consumer_q* cq[2];
+  pthread_barrier_t* barrier;
+  struct perf_counters perf;
+  struct bench_hist* hist; // latency run, initiator only
+  uint64_t elapsed_ns;
+  int err;
+};
+
+static void* producer_fn(void* ptr) {
+  struct run* run = (struct run*)ptr;
+  run->err = bench_pin(run->cpu);
+  pthread_barrier_wait(run->barrier);
+
+  perf_start(&run->perf, false);
+  for (uint64_t i = 1; i <= run->ops; i++) {
+    while (spsc_enqueue(run->pq[0], (void*)(uintptr_t)i) == -EAGAIN);
+  }
+  perf_stop(&run->perf);
+
+  return NULL;
+}
+
+static void* consumer_fn(void* ptr) {
+  struct run* run = (struct run*)ptr;
+  run->err = bench_pin(run->cpu);
+  pthread_barrier_wait(run->barrier);
+
+  uint64_t start = bench_now_ns();
+  perf_start(&run->perf, false);
+  for (uint64_t i = 1; i <= run->ops; i++) {
+    void* item;
+    while ((item = spsc_dequeue(run->cq[0])) == NULL);
+    if ((uintptr_t)item != i) {
+      run->err = -EPROTO; // out of order, or corrupted
+      break;
+    }
+  }
+  perf_stop(&run->perf);
+  run->elapsed_ns = bench_now_ns() - start;
+
+  return NULL;
+}
+
+static void* ping_fn(void* ptr) {
+  struct run* run = (struct run*)ptr;
+  run->err = bench_pin(run->cpu);
+  pthread_barrier_wait(run->barrier);
+
+  for (uint64_t i = 1; i <= run->samples; i++) {
+    uint64_t start = bench_now_ns();
+    while (spsc_enqueue(run->pq[0], (void*)(uintptr_t)i) == -EAGAIN);
+    while (spsc_dequeue(run->cq[1]) == NULL);
+    hist_add(run->hist, (bench_now_ns() - start) / 2);
+  }
+
+  return NULL;
+}
+
+static void* pong_fn(void* ptr) {
+  struct run* run = (struct run*)ptr;
+  run->err = bench_pin(run->cpu);
+  pthread_barrier_wait(run->barrier);
+
+  for (uint64_t i = 1; i <= run->samples; i++) {
+    void* item;
+    while ((item = spsc_dequeue(run->cq[0])) == NULL);
+    while (spsc_enqueue(run->pq[1], item) == -EAGAIN);
+  }
+
+  return NULL;
+}
+
+static int run_pair(
+  const struct pair* pair,
+  void* (*fns[2])(void*),
+  struct run runs[2],
+  size_t slots
+) {
+  struct producer_q pqs[2];
+  struct consumer_q cqs[2];
+  void* bufs[2];
+  for (int i = 0; i < 2; i++) {
+    bufs[i] = aligned_alloc(CACHE_LINE_SIZE, sizeof(void*) * slots);
+    if (!bufs[i]) {
+      if (i)
+        free(bufs[0]);
+      return -ENOMEM;
+    }
+    spsc_queue_init(&pqs[i], &cqs[i], bufs[i], slots);
+  }
+
+  pthread_barrier_t barrier;
+  pthread_barrier_init(&barrier, NULL, 2);
+
+  pthread_t threads[2];
+  int ret = 0;
+  for (int i = 0; i < 2; i++) {
+    runs[i].cpu = pair->cpus[i];
+    runs[i].barrier = &barrier;
+    runs[i].err = 0;
+    runs[i].elapsed_ns = 0;
+    for (int j = 0; j < 2; j++) {
+      runs[i].pq[j] = &pqs[j];
+      runs[i].cq[j] = &cqs[j];
+    }
+    ret = pthread_create(&threads[i], NULL, fns[i], &runs[i]);
+    if (ret) {
+      fprintf(stderr, "Error spawning thread: %s\n", strerror(ret));
+      exit(EXIT_FAILURE); // the other thread is stuck on the barrier
+    }
+  }
+
+  for (int i = 0; i < 2; i++)
+    pthread_join(threads[i], NULL);
+
+  pthread_barrier_destroy(&barrier);
+  free(bufs[0]);
+  free(bufs[1]);
+
+  for (int i = 0; i < 2; i++) {
+    if (runs[i].err)
+      return runs[i].err;
+  }
+  return 0;
+}
+
+static int bench_pair(const struct pair* pair, uint64_t ops, uint64_t samples, size_t slots) {
+  printf("%s, cpus %d -> %d\n", pair->name, pair->cpus[0], pair->cpus[1]);
+
+  struct run runs[2];
+  memset(runs, 0, sizeof(runs));
+  runs[0].ops = runs[1].ops = ops;
+  void* (*throughput_fns[2])(void*) = { producer_fn, consumer_fn };
+  int ret = run_pair(pair, throughput_fns, runs, slots);
+  if (ret) {
+    fprintf(stderr, "  throughput run failed: %s\n", strerror(-ret));
+    return ret;
+  }
+
+  printf(
+    "  %-28s %.2f Mops/s, %.2f ns/op\n",
+    "throughput",
+    ops / (runs[1].elapsed_ns / 1000.0),
+    (double)runs[1].elapsed_ns / ops
+  );
+  perf_report("producer", &runs[0].perf, ops);
+  perf_report("consumer", &runs[1].perf, ops);
+
+  struct bench_hist hist;
+  ret = hist_init(&hist, samples);
+  if (ret)
+    return ret;
+
+  memset(runs, 0, sizeof(runs));
+  runs[0].samples = runs[1].samples = samples;
+  runs[0].hist = &hist;
+  void* (*latency_fns[2])(void*) = { ping_fn, pong_fn };
+  ret = run_pair(pair, latency_fns, runs, slots);
+  if (ret) {
+    fprintf(stderr, "  latency run failed: %s\n", strerror(-ret));
+  } else {
+    hist_report("handoff latency", &hist);
+  }
+  hist_cleanup(&hist);
+
+  return ret;
+}
+
+static bool contains(const int* cpus, int count, int cpu) {
+  for (int i = 0; i < count; i++) {
+    if (cpus[i] == cpu)
+      return true;
+  }
+  return false;
+}
+
+static int topology_pairs(struct pair* pairs) {
+  /**
+   * Picks cpu pairs for each placement from cpu 0's topology
+   *
+   * Returns:
+   * - int: the number of pairs found
+   */
+  static int siblings[BENCH_MAX_CPUS];
+  static int l3[BENCH_MAX_CPUS];
+  static int online[BENCH_MAX_CPUS];
+
+  int sibling_count = read_cpu_list(
+    "/sys/devices/system/cpu/cpu0/topology/thread_siblings_list",
+    siblings,
+    BENCH_MAX_CPUS
+  );
+  int l3_count = read_cpu_list(
+    "/sys/devices/system/cpu/cpu0/cache/index3/shared_cpu_list",
+    l3,
+    BENCH_MAX_CPUS
+  );
+  int online_count = read_cpu_list(
+    "/sys/devices/system/cpu/online",
+    online,
+    BENCH_MAX_CPUS
+  );
+
+  int count = 0;
+  for (int i = 0; i < sibling_count; i++) {
+    if (siblings[i] != 0) {
+      pairs[count++] = (struct pair){ "same core", { 0, siblings[i] } };
+      break;
+    }
+  }
+
+  for (int i = 0; i < l3_count; i++) {
+    if (l3[i] != 0 && !contains(siblings, sibling_count, l3[i])) {
+      pairs[count++] = (struct pair){ "same CCD", { 0, l3[i] } };
+      break;
+    }
+  }
+
+  for (int i = 0; i < online_count && l3_count > 0; i++) {
+    if (!contains(l3, l3_count, online[i])) {
+      pairs[count++] = (struct pair){ "cross CCD", { 0, online[i] } };
+      break;
+    }
+  }
+
+  // without an L3 in sysfs, at least compare against another cpu
+  if (l3_count <= 0) {
+    for (int i = 0; i < online_count; i++) {
+      if (online[i] != 0 && !contains(siblings, sibling_count, online[i])) {
+        pairs[count++] = (struct pair){ "other core", { 0, online[i] } };
+        break;
+      }
+    }
+  }
+
+  return count;
+}
+
+int main(int argc, char** argv) {
+  uint64_t ops = DEFAULT_OPS;
+  uint64_t samples = DEFAULT_SAMPLES;
+  size_t slots = DEFAULT_SLOTS;
+  struct pair pairs[MAX_PAIRS];
+  int pair_count = 0;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "n:l:q:c:")) != -1) {
+    switch (opt) {
+      case 'n':
+        ops = strtoull(optarg, NULL, 10);
+        break;
+      case 'l':
+        samples = strtoull(optarg, NULL, 10);
+        break;
+      case 'q':
+        slots = strtoull(optarg, NULL, 10);
+        break;
+      case 'c': {
+        int cpus[2];
+        if (pair_count == MAX_PAIRS || parse_cpu_list(optarg, cpus, 2) != 2) {
+          fprintf(stderr, "-c takes a pair of cpus, like 0,4\n");
+          return EXIT_FAILURE;
+        }
+        pairs[pair_count++] = (struct pair){ "given", { cpus[0], cpus[1] } };
+        break;
+      }
+      default:
+        fprintf(stderr, "Usage: spsc_bench [-n ops] [-l samples] [-q slots] [-c cpu,cpu]...\n");
+        return EXIT_FAILURE;
+    }
+  }
+
+  // the queue buffer must be cache line aligned, so a whole number of lines
+  size_t per_line = CACHE_LINE_SIZE / sizeof(void*);
+  if (slots < 2 || slots % per_line) {
+    fprintf(stderr, "Queue slots must be a multiple of %zu\n", per_line);
+    return EXIT_FAILURE;
+  }
+  if (ops == 0 || samples == 0) {
+    fprintf(stderr, "Ops and samples must be nonzero\n");
+    return EXIT_FAILURE;
+  }
+
+  if (pair_count == 0)
+    pair_count = topology_pairs(pairs);
+  if (pair_count == 0) {
+    fprintf(stderr, "No cpu pairs found, give them with -c\n");
+    return EXIT_FAILURE;
+  }
+
+  printf("spsc_queue, %zu slots, %lu ops, %lu latency samples\n", slots, ops, samples);
+  int ret = 0;
+  for (int i = 0; i < pair_count; i++) {
+    if (bench_pair(&pairs[i], ops, samples, slots))
+      ret = EXIT_FAILURE;
+  }
+
+  return ret;
+}
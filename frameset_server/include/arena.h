@@ -0,0 +1,33 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * A bump allocator for the state the server sets up once at startup
+ * and keeps until it exits.
+ *
+ * Everything is carved out of a single anonymous mapping, so the
+ * per camera queues, buffers and contexts sit together rather than
+ * spread across the stack and heap. The mapping is populated by the
+ * thread that creates it, and with the kernel's default first touch
+ * policy its pages land on that thread's NUMA node, so the server
+ * pins itself to its CCD before creating the arena.
+ *
+ * An arena with no mapping only counts, arena_alloc returns NULL and
+ * advances used, so the same layout function can size the arena and
+ * then fill it in.
+ */
+
+struct arena {
+  uint8_t* base; // NULL while sizing
+  size_t size;
+  size_t used;
+};
+
+int init_arena(struct arena* arena, size_t size);
+void* arena_alloc(struct arena* arena, size_t size, size_t align);
+void cleanup_arena(struct arena* arena);
+
+#endif // ARENA_H
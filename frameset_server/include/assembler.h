@@ -0,0 +1,109 @@
+#ifndef ASSEMBLER_H
+#define ASSEMBLER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "spsc_queue.h"
+#include "stream_mgr.h"
+
+#define ASSEMBLER_MAX_CAMS 64 // one bit per camera in the masks
+#define ASSEMBLER_SLOTS 16 // frame intervals in flight at once
+#define ASSEMBLER_LATE UINT64_MAX // returned for a frame too late to be used
+
+/**
+ * Groups frames from every camera into framesets by their
+ * capture timestamp.
+ *
+ * The cameras capture on a shared schedule, start_ts + n * frame_dur,
+ * so each frame maps to a frame index n, and each index in flight gets
+ * a slot in a small table. Frames fill in their slot as they arrive from
+ * the decoders, in any order across cameras.
+ *
+ * Cameras may run at different rates, as long as the fastest rate is
+ * a multiple of every other one. frame_dur is the fastest camera's
+ * interval, and a camera at 1 / k of that rate is only expected in
+ * every kth slot, the ones its own schedule lands on.
+ *
+ * The whole rig can also be decimated, see rate_ctl.h, which multiplies
+ * every camera's period by the same factor from a given frame index on.
+ * Slots no camera is expected in are skipped without being emitted.
+ *
+ * A slot is finished as soon as every camera expected in it has either
+ * contributed a frame to it or delivered a frame for a later index, since frames from
+ * a single camera always arrive in order, a camera that has moved past
+ * a slot will never fill it. A slot still waiting on a camera is given
+ * up once its deadline passes, so a single slow or stalled camera only
+ * holds framesets back by the deadline.
+ *
+ * Incomplete slots are emitted with a mask of the cameras present when
+ * partial framesets are enabled, and dropped otherwise.
+ *
+ * A camera whose stream has faulted, see ingest.h, is masked out with
+ * assembler_set_degraded until it's streaming again. Slots don't wait
+ * on a degraded camera, so the rest of the rig carries on at full rate
+ * with partial framesets, which still count it as missed.
+ *
+ * Framesets are always emitted in frame index order.
+ */
+
+struct assembler_slot {
+  uint64_t timestamp;
+  uint64_t deadline;
+  uint64_t cam_mask;
+  uint64_t first_arrival; // of the slot's first frame, CLOCK_MONOTONIC
+  bool open;
+};
+
+struct assembler {
+  uint64_t start_ts;
+  uint64_t frame_dur;
+  uint64_t timeout;
+  uint64_t full_mask;
+  uint64_t degraded; // cameras no slot waits on
+  uint32_t max_period; // the slowest camera's period, in frame_dur
+  uint64_t next_idx; // oldest frame index not yet emitted or dropped
+  uint64_t dropped; // incomplete framesets that were not emitted
+  uint64_t partial; // incomplete framesets emitted with cameras missing
+  uint32_t cam_count;
+  bool emit_partial;
+  struct producer_q* empty_qs;
+  uint64_t* cam_next_idx; // one past the last index each camera delivered
+  uint32_t* cam_period; // frame_dur intervals between a camera's captures
+  uint64_t* cam_missed; // per camera, incomplete framesets it was expected in
+  uint32_t decimation; // applies from decimation_idx on
+  uint32_t prev_decimation; // applies before it
+  uint64_t decimation_idx;
+  struct ts_frame_buf** frames; // ASSEMBLER_SLOTS * cam_count
+  struct assembler_slot slots[ASSEMBLER_SLOTS];
+};
+
+int init_assembler(
+  struct assembler* as,
+  uint32_t cam_count,
+  uint64_t start_ts,
+  const uint32_t* cam_fps,
+  uint64_t timeout,
+  bool emit_partial,
+  struct producer_q* empty_qs
+);
+uint64_t assembler_add(
+  struct assembler* as,
+  uint32_t cam,
+  struct ts_frame_buf* frame,
+  uint64_t now
+);
+bool assembler_next(
+  struct assembler* as,
+  uint64_t now,
+  struct ts_frame_buf** frames,
+  uint64_t* timestamp,
+  uint64_t* cam_mask
+);
+void assembler_set_decimation(struct assembler* as, uint32_t decimation, uint64_t from_idx);
+void assembler_set_degraded(struct assembler* as, uint64_t degraded);
+void assembler_reset(struct assembler* as, uint64_t start_ts);
+uint64_t assembler_deadline(struct assembler* as);
+void cleanup_assembler(struct assembler* as);
+
+#endif // ASSEMBLER_H
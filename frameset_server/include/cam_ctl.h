@@ -0,0 +1,88 @@
+#ifndef CAM_CTL_H
+#define CAM_CTL_H
+
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "ctl_msg.h"
+#include "parse_conf.h"
+#include "stream_msg.h"
+#include "telemetry.h"
+
+#define CTL_REPEAT_INTERVAL 20000000ULL // ns between repeats of a command not every camera acknowledged
+#define CTL_MAX_REPEATS 25 // before the cameras still silent are given up on
+#define CTL_PING_INTERVAL 1000000000ULL // ns between latency probes
+#define CTL_PING_WAIT 200000000ULL // ns the first session waits on every camera answering a ping
+#define CTL_LEAD_RTTS 4 // round trips of the slowest camera a start or stop is scheduled ahead by
+#define CTL_LEAD_REPEATS 3 // repeats on top, so a camera that loses a datagram or two still makes it
+#define CTL_MIN_LEAD 20000000ULL // ns
+#define CTL_RTT_WEIGHT 8 // 1 / weight of each new round trip in the smoothed one
+
+/**
+ * Drives every camera through a session over the multicast control
+ * group, see ctl_msg.h.
+ *
+ * Commands go out as a single datagram to the whole rig, so starting
+ * and stopping costs the same for three cameras as for dozens. The
+ * last ARM or STOP is repeated every CTL_REPEAT_INTERVAL until each
+ * camera it's waiting on has acknowledged it, and given up on after
+ * CTL_MAX_REPEATS, naming the cameras that never answered.
+ *
+ * The cameras are pinged every CTL_PING_INTERVAL, keeping a smoothed
+ * round trip per camera along with how far its clock sits from the
+ * server's, both published in the metrics page. A start or stop is
+ * scheduled cam_ctl_lead ahead, CTL_LEAD_RTTS round trips of the
+ * slowest camera plus CTL_LEAD_REPEATS repeats, rather than a fixed
+ * delay, so the rig starts as soon as every camera is sure to have
+ * heard, and a lost datagram is covered by a repeat rather than
+ * leaving a camera off the schedule.
+ *
+ * Each ARM carries every camera's subscription, set with
+ * cam_ctl_subscribe, so the rig's streams are settled in the same
+ * datagram that starts it.
+ *
+ * Everything runs on the main thread, the socket is watched alongside
+ * its other events and cam_ctl_update is called every pass.
+ */
+
+struct ctl_cam {
+  uint64_t rtt; // smoothed, ns, 0 until the camera answers a ping
+  int64_t clock_offset; // ns the camera's clock is ahead of the server's
+  uint8_t streams; // subscription sent with every ARM, see stream_msg.h
+};
+
+struct cam_ctl {
+  int fd; // UDP, sends to the group and receives the acknowledgements
+  struct sockaddr_in group;
+  cam_conf* confs;
+  struct ctl_cam* cams;
+  uint32_t cam_count;
+  struct telemetry* tm;
+  uint32_t seq;
+  struct ctl_arm pending; // the last ARM or STOP, repeated until acknowledged
+  uint64_t waiting; // cameras yet to acknowledge it
+  uint64_t refused; // cameras that refused it, only logged once
+  uint32_t repeats;
+  uint64_t next_repeat; // CLOCK_MONOTONIC
+  uint32_t ping_seq;
+  uint64_t next_ping; // CLOCK_MONOTONIC
+};
+
+int init_cam_ctl(
+  struct cam_ctl* ctl,
+  struct ctl_cam* cams,
+  cam_conf* confs,
+  uint32_t cam_count,
+  struct telemetry* tm
+);
+void cam_ctl_subscribe(struct cam_ctl* ctl, uint32_t cam, uint8_t streams);
+uint64_t cam_ctl_lead(const struct cam_ctl* ctl);
+int cam_ctl_arm(struct cam_ctl* ctl, uint64_t start_ts, uint16_t fps, uint64_t cams, uint64_t now);
+int cam_ctl_stop(struct cam_ctl* ctl, uint64_t stop_ts, uint64_t now);
+void cam_ctl_recv(struct cam_ctl* ctl);
+void cam_ctl_update(struct cam_ctl* ctl, uint64_t now);
+int cam_ctl_timeout(const struct cam_ctl* ctl, uint64_t now);
+void cleanup_cam_ctl(struct cam_ctl* ctl);
+
+#endif // CAM_CTL_H
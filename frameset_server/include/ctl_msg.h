@@ -0,0 +1,92 @@
+#ifndef CTL_MSG_H
+#define CTL_MSG_H
+
+#include <stdint.h>
+
+/**
+ * Session control the server multicasts to every camera at once,
+ * see cam_ctl.h. This header is shared between the server and the
+ * cameras, so it must stay valid as both C and C++.
+ *
+ * Every camera joins CTL_GROUP on CTL_PORT, so a command costs the
+ * server one datagram however many cameras there are. Messages are
+ * sent raw and little endian.
+ *
+ * CTL_ARM starts capturing on the shared schedule from timestamp, a
+ * CLOCK_REALTIME time in ns. fps is the rig's fastest rate, the one the
+ * schedule is laid out at, and a camera whose own rate doesn't divide
+ * it refuses. An ARM only takes effect once, and again after a STOP
+ * for a later session, so repeating it is harmless to a camera that's
+ * already capturing, and lets one that dropped out rejoin.
+ *
+ * An ARM also carries each camera's subscription, sub_count ctl_sub
+ * entries following the message, which streams of stream_msg.h it
+ * should encode and send. A camera with no entry sends only
+ * STREAM_MAIN, and one asked for a stream it isn't configured to
+ * produce refuses. Unlike the start time, a subscription is applied
+ * by every ARM, so the server can change it mid session by arming
+ * again with the same timestamp.
+ *
+ * CTL_STOP ends the stream at timestamp, so every camera's last capture
+ * is on the same frame, or right away if it's 0 or already passed.
+ *
+ * CTL_PING carries the server's send time in timestamp, which the
+ * camera echoes back along with its own clock on receipt, measuring
+ * both the round trip and how far the camera's clock sits from the
+ * server's.
+ *
+ * A camera answers every command with a ctl_ack sent back to where
+ * the command came from, echoing its seq. The server repeats a command
+ * until every camera it's waiting on has acknowledged it, so a lost
+ * datagram only delays a camera rather than leaving it out of sync.
+ */
+
+#define CTL_GROUP "239.255.77.1" // administratively scoped, never leaves the site
+#define CTL_PORT 22400
+#define CTL_MAGIC 0x4c525443U // "CTRL"
+#define CTL_ACK_MAGIC 0x4b434143U // "CACK"
+#define CTL_VERSION 2
+#define CTL_MAX_SUBS 64
+
+#define CTL_ARM 1
+#define CTL_STOP 2
+#define CTL_PING 3
+
+#define CTL_ACK_REFUSED (1u << 0) // the camera can't follow the command
+
+struct __attribute__((packed)) ctl_msg {
+  uint32_t magic;
+  uint8_t version;
+  uint8_t cmd;
+  uint16_t fps; // CTL_ARM only
+  uint32_t seq;
+  uint64_t timestamp;
+  uint8_t sub_count; // CTL_ARM only, ctl_sub entries that follow
+  uint8_t reserved[3];
+};
+
+struct __attribute__((packed)) ctl_sub {
+  uint16_t cam_id; // the camera's stream port
+  uint8_t streams; // a STREAM_BIT per stream to send
+  uint8_t reserved;
+};
+
+struct __attribute__((packed)) ctl_arm {
+  struct ctl_msg msg;
+  struct ctl_sub subs[CTL_MAX_SUBS]; // only sub_count are sent
+};
+
+struct __attribute__((packed)) ctl_ack {
+  uint32_t magic;
+  uint8_t version;
+  uint8_t cmd;
+  uint8_t flags;
+  uint8_t reserved;
+  uint16_t cam_id; // the camera's stream port, see stream_msg.h
+  uint16_t reserved2;
+  uint32_t seq;
+  uint64_t echo_ts; // the command's timestamp
+  uint64_t recv_ts; // the camera's CLOCK_REALTIME when it received the command
+};
+
+#endif // CTL_MSG_H
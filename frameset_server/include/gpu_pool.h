@@ -0,0 +1,18 @@
+#ifndef GPU_POOL_H
+#define GPU_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef CUDA_FRAMESETS
+
+int init_gpu_pool(
+  size_t size,
+  uint8_t** dev_pool,
+  uint8_t* ipc_handle
+);
+void cleanup_gpu_pool(uint8_t* dev_pool);
+
+#endif // CUDA_FRAMESETS
+
+#endif // GPU_POOL_H
@@ -0,0 +1,112 @@
+#ifndef INGEST_H
+#define INGEST_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "metrics.h"
+#include "parse_conf.h"
+#include "recorder.h"
+#include "spsc_queue.h"
+
+#define PACKETS_PER_CAM 16 // encoded packets in flight between ingest and a decoder
+#define PACKET_Q_SIZE 32 // queue slots, must exceed PACKETS_PER_CAM and stay cache line aligned
+#define PACKET_MIN_BUF_SIZE 8192 // smallest packet buffer, whatever the resolution
+
+/**
+ * A thread receives every TCP stream of a group of cameras, a
+ * group per L3 domain, see topology.h.
+ *
+ * All sockets are nonblocking and driven from one epoll set. Each
+ * readable connection is drained with a single large recv into its
+ * receive buffer, then every complete header and payload in the
+ * buffer is parsed in place, see stream_msg.h, so a burst of packets
+ * costs one syscall rather than three per packet. A stream that loses
+ * sync recovers at its next keyframe rather than failing.
+ *
+ * Complete packets are copied into a packet buffer from the camera's
+ * pool and handed to its decoder through an SPSC queue. When a camera
+ * has no free packet buffers, because its decoder is behind, the
+ * reactor stops reading that socket until one is returned, which
+ * pushes back on the camera through TCP flow control instead of
+ * dropping packets, and without stalling any other camera.
+ *
+ * Packet buffers start out sized for a typical packet at the camera's
+ * resolution, and one that receives a larger packet, usually a
+ * keyframe, is grown to the next power of two and keeps its size when
+ * it's returned to the pool, so after the first few keyframes a camera
+ * never allocates again. Receive buffers grow the same way to hold the
+ * largest record seen. Anything over ENCODED_FRAME_MAX_SIZE is treated
+ * as a corrupt stream.
+ *
+ * When recording, every packet is also appended to the recorder as
+ * it's parsed, see recorder.h. A stream that isn't live only hands
+ * its end of stream to the decoder, so cameras can be recorded
+ * without decoding anything. A camera with a preview stream, see
+ * stream_msg.h, has the preview decoded and the main stream
+ * recorded, so full resolution goes to disk without ever reaching a
+ * decoder. Since the recorder's queues have a single
+ * producer, one thread takes every camera while recording.
+ *
+ * A thread idles until start_fd is written, then accepts and streams
+ * every camera once, and idles again after each has sent its end of
+ * stream. The listening sockets stay open in between, so a camera that
+ * connects early waits in the backlog, and the timeouts only run while
+ * a session is in progress.
+ *
+ * A camera failing mid session only takes itself down. When its
+ * connection drops, times out or can't be trusted, or it never
+ * connects at all, the connection is closed, the camera is marked
+ * degraded so the main thread masks it out of framesets, and its
+ * decoder is sent a reset packet to discard whatever it was holding.
+ * The thread goes back to listening on the camera's socket, and once it
+ * reconnects and delivers a keyframe the camera is no longer degraded.
+ * A degraded camera counts as finished when deciding a session is over,
+ * and once the cameras are stopped it's no longer rearmed, so a group
+ * whose every camera is degraded then finishes without one ending.
+ */
+
+struct enc_packet {
+  uint64_t timestamp; // scheduled capture time, what framesets are assembled on
+  uint64_t sensor_ts; // measured start of exposure, 0 if the camera didn't report it
+  uint32_t size;
+  bool end_of_stream;
+  bool keyframe; // see STREAM_KEYFRAME
+  bool reset; // the stream faulted, no payload, the decoder starts over
+  uint32_t cap; // bytes allocated for data, grown as needed
+  uint8_t* data;
+};
+
+struct ingest_stream {
+  cam_conf* conf;
+  uint32_t cam; // index among every camera, not just this thread's
+  struct producer_q* filled_pkts;
+  struct pool_event* work_ev; // the decode pool's
+  struct consumer_q* empty_pkts;
+  struct spsc_event* empty_ev;
+  struct recorder* recorder; // NULL unless recording
+  struct metrics_cam* metrics;
+  bool live; // hand packets to the decoder
+  uint8_t streams; // the camera is subscribed to, see stream_msg.h
+  uint8_t primary; // the stream it's degraded without, decoded when live, recorded otherwise
+  _Atomic bool degraded; // written by the ingest thread, read by the main thread
+};
+
+struct ingest_ctx {
+  struct ingest_stream* streams;
+  uint32_t stream_count;
+  uint32_t core;
+  pthread_t main_thread; // signaled if the thread fails
+  int stop_fd; // eventfd, written to stop the thread
+  int start_fd; // eventfd, written to start a session
+  _Atomic bool stopping; // set by the main thread once the cameras are sent STOP
+};
+
+int init_packet_bufs(struct enc_packet* pkts, uint32_t count, const cam_conf* conf);
+void cleanup_packet_bufs(struct enc_packet* pkts, uint32_t count);
+void* ingest_fn(void* ptr);
+
+#endif // INGEST_H
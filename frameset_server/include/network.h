@@ -1,9 +1,12 @@
 #ifndef NETWORK_H
 #define NETWORK_H
 
+#include <stdbool.h>
+#include <stddef.h>
+
 #include "parse_conf.h"
 
-int broadcast_msg(cam_conf* confs, int confs_size, const char* msg, size_t msg_size);
+int send_cam_msgs(cam_conf* confs, int confs_size, const void* msgs, size_t msg_size, bool* eth_conn);
 int setup_stream(cam_conf* conf);
 int accept_conn(int sockfd);
 ssize_t recv_from_stream(int clientfd, char* buf, size_t size);
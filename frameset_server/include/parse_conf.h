@@ -4,18 +4,16 @@
 #include <arpa/inet.h>
 #include <stdint.h>
 
-#define CAM_NAME_LEN 9
+#include "rig_conf.h"
 
-typedef struct cam_conf {
-  struct in_addr eth_ip;
-  struct in_addr wifi_ip;
-  uint16_t tcp_port;
-  uint16_t udp_port;
-  uint8_t id;
-  char name[CAM_NAME_LEN]; // expected name format rpicamXX\0 where XX is a counter from 00-99
-} cam_conf;
+/**
+ * Loads the rig's snapshot, see rig_conf.h, parsing cams.yaml only
+ * when the snapshot at rig_path is missing, from another version, or
+ * older than the yaml. A fresh parse is written back to rig_path for
+ * the next start and for the toolkit to map, and failing to write it
+ * only costs that, so it's logged rather than returned.
+ */
 
-int count_cameras(const char* fpath);
-int parse_conf(cam_conf* confs, int count);
+int load_rig_conf(const char* yaml_path, const char* rig_path, struct rig_conf* rig);
 
 #endif
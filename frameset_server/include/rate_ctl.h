@@ -0,0 +1,83 @@
+#ifndef RATE_CTL_H
+#define RATE_CTL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "assembler.h"
+#include "ingest.h"
+#include "parse_conf.h"
+#include "rate_msg.h"
+#include "spsc_queue.h"
+#include "stream_mgr.h"
+
+#define RATE_CTL_INTERVAL 500000000ULL // ns between feedback messages
+#define RATE_LAG_HIGH 250000000ULL // decode lag of a camera that's falling behind
+#define RATE_LAG_LOW 100000000ULL // decode lag of a camera with room to spare
+#define RATE_DEPTH_HIGH (PACKETS_PER_CAM / 2)
+#define RATE_DEPTH_LOW 1
+#define RATE_RECOVER_INTERVALS 6 // healthy intervals before a step is undone
+#define RATE_WIFI_LEVEL 2 // lowest level while the cameras are on wifi
+#define RATE_DECIMATION_LEAD 500000000ULL // ns ahead a new decimation takes effect
+
+/**
+ * Eases cameras off when the server can't keep up with them, instead
+ * of letting packets back up until framesets are dropped at random.
+ *
+ * Every RATE_CTL_INTERVAL the main thread measures each camera's
+ * backlog, the packets waiting on its decoder and how far behind the
+ * capture time its decoder is, and sends it a rate_msg, see
+ * rate_msg.h. Messages are resent every interval whether anything
+ * changed or not, so a lost datagram costs one interval.
+ *
+ * A camera that's falling behind is first stepped down in quality,
+ * which shrinks its packets, so both the network and its decoder have
+ * less to move. Once a camera is at RATE_MAX_LEVEL and still behind,
+ * the whole rig is decimated, halving every camera's capture rate at
+ * once so framesets stay complete, and the assembler is told which
+ * cameras to expect from then on. Recovery runs in reverse, the frame
+ * rate comes back first, then quality, each step only after
+ * RATE_RECOVER_INTERVALS healthy intervals, so the rig doesn't
+ * oscillate around its limit.
+ *
+ * Over wifi every camera is held at RATE_WIFI_LEVEL or lower quality,
+ * since the link has a fraction of ethernet's bandwidth to share.
+ */
+
+struct rate_cam {
+  uint32_t level;
+  uint32_t healthy; // consecutive intervals with room to spare
+  uint32_t depth;
+  uint64_t lag;
+  uint64_t last_ts; // newest packet timestamp its decoder had taken
+};
+
+struct rate_ctl {
+  struct rate_cam* cams;
+  struct rate_msg* msgs;
+  uint32_t cam_count;
+  uint32_t decimation;
+  uint64_t effective_ts; // of the latest decimation
+  uint32_t healthy; // consecutive intervals every camera had room to spare
+  uint64_t next_update; // CLOCK_MONOTONIC
+  bool wifi;
+};
+
+void init_rate_ctl(
+  struct rate_ctl* rc,
+  struct rate_cam* cams,
+  struct rate_msg* msgs,
+  uint32_t cam_count,
+  uint64_t now
+);
+int rate_ctl_timeout(const struct rate_ctl* rc, uint64_t now);
+void rate_ctl_update(
+  struct rate_ctl* rc,
+  cam_conf* confs,
+  struct stream_ctx* streams,
+  struct consumer_q* filled_pkt_qs,
+  struct assembler* as,
+  uint64_t now
+);
+
+#endif // RATE_CTL_H
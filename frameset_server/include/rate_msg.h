@@ -0,0 +1,47 @@
+#ifndef RATE_MSG_H
+#define RATE_MSG_H
+
+#include <stdint.h>
+
+/**
+ * Rate feedback the server sends each camera over its UDP control
+ * port, see rate_ctl.h. This header is shared between the server and
+ * the cameras, so it must stay valid as both C and C++.
+ *
+ * The message is sent raw and little endian like the session commands
+ * in ctl_msg.h, which arrive on the control group instead, and is
+ * checked by its size and magic.
+ *
+ * level is a step down from the camera's configured quality, 0 being
+ * the configured CRF or bitrate, each step raising the CRF by
+ * RATE_CRF_STEP or lowering the bitrate by the matching factor, so a
+ * camera can be eased off without touching the capture schedule.
+ *
+ * decimation is shared across the rig. A camera at decimation k only
+ * captures the frames of its schedule whose index is a multiple of k,
+ * so every camera drops the same frames and framesets stay whole at
+ * 1 / k of the rate. It applies to captures scheduled at or after
+ * effective_ts, a realtime timestamp picked between two frames, far
+ * enough ahead for every camera to hear about it first.
+ */
+
+#define RATE_MSG_MAGIC 0x45544152U // "RATE"
+#define RATE_MSG_VERSION 1
+#define RATE_MAX_LEVEL 4
+#define RATE_MAX_DECIMATION 4 // must be a power of two
+#define RATE_CRF_STEP 3 // CRF added per level, 6 roughly halves the bitrate
+
+#define RATE_FLAG_WIFI 1 // the server reached the camera over wifi
+
+struct __attribute__((packed)) rate_msg {
+  uint32_t magic;
+  uint8_t version;
+  uint8_t level;
+  uint8_t decimation;
+  uint8_t flags;
+  uint64_t effective_ts;
+  uint32_t queue_depth; // packets waiting on the camera's decoder
+  uint32_t decode_lag_us; // capture of the frame being decoded to now
+};
+
+#endif // RATE_MSG_H
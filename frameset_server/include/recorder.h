@@ -0,0 +1,83 @@
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "parse_conf.h"
+#include "recording.h"
+#include "spsc_queue.h"
+
+#define RECORD_ALIGN 4096 // O_DIRECT offset, length and buffer alignment
+#define RECORD_BUF_SIZE (2 * 1024 * 1024)
+#define RECORD_BUFS_PER_CAM 4
+#define RECORD_IDX_PER_BUF 1024 // index entries a buffer can carry
+#define RECORD_FLUSH_NS 1000000000ULL // hand off a buffer at least this often
+
+/**
+ * Writes each camera's encoded packets to disk as they are received,
+ * without decoding them, see recording.h for the files it produces.
+ *
+ * The ingest thread copies every packet into the camera's current
+ * buffer, and records its timestamp, offset and keyframe flag. Once a
+ * buffer is full, or has been held for RECORD_FLUSH_NS, the largest
+ * RECORD_ALIGN multiple at its front is handed to a writer thread
+ * through an SPSC queue, and the rest is carried into the camera's
+ * next buffer, so every write lands on an aligned file offset with an
+ * aligned length and the data files can be opened with O_DIRECT,
+ * skipping the page cache entirely.
+ *
+ * The writer appends a buffer's index entries only after its data is
+ * written, and returns the buffer through a second queue. Ingest never
+ * waits on the disk: a camera with no free buffer, because the disk
+ * has fallen behind, has its packets dropped from the recording and
+ * counted, while the live stream carries on.
+ */
+
+struct record_buf {
+  uint8_t* data; // RECORD_BUF_SIZE bytes, RECORD_ALIGN aligned
+  struct record_idx_entry* idx;
+  uint64_t file_offset; // of data[0]
+  size_t len;
+  size_t write_len; // aligned prefix handed to the writer
+  uint32_t idx_count;
+  uint32_t idx_write; // entries covered by the written prefix
+  uint32_t cam;
+};
+
+struct record_cam {
+  char name[CAM_NAME_LEN];
+  int data_fd;
+  int idx_fd;
+  struct record_buf* cur;
+  uint64_t cur_since; // when cur received its first bytes
+  uint64_t packets;
+  uint64_t dropped;
+  bool failed; // a write failed, the writer skips this camera from then on
+};
+
+struct recorder {
+  struct record_cam* cams;
+  uint32_t cam_count;
+  struct record_buf* bufs;
+  uint8_t* buf_data;
+  struct record_idx_entry* buf_idx;
+  void** q_bufs;
+  struct producer_q filled_pq;
+  struct consumer_q filled_cq;
+  struct producer_q empty_pq;
+  struct consumer_q empty_cq;
+  struct spsc_event filled_ev;
+  pthread_t writer;
+  bool writer_running;
+  _Atomic bool stopping;
+};
+
+int init_recorder(struct recorder* rec, const char* dir, cam_conf* confs, uint32_t cam_count);
+int recorder_add(struct recorder* rec, uint32_t cam, uint64_t timestamp, const uint8_t* data, uint32_t size);
+void cleanup_recorder(struct recorder* rec);
+
+#endif // RECORDER_H
@@ -0,0 +1,48 @@
+#ifndef RECORDING_H
+#define RECORDING_H
+
+#include <stdint.h>
+
+/**
+ * On disk layout of a recording made with the server's -r option.
+ * This header is shared between the server and the toolkit, so it
+ * must stay valid as both C and C++.
+ *
+ * A recording is a directory with two files per camera:
+ *
+ * 1. <name>.h264, the camera's encoded packets back to back exactly as
+ *    they were received, a raw Annex B stream any H.264 decoder or
+ *    ffmpeg can read directly.
+ *
+ * 2. <name>.idx, a record_idx_header followed by one record_idx_entry
+ *    per packet, in the order the packets were received. Entries are
+ *    only ever appended once the data they point to is on disk, so an
+ *    index cut short by a crash is still valid up to its last whole
+ *    entry.
+ *
+ * Every multibyte field is little endian, which is what the cameras
+ * send and what the server runs on.
+ */
+
+#define RECORD_IDX_MAGIC 0x5844494dU // "MIDX"
+#define RECORD_IDX_VERSION 1
+#define RECORD_NAME_LEN 16
+#define RECORD_DATA_EXT ".h264"
+#define RECORD_IDX_EXT ".idx"
+
+#define RECORD_KEYFRAME 1 // the packet starts with an SPS or an IDR slice
+
+struct record_idx_header {
+  uint32_t magic;
+  uint32_t version;
+  char cam_name[RECORD_NAME_LEN];
+};
+
+struct record_idx_entry {
+  uint64_t timestamp; // capture timestamp from the camera, PTP synced ns
+  uint64_t offset; // of the packet in the data file
+  uint32_t size;
+  uint32_t flags;
+};
+
+#endif // RECORDING_H
@@ -0,0 +1,93 @@
+#ifndef RIG_CONF_H
+#define RIG_CONF_H
+
+#include <arpa/inet.h>
+#include <stdint.h>
+
+/**
+ * The rig's layout, parsed once from cams.yaml into a flat snapshot
+ * that the server and the toolkit both read. This header is shared
+ * between the server and the toolkit, so it must stay valid as both
+ * C and C++.
+ *
+ * The server is the only thing that parses the yaml, see parse_conf.h.
+ * It writes what it parsed to RIG_CONF_PATH, a single fixed size
+ * rig_conf holding each camera's conf and the placement overrides,
+ * and its next start loads that instead of parsing again, as long as
+ * cams.yaml hasn't changed since, going by the size and modification
+ * time the snapshot records. The toolkit maps the same file read only,
+ * so every process sees the same cameras in the same order, the order
+ * the server numbers them in, without a yaml parser of its own.
+ *
+ * The snapshot is only ever replaced whole, by renaming a new one over
+ * the old, so a reader that has it mapped keeps seeing a consistent
+ * rig until it maps the file again. It's read in place on the machine
+ * that wrote it, so the structs are laid out as the compiler lays them
+ * out, and cam_size guards against a reader built with another layout.
+ */
+
+#define RIG_CONF_MAGIC 0x4749524dU // "MRIG"
+#define RIG_CONF_VERSION 1
+#define RIG_CONF_YAML "/etc/mocap-toolkit/cams.yaml"
+#define RIG_CONF_PATH "/var/cache/mocap-toolkit/rig.bin"
+#define RIG_MAX_CAMS 64
+#define RIG_CPU_WORDS 16 // 64 CPUs each, CPU_SETSIZE in all
+
+#define CAM_NAME_LEN 9
+
+// stream parameters a camera's conf may leave out
+#define CAM_DEFAULT_WIDTH 1280
+#define CAM_DEFAULT_HEIGHT 720
+#define CAM_DEFAULT_FPS 30 // must match FPS in the picam config.txt
+
+typedef struct cam_conf {
+  struct in_addr eth_ip;
+  struct in_addr wifi_ip;
+  uint16_t tcp_port;
+  uint16_t udp_port;
+  uint16_t width;
+  uint16_t height;
+  uint16_t fps;
+  uint16_t preview_width; // 0 if the camera has no preview stream, must match PREVIEW_WIDTH
+  uint16_t preview_height;
+
+  // the stream decoded into framesets, the preview when the camera has
+  // one, so full resolution is only ever recorded, see stream_msg.h
+  uint16_t live_width;
+  uint16_t live_height;
+  uint8_t live_stream;
+
+  uint8_t id;
+  char name[CAM_NAME_LEN]; // expected name format rpicamXX\0 where XX is a counter from 00-99
+} cam_conf;
+
+// the placement mapping of cams.yaml, see topology.h
+struct rig_placement {
+  int32_t main_core; // -1 when unset
+  int32_t ingest_core;
+  uint32_t decode_core_count; // 0 when unset
+  uint32_t reserved;
+  uint64_t decode_cores[RIG_CPU_WORDS]; // bit i of word i / 64 for CPU i
+};
+
+struct rig_conf {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t cam_size; // sizeof(cam_conf) of the writer
+  uint32_t cam_count;
+  uint32_t reserved;
+  uint64_t yaml_size; // of the cams.yaml parsed, bytes
+  uint64_t yaml_mtime; // unix ns
+  struct rig_placement placement;
+  cam_conf cams[RIG_MAX_CAMS]; // only cam_count are set
+};
+
+static inline int rig_conf_valid(const struct rig_conf* rig) {
+  return rig->magic == RIG_CONF_MAGIC &&
+         rig->version == RIG_CONF_VERSION &&
+         rig->cam_size == sizeof(cam_conf) &&
+         rig->cam_count > 0 &&
+         rig->cam_count <= RIG_MAX_CAMS;
+}
+
+#endif // RIG_CONF_H
@@ -2,11 +2,18 @@
 #define SPSC_QUEUE_H
 
 #include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <poll.h>
 #include <stdatomic.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdalign.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 #define CACHE_LINE_SIZE 64
 
@@ -148,4 +155,199 @@ static inline void* spsc_dequeue(struct consumer_q* q) {
   return data;
 }
 
+static inline bool spsc_empty(struct consumer_q* q) {
+  // doesn't touch the cached head, so any thread may use it as a hint
+  size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  return tail == atomic_load_explicit(q->head_ptr, memory_order_acquire);
+}
+
+static inline size_t spsc_depth(struct consumer_q* q) {
+  // like spsc_empty, a hint any thread may use, already stale when it returns
+  size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  size_t head = atomic_load_explicit(q->head_ptr, memory_order_acquire);
+  return head >= tail ? head - tail : head + q->cap - tail;
+}
+
+/**
+ * Optional blocking support for a queue.
+ *
+ * The queues themselves never block, so a consumer with nothing
+ * to do would otherwise have to poll. An spsc_event lets it sleep
+ * on an eventfd instead, which can also be waited on alongside
+ * other fds with epoll.
+ *
+ * The producer only pays for a syscall when the consumer is
+ * actually parked. The consumer sets parked, then checks the
+ * queue once more before sleeping. The producer publishes its
+ * item, then checks parked. The fences between the store and
+ * the load on each side guarantee at least one of them sees
+ * the other, so either the consumer finds the item or the
+ * producer wakes it.
+ *
+ * The event is an attachment rather than part of the queue, since
+ * most queues are never waited on, and a consumer can park on
+ * several of them at once. It only has room for a single consumer
+ * though, parked is one flag the first notify clears and the first
+ * consumer to wake drains the eventfd, so a second consumer parked
+ * on the same event can sleep through every notify after it. Queues
+ * drained by several consumers park on a pool_event instead.
+ */
+
+struct spsc_event {
+  alignas(CACHE_LINE_SIZE) _Atomic bool parked;
+  int fd;
+};
+
+static inline int spsc_event_init(struct spsc_event* ev) {
+  atomic_store_explicit(&ev->parked, false, memory_order_relaxed);
+  ev->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (ev->fd == -1)
+    return -errno;
+
+  return 0;
+}
+
+static inline void spsc_event_cleanup(struct spsc_event* ev) {
+  if (ev->fd >= 0)
+    close(ev->fd);
+  ev->fd = -1;
+}
+
+static inline void spsc_notify(struct spsc_event* ev) {
+  // called by the producer after enqueueing, pairs with the fence in spsc_park
+  atomic_thread_fence(memory_order_seq_cst);
+  if (!atomic_load_explicit(&ev->parked, memory_order_relaxed))
+    return;
+
+  // only the first notify after a park pays for the write
+  if (atomic_exchange_explicit(&ev->parked, false, memory_order_relaxed)) {
+    uint64_t one = 1;
+    ssize_t ret = write(ev->fd, &one, sizeof(one));
+    (void)ret; // can only fail if the counter would overflow, it's already readable
+  }
+}
+
+static inline bool spsc_park(struct spsc_event* ev, struct consumer_q* q) {
+  /**
+   * Marks the consumer as about to sleep on the event fd
+   *
+   * Returns false, leaving the consumer unparked, if the queue
+   * is not empty, in which case the consumer must not sleep.
+   */
+  atomic_store_explicit(&ev->parked, true, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+  if (!spsc_empty(q)) {
+    atomic_store_explicit(&ev->parked, false, memory_order_relaxed);
+    return false;
+  }
+
+  return true;
+}
+
+static inline void spsc_unpark(struct spsc_event* ev) {
+  // drain the counter so the fd stops polling readable
+  uint64_t count;
+  ssize_t ret = read(ev->fd, &count, sizeof(count));
+  (void)ret; // EAGAIN if we woke for another reason
+  atomic_store_explicit(&ev->parked, false, memory_order_relaxed);
+}
+
+static inline int spsc_wait(struct consumer_q* q, struct spsc_event* ev) {
+  /**
+   * Sleeps until the queue is not empty
+   *
+   * Returns 0 once an item is available, or -EINTR if a signal
+   * arrived first, so the caller can check whether it should stop.
+   */
+  if (!spsc_park(ev, q))
+    return 0;
+
+  struct pollfd pfd = {
+    .fd = ev->fd,
+    .events = POLLIN
+  };
+  int ret = poll(&pfd, 1, -1);
+  int err = errno;
+  spsc_unpark(ev);
+
+  return ret == -1 ? -err : 0;
+}
+
+/**
+ * Blocking support for queues drained by a pool of consumers.
+ *
+ * Any number of consumers can park on a pool_event, and a notify wakes
+ * one of them, so every consumer parked on it must be able to take any
+ * of the work it's notified for. A consumer that finds more work than
+ * it can take notifies again to pass the rest on, rather than every
+ * notify waking the whole pool to race for one item. It's a futex
+ * rather than an eventfd, so it can't be waited on with epoll.
+ *
+ * A consumer counts itself in waiters and reads seq, then checks for
+ * work once more, and only sleeps while seq still holds what it read.
+ * The producer publishes its item, then checks waiters, and if a
+ * consumer is parked bumps seq and wakes one waiter. As with an
+ * spsc_event the fences make sure either the consumer finds the item
+ * or the producer sees it parked, and a bump landing between the
+ * consumer's check and its sleep makes the futex return right away,
+ * so no notify is lost. The producer only pays for a syscall while a
+ * consumer is parked.
+ *
+ * pool_event_close wakes every consumer for good, those that park
+ * afterwards return straight away, so the pool can be joined.
+ */
+
+struct pool_event {
+  alignas(CACHE_LINE_SIZE) _Atomic uint32_t seq;
+  _Atomic uint32_t waiters;
+  _Atomic bool closed;
+};
+
+static inline void pool_event_init(struct pool_event* ev) {
+  atomic_store_explicit(&ev->seq, 0, memory_order_relaxed);
+  atomic_store_explicit(&ev->waiters, 0, memory_order_relaxed);
+  atomic_store_explicit(&ev->closed, false, memory_order_relaxed);
+}
+
+static inline void pool_wake(struct pool_event* ev, int count) {
+  atomic_fetch_add_explicit(&ev->seq, 1, memory_order_release);
+  syscall(SYS_futex, (uint32_t*)(void*)&ev->seq, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+static inline void pool_notify(struct pool_event* ev) {
+  // called by the producer after enqueueing, pairs with the fence in pool_park
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load_explicit(&ev->waiters, memory_order_relaxed))
+    pool_wake(ev, 1);
+}
+
+static inline uint32_t pool_park(struct pool_event* ev) {
+  /**
+   * Counts the consumer as about to sleep, it must check for work
+   * once more after this, then either pool_wait or pool_unpark
+   *
+   * Returns the seq to pass to pool_wait.
+   */
+  atomic_fetch_add_explicit(&ev->waiters, 1, memory_order_relaxed);
+  uint32_t seq = atomic_load_explicit(&ev->seq, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+  return seq;
+}
+
+static inline void pool_unpark(struct pool_event* ev) {
+  atomic_fetch_sub_explicit(&ev->waiters, 1, memory_order_relaxed);
+}
+
+static inline void pool_wait(struct pool_event* ev, uint32_t seq) {
+  // returns on a notify, a signal, or right away if one already came
+  if (!atomic_load_explicit(&ev->closed, memory_order_acquire))
+    syscall(SYS_futex, (uint32_t*)(void*)&ev->seq, FUTEX_WAIT_PRIVATE, seq, NULL, NULL, 0);
+  pool_unpark(ev);
+}
+
+static inline void pool_event_close(struct pool_event* ev) {
+  atomic_store_explicit(&ev->closed, true, memory_order_seq_cst);
+  pool_wake(ev, INT_MAX);
+}
+
 #endif // SPSC_QUEUE_H
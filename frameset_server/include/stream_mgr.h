@@ -1,28 +1,116 @@
 #ifndef STREAM_MGR_H
 #define STREAM_MGR_H
 
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stdint.h>
+#include <sys/types.h>
 
+#include "metrics.h"
 #include "parse_conf.h"
 #include "spsc_queue.h"
+#include "ts_ring.h"
+#include "viddec.h"
 
-#define ENCODED_FRAME_BUF_SIZE 6400 // 6.4kb
-#define DECODED_FRAME_WIDTH 1280
-#define DECODED_FRAME_HEIGHT 720
+#define ENCODED_FRAME_MAX_SIZE (1024 * 1024) // larger packets are treated as a corrupt stream
+#define DECODE_WORKERS 4 // upper bound per camera group, never more than one per camera
 
-struct thread_ctx {
+/**
+ * Camera streams are decoded by a small pool of workers rather
+ * than a thread per camera.
+ *
+ * Every stream keeps its own decoder, since each H.264 stream
+ * carries its own reference frames, but they all share a single
+ * CUDA device context. A worker claims a stream, decodes one
+ * packet and receives whatever frames it produced, then releases
+ * it, so a stream is only ever touched by one worker at a time
+ * while any worker in the stream's group can serve it. Workers are
+ * grouped by the L3 domain they're pinned to, see topology.h, so
+ * a stream's decoder state stays in one cache.
+ *
+ * Among the streams that have a packet pending and a free frame
+ * buffer to decode into, workers pick the one whose last decoded
+ * packet has the oldest timestamp. Packets arrive in timestamp order,
+ * so that is the stream furthest behind, the one holding back the
+ * oldest frameset.
+ *
+ * Idle workers sleep on their group's pool_event, see spsc_queue.h,
+ * notified by the ingest threads when a packet arrives and by the
+ * main thread when frame buffers are returned. A notify wakes a single
+ * worker, and a worker that claims a stream while others are still
+ * runnable, or releases one that still is, wakes the next, so a burst
+ * of packets is decoded in parallel without the whole group waking
+ * for each one. Each group has its own event, since a worker woken
+ * for another group's stream couldn't take it.
+ *
+ * Once a stream's end has been decoded and every frame drained, its
+ * decoder is reset in place, ready for the camera's next stream, and
+ * the stream is counted in ended_count, with ended_fd written to wake
+ * the main thread, see main.c. Decoders are only ever opened once.
+ *
+ * A stream that fails to decode, or whose camera's connection faulted,
+ * see ingest.h, is reset the same way without ending, and skips the
+ * camera's packets until its next keyframe. A failure never stops any
+ * other stream.
+ */
+
+struct stream_ctx {
   cam_conf* conf;
+  uint32_t idx;
+  struct consumer_q* filled_pkts;
+  struct producer_q* empty_pkts;
+  struct spsc_event* empty_pkt_ev;
   struct producer_q* filled_bufs;
   struct consumer_q* empty_bufs;
+  struct spsc_event* filled_ev;
+  struct metrics_cam* metrics;
+
+  // hints for picking a stream, only written by the worker holding the claim
+  _Atomic bool claimed;
+  _Atomic bool ended;
+  _Atomic uint64_t last_ts;
+
+  // only touched by the worker holding the claim
+  bool decoder_initialized;
+  decoder viddec;
+  struct ts_ring timestamps; // decoded frames are matched to their packets by pts
+  int64_t next_pts;
+  bool awaiting_key; // reset, packets before the next keyframe can't be decoded
+  struct ts_frame_buf* current_buf;
+};
+
+struct decode_pool {
+  struct stream_ctx* streams;
+  uint32_t stream_count;
+  struct AVBufferRef* hw_device_ctx;
+  pthread_t main_thread;
+  _Atomic uint32_t ended_count; // streams fully drained, zeroed by the main thread per session
+  int ended_fd; // eventfd, written when a stream is counted in ended_count
+};
+
+struct thread_ctx {
+  struct decode_pool* pool;
   uint32_t core;
-  pid_t main_thread;
+  uint32_t first_stream; // the worker only decodes its group's streams
+  uint32_t stream_count;
+  struct pool_event* work_ev; // its group's, notified when one of those streams has work
 };
 
 struct ts_frame_buf {
   uint64_t timestamp;
+  uint64_t sensor_ts; // see enc_packet
   uint8_t* frame_buf;
+  uint32_t idx; // index into the camera's part of the shared memory frame pool
 };
 
+int init_decode_pool(
+  struct decode_pool* pool,
+  struct stream_ctx* streams,
+  uint32_t stream_count,
+  pthread_t main_thread
+);
+void cleanup_decode_pool(struct decode_pool* pool);
 void* stream_mgr_fn(void* ptr);
 
 #endif // STREAM_MGR_H
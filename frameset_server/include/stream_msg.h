@@ -0,0 +1,98 @@
+#ifndef STREAM_MSG_H
+#define STREAM_MSG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * Framing of the encoded stream each camera sends the server over
+ * TCP. This header is shared between the server and the cameras, so
+ * it must stay valid as both C and C++.
+ *
+ * Every packet is a fixed stream_hdr followed by size bytes of
+ * payload, sent raw and little endian. The end of a stream is a header
+ * with STREAM_END set and no payload.
+ *
+ * The header opens with a sync marker and is covered by a CRC, so a
+ * receiver that loses its place, a reconnect resuming partway through
+ * a packet, can scan forward for the next header it can trust rather
+ * than reading garbage as a length. seq counts every header the camera
+ * sends, so a packet missing from the stream is noticed even when the
+ * headers around it are intact. Either way the decoder has lost its
+ * reference frames, and the receiver skips ahead to the next packet
+ * flagged STREAM_KEYFRAME.
+ *
+ * cam_id is the camera's stream port, unique across the rig, which
+ * lets the server catch a camera streaming to another camera's port.
+ *
+ * A camera may encode a second, low resolution copy of every capture
+ * from the ISP's other output, and both travel interleaved over the
+ * same connection, told apart by stream_id. Each stream has its own
+ * keyframes, and a camera only encodes and sends the streams the
+ * server subscribed it to, see ctl_msg.h, so the server can decode
+ * the preview for live use and record the main stream untouched.
+ * seq counts headers across both, and the single end of stream ends
+ * both.
+ *
+ * timestamp is the scheduled capture time framesets are assembled on,
+ * and sensor_ts when the sensor measured the exposure to have started,
+ * on the same clock, 0 if the camera couldn't tell.
+ */
+
+#define STREAM_SYNC 0x4d43 // "CM", the first bytes seen on the wire
+#define STREAM_VERSION 3
+
+#define STREAM_KEYFRAME (1u << 0) // the payload starts with an SPS or an IDR slice
+#define STREAM_END (1u << 1) // the camera is done streaming, no payload
+
+#define STREAM_MAIN 0 // full resolution, what's recorded
+#define STREAM_PREVIEW 1 // the ISP's low resolution output
+#define STREAM_COUNT 2
+#define STREAM_BIT(id) (1u << (id)) // subscription masks carry a bit per stream
+
+struct __attribute__((packed)) stream_hdr {
+  uint16_t sync;
+  uint8_t version;
+  uint8_t flags;
+  uint16_t cam_id;
+  uint16_t crc; // CRC-16/CCITT over the header, with crc zeroed
+  uint32_t seq;
+  uint32_t size; // of the payload that follows
+  uint8_t stream_id;
+  uint8_t reserved[3]; // zero
+  uint64_t timestamp;
+  uint64_t sensor_ts;
+};
+
+static inline uint16_t stream_crc16(const uint8_t* data, size_t len) {
+  uint16_t crc = 0xffff;
+  for (size_t i = 0; i < len; i++) {
+    crc ^= (uint16_t)data[i] << 8;
+    for (int bit = 0; bit < 8; bit++)
+      crc = crc & 0x8000 ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+  }
+  return crc;
+}
+
+static inline uint16_t stream_hdr_crc(const struct stream_hdr* hdr) {
+  struct stream_hdr copy;
+  memcpy(&copy, hdr, sizeof(copy));
+  copy.crc = 0;
+  return stream_crc16((const uint8_t*)&copy, sizeof(copy));
+}
+
+static inline void stream_hdr_seal(struct stream_hdr* hdr) {
+  hdr->sync = STREAM_SYNC;
+  hdr->version = STREAM_VERSION;
+  hdr->crc = stream_hdr_crc(hdr);
+}
+
+static inline bool stream_hdr_valid(const struct stream_hdr* hdr) {
+  return hdr->sync == STREAM_SYNC &&
+    hdr->version == STREAM_VERSION &&
+    stream_hdr_crc(hdr) == hdr->crc;
+}
+
+#endif // STREAM_MSG_H
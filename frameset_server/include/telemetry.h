@@ -0,0 +1,49 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "assembler.h"
+#include "frameset_shm.h"
+#include "metrics.h"
+#include "parse_conf.h"
+#include "rate_ctl.h"
+
+/**
+ * The server's side of the metrics page, see metrics.h.
+ *
+ * The page is created at startup and handed out per camera, the ingest
+ * and decode threads record straight into their camera's metrics_cam,
+ * and the main thread records arrival skew and exposure offsets as it
+ * assembles framesets.
+ * Reports from the cameras arrive on stats_fd, which the main thread
+ * watches alongside its other events, and gauges measured elsewhere,
+ * by the rate controller and the assembler, are copied in with
+ * telemetry_sample.
+ */
+
+struct telemetry {
+  void* page;
+  size_t size;
+  int shm_fd;
+  int stats_fd; // UDP, bound to CAM_STATS_PORT
+  struct metrics_header* hdr;
+  cam_conf* confs;
+  uint32_t cam_count;
+};
+
+int init_telemetry(struct telemetry* tm, cam_conf* confs, uint32_t cam_count, pid_t pid);
+struct metrics_cam* telemetry_cam(struct telemetry* tm, uint32_t cam);
+void telemetry_recv(struct telemetry* tm);
+void telemetry_exposure(struct telemetry* tm, uint32_t cam, uint64_t timestamp, uint64_t sensor_ts);
+void telemetry_sample(
+  struct telemetry* tm,
+  const struct rate_ctl* rc,
+  const struct assembler* as,
+  struct frameset_shm_header* frameset_hdr
+);
+void cleanup_telemetry(struct telemetry* tm);
+
+#endif // TELEMETRY_H
@@ -0,0 +1,96 @@
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+#include <sched.h> // cpu_set_t needs _GNU_SOURCE defined by the includer
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "rig_conf.h"
+
+#define TOPO_MAX_DOMAINS 64
+#define PLAN_CAMS_PER_GROUP 8 // cameras a single L3 domain takes before the next is used
+#define PLAN_MAX_WORKERS 16 // decode workers in a group, only reachable through decode_cores
+
+/**
+ * Finds where the server's threads and buffers should live.
+ *
+ * discover_topology groups the CPUs the process may run on by the L3
+ * cache they share, reading /sys/devices/system/cpu, and finds each
+ * group's NUMA node. On Zen each such domain is a CCD. Domains are
+ * ordered largest L3 first, so a 3D V-cache CCD comes first, then by
+ * their lowest CPU. Within a domain, one hardware thread of every
+ * core is listed before any SMT sibling, so threads only share a core
+ * once every core is busy.
+ *
+ * plan_placement splits the cameras into groups of consecutive
+ * cameras, one per domain, as many domains as PLAN_CAMS_PER_GROUP
+ * cameras per group calls for. Each group gets an ingest thread and
+ * up to DECODE_WORKERS decode workers, which only decode the group's
+ * cameras, and its cameras' frame pool runs are first touched from
+ * the domain, so the packets, decoder state and frames of a camera
+ * stay within one L3 and one node. The main thread, which assembles
+ * framesets from every camera, runs in the first domain.
+ *
+ * Any of it can be pinned down from a placement mapping in cams.yaml,
+ * CPU lists in the same format as sysfs, which parse_conf carries in
+ * the rig snapshot:
+ *
+ *   placement:
+ *     main_core: 0
+ *     ingest_core: 1
+ *     decode_cores: 2-5
+ *
+ * decode_cores puts every camera in a single group decoded on exactly
+ * those CPUs, main_core and ingest_core move just that thread.
+ */
+
+struct cache_domain {
+  cpu_set_t cpus;
+  uint16_t cpu_order[CPU_SETSIZE]; // cores first, then SMT siblings
+  uint32_t cpu_count;
+  uint64_t l3_size; // bytes, 0 if there's no L3 information
+  int node; // -1 if unknown
+};
+
+struct topology {
+  uint32_t domain_count;
+  struct cache_domain domains[TOPO_MAX_DOMAINS];
+};
+
+struct placement_conf {
+  int main_core; // -1 when unset
+  int ingest_core;
+  cpu_set_t decode_cores;
+  uint32_t decode_core_count; // 0 when unset
+};
+
+struct placement_group {
+  uint32_t domain;
+  uint32_t first_cam;
+  uint32_t cam_count;
+  uint32_t ingest_core;
+  uint32_t worker_count;
+  uint32_t worker_cores[PLAN_MAX_WORKERS];
+};
+
+struct placement {
+  uint32_t main_core;
+  bool shared_ingest; // a single ingest thread, group 0's, takes every camera
+  uint32_t worker_count; // across every group
+  uint32_t group_count;
+  struct placement_group groups[TOPO_MAX_DOMAINS];
+};
+
+int discover_topology(struct topology* topo);
+int parse_cpu_list(const char* str, cpu_set_t* cpus);
+void load_placement_conf(const struct rig_placement* rig, struct placement_conf* conf);
+int plan_placement(
+  const struct topology* topo,
+  const struct placement_conf* conf,
+  uint32_t cam_count,
+  bool shared_ingest,
+  struct placement* plan
+);
+void log_placement(const struct topology* topo, const struct placement* plan);
+
+#endif // TOPOLOGY_H
@@ -3,24 +3,31 @@
 
 #include <stdint.h>
 
+#define DECODE_SURFACES 4 // cuvid decode surfaces per stream
+
 struct AVCodecContext;
 struct AVFrame;
 struct AVPacket;
 struct AVBufferRef;
+struct CUstream_st;
 
 typedef struct decoder {
   struct AVCodecContext* ctx;
   struct AVFrame* frame;
   struct AVFrame* hw_frame;
   struct AVPacket* pkt;
-  struct AVBufferRef* hw_device_ctx;
+  struct CUstream_st* cuda_stream; // only used with CUDA_FRAMESETS
 
   uint32_t width;
   uint32_t height;
 } decoder;
 
+int init_hw_device(struct AVBufferRef** hw_device_ctx);
+void cleanup_hw_device(struct AVBufferRef** hw_device_ctx);
+
 int init_decoder(
   decoder* dec,
+  struct AVBufferRef* hw_device_ctx,
   uint32_t width,
   uint32_t height
 );
@@ -28,15 +35,26 @@ int init_decoder(
 int decode_packet(
   decoder* dec,
   uint8_t* data,
-  uint32_t size
+  uint32_t size,
+  int64_t pts
 );
 
 int recv_frame(
   decoder* dec,
-  uint8_t* out_buf
+  uint8_t* out_buf,
+  int64_t* pts
+);
+
+#ifdef CUDA_FRAMESETS
+int recv_frame_gpu(
+  decoder* dec,
+  uint8_t* dev_buf,
+  int64_t* pts
 );
+#endif
 
 int flush_decoder(decoder* dec);
+void reset_decoder(decoder* dec);
 void cleanup_decoder(decoder* dec);
 
 #endif // VIDDEC_H
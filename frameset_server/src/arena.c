@@ -0,0 +1,75 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "logging.h"
+
+int init_arena(struct arena* arena, size_t size) {
+  /**
+   * Maps and populates an arena of at least size bytes
+   *
+   * Parameters:
+   * - struct arena* arena: the arena to initialize
+   * - size_t size: the bytes needed, as counted by a sizing pass
+   *
+   * Returns:
+   * - int: 0 on success, or a negative error code
+   */
+  char logstr[128];
+
+  long page_size = sysconf(_SC_PAGESIZE);
+  size = (size + page_size - 1) & ~(size_t)(page_size - 1);
+
+  void* base = mmap(
+    NULL,
+    size,
+    PROT_READ | PROT_WRITE,
+    MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE,
+    -1,
+    0
+  );
+  if (base == MAP_FAILED) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error mapping startup arena: %s",
+      strerror(errno)
+    );
+    log(ERROR, logstr);
+    return -errno;
+  }
+
+  arena->base = base;
+  arena->size = size;
+  arena->used = 0;
+  return 0;
+}
+
+void* arena_alloc(struct arena* arena, size_t size, size_t align) {
+  /**
+   * Carves size bytes aligned to align, a power of two, out of the arena
+   *
+   * Returns:
+   * - void*: the zeroed allocation, or NULL if the arena is only sizing
+   *          or has run out
+   */
+  size_t offset = (arena->used + align - 1) & ~(align - 1);
+  arena->used = offset + size;
+
+  if (!arena->base || arena->used > arena->size)
+    return NULL;
+
+  return arena->base + offset;
+}
+
+void cleanup_arena(struct arena* arena) {
+  if (arena->base)
+    munmap(arena->base, arena->size);
+
+  arena->base = NULL;
+  arena->size = 0;
+  arena->used = 0;
+}
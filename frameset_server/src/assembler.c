@@ -0,0 +1,389 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "assembler.h"
+#include "logging.h"
+
+int init_assembler(
+  struct assembler* as,
+  uint32_t cam_count,
+  uint64_t start_ts,
+  const uint32_t* cam_fps,
+  uint64_t timeout,
+  bool emit_partial,
+  struct producer_q* empty_qs
+) {
+  /**
+   * Initializes a frameset assembler
+   *
+   * Parameters:
+   * - struct assembler* as: the assembler to initialize
+   * - uint32_t cam_count: number of cameras, at most ASSEMBLER_MAX_CAMS
+   * - uint64_t start_ts: timestamp of the first scheduled capture in ns
+   * - const uint32_t* cam_fps: each camera's frame rate, the fastest a multiple of the rest
+   * - uint64_t timeout: ns an incomplete frameset waits for missing cameras
+   * - bool emit_partial: emit incomplete framesets rather than dropping them
+   * - struct producer_q* empty_qs: the per camera queues frames are released to
+   *
+   * Returns:
+   * - int: 0 on success, or a negative error code
+   */
+  if (cam_count == 0 || cam_count > ASSEMBLER_MAX_CAMS) {
+    log(ERROR, "Invalid frameset assembler parameters");
+    return -EINVAL;
+  }
+
+  uint32_t max_fps = 0;
+  for (uint32_t i = 0; i < cam_count; i++) {
+    if (cam_fps[i] > max_fps)
+      max_fps = cam_fps[i];
+  }
+  for (uint32_t i = 0; i < cam_count; i++) {
+    if (cam_fps[i] == 0 || max_fps % cam_fps[i]) {
+      log_fmt(
+        ERROR,
+        "Camera %u runs at %u fps, which doesn't divide the fastest camera's %u fps",
+        i,
+        cam_fps[i],
+        max_fps
+      );
+      return -EINVAL;
+    }
+  }
+
+  memset(as, 0, sizeof(*as));
+  as->start_ts = start_ts;
+  as->frame_dur = 1000000000ULL / max_fps;
+  as->timeout = timeout;
+  as->full_mask = cam_count == 64 ? UINT64_MAX : (1ULL << cam_count) - 1;
+  as->cam_count = cam_count;
+  as->emit_partial = emit_partial;
+  as->empty_qs = empty_qs;
+  as->decimation = 1;
+  as->prev_decimation = 1;
+
+  as->cam_next_idx = calloc(cam_count, sizeof(uint64_t));
+  as->cam_period = calloc(cam_count, sizeof(uint32_t));
+  as->cam_missed = calloc(cam_count, sizeof(uint64_t));
+  as->frames = calloc(ASSEMBLER_SLOTS * cam_count, sizeof(struct ts_frame_buf*));
+  if (!as->cam_next_idx || !as->cam_period || !as->cam_missed || !as->frames) {
+    log(ERROR, "Failed to allocate frameset assembler");
+    cleanup_assembler(as);
+    return -ENOMEM;
+  }
+
+  for (uint32_t i = 0; i < cam_count; i++) {
+    as->cam_period[i] = max_fps / cam_fps[i];
+    if (as->cam_period[i] > as->max_period)
+      as->max_period = as->cam_period[i];
+  }
+
+  return 0;
+}
+
+static struct ts_frame_buf** slot_frames(struct assembler* as, uint64_t idx) {
+  return as->frames + (idx % ASSEMBLER_SLOTS) * as->cam_count;
+}
+
+static uint64_t expected_mask(struct assembler* as, uint64_t idx) {
+  uint32_t decimation = idx >= as->decimation_idx ? as->decimation : as->prev_decimation;
+
+  // every camera is expected in every slot unless some run slower
+  if (as->max_period == 1 && decimation == 1)
+    return as->full_mask;
+
+  uint64_t mask = 0;
+  for (uint32_t i = 0; i < as->cam_count; i++) {
+    if (idx % (as->cam_period[i] * decimation) == 0)
+      mask |= 1ULL << i;
+  }
+  return mask;
+}
+
+static void count_missed(struct assembler* as, uint64_t missing) {
+  for (uint32_t i = 0; i < as->cam_count; i++) {
+    if (missing & (1ULL << i))
+      as->cam_missed[i]++;
+  }
+}
+
+static void release_frame(struct assembler* as, uint32_t cam, struct ts_frame_buf* frame) {
+  spsc_enqueue(&as->empty_qs[cam], frame);
+}
+
+static void drop_slot(struct assembler* as, uint64_t idx) {
+  char logstr[128];
+
+  struct assembler_slot* slot = &as->slots[idx % ASSEMBLER_SLOTS];
+  if (!slot->open)
+    return;
+
+  if (slot->cam_mask) {
+    as->dropped++;
+    count_missed(as, expected_mask(as, idx) & ~slot->cam_mask);
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Dropped incomplete frameset with timestamp %lu, camera mask %lx",
+      slot->timestamp,
+      slot->cam_mask
+    );
+    log(WARNING, logstr);
+  }
+
+  struct ts_frame_buf** frames = slot_frames(as, idx);
+  for (uint32_t i = 0; i < as->cam_count; i++) {
+    if (frames[i])
+      release_frame(as, i, frames[i]);
+    frames[i] = NULL;
+  }
+
+  slot->open = false;
+}
+
+uint64_t assembler_add(
+  struct assembler* as,
+  uint32_t cam,
+  struct ts_frame_buf* frame,
+  uint64_t now
+) {
+  /**
+   * Adds a decoded frame to the frameset for its capture timestamp
+   *
+   * The timestamp is rounded to the nearest scheduled capture, so small
+   * deviations from the schedule still land in the right slot. Frames
+   * which can't be used, because their frameset was already emitted or
+   * they repeat an index the camera already delivered, are released
+   * straight back to the camera's empty queue.
+   *
+   * A frame too far ahead of the oldest pending frameset to fit in the
+   * slot table forces the framesets it skips over to be dropped.
+   *
+   * Parameters:
+   * - struct assembler* as: the assembler
+   * - uint32_t cam: index of the camera the frame came from
+   * - struct ts_frame_buf* frame: the decoded frame
+   * - uint64_t now: the current CLOCK_MONOTONIC time in ns
+   *
+   * Returns:
+   * - uint64_t: ns since the first frame of the same frameset arrived,
+   *             0 for the first, or ASSEMBLER_LATE if it was discarded
+   */
+  uint64_t half_dur = as->frame_dur / 2;
+  uint64_t idx = (frame->timestamp + half_dur - as->start_ts) / as->frame_dur;
+  if (
+    frame->timestamp + half_dur < as->start_ts ||
+    idx < as->next_idx ||
+    idx < as->cam_next_idx[cam]
+  ) {
+    log_fmt(
+      DEBUG,
+      "Discarding late frame with timestamp %lu from camera %u",
+      frame->timestamp,
+      cam
+    );
+    release_frame(as, cam, frame);
+    return ASSEMBLER_LATE;
+  }
+
+  if (idx >= as->next_idx + ASSEMBLER_SLOTS) {
+    uint64_t new_next_idx = idx - ASSEMBLER_SLOTS + 1;
+    for (
+      uint64_t i = as->next_idx;
+      i < new_next_idx && i < as->next_idx + ASSEMBLER_SLOTS;
+      i++
+    ) {
+      drop_slot(as, i);
+    }
+    as->next_idx = new_next_idx;
+  }
+
+  // every index up to this one is now in flight, so they all get a
+  // deadline even if no camera has delivered a frame for them yet
+  for (uint64_t i = as->next_idx; i <= idx; i++) {
+    struct assembler_slot* slot = &as->slots[i % ASSEMBLER_SLOTS];
+    if (slot->open)
+      continue;
+
+    slot->open = true;
+    slot->deadline = now + as->timeout;
+    slot->cam_mask = 0;
+    slot->timestamp = as->start_ts + i * as->frame_dur;
+  }
+
+  struct assembler_slot* slot = &as->slots[idx % ASSEMBLER_SLOTS];
+  if (!slot->cam_mask) {
+    slot->timestamp = frame->timestamp;
+    slot->first_arrival = now;
+  }
+  slot->cam_mask |= 1ULL << cam;
+  slot_frames(as, idx)[cam] = frame;
+  as->cam_next_idx[cam] = idx + 1;
+  return now - slot->first_arrival;
+}
+
+bool assembler_next(
+  struct assembler* as,
+  uint64_t now,
+  struct ts_frame_buf** frames,
+  uint64_t* timestamp,
+  uint64_t* cam_mask
+) {
+  /**
+   * Takes the oldest pending frameset once it's ready to be published
+   *
+   * Should be called repeatedly until it returns false, since a single
+   * frame can complete several framesets at once.
+   *
+   * Parameters:
+   * - struct assembler* as: the assembler
+   * - uint64_t now: the current CLOCK_MONOTONIC time in ns
+   * - struct ts_frame_buf** frames: receives cam_count frames, NULL for
+   *                                 any camera missing from the frameset
+   * - uint64_t* timestamp: receives the frameset timestamp
+   * - uint64_t* cam_mask: receives the mask of cameras present
+   *
+   * Returns:
+   * - bool: true if a frameset was taken, ownership of its frames
+   *         passes to the caller
+   */
+  while (true) {
+    struct assembler_slot* slot = &as->slots[as->next_idx % ASSEMBLER_SLOTS];
+    if (!slot->open)
+      return false; // slots open in order, so nothing is pending
+
+    uint64_t passed_mask = 0;
+    for (uint32_t i = 0; i < as->cam_count; i++) {
+      if (as->cam_next_idx[i] > as->next_idx + 1)
+        passed_mask |= 1ULL << i;
+    }
+
+    uint64_t expected = expected_mask(as, as->next_idx);
+    if (!expected && !slot->cam_mask) {
+      slot->open = false; // decimated away, nothing to emit
+      as->next_idx++;
+      continue;
+    }
+
+    // a degraded camera won't deliver, but the frameset is still incomplete without it
+    uint64_t awaited = expected & ~as->degraded;
+    bool complete = (slot->cam_mask & expected) == expected;
+    bool final = ((slot->cam_mask | passed_mask) & awaited) == awaited;
+    if (!final && now < slot->deadline)
+      return false;
+
+    if (!complete && !(as->emit_partial && slot->cam_mask)) {
+      drop_slot(as, as->next_idx++);
+      continue;
+    }
+
+    struct ts_frame_buf** slot_bufs = slot_frames(as, as->next_idx);
+    memcpy(frames, slot_bufs, sizeof(struct ts_frame_buf*) * as->cam_count);
+    memset(slot_bufs, 0, sizeof(struct ts_frame_buf*) * as->cam_count);
+    *timestamp = slot->timestamp;
+    *cam_mask = slot->cam_mask;
+
+    if (!complete) {
+      as->partial++;
+      count_missed(as, expected & ~slot->cam_mask);
+    }
+
+    slot->open = false;
+    as->next_idx++;
+    return true;
+  }
+}
+
+void assembler_set_decimation(struct assembler* as, uint32_t decimation, uint64_t from_idx) {
+  /**
+   * Changes which frame indices the cameras are expected in
+   *
+   * A camera at period p is expected at every index that's a multiple
+   * of p * decimation from from_idx on, and at the previous decimation
+   * before it. Only one change is tracked at a time, so the caller
+   * must not make another until from_idx has been reached.
+   *
+   * Parameters:
+   * - struct assembler* as: the assembler
+   * - uint32_t decimation: the factor every camera's period is multiplied by
+   * - uint64_t from_idx: the first frame index it applies to
+   */
+  as->prev_decimation = as->decimation;
+  as->decimation = decimation;
+  as->decimation_idx = from_idx;
+}
+
+void assembler_set_degraded(struct assembler* as, uint64_t degraded) {
+  /**
+   * Sets which cameras framesets are emitted without waiting on
+   *
+   * Takes effect for every pending slot, so one already waiting on a
+   * camera that's just been degraded is emitted on the next call to
+   * assembler_next rather than at its deadline.
+   *
+   * Parameters:
+   * - struct assembler* as: the assembler
+   * - uint64_t degraded: mask of the cameras whose streams are down
+   */
+  as->degraded = degraded & as->full_mask;
+}
+
+void assembler_reset(struct assembler* as, uint64_t start_ts) {
+  /**
+   * Readies the assembler for a new session on a new schedule
+   *
+   * Any frameset still pending is dropped and its frames released,
+   * and the decimation goes back to 1, as the cameras start every
+   * session at full rate.
+   *
+   * Parameters:
+   * - struct assembler* as: the assembler
+   * - uint64_t start_ts: timestamp of the session's first scheduled capture in ns
+   */
+  for (uint64_t i = as->next_idx; i < as->next_idx + ASSEMBLER_SLOTS; i++)
+    drop_slot(as, i);
+
+  memset(as->cam_next_idx, 0, sizeof(uint64_t) * as->cam_count);
+  as->start_ts = start_ts;
+  as->next_idx = 0;
+  as->degraded = 0;
+  as->decimation = 1;
+  as->prev_decimation = 1;
+  as->decimation_idx = 0;
+}
+
+uint64_t assembler_deadline(struct assembler* as) {
+  /**
+   * Returns the time assembler_next should next be called even if
+   * no frames arrive, or UINT64_MAX if nothing is pending
+   *
+   * Framesets are emitted in order, so only the oldest pending
+   * slot's deadline matters.
+   */
+  struct assembler_slot* slot = &as->slots[as->next_idx % ASSEMBLER_SLOTS];
+  return slot->open ? slot->deadline : UINT64_MAX;
+}
+
+void cleanup_assembler(struct assembler* as) {
+  if (as->cam_next_idx) {
+    free(as->cam_next_idx);
+    as->cam_next_idx = NULL;
+  }
+
+  if (as->cam_period) {
+    free(as->cam_period);
+    as->cam_period = NULL;
+  }
+
+  if (as->cam_missed) {
+    free(as->cam_missed);
+    as->cam_missed = NULL;
+  }
+
+  if (as->frames) {
+    free(as->frames);
+    as->frames = NULL;
+  }
+}
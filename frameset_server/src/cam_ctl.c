@@ -0,0 +1,344 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cam_ctl.h"
+#include "logging.h"
+#include "metrics.h"
+
+static uint64_t realtime_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t full_mask(const struct cam_ctl* ctl) {
+  return ctl->cam_count == 64 ? UINT64_MAX : (1ULL << ctl->cam_count) - 1;
+}
+
+int init_cam_ctl(
+  struct cam_ctl* ctl,
+  struct ctl_cam* cams,
+  cam_conf* confs,
+  uint32_t cam_count,
+  struct telemetry* tm
+) {
+  /**
+   * Creates the socket commands are multicast from
+   *
+   * Commands only go as far as the local network, and aren't looped
+   * back, so the socket only ever reads acknowledgements.
+   *
+   * Parameters:
+   * - struct cam_ctl* ctl: the controller to initialize
+   * - struct ctl_cam* cams: cam_count entries of per camera state
+   * - cam_conf* confs: the cameras, acknowledgements are matched by stream port
+   * - uint32_t cam_count: number of cameras, at most 64
+   * - struct telemetry* tm: where round trips and clock offsets are published
+   *
+   * Returns:
+   * - int: 0 on success, or a negative error code
+   */
+  char logstr[128];
+
+  memset(ctl, 0, sizeof(*ctl));
+  memset(cams, 0, sizeof(*cams) * cam_count);
+  for (uint32_t i = 0; i < cam_count; i++)
+    cams[i].streams = STREAM_BIT(STREAM_MAIN);
+  ctl->cams = cams;
+  ctl->confs = confs;
+  ctl->cam_count = cam_count;
+  ctl->tm = tm;
+
+  ctl->group.sin_family = AF_INET;
+  ctl->group.sin_port = htons(CTL_PORT);
+  inet_pton(AF_INET, CTL_GROUP, &ctl->group.sin_addr);
+
+  ctl->fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (ctl->fd < 0) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error creating camera control socket: %s",
+      strerror(errno)
+    );
+    log(ERROR, logstr);
+    return -errno;
+  }
+
+  unsigned char ttl = 1;
+  unsigned char loop = 0;
+  if (
+    setsockopt(ctl->fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) < 0 ||
+    setsockopt(ctl->fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) < 0
+  ) {
+    int err = errno;
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error setting up camera control socket: %s",
+      strerror(err)
+    );
+    log(ERROR, logstr);
+    return -err;
+  }
+
+  return 0;
+}
+
+static int send_cmd(struct cam_ctl* ctl, const struct ctl_msg* msg) {
+  size_t len = sizeof(*msg) + msg->sub_count * sizeof(struct ctl_sub);
+  ssize_t sent = sendto(
+    ctl->fd,
+    msg,
+    len,
+    0,
+    (struct sockaddr*)&ctl->group,
+    sizeof(ctl->group)
+  );
+  if (sent < 0) {
+    int err = errno;
+    log_fmt(ERROR, "Error multicasting camera command: %s", strerror(err));
+    return -err;
+  }
+
+  return 0;
+}
+
+static int issue(struct cam_ctl* ctl, uint8_t cmd, uint16_t fps, uint64_t timestamp, uint64_t now) {
+  struct ctl_msg* msg = &ctl->pending.msg;
+  memset(msg, 0, sizeof(*msg));
+  msg->magic = CTL_MAGIC;
+  msg->version = CTL_VERSION;
+  msg->cmd = cmd;
+  msg->fps = fps;
+  msg->seq = ++ctl->seq;
+  msg->timestamp = timestamp;
+
+  if (cmd == CTL_ARM) {
+    for (uint32_t i = 0; i < ctl->cam_count; i++) {
+      struct ctl_sub* sub = &ctl->pending.subs[i];
+      sub->cam_id = ctl->confs[i].tcp_port;
+      sub->streams = ctl->cams[i].streams;
+      sub->reserved = 0;
+    }
+    msg->sub_count = ctl->cam_count;
+  }
+
+  ctl->repeats = 0;
+  ctl->next_repeat = now + CTL_REPEAT_INTERVAL;
+  return send_cmd(ctl, msg);
+}
+
+void cam_ctl_subscribe(struct cam_ctl* ctl, uint32_t cam, uint8_t streams) {
+  /**
+   * Sets which streams a camera sends, see stream_msg.h, from the next ARM on
+   */
+  ctl->cams[cam].streams = streams;
+}
+
+uint64_t cam_ctl_lead(const struct cam_ctl* ctl) {
+  /**
+   * Returns how far ahead a start or stop should be scheduled for
+   * every camera to have heard of it in time
+   *
+   * Returns:
+   * - uint64_t: the lead in ns, or 0 if some camera hasn't answered a
+   *             ping yet, so there's nothing to go on
+   */
+  uint64_t slowest = 0;
+  for (uint32_t i = 0; i < ctl->cam_count; i++) {
+    if (!ctl->cams[i].rtt)
+      return 0;
+    if (ctl->cams[i].rtt > slowest)
+      slowest = ctl->cams[i].rtt;
+  }
+
+  uint64_t lead = CTL_LEAD_RTTS * slowest + CTL_LEAD_REPEATS * CTL_REPEAT_INTERVAL;
+  return lead < CTL_MIN_LEAD ? CTL_MIN_LEAD : lead;
+}
+
+int cam_ctl_arm(struct cam_ctl* ctl, uint64_t start_ts, uint16_t fps, uint64_t cams, uint64_t now) {
+  /**
+   * Arms cameras to start capturing on the schedule from start_ts
+   *
+   * Arming again with the same start_ts, to let cameras that dropped
+   * out rejoin, waits on them as well as any camera still owing an
+   * acknowledgement for the first, and the cameras already capturing
+   * just acknowledge it again.
+   *
+   * Parameters:
+   * - struct cam_ctl* ctl: the controller
+   * - uint64_t start_ts: CLOCK_REALTIME of the schedule's first capture in ns
+   * - uint16_t fps: the rig's fastest rate, that the schedule is laid out at
+   * - uint64_t cams: mask of the cameras to wait on
+   * - uint64_t now: the current CLOCK_MONOTONIC time in ns
+   *
+   * Returns:
+   * - int: 0 on success, or a negative error code if it couldn't be sent,
+   *        it's still repeated
+   */
+  bool rearm = ctl->pending.msg.cmd == CTL_ARM && ctl->pending.msg.timestamp == start_ts;
+  if (!rearm) {
+    ctl->waiting = 0;
+    ctl->refused = 0;
+  }
+  ctl->waiting |= cams & full_mask(ctl) & ~ctl->refused;
+  return issue(ctl, CTL_ARM, fps, start_ts, now);
+}
+
+int cam_ctl_stop(struct cam_ctl* ctl, uint64_t stop_ts, uint64_t now) {
+  /**
+   * Stops every camera's stream at stop_ts, or right away if it's 0
+   *
+   * Parameters:
+   * - struct cam_ctl* ctl: the controller
+   * - uint64_t stop_ts: CLOCK_REALTIME in ns, no capture at or after it is streamed
+   * - uint64_t now: the current CLOCK_MONOTONIC time in ns
+   *
+   * Returns:
+   * - int: 0 on success, or a negative error code if it couldn't be sent,
+   *        it's still repeated
+   */
+  ctl->waiting = full_mask(ctl);
+  ctl->refused = 0;
+  return issue(ctl, CTL_STOP, 0, stop_ts, now);
+}
+
+static void recv_pong(struct cam_ctl* ctl, uint32_t cam, const struct ctl_ack* ack) {
+  /**
+   * Takes a round trip and clock offset from a camera's answer to a ping
+   *
+   * The offset assumes the trip is symmetric, which over a switched
+   * LAN leaves it within the slowest path's queueing delay, far from
+   * a frame interval.
+   */
+  uint64_t now = realtime_ns();
+  if (ack->echo_ts > now)
+    return; // the server's clock stepped back since it was sent
+
+  struct ctl_cam* cc = &ctl->cams[cam];
+  int64_t rtt = (int64_t)(now - ack->echo_ts);
+  cc->rtt = cc->rtt ? (uint64_t)((int64_t)cc->rtt + (rtt - (int64_t)cc->rtt) / CTL_RTT_WEIGHT) : (uint64_t)rtt;
+  if (!cc->rtt)
+    cc->rtt = 1; // answered, just faster than the clock can tell
+  cc->clock_offset = (int64_t)(ack->recv_ts - ack->echo_ts) - rtt / 2;
+
+  struct metrics_cam* metrics = telemetry_cam(ctl->tm, cam);
+  metrics_observe(&metrics->ctl_rtt, rtt);
+  metrics_store(&metrics->clock_offset_ns, (uint64_t)cc->clock_offset);
+}
+
+void cam_ctl_recv(struct cam_ctl* ctl) {
+  /**
+   * Takes every acknowledgement waiting on the socket
+   *
+   * Anything malformed, from an unknown camera, or acknowledging a
+   * command since replaced is dropped.
+   */
+  struct ctl_ack ack;
+  ssize_t len;
+  while ((len = recv(ctl->fd, &ack, sizeof(ack), MSG_TRUNC)) >= 0) {
+    if (
+      (size_t)len != sizeof(ack) ||
+      ack.magic != CTL_ACK_MAGIC ||
+      ack.version != CTL_VERSION
+    )
+      continue;
+
+    uint32_t cam = 0;
+    while (cam < ctl->cam_count && ctl->confs[cam].tcp_port != ack.cam_id)
+      cam++;
+    if (cam == ctl->cam_count) {
+      log_fmt(DEBUG, "Discarding control acknowledgement from unknown stream port %u", ack.cam_id);
+      continue;
+    }
+
+    if (ack.cmd == CTL_PING) {
+      recv_pong(ctl, cam, &ack);
+      continue;
+    }
+
+    if (ack.cmd != ctl->pending.msg.cmd || ack.seq != ctl->pending.msg.seq)
+      continue;
+
+    uint64_t bit = 1ULL << cam;
+    ctl->waiting &= ~bit;
+    if ((ack.flags & CTL_ACK_REFUSED) && !(ctl->refused & bit)) {
+      ctl->refused |= bit;
+      log_fmt(
+        ERROR,
+        "Cam %s refused to arm, its frame rate doesn't divide the rig's %u fps or it has no preview stream",
+        ctl->confs[cam].name,
+        ctl->pending.msg.fps
+      );
+    }
+  }
+}
+
+void cam_ctl_update(struct cam_ctl* ctl, uint64_t now) {
+  /**
+   * Repeats the pending command if it's due, and pings if it's time
+   *
+   * Parameters:
+   * - struct cam_ctl* ctl: the controller
+   * - uint64_t now: the current CLOCK_MONOTONIC time in ns
+   */
+  if (ctl->waiting && now >= ctl->next_repeat) {
+    if (ctl->repeats == CTL_MAX_REPEATS) {
+      for (uint32_t i = 0; i < ctl->cam_count; i++) {
+        if (ctl->waiting & (1ULL << i)) {
+          log_fmt(
+            WARNING,
+            "Cam %s never acknowledged %s",
+            ctl->confs[i].name,
+            ctl->pending.msg.cmd == CTL_ARM ? "arming" : "stopping"
+          );
+        }
+      }
+      ctl->waiting = 0;
+    } else {
+      send_cmd(ctl, &ctl->pending.msg);
+      metrics_add(&ctl->tm->hdr->ctl_repeats, 1);
+      ctl->repeats++;
+      ctl->next_repeat = now + CTL_REPEAT_INTERVAL;
+    }
+  }
+
+  if (now >= ctl->next_ping) {
+    struct ctl_msg ping = {
+      .magic = CTL_MAGIC,
+      .version = CTL_VERSION,
+      .cmd = CTL_PING,
+      .seq = ++ctl->ping_seq,
+      .timestamp = realtime_ns()
+    };
+    send_cmd(ctl, &ping);
+    ctl->next_ping = now + CTL_PING_INTERVAL;
+  }
+}
+
+int cam_ctl_timeout(const struct cam_ctl* ctl, uint64_t now) {
+  /**
+   * Returns the ms until cam_ctl_update is next due, rounded up,
+   * for use as an epoll_wait timeout
+   */
+  uint64_t due = ctl->next_ping;
+  if (ctl->waiting && ctl->next_repeat < due)
+    due = ctl->next_repeat;
+
+  if (now >= due)
+    return 0;
+  return (int)((due - now + 999999) / 1000000);
+}
+
+void cleanup_cam_ctl(struct cam_ctl* ctl) {
+  if (ctl->fd >= 0)
+    close(ctl->fd);
+  ctl->fd = -1;
+}
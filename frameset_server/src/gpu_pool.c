@@ -0,0 +1,76 @@
+#ifdef CUDA_FRAMESETS
+
+#include <cuda_runtime_api.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "gpu_pool.h"
+#include "logging.h"
+
+int init_gpu_pool(
+  size_t size,
+  uint8_t** dev_pool,
+  uint8_t* ipc_handle
+) {
+  /**
+   * Allocates the device resident frame pool and exports it
+   *
+   * The pool is a single allocation so that a single cudaIpcMemHandle_t
+   * published in the frameset header lets a consumer open every camera's
+   * buffers at once. Buffers are then addressed by their pool index, the
+   * same way as the host pool.
+   *
+   * Parameters:
+   * - size_t size: the size of the pool in bytes
+   * - uint8_t** dev_pool: set to the device pointer of the pool
+   * - uint8_t* ipc_handle: receives the FRAMESET_IPC_HANDLE_SIZE byte handle
+   *
+   * Returns:
+   * - int: 0 on success, or a negative error code
+   */
+  char logstr[128];
+
+  _Static_assert(
+    sizeof(cudaIpcMemHandle_t) == 64,
+    "cudaIpcMemHandle_t no longer matches FRAMESET_IPC_HANDLE_SIZE"
+  );
+
+  cudaError_t ret = cudaMalloc((void**)dev_pool, size);
+  if (ret != cudaSuccess) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Failed to allocate device frame pool: %s",
+      cudaGetErrorString(ret)
+    );
+    log(ERROR, logstr);
+    *dev_pool = NULL;
+    return -ENOMEM;
+  }
+
+  cudaIpcMemHandle_t handle;
+  ret = cudaIpcGetMemHandle(&handle, *dev_pool);
+  if (ret != cudaSuccess) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Failed to export device frame pool: %s",
+      cudaGetErrorString(ret)
+    );
+    log(ERROR, logstr);
+    cleanup_gpu_pool(*dev_pool);
+    *dev_pool = NULL;
+    return -EIO;
+  }
+
+  memcpy(ipc_handle, &handle, sizeof(handle));
+  return 0;
+}
+
+void cleanup_gpu_pool(uint8_t* dev_pool) {
+  if (dev_pool)
+    cudaFree(dev_pool);
+}
+
+#endif // CUDA_FRAMESETS
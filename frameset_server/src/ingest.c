@@ -0,0 +1,776 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ingest.h"
+#include "logging.h"
+#include "metrics.h"
+#include "network.h"
+#include "stream_mgr.h"
+#include "stream_msg.h"
+#include "trace.h"
+
+#define ACCEPT_TIMEOUT 10 // 10 sec
+#define RECV_TIMEOUT 1 // 1 sec
+#define REACTOR_TICK 100 // ms between timeout checks when idle
+#define RX_BUF_SIZE 65536 // initial size, holds several typical packets
+
+enum ev_type {
+  EV_LISTEN,
+  EV_CONN,
+  EV_PKT_FREE,
+  EV_STOP,
+  EV_START
+};
+
+enum owed_pkt {
+  OWED_NOTHING,
+  OWED_RESET, // the stream faulted, whatever the decoder holds is stale
+  OWED_END // the session ended without the camera, the decoder still has to finish
+};
+
+struct conn {
+  int listen_fd;
+  int fd;
+  uint8_t* rx_buf;
+  size_t rx_len;
+  size_t rx_cap;
+  uint64_t last_rx;
+  bool streaming; // received at least one byte
+  bool stalled; // waiting on a free packet buffer, not reading
+  bool ended; // end of stream received
+  bool synced; // the last header parsed was valid
+  uint8_t awaiting_key; // streams dropping packets until their next keyframe, see stream_msg.h
+  bool seq_valid;
+  uint32_t next_seq;
+  bool listening; // listen_fd is in the epoll set
+  bool joined; // connected at some point this session
+  enum owed_pkt owed; // sent ahead of anything else once a packet buffer is free
+};
+
+static uint64_t monotonic_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static size_t round_pow2(size_t size) {
+  size_t rounded = 1;
+  while (rounded < size)
+    rounded <<= 1;
+  return rounded;
+}
+
+int init_packet_bufs(struct enc_packet* pkts, uint32_t count, const cam_conf* conf) {
+  /**
+   * Allocates a camera's packet buffers, sized for a typical packet
+   *
+   * Around 0.125 bits per pixel covers the cameras' P frames with
+   * room to spare, keyframes grow their buffer once when they arrive.
+   *
+   * Parameters:
+   * - struct enc_packet* pkts: the camera's packets
+   * - uint32_t count: number of packets
+   * - const cam_conf* conf: the camera's conf, for the resolution it's decoded at
+   *
+   * Returns:
+   * - int: 0 on success, or a negative error code
+   */
+  size_t size = round_pow2((size_t)conf->live_width * conf->live_height / 64);
+  if (size < PACKET_MIN_BUF_SIZE)
+    size = PACKET_MIN_BUF_SIZE;
+
+  for (uint32_t i = 0; i < count; i++) {
+    pkts[i].cap = size;
+    pkts[i].data = malloc(size);
+    if (!pkts[i].data) {
+      log(ERROR, "Failed to allocate packet buffers");
+      return -ENOMEM;
+    }
+  }
+
+  return 0;
+}
+
+void cleanup_packet_bufs(struct enc_packet* pkts, uint32_t count) {
+  for (uint32_t i = 0; i < count; i++) {
+    free(pkts[i].data);
+    pkts[i].data = NULL;
+    pkts[i].cap = 0;
+  }
+}
+
+static int fit_packet(struct enc_packet* pkt, uint32_t size) {
+  /**
+   * Grows a packet buffer to hold size bytes, its contents aren't kept
+   *
+   * Returns:
+   * - int: 0 on success, or -ENOMEM
+   */
+  if (size <= pkt->cap)
+    return 0;
+
+  size_t cap = round_pow2(size);
+  uint8_t* data = malloc(cap);
+  if (!data) {
+    log(ERROR, "Failed to grow packet buffer");
+    return -ENOMEM;
+  }
+
+  free(pkt->data);
+  pkt->data = data;
+  pkt->cap = cap;
+  return 0;
+}
+
+static int fit_rx_buf(struct conn* conn, size_t size) {
+  /**
+   * Grows a receive buffer to hold a whole record of size bytes,
+   * keeping what's been received so far
+   *
+   * Returns:
+   * - int: 0 on success, or -ENOMEM
+   */
+  if (size <= conn->rx_cap)
+    return 0;
+
+  size_t cap = round_pow2(size);
+  uint8_t* rx_buf = realloc(conn->rx_buf, cap);
+  if (!rx_buf) {
+    log(ERROR, "Failed to grow receive buffer");
+    return -ENOMEM;
+  }
+
+  conn->rx_buf = rx_buf;
+  conn->rx_cap = cap;
+  return 0;
+}
+
+static int watch(int epoll_fd, int op, int fd, uint32_t events, enum ev_type type, uint32_t idx) {
+  struct epoll_event ev = {
+    .events = events,
+    .data.u64 = ((uint64_t)type << 32) | idx
+  };
+  return epoll_ctl(epoll_fd, op, fd, &ev);
+}
+
+static size_t next_sync(const uint8_t* buf, size_t len) {
+  /**
+   * Finds where the next header could start, the first sync marker in buf
+   *
+   * Returns:
+   * - size_t: the marker's offset, or where a marker split across the
+   *           end of buf would start, so those bytes are kept
+   */
+  const uint16_t sync = STREAM_SYNC;
+  const uint8_t* found = memmem(buf, len, &sync, sizeof(sync));
+  if (found)
+    return found - buf;
+  return len && buf[len - 1] == (uint8_t)sync ? len - 1 : len;
+}
+
+static void lose_sync(struct ingest_stream* stream, struct conn* conn, const char* why) {
+  /**
+   * Drops whatever the decoder was building on, and waits for a keyframe
+   */
+  if (conn->awaiting_key)
+    return; // already waiting, the first loss is the one worth counting
+
+  log_fmt(WARNING, "Stream from cam %s %s, skipping to the next keyframe", stream->conf->name, why);
+  metrics_add(&stream->metrics->stream_resyncs, 1);
+  conn->awaiting_key = stream->streams;
+}
+
+static bool send_owed(struct ingest_stream* stream, struct conn* conn) {
+  /**
+   * Hands the decoder the reset or end of stream it's owed, if any
+   *
+   * Returns:
+   * - bool: true once nothing is owed, false if no packet buffer is free yet
+   */
+  if (conn->owed == OWED_NOTHING)
+    return true;
+
+  struct enc_packet* pkt = spsc_dequeue(stream->empty_pkts);
+  if (!pkt)
+    return false;
+
+  pkt->end_of_stream = conn->owed == OWED_END;
+  pkt->reset = conn->owed == OWED_RESET;
+  pkt->keyframe = false;
+  pkt->size = 0;
+  pkt->timestamp = 0;
+  pkt->sensor_ts = 0;
+  spsc_enqueue(stream->filled_pkts, pkt);
+  pool_notify(stream->work_ev);
+
+  conn->owed = OWED_NOTHING;
+  return true;
+}
+
+static void settle_owed(struct ingest_stream* stream, struct conn* conn) {
+  // a buffer freed while parking means the decoder won't signal, so retry,
+  // otherwise whatever is owed goes out when the decoder returns a buffer
+  while (!send_owed(stream, conn) && !spsc_park(stream->empty_ev, stream->empty_pkts))
+    ;
+}
+
+static void recover_stream(struct ingest_stream* stream) {
+  /**
+   * Unmasks a degraded camera once it's delivering frames the decoder can use
+   */
+  if (!atomic_load_explicit(&stream->degraded, memory_order_relaxed))
+    return;
+
+  log_fmt(INFO, "Cam %s is streaming again", stream->conf->name);
+  metrics_add(&stream->metrics->stream_recoveries, 1);
+  metrics_store(&stream->metrics->degraded, 0);
+  atomic_store_explicit(&stream->degraded, false, memory_order_relaxed);
+}
+
+static int parse_packets(
+  struct ingest_stream* stream,
+  struct conn* conn
+) {
+  /**
+   * Hands every complete packet in the receive buffer to the decoder,
+   * and to the recorder when recording
+   *
+   * Bytes that don't start a valid header, see stream_msg.h, are
+   * skipped up to the next sync marker. After that, or a gap in the
+   * sequence, packets are dropped until the next keyframe, since the
+   * decoder couldn't use them. A connection starts out waiting for a
+   * keyframe, which the camera always opens its stream with. Each of
+   * the camera's streams waits on a keyframe of its own.
+   *
+   * The live stream, see cam_conf, goes to the decoder and the main
+   * stream to the recorder, which for a camera without a preview is
+   * the same stream. Packets of a stream the camera wasn't subscribed
+   * to are dropped.
+   *
+   * Stops early, marking the connection stalled, if the camera's pool
+   * has no free packet buffers, including for a reset the decoder is
+   * still owed, which must reach it before anything parsed here. Whatever is left over, a partial packet
+   * or packets waiting on a buffer, is moved to the front of the
+   * receive buffer for the next call.
+   *
+   * Returns:
+   * - int: 0 on success, or a negative error code if the stream can't be trusted at all
+   */
+  size_t offset = 0;
+  conn->stalled = !send_owed(stream, conn);
+  while (!conn->stalled && !conn->ended && conn->rx_len - offset >= sizeof(struct stream_hdr)) {
+    uint8_t* record = conn->rx_buf + offset;
+
+    struct stream_hdr hdr;
+    memcpy(&hdr, record, sizeof(hdr));
+    if (!stream_hdr_valid(&hdr) || hdr.size > ENCODED_FRAME_MAX_SIZE) {
+      if (conn->synced)
+        lose_sync(stream, conn, "lost sync");
+      conn->synced = false;
+      offset += 1 + next_sync(record + 1, conn->rx_len - offset - 1);
+      continue;
+    }
+    conn->synced = true;
+
+    if (hdr.cam_id != stream->conf->tcp_port) {
+      log_fmt(
+        ERROR,
+        "Cam %s is receiving the stream of the camera streaming to port %u",
+        stream->conf->name,
+        hdr.cam_id
+      );
+      return -EPROTO;
+    }
+
+    bool end_of_stream = hdr.flags & STREAM_END;
+    size_t record_size = sizeof(hdr) + (end_of_stream ? 0 : hdr.size);
+    if (conn->rx_len - offset < record_size) {
+      // the record starts at offset once it's moved to the front below
+      int ret = fit_rx_buf(conn, record_size);
+      if (ret)
+        return ret;
+      break;
+    }
+
+    // a packet parsed again after a stall carries the sequence just seen
+    bool repeat = conn->seq_valid && hdr.seq + 1 == conn->next_seq;
+    if (conn->seq_valid && !repeat && hdr.seq != conn->next_seq)
+      lose_sync(stream, conn, "is missing packets");
+    conn->seq_valid = true;
+    conn->next_seq = hdr.seq + 1;
+
+    uint8_t bit = hdr.stream_id < STREAM_COUNT ? STREAM_BIT(hdr.stream_id) : 0;
+    bool skip = false;
+    if (!end_of_stream) {
+      if ((conn->awaiting_key & bit) && (hdr.flags & STREAM_KEYFRAME)) {
+        conn->awaiting_key &= ~bit;
+        // back once whatever this camera is needed for can be used again
+        if (!(conn->awaiting_key & STREAM_BIT(stream->primary)))
+          recover_stream(stream);
+      }
+      skip = !(stream->streams & bit) || (conn->awaiting_key & bit);
+    }
+    bool decode = stream->live && hdr.stream_id == stream->conf->live_stream;
+    bool recorded = stream->recorder && hdr.stream_id == STREAM_MAIN;
+
+    // the decoder still needs the end of stream to flush and finish
+    struct enc_packet* pkt = NULL;
+    if ((decode && !skip) || end_of_stream) {
+      pkt = spsc_dequeue(stream->empty_pkts);
+      if (!pkt) {
+        conn->stalled = true;
+        break;
+      }
+    }
+
+    const uint8_t* payload = record + sizeof(hdr);
+    if (!end_of_stream) {
+      TRACE_POINT(TRACE_RECEIVED, stream->cam, hdr.timestamp);
+      metrics_add(&stream->metrics->pkts_received, 1);
+      metrics_add(&stream->metrics->bytes_received, hdr.size);
+      if (skip)
+        metrics_add(&stream->metrics->pkts_skipped, 1);
+      else if (recorded)
+        recorder_add(stream->recorder, stream->cam, hdr.timestamp, payload, hdr.size);
+    }
+    conn->ended = end_of_stream;
+
+    if (pkt) {
+      pkt->end_of_stream = end_of_stream;
+      pkt->keyframe = hdr.flags & STREAM_KEYFRAME;
+      pkt->reset = false;
+      pkt->size = end_of_stream ? 0 : hdr.size;
+      pkt->timestamp = hdr.timestamp;
+      pkt->sensor_ts = hdr.sensor_ts;
+      if (!end_of_stream) {
+        int ret = fit_packet(pkt, hdr.size);
+        if (ret)
+          return ret;
+        memcpy(pkt->data, payload, hdr.size);
+      }
+
+      spsc_enqueue(stream->filled_pkts, pkt);
+      pool_notify(stream->work_ev);
+    }
+    offset += record_size;
+  }
+
+  conn->rx_len -= offset;
+  if (offset && conn->rx_len)
+    memmove(conn->rx_buf, conn->rx_buf + offset, conn->rx_len);
+
+  return 0;
+}
+
+static int read_stream(
+  int epoll_fd,
+  struct ingest_stream* stream,
+  struct conn* conn,
+  uint32_t idx,
+  uint64_t now
+) {
+  /**
+   * Receives everything available on a connection and parses it
+   *
+   * Returns:
+   * - int: 0 on success, or a negative error code if the stream failed
+   */
+  char logstr[128];
+
+  if (!conn->stalled && !conn->ended && conn->rx_len < conn->rx_cap) {
+    ssize_t bytes = recv_from_stream(
+      conn->fd,
+      (char*)conn->rx_buf + conn->rx_len,
+      conn->rx_cap - conn->rx_len
+    );
+
+    if (bytes == 0) {
+      snprintf(
+        logstr,
+        sizeof(logstr),
+        "Cam %s disconnected before the end of its stream",
+        stream->conf->name
+      );
+      log(ERROR, logstr);
+      return -ECONNRESET;
+    } else if (bytes == -EAGAIN || bytes == -EINTR) {
+      return 0;
+    } else if (bytes < 0) {
+      return bytes;
+    }
+
+    conn->rx_len += bytes;
+    conn->last_rx = now;
+    conn->streaming = true;
+  }
+
+  bool was_stalled = conn->stalled;
+  do {
+    int ret = parse_packets(stream, conn);
+    if (ret)
+      return ret;
+    // a buffer freed while parking means the decoder won't signal, so retry
+  } while (conn->stalled && !spsc_park(stream->empty_ev, stream->empty_pkts));
+
+  if (conn->ended) {
+    // nothing more is expected, the camera may close the socket at any time
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    conn->fd = -1;
+    return 0;
+  }
+
+  if (conn->stalled == was_stalled)
+    return 0;
+  if (conn->stalled)
+    metrics_add(&stream->metrics->ingest_stalls, 1);
+
+  // level triggered, so a stalled socket must stop being watched or it
+  // would keep waking the reactor with data it can't take yet
+  int ret = watch(
+    epoll_fd,
+    EPOLL_CTL_MOD,
+    conn->fd,
+    conn->stalled ? 0 : EPOLLIN,
+    EV_CONN,
+    idx
+  );
+  if (ret == -1)
+    return -errno;
+
+  return 0;
+}
+
+static int fault_stream(
+  int epoll_fd,
+  struct ingest_stream* stream,
+  struct conn* conn,
+  uint32_t idx
+) {
+  /**
+   * Masks a failed camera out of framesets until it reconnects,
+   * without disturbing any other camera
+   *
+   * The connection, if there is one, is closed and whatever was left
+   * in its receive buffer discarded, the buffer itself is kept. The
+   * decoder is owed a reset, and the camera's listening socket is
+   * watched again so it can rejoin the session.
+   *
+   * Returns:
+   * - int: 0 on success, or a negative error code if the socket couldn't be watched
+   */
+  if (conn->fd >= 0) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    conn->fd = -1;
+  }
+  conn->rx_len = 0;
+  conn->streaming = false;
+  conn->stalled = false;
+
+  log_fmt(WARNING, "Cam %s is masked out of framesets until it reconnects", stream->conf->name);
+  metrics_add(&stream->metrics->stream_faults, 1);
+  metrics_store(&stream->metrics->degraded, 1);
+  atomic_store_explicit(&stream->degraded, true, memory_order_relaxed);
+
+  conn->owed = OWED_RESET;
+  settle_owed(stream, conn);
+
+  if (conn->listening)
+    return 0;
+  int ret = watch(epoll_fd, EPOLL_CTL_ADD, conn->listen_fd, EPOLLIN, EV_LISTEN, idx);
+  if (ret == -1)
+    return -errno;
+  conn->listening = true;
+  return 0;
+}
+
+void* ingest_fn(void* ptr) {
+  int ret = 0;
+  char logstr[128];
+
+  struct ingest_ctx* ctx = (struct ingest_ctx*)ptr;
+  uint32_t count = ctx->stream_count;
+
+  int epoll_fd = -1;
+  struct conn* conns = calloc(count, sizeof(struct conn));
+  struct epoll_event* events = malloc(sizeof(struct epoll_event) * (count * 2 + 2));
+  if (!conns || !events) {
+    log(ERROR, "Failed to allocate ingest buffers");
+    goto err_cleanup;
+  }
+
+  for (uint32_t i = 0; i < count; i++) {
+    conns[i].listen_fd = -1;
+    conns[i].fd = -1;
+    conns[i].rx_cap = RX_BUF_SIZE;
+    conns[i].rx_buf = malloc(RX_BUF_SIZE);
+    if (!conns[i].rx_buf) {
+      log(ERROR, "Failed to allocate ingest buffers");
+      goto err_cleanup;
+    }
+  }
+
+  cpu_set_t cpuset;
+  CPU_ZERO(&cpuset);
+  CPU_SET(ctx->core, &cpuset);
+  ret = sched_setaffinity(
+    gettid(),
+    sizeof(cpu_set_t),
+    &cpuset
+  );
+  if (ret == -1) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error pinning ingest thread to core %d, err: %s",
+      ctx->core,
+      strerror(errno)
+    );
+    log(ERROR, logstr);
+    goto err_cleanup;
+  }
+
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd == -1) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error creating ingest epoll instance: %s",
+      strerror(errno)
+    );
+    log(ERROR, logstr);
+    goto err_cleanup;
+  }
+
+  ret = watch(epoll_fd, EPOLL_CTL_ADD, ctx->stop_fd, EPOLLIN, EV_STOP, 0);
+  if (ret == -1)
+    goto err_cleanup;
+
+  ret = watch(epoll_fd, EPOLL_CTL_ADD, ctx->start_fd, EPOLLIN, EV_START, 0);
+  if (ret == -1)
+    goto err_cleanup;
+
+  for (uint32_t i = 0; i < count; i++) {
+    conns[i].listen_fd = setup_stream(ctx->streams[i].conf);
+    if (conns[i].listen_fd < 0)
+      goto err_cleanup;
+
+    ret = watch(epoll_fd, EPOLL_CTL_ADD, ctx->streams[i].empty_ev->fd, EPOLLIN, EV_PKT_FREE, i);
+    if (ret == -1)
+      goto err_cleanup;
+  }
+
+  bool active = false; // a session is in progress
+  uint64_t start = 0;
+  uint32_t connected = 0;
+  while (true) {
+    int ready = epoll_wait(epoll_fd, events, count * 2 + 2, active ? REACTOR_TICK : -1);
+    if (ready == -1 && errno != EINTR) {
+      snprintf(
+        logstr,
+        sizeof(logstr),
+        "Error waiting on camera streams: %s",
+        strerror(errno)
+      );
+      log(ERROR, logstr);
+      goto err_cleanup;
+    }
+
+    uint64_t now = monotonic_ns();
+    for (int i = 0; i < ready; i++) {
+      enum ev_type type = events[i].data.u64 >> 32;
+      uint32_t idx = (uint32_t)events[i].data.u64;
+      struct ingest_stream* stream = &ctx->streams[idx];
+      struct conn* conn = &conns[idx];
+
+      switch (type) {
+        case EV_STOP:
+          goto shutdown_cleanup;
+
+        case EV_START: {
+          uint64_t value;
+          ssize_t len = read(ctx->start_fd, &value, sizeof(value));
+          (void)len;
+          if (active)
+            break;
+
+          for (uint32_t j = 0; j < count; j++) {
+            // every camera is expected again, if it was degraded last session
+            metrics_store(&ctx->streams[j].metrics->degraded, 0);
+            atomic_store_explicit(&ctx->streams[j].degraded, false, memory_order_relaxed);
+
+            ret = watch(epoll_fd, EPOLL_CTL_ADD, conns[j].listen_fd, EPOLLIN, EV_LISTEN, j);
+            if (ret == -1)
+              goto err_cleanup;
+            conns[j].listening = true;
+          }
+          active = true;
+          start = now;
+          connected = 0;
+          break;
+        }
+
+        case EV_LISTEN:
+          ret = accept_conn(conn->listen_fd);
+          if (ret == -EAGAIN)
+            break;
+          if (ret < 0) {
+            // still listening, so the camera can connect again when it's rearmed
+            if (!atomic_load_explicit(&stream->degraded, memory_order_relaxed) &&
+                fault_stream(epoll_fd, stream, conn, idx))
+              goto err_cleanup;
+            break;
+          }
+
+          conn->fd = ret;
+          conn->last_rx = now;
+          conn->synced = true;
+          conn->awaiting_key = stream->streams;
+          conn->seq_valid = false;
+          if (!conn->joined)
+            connected++;
+          else
+            log_fmt(INFO, "Cam %s reconnected, waiting for a keyframe", stream->conf->name);
+          conn->joined = true;
+
+          // one client per camera, stop listening once it's connected
+          epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->listen_fd, NULL);
+          conn->listening = false;
+          ret = watch(epoll_fd, EPOLL_CTL_ADD, conn->fd, EPOLLIN, EV_CONN, idx);
+          if (ret == -1)
+            goto err_cleanup;
+          break;
+
+        case EV_CONN:
+          if (conn->fd < 0)
+            break;
+          ret = read_stream(epoll_fd, stream, conn, idx, now);
+          if (ret && fault_stream(epoll_fd, stream, conn, idx))
+            goto err_cleanup;
+          break;
+
+        case EV_PKT_FREE:
+          spsc_unpark(stream->empty_ev);
+          if (conn->fd < 0) {
+            settle_owed(stream, conn); // owed by a stream that's gone
+            break;
+          }
+          if (!conn->stalled)
+            break;
+          ret = read_stream(epoll_fd, stream, conn, idx, now);
+          if (ret && fault_stream(epoll_fd, stream, conn, idx))
+            goto err_cleanup;
+          break;
+      }
+    }
+
+    if (!active)
+      continue;
+
+    // with every camera degraded there's nothing to end on, they may still rejoin,
+    // unless the cameras were stopped, a degraded one isn't rearmed after that
+    bool stopping = atomic_load_explicit(&ctx->stopping, memory_order_relaxed);
+    uint32_t ended = 0;
+    uint32_t finished = 0;
+    for (uint32_t i = 0; i < count; i++) {
+      if (conns[i].ended)
+        ended++;
+      if (conns[i].ended || atomic_load_explicit(&ctx->streams[i].degraded, memory_order_relaxed))
+        finished++;
+    }
+    if ((ended || stopping) && finished == count) {
+      // every stream is closed, ready the connections for the next session
+      for (uint32_t i = 0; i < count; i++) {
+        struct conn* conn = &conns[i];
+        if (!conn->ended) {
+          // degraded, its decoder still has to end for the session to finish
+          if (conn->fd >= 0) {
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+            close(conn->fd);
+            conn->fd = -1;
+          }
+          if (conn->listening) {
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->listen_fd, NULL);
+            conn->listening = false;
+          }
+          conn->owed = OWED_END;
+          settle_owed(&ctx->streams[i], conn);
+        }
+
+        conn->rx_len = 0;
+        conn->streaming = false;
+        conn->stalled = false;
+        conn->ended = false;
+        conn->joined = false;
+      }
+      active = false;
+      continue;
+    }
+
+    // a camera that never connects is degraded like one that dropped, it may join once rearmed
+    if (connected < count && now - start > ACCEPT_TIMEOUT * 1000000000ULL) {
+      for (uint32_t i = 0; i < count; i++) {
+        struct ingest_stream* stream = &ctx->streams[i];
+        if (conns[i].joined || atomic_load_explicit(&stream->degraded, memory_order_relaxed))
+          continue;
+
+        log_fmt(WARNING, "Accept connection timed out for cam %s", stream->conf->name);
+        if (fault_stream(epoll_fd, stream, &conns[i], i))
+          goto err_cleanup;
+      }
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+      struct conn* conn = &conns[i];
+      if (conn->fd < 0 || conn->stalled)
+        continue; // a stalled camera is waiting on us, not the other way around
+
+      // the first packet isn't sent until the cameras reach the start timestamp
+      uint64_t timeout = conn->streaming ? RECV_TIMEOUT : ACCEPT_TIMEOUT;
+      if (now - conn->last_rx > timeout * 1000000000ULL) {
+        snprintf(
+          logstr,
+          sizeof(logstr),
+          "Timed out waiting for packet from cam %s",
+          ctx->streams[i].conf->name
+        );
+        log(WARNING, logstr);
+        if (fault_stream(epoll_fd, &ctx->streams[i], conn, i))
+          goto err_cleanup;
+      }
+    }
+  }
+
+err_cleanup:
+  log(DEBUG, "Notified main thread of error");
+  pthread_kill(ctx->main_thread, SIGTERM);
+
+shutdown_cleanup:
+  if (conns) {
+    for (uint32_t i = 0; i < count; i++) {
+      if (conns[i].fd >= 0)
+        close(conns[i].fd);
+      if (conns[i].listen_fd >= 0)
+        close(conns[i].listen_fd);
+      free(conns[i].rx_buf);
+    }
+    free(conns);
+  }
+  if (events)
+    free(events);
+  if (epoll_fd >= 0)
+    close(epoll_fd);
+
+  return NULL;
+}
@@ -1,24 +1,140 @@
 #include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #include <time.h>
 #include <unistd.h>
 
 #include "logging.h"
 
+/**
+ * Shared by the server, picam and the toolkit, compiled as C or C++,
+ * and the copies must be kept identical.
+ *
+ * Logging a message only copies it into a record in the calling
+ * thread's ring, so no caller ever formats a timestamp or makes a
+ * syscall. A drain thread at low priority merges the rings in
+ * timestamp order, formats the records and writes them out in
+ * batches. A full ring drops the message rather than block, and the
+ * drain thread logs how many were dropped.
+ *
+ * Rings come from a static pool, claimed by a thread's first message,
+ * so recording never allocates, locks or blocks, and is safe from a
+ * signal handler as long as the message is preformatted. A message
+ * logged from a handler that interrupted its thread mid log, or from
+ * a thread while every ring is taken, is written synchronously instead.
+ *
+ * A thread hands its ring back when it exits, through a thread specific
+ * key's destructor, and the drain thread frees the ring for the next
+ * thread once it has written everything the old owner logged. So only
+ * threads alive at once count against LOG_MAX_THREADS, however many
+ * come and go over a process's life.
+ */
+
+#define LOG_MSG_SIZE 224 // longest message kept, including the terminator
+#define LOG_RING_SIZE 256 // records per thread, must be a power of two
+#define LOG_MAX_THREADS 32
+#define LOG_LINE_SIZE (LOG_MSG_SIZE + 96) // formatted record, with room for the prefix
+#define LOG_BATCH_SIZE 65536
+#define LOG_DRAIN_INTERVAL_NS 10000000 // 10ms
+#define LOG_DRAIN_NICE 10
+#define LOG_LEVEL_ENV "MOCAP_LOG_LEVEL"
+
+struct log_rec {
+  uint64_t ns; // CLOCK_REALTIME when logged
+  const char* file;
+  uint32_t line;
+  uint16_t lvl;
+  uint16_t len;
+  char msg[LOG_MSG_SIZE];
+};
+
+#define RING_FREE 0
+#define RING_OWNED 1
+#define RING_RELEASED 2 // its thread exited, free once drained
+
+struct log_ring {
+  uint64_t head; // records ever published, only written by the owning thread
+  uint32_t state;
+  char pad0[52];
+  uint64_t tail; // records ever drained, only written by the drain thread
+  char pad1[56];
+  uint64_t dropped; // records lost to a full ring, reset by the drain thread
+  struct log_rec recs[LOG_RING_SIZE];
+};
+
+uint32_t log_level_mask = LOG_ALL_LEVELS;
+
 static int fd = -1;
+static int running = 0;
+static pthread_t drain_thread;
 
-int setup_logging(const char* fpath) {
-  fd = open(fpath, O_WRONLY | O_CREAT | O_APPEND, 0664);
-  if (fd < 0) {
-    return -errno;
+static struct log_ring ring_pool[LOG_MAX_THREADS];
+static uint32_t ring_count = 0; // rings ever claimed, the drain thread looks at these
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+static __thread struct log_ring* thread_ring = NULL;
+static __thread int thread_unringed = 0; // every ring was taken, or the thread is exiting
+static __thread int thread_logging = 0; // mid record, a handler logging now must not touch the ring
+
+static char batch[LOG_BATCH_SIZE]; // drain thread only
+
+static const char* log_levels[] = {
+  "[INFO]",
+  "[DEBUG]",
+  "[WARNING]",
+  "[ERROR]",
+  "[UNKNOWN]"
+};
+
+// lowest to highest severity, the enum's order predates the filter
+static const log_level severity_order[] = {
+  DEBUG,
+  INFO,
+  WARNING,
+  ERROR
+};
+
+void set_log_level(log_level lvl) {
+  /**
+   * Keeps messages at lvl and above, lowest to highest being
+   * DEBUG, INFO, WARNING, ERROR
+   *
+   * Parameters:
+   * - log_level lvl: the least severe level still logged
+   */
+  uint32_t mask = 0;
+  bool keep = false;
+  for (size_t i = 0; i < sizeof(severity_order) / sizeof(severity_order[0]); i++) {
+    if (severity_order[i] == lvl)
+      keep = true;
+    if (keep)
+      mask |= 1u << severity_order[i];
   }
-  return 0;
+  __atomic_store_n(&log_level_mask, mask, __ATOMIC_RELAXED);
 }
 
-void cleanup_logging() {
-  if (fd >= 0) {
-    close(fd);
+static void level_from_env() {
+  const char* name = getenv(LOG_LEVEL_ENV);
+  if (!name)
+    return;
+
+  for (int lvl = INFO; lvl <= ERROR; lvl++) {
+    const char* level_str = log_levels[lvl] + 1; // past the '['
+    size_t len = strlen(level_str) - 1; // before the ']'
+    if (strncmp(name, level_str, len) == 0 && name[len] == '\0') {
+      set_log_level((log_level)lvl);
+      return;
+    }
   }
 }
 
@@ -61,43 +177,43 @@ static void i_to_str(int value, char* buffer, size_t* offset) {
   }
 }
 
-#define LEAP_YEAR(year) ((year % 4 == 0 && year % 100 != 0) || year % 400 == 0)
-#define SECONDS_PER_LEAP_YEAR 31622400
-#define SECONDS_PER_YEAR 31536000
+static void padded_to_str(int value, int width, char* buffer, size_t* offset) {
+  for (int limit = 10; width > 1; width--, limit *= 10) {
+    if (value < limit)
+      buffer[(*offset)++] = '0';
+  }
+  i_to_str(value, buffer, offset);
+}
+
 #define SECONDS_PER_DAY 86400
 #define SECONDS_PER_HOUR 3600
 #define SECONDS_PER_MINUTE 60
+#define NANOS_PER_SECOND 1000000000ULL
 #define NANOS_PER_MILLISECOND 1000000
 #define NANOS_PER_MICROSECOND 1000
 
-static const int SECONDS_PER_MONTH[] = {
-  2505600,  // February leap
-  2678400,  // January
-  2419200,  // February
-  2678400,  // March
-  2592000,  // April
-  2678400,  // May
-  2592000,  // June
-  2678400,  // July
-  2678400,  // August
-  2592000,  // September
-  2678400,  // October
-  2592000,  // November
-  2678400   // December
-};
-
-static void timestamp(char* buffer, size_t* offset) {
+static void civil_from_days(int64_t days, int* year, int* month, int* day) {
   /**
-   * Generates an ISO 8601 timestamp without using unsafe time functions.
+   * Converts days since the epoch to a proleptic Gregorian date
    *
-   * 1. Gets raw seconds and nanoseconds
-   * 2. Accounts for leap years since epoch
-   * 3. Breaks down into calendar components:
-   *    - Years since 1970
-   *    - Months (handling February in leap years)
-   *    - Days
-   *    - Hours, minutes, seconds
-   *    - Milliseconds and microseconds
+   * Counts in 400 year eras starting from March, so the leap day
+   * falls at the end of the year, which takes the date in constant
+   * time rather than walking the years and months since 1970.
+   */
+  days += 719468; // from 1970-01-01 to 0000-03-01
+  int64_t era = (days >= 0 ? days : days - 146096) / 146097;
+  int64_t doe = days - era * 146097; // [0, 146096]
+  int64_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365; // [0, 399]
+  int64_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100); // [0, 365]
+  int64_t mp = (5 * doy + 2) / 153; // [0, 11], from March
+  *day = (int)(doy - (153 * mp + 2) / 5 + 1);
+  *month = (int)(mp < 10 ? mp + 3 : mp - 9);
+  *year = (int)(yoe + era * 400 + (*month <= 2));
+}
+
+static void timestamp(uint64_t ns, char* buffer, size_t* offset) {
+  /**
+   * Formats an ISO 8601 timestamp without using unsafe time functions.
    *
    * Format: "YYYY-MM-DD HH:MM:SS.mmmuuuZ"
    * Example: "2024-03-27 14:30:15.123456Z"
@@ -105,40 +221,15 @@ static void timestamp(char* buffer, size_t* offset) {
    * Note: The Z suffix indicates UTC timezone, which is what
    * CLOCK_REALTIME provides on Linux systems
    */
-  struct timespec ts;
-  clock_gettime(CLOCK_REALTIME, &ts);
-  time_t seconds = ts.tv_sec;
-  int nanos = ts.tv_nsec;
-
-  int year = 1970;
-  while (true) {
-    int seconds_in_year = LEAP_YEAR(year) ?
-                        SECONDS_PER_LEAP_YEAR :
-                        SECONDS_PER_YEAR;
-    if (seconds < seconds_in_year) {
-      break;
-    }
-    seconds -= seconds_in_year;
-    year++;
-  }
-
-  int month = 1;
-  while (true) {
-    int seconds_in_month = LEAP_YEAR(year) && month == 2 ?
-                         SECONDS_PER_MONTH[0] :
-                         SECONDS_PER_MONTH[month];
-    if (seconds < seconds_in_month) {
-      break;
-    }
-    seconds -= seconds_in_month;
-    month++;
-  }
+  int64_t seconds = (int64_t)(ns / NANOS_PER_SECOND);
+  int nanos = (int)(ns % NANOS_PER_SECOND);
 
-  int day = seconds / SECONDS_PER_DAY + 1;
+  int year, month, day;
+  civil_from_days(seconds / SECONDS_PER_DAY, &year, &month, &day);
   seconds %= SECONDS_PER_DAY;
-  int hour = seconds / SECONDS_PER_HOUR;
+  int hour = (int)(seconds / SECONDS_PER_HOUR);
   seconds %= SECONDS_PER_HOUR;
-  int minute = seconds / SECONDS_PER_MINUTE;
+  int minute = (int)(seconds / SECONDS_PER_MINUTE);
   seconds %= SECONDS_PER_MINUTE;
   int millis = nanos / NANOS_PER_MILLISECOND;
   nanos %= NANOS_PER_MILLISECOND;
@@ -146,105 +237,63 @@ static void timestamp(char* buffer, size_t* offset) {
 
   i_to_str(year, buffer, offset);
   buffer[(*offset)++] = '-';
-
-  if (month < 10) {
-    buffer[(*offset)++] = '0';
-  }
-  i_to_str(month, buffer, offset);
+  padded_to_str(month, 2, buffer, offset);
   buffer[(*offset)++] = '-';
-
-  if (day < 10) {
-    buffer[(*offset)++] = '0';
-  }
-  i_to_str(day, buffer, offset);
+  padded_to_str(day, 2, buffer, offset);
   buffer[(*offset)++] = ' ';
-
-  if (hour < 10) {
-    buffer[(*offset)++] = '0';
-  }
-  i_to_str(hour, buffer, offset);
+  padded_to_str(hour, 2, buffer, offset);
   buffer[(*offset)++] = ':';
-
-  if (minute < 10) {
-    buffer[(*offset)++] = '0';
-  }
-  i_to_str(minute, buffer, offset);
+  padded_to_str(minute, 2, buffer, offset);
   buffer[(*offset)++] = ':';
-
-  if (seconds < 10) {
-    buffer[(*offset)++] = '0';
-  }
-  i_to_str(seconds, buffer, offset);
+  padded_to_str((int)seconds, 2, buffer, offset);
   buffer[(*offset)++] = '.';
-
-  if (millis < 100) {
-    buffer[(*offset)++] = '0';
-  }
-  if (millis < 10) {
-    buffer[(*offset)++] = '0';
-  }
-  i_to_str(millis, buffer, offset);
-
-  if (micros < 100) {
-    buffer[(*offset)++] = '0';
-  }
-  if (micros < 10) {
-    buffer[(*offset)++] = '0';
-  }
-  i_to_str(micros, buffer, offset);
-
+  padded_to_str(millis, 3, buffer, offset);
+  padded_to_str(micros, 3, buffer, offset);
   buffer[(*offset)++] = 'Z';
 }
 
-static const char* log_levels[] = {
-  "[INFO]",
-  "[DEBUG]",
-  "[WARNING]",
-  "[ERROR]",
-  "[UNKNOWN]"
-};
-
-void log_msg(log_level lvl, const char* file, int line, const char* log_str) {
+static size_t format_rec(const struct log_rec* rec, char* buffer) {
   /**
-   * Atomic writes a log entry, safe for multiple threads to share
+   * Formats a record as a log line, at most LOG_LINE_SIZE bytes
    *
    * The log format is:
    * "TIMESTAMP [LEVEL] file:line: message\n"
    * Example:
    * "2024-03-27 14:30:15.123456Z [INFO] main.cpp:42: Process started\n"
+   *
+   * Long file paths are cut short rather than overrun the line.
    */
-  if (fd < 0) {
-    return;
-  }
-
-  char buffer[256];
   size_t offset = 0;
 
-  timestamp(buffer, &offset);
+  timestamp(rec->ns, buffer, &offset);
   buffer[offset++] = ' ';
-  const char* level_str = log_levels[lvl];
+  const char* level_str = log_levels[rec->lvl <= ERROR ? rec->lvl : ERROR + 1];
   for (; *level_str; level_str++) {
     buffer[offset++] = *level_str;
   }
   buffer[offset++] = ' ';
-  for (const char* c = file; *c; c++) {
+  const size_t file_end = LOG_LINE_SIZE - LOG_MSG_SIZE - 16;
+  for (const char* c = rec->file; *c && offset < file_end; c++) {
     buffer[offset++] = *c;
   }
   buffer[offset++] = ':';
-  i_to_str(line, buffer, &offset);
+  i_to_str((int)rec->line, buffer, &offset);
   buffer[offset++] = ':';
   buffer[offset++] = ' ';
-  for (const char* c = log_str; *c; c++) {
-    buffer[offset++] = *c;
-  }
+  memcpy(buffer + offset, rec->msg, rec->len);
+  offset += rec->len;
   buffer[offset++] = '\n';
 
+  return offset;
+}
+
+static void write_all(const char* buffer, size_t size) {
   size_t total_bytes_written = 0;
-  while (total_bytes_written < offset) {
+  while (total_bytes_written < size) {
     ssize_t result = write(
       fd,
       buffer + total_bytes_written,
-      offset - total_bytes_written
+      size - total_bytes_written
     );
 
     if (result < 0) {
@@ -257,3 +306,326 @@ void log_msg(log_level lvl, const char* file, int line, const char* log_str) {
     total_bytes_written += result;
   }
 }
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec * NANOS_PER_SECOND + ts.tv_nsec;
+}
+
+static void drain_rings() {
+  /**
+   * Formats and writes every published record, oldest first across
+   * all rings, batching as many lines per write as fit
+   */
+  size_t offset = 0;
+  uint32_t count = __atomic_load_n(&ring_count, __ATOMIC_ACQUIRE);
+  if (count > LOG_MAX_THREADS)
+    count = LOG_MAX_THREADS;
+
+  for (uint32_t i = 0; i < count; i++) {
+    struct log_ring* ring = &ring_pool[i];
+    uint64_t dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+    if (!dropped)
+      continue;
+
+    struct log_rec rec;
+    rec.ns = now_ns();
+    rec.file = __FILE__;
+    rec.line = __LINE__;
+    rec.lvl = WARNING;
+    int len = snprintf(rec.msg, sizeof(rec.msg), "Dropped %lu log messages, ring full", (unsigned long)dropped);
+    rec.len = (uint16_t)(len < (int)sizeof(rec.msg) ? len : (int)sizeof(rec.msg) - 1);
+    offset += format_rec(&rec, batch + offset);
+  }
+
+  uint64_t heads[LOG_MAX_THREADS];
+  for (uint32_t i = 0; i < count; i++)
+    heads[i] = __atomic_load_n(&ring_pool[i].head, __ATOMIC_ACQUIRE);
+
+  while (true) {
+    // a k way merge on the rings' oldest records, there are few rings
+    struct log_ring* oldest = NULL;
+    for (uint32_t i = 0; i < count; i++) {
+      struct log_ring* ring = &ring_pool[i];
+      if (ring->tail == heads[i])
+        continue;
+      const struct log_rec* rec = &ring->recs[ring->tail & (LOG_RING_SIZE - 1)];
+      if (!oldest || rec->ns < oldest->recs[oldest->tail & (LOG_RING_SIZE - 1)].ns)
+        oldest = ring;
+    }
+    if (!oldest)
+      break;
+
+    if (offset + LOG_LINE_SIZE > LOG_BATCH_SIZE) {
+      write_all(batch, offset);
+      offset = 0;
+    }
+
+    offset += format_rec(&oldest->recs[oldest->tail & (LOG_RING_SIZE - 1)], batch + offset);
+    __atomic_store_n(&oldest->tail, oldest->tail + 1, __ATOMIC_RELEASE);
+  }
+
+  if (offset)
+    write_all(batch, offset);
+
+  // a released ring's head is final, so once it's drained it can be reused
+  for (uint32_t i = 0; i < count; i++) {
+    struct log_ring* ring = &ring_pool[i];
+    if (__atomic_load_n(&ring->state, __ATOMIC_ACQUIRE) == RING_RELEASED &&
+        ring->tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE))
+      __atomic_store_n(&ring->state, RING_FREE, __ATOMIC_RELEASE);
+  }
+}
+
+static void* drain_loop(void* arg) {
+  (void)arg;
+  setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), LOG_DRAIN_NICE);
+
+  struct timespec interval = { 0, LOG_DRAIN_INTERVAL_NS };
+  while (__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+    drain_rings();
+    nanosleep(&interval, NULL);
+  }
+
+  drain_rings();
+  return NULL;
+}
+
+static void release_ring(void* ptr) {
+  // runs as the thread exits, anything it logs after this is written synchronously
+  struct log_ring* ring = (struct log_ring*)ptr;
+  thread_ring = NULL;
+  thread_unringed = 1;
+  __atomic_store_n(&ring->state, RING_RELEASED, __ATOMIC_RELEASE);
+}
+
+static void create_ring_key() {
+  pthread_key_create(&ring_key, release_ring);
+}
+
+int setup_logging(const char* fpath) {
+  /**
+   * Opens the log file and starts the drain thread
+   *
+   * The level filter is taken from MOCAP_LOG_LEVEL when it's set to
+   * one of DEBUG, INFO, WARNING or ERROR, otherwise every level is
+   * logged.
+   *
+   * The drain thread runs niced and with every signal blocked, so
+   * signals are left to the threads that handle them.
+   *
+   * Parameters:
+   * - const char* fpath: the log file, appended to
+   *
+   * Returns:
+   * - int: 0 on success, or a negative error code
+   */
+  fd = open(fpath, O_WRONLY | O_CREAT | O_APPEND, 0664);
+  if (fd < 0) {
+    return -errno;
+  }
+
+  level_from_env();
+  pthread_once(&ring_key_once, create_ring_key);
+
+  sigset_t all, prev;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &prev);
+
+  __atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+  int ret = pthread_create(&drain_thread, NULL, drain_loop, NULL);
+  pthread_sigmask(SIG_SETMASK, &prev, NULL);
+
+  if (ret != 0) {
+    __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+    close(fd);
+    fd = -1;
+    return -ret;
+  }
+
+  return 0;
+}
+
+void cleanup_logging() {
+  /**
+   * Stops the drain thread once it has written everything logged so
+   * far, then closes the log file
+   */
+  if (__atomic_exchange_n(&running, 0, __ATOMIC_ACQ_REL)) {
+    pthread_join(drain_thread, NULL);
+  }
+
+  if (fd >= 0) {
+    close(fd);
+    fd = -1;
+  }
+}
+
+static bool claim_ring(struct log_ring* ring) {
+  uint32_t expected = RING_FREE;
+  return __atomic_compare_exchange_n(
+    &ring->state,
+    &expected,
+    RING_OWNED,
+    false,
+    __ATOMIC_ACQUIRE,
+    __ATOMIC_RELAXED
+  );
+}
+
+static struct log_ring* get_ring() {
+  /**
+   * Returns the thread's ring, claiming one on its first message
+   *
+   * A ring an exited thread gave back is reused before a new one is
+   * taken from the pool. A thread that finds every ring taken logs
+   * synchronously from then on.
+   */
+  struct log_ring* ring = thread_ring;
+  if (ring || thread_unringed)
+    return ring;
+
+  while (!ring) {
+    uint32_t count = __atomic_load_n(&ring_count, __ATOMIC_ACQUIRE);
+    if (count > LOG_MAX_THREADS)
+      count = LOG_MAX_THREADS;
+
+    for (uint32_t i = 0; i < count && !ring; i++) {
+      if (claim_ring(&ring_pool[i]))
+        ring = &ring_pool[i];
+    }
+    if (ring)
+      break;
+
+    if (count == LOG_MAX_THREADS) {
+      thread_unringed = 1;
+      return NULL;
+    }
+
+    uint32_t idx = __atomic_fetch_add(&ring_count, 1, __ATOMIC_ACQ_REL);
+    if (idx >= LOG_MAX_THREADS) {
+      __atomic_fetch_sub(&ring_count, 1, __ATOMIC_RELAXED);
+      continue; // another thread took the last one, one may have been freed since
+    }
+
+    // a thread scanning may take the new ring first, then look again
+    if (claim_ring(&ring_pool[idx]))
+      ring = &ring_pool[idx];
+  }
+
+  // glibc keeps the first keys' values in the thread descriptor, so
+  // setting one doesn't allocate, even from a handler
+  pthread_setspecific(ring_key, ring);
+  thread_ring = ring;
+  return ring;
+}
+
+static struct log_rec* claim_rec(struct log_ring* ring) {
+  uint64_t head = ring->head;
+  if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == LOG_RING_SIZE) {
+    __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+    return NULL;
+  }
+  return &ring->recs[head & (LOG_RING_SIZE - 1)];
+}
+
+static void publish_rec(struct log_ring* ring) {
+  __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+static void log_sync(const struct log_rec* rec) {
+  char buffer[LOG_LINE_SIZE];
+  size_t len = format_rec(rec, buffer);
+  write_all(buffer, len);
+}
+
+void log_msg(log_level lvl, const char* file, int line, const char* log_str) {
+  /**
+   * Queues a log entry for the drain thread, safe for multiple threads
+   * to share, and safe from a signal handler
+   *
+   * Messages longer than LOG_MSG_SIZE - 1 bytes are cut short.
+   *
+   * Parameters:
+   * - log_level lvl: the message's level, dropped if filtered out
+   * - const char* file: the source file, must outlive the logger
+   * - int line: the source line
+   * - const char* log_str: the message
+   */
+  if (!log_enabled(lvl) || !__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+    return;
+  }
+
+  struct log_rec local;
+  struct log_ring* ring = thread_logging ? NULL : get_ring();
+  thread_logging++;
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+
+  struct log_rec* rec = ring ? claim_rec(ring) : &local;
+  if (rec) {
+    rec->ns = now_ns();
+    rec->file = file;
+    rec->line = (uint32_t)line;
+    rec->lvl = (uint16_t)lvl;
+    size_t len = 0;
+    for (; log_str[len] && len < LOG_MSG_SIZE - 1; len++) {
+      rec->msg[len] = log_str[len];
+    }
+    rec->len = (uint16_t)len;
+
+    if (ring)
+      publish_rec(ring);
+    else
+      log_sync(rec);
+  }
+
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+  thread_logging--;
+}
+
+void log_msg_fmt(log_level lvl, const char* file, int line, const char* fmt, ...) {
+  /**
+   * Formats a message straight into the thread's next record
+   *
+   * Used through the format macro, which skips the call entirely when
+   * the level is filtered out, so the arguments are never formatted.
+   * Not safe from a signal handler, since vsnprintf isn't.
+   *
+   * Parameters:
+   * - log_level lvl: the message's level
+   * - const char* file: the source file, must outlive the logger
+   * - int line: the source line
+   * - const char* fmt: a printf format, and its arguments
+   */
+  if (!log_enabled(lvl) || !__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+    return;
+  }
+
+  struct log_rec local;
+  struct log_ring* ring = thread_logging ? NULL : get_ring();
+  thread_logging++;
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+
+  struct log_rec* rec = ring ? claim_rec(ring) : &local;
+  if (rec) {
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(rec->msg, sizeof(rec->msg), fmt, args);
+    va_end(args);
+
+    rec->ns = now_ns();
+    rec->file = file;
+    rec->line = (uint32_t)line;
+    rec->lvl = (uint16_t)lvl;
+    rec->len = (uint16_t)(len < 0 ? 0 : len < (int)sizeof(rec->msg) ? len : (int)sizeof(rec->msg) - 1);
+
+    if (ring)
+      publish_rec(ring);
+    else
+      log_sync(rec);
+  }
+
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+  thread_logging--;
+}
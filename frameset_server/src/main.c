@@ -2,7 +2,6 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <pthread.h>
-#include <semaphore.h>
 #include <sched.h>
 #include <signal.h>
 #include <stdbool.h>
@@ -10,54 +9,204 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/mman.h>
+#include <sys/signalfd.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "arena.h"
+#include "assembler.h"
+#include "cam_ctl.h"
+#include "frameset_shm.h"
+#include "gpu_pool.h"
+#include "ingest.h"
 #include "spsc_queue.h"
 #include "logging.h"
 #include "parse_conf.h"
+#include "rate_ctl.h"
+#include "recorder.h"
 #include "stream_mgr.h"
 #include "network.h"
+#include "telemetry.h"
+#include "topology.h"
+#include "trace.h"
 
 #define LOG_PATH "/var/log/mocap-toolkit/server.log"
-#define CAM_CONF_PATH "/etc/mocap-toolkit/cams.yaml"
+#define TRACE_PATH "/var/log/mocap-toolkit/server.trace"
 
-#define SHM_NAME "/mocap-toolkit_frameset"
-#define SEM_CONSUMER_READY "/mocap-toolkit_consumer_ready"
+#define TIMESTAMP_DELAY 1 // seconds, until every camera has answered a ping, see cam_ctl.h
+#define SESSION_START_DELAY 100000000ULL // ns, the least a session starts ahead of being armed
+#define RESIDENT_POLL_MS 100 // between checks for attached consumers
+#define RESIDENT_IDLE_TIMEOUT 600 // seconds without a consumer before a resident server exits
+#define FRAME_BUFS_PER_THREAD 64
+#define MAX_FRAMESET_SLOTS (FRAME_BUFS_PER_THREAD / 2) // a camera's published frames leave the rest to decode into
+#define FRAMESET_DEADLINE 100000000 // 100 ms for a slow camera to catch up
+#define PARTIAL_FRAMESETS true // publish framesets missing cameras after the deadline
+#define LEASE_DROP_LOG_INTERVAL 100 // log the first frameset dropped for a lease, then every this many
+#define REJOIN_INTERVAL 1000000000ULL // ns between resending a degraded camera the session's timestamp
 
-#define CORES_PER_CCD 8
-#define TIMESTAMP_DELAY 1 // seconds
-#define EMPTY_QS_WAIT 10000 // 0.01 ms
-#define FRAME_BUFS_PER_THREAD 256
+_Static_assert(MAX_FRAMESET_SLOTS <= FRAMESET_MAX_SLOTS, "a slot past the lease bits can't be leased");
+
+/**
+ * Everything the server sets up per camera, carved out of the startup
+ * arena, see arena.h, rather than sized on the stack.
+ */
+struct server_state {
+  cam_conf* confs;
+  uint32_t* cam_fps;
+  struct ts_frame_buf* frame_bufs;
+  void** frame_q_bufs;
+  struct producer_q* filled_frame_pqs;
+  struct consumer_q* filled_frame_cqs;
+  struct producer_q* empty_frame_pqs;
+  struct consumer_q* empty_frame_cqs;
+  struct enc_packet* packets;
+  void** pkt_q_bufs;
+  struct producer_q* filled_pkt_pqs;
+  struct consumer_q* filled_pkt_cqs;
+  struct producer_q* empty_pkt_pqs;
+  struct consumer_q* empty_pkt_cqs;
+  struct spsc_event* queue_evs;
+  struct stream_ctx* decode_streams;
+  struct ingest_stream* ingest_streams;
+  struct thread_ctx* ctxs;
+  struct pool_event* work_evs; // one per placement group
+  pthread_t* threads;
+  struct ingest_ctx* ingest_ctxs;
+  pthread_t* ingest_threads;
+  int* ingest_start_fds;
+  struct ts_frame_buf** current_frames;
+  struct ts_frame_buf** published_frames;
+  struct epoll_event* events;
+  struct rate_cam* rate_cams;
+  struct rate_msg* rate_msgs;
+  struct ctl_cam* ctl_cams;
+};
 
 static void shutdown_handler(int signum);
 static void perform_cleanup();
+static bool layout_state(
+  struct arena* arena,
+  struct server_state* state,
+  uint32_t cam_count,
+  uint32_t worker_count,
+  uint32_t ingest_count,
+  uint32_t group_count,
+  uint32_t slot_count
+);
+static void touch_frame_pools(
+  void* shm,
+  const struct frameset_shm_header* hdr,
+  const struct topology* topo,
+  const struct placement* plan
+);
+static bool publish_frameset(
+  void* shm,
+  struct frameset_shm_header* hdr,
+  struct ts_frame_buf** frames,
+  struct ts_frame_buf** published_frames,
+  struct producer_q* empty_qs,
+  uint64_t timestamp,
+  uint64_t cam_mask
+);
+static bool consumers_attached(struct frameset_shm_header* hdr);
 
 struct cleanup_ctx {
-  void* frame_bufs;
-  void* q_bufs;
+  struct arena arena;
+  struct enc_packet* packets;
+  int packet_count;
   void* frameset_buf;
   size_t shm_size;
+  uint8_t* gpu_pool;
+  struct assembler* assembler;
+  struct spsc_event* events;
+  int event_count;
+  int epoll_fd;
+  int timer_fd;
+  int signal_fd;
   int shm_fd;
-  sem_t* consumer_ready;
   pthread_t* threads;
   int thread_count;
+  struct pool_event* work_evs;
+  int work_ev_count;
+  struct decode_pool* decode_pool;
+  pthread_t* ingest_threads;
+  int ingest_count;
+  int ingest_stop_fd;
+  int* ingest_start_fds;
+  int ingest_start_count;
+  struct recorder* recorder;
+  struct telemetry* telemetry;
+  struct cam_ctl* cam_ctl;
   bool logging_initialized;
 };
 
 static struct cleanup_ctx cleanup = {
-  0,
-  .shm_fd = -1
+  .shm_fd = -1,
+  .epoll_fd = -1,
+  .timer_fd = -1,
+  .signal_fd = -1,
+  .ingest_stop_fd = -1
 };
 
 static volatile sig_atomic_t running = 1;
 
-int main() {
+// too large for the stack with a CPU order per domain
+static struct topology topology;
+static struct rig_conf rig_conf;
+
+int main(int argc, char* argv[]) {
   int ret = 0;
   char logstr[128];
 
+  // -r <dir> records every camera's stream to dir, see recorder.h,
+  // -n records without decoding, leaving the framesets empty,
+  // -d stays resident, streaming whenever a consumer is attached,
+  // -s <slots> sets how many framesets the ring holds, see frameset_shm.h
+  const char* record_dir = NULL;
+  bool live = true;
+  bool resident = false;
+  uint32_t slot_count = FRAMESET_SLOTS;
+  int opt;
+  while ((opt = getopt(argc, argv, "r:nds:")) != -1) {
+    switch (opt) {
+      case 'r':
+        record_dir = optarg;
+        break;
+      case 'n':
+        live = false;
+        break;
+      case 'd':
+        resident = true;
+        break;
+      case 's': {
+        char* end;
+        unsigned long slots = strtoul(optarg, &end, 10);
+        if (*optarg == '\0' || *end != '\0' || slots < 1 || slots > MAX_FRAMESET_SLOTS) {
+          printf("-s takes a frameset ring depth from 1 to %d\n", MAX_FRAMESET_SLOTS);
+          return -EINVAL;
+        }
+        slot_count = (uint32_t)slots;
+        break;
+      }
+      default:
+        printf("Usage: %s [-s slots] [-d | -r recording_dir [-n]]\n", argv[0]);
+        return -EINVAL;
+    }
+  }
+  if (!live && !record_dir) {
+    printf("-n only makes sense when recording with -r\n");
+    return -EINVAL;
+  }
+  if (resident && record_dir) {
+    printf("-d can't be combined with recording, a recording is a single session\n");
+    return -EINVAL;
+  }
+
   ret = setup_logging(LOG_PATH);
   if (ret) {
     printf("Error opening log file: %s\n", strerror(errno));
@@ -91,39 +240,67 @@ int main() {
     log(ERROR, logstr);
   }
 
-  int cam_count = count_cameras(CAM_CONF_PATH);
-  if (cam_count <= 0) {
+  // blocked before any thread is created, so only the signalfd below sees it
+  sigset_t wake_mask;
+  sigemptyset(&wake_mask);
+  sigaddset(&wake_mask, FRAMESET_WAKE_SIGNAL);
+  pthread_sigmask(SIG_BLOCK, &wake_mask, NULL);
+
+  // loaded before the arena, which is sized by the camera count
+  ret = load_rig_conf(RIG_CONF_YAML, RIG_CONF_PATH, &rig_conf);
+  if (ret) {
     snprintf(
       logstr,
       sizeof(logstr),
-      "Error getting camera count: %s",
-      strerror(cam_count)
+      "Error parsing camera confs %s",
+      strerror(-ret)
     );
     log(ERROR, logstr);
     perform_cleanup();
-    return cam_count;
+    return ret;
   }
 
-  struct cam_conf confs[cam_count];
-  ret = parse_conf(confs, cam_count);
-  if (ret) {
+  const int cam_count = rig_conf.cam_count;
+  if (cam_count > ASSEMBLER_MAX_CAMS) {
     snprintf(
       logstr,
       sizeof(logstr),
-      "Error parsing camera confs %s",
-      strerror(ret)
+      "At most %d cameras are supported",
+      ASSEMBLER_MAX_CAMS
     );
     log(ERROR, logstr);
+    perform_cleanup();
+    return -EINVAL;
+  }
+
+  struct placement_conf placement_conf;
+  load_placement_conf(&rig_conf.placement, &placement_conf);
+
+  ret = discover_topology(&topology);
+  if (ret) {
     perform_cleanup();
     return ret;
   }
 
-  // pin to cam_count % 8 to stay on ccd0 for 3dv cache with threads
-  // but not be on the same core as any threads until there are 8+
+  // the recorder's queues take packets from a single ingest thread
+  struct placement plan;
+  ret = plan_placement(&topology, &placement_conf, cam_count, record_dir != NULL, &plan);
+  if (ret) {
+    perform_cleanup();
+    return ret;
+  }
+  log_placement(&topology, &plan);
+
+  const int worker_count = plan.worker_count;
+  const int ingest_count = plan.shared_ingest ? 1 : plan.group_count;
+
+  // the threads pin themselves once they're created, the main thread
+  // takes the first CPU of the first domain, see topology.h
   cpu_set_t cpuset;
   CPU_ZERO(&cpuset);
-  CPU_SET(cam_count % CORES_PER_CCD, &cpuset);
+  CPU_SET(plan.main_core, &cpuset);
   pid_t pid = getpid();
+  pthread_t main_thread = pthread_self(); // what the other threads signal on failure
   ret = sched_setaffinity(
     pid,
     sizeof(cpu_set_t),
@@ -141,247 +318,818 @@ int main() {
     return -errno;
   }
 
-  const uint64_t frame_bufs_count = cam_count * FRAME_BUFS_PER_THREAD;
-  const uint64_t frame_buf_size = DECODED_FRAME_WIDTH * DECODED_FRAME_HEIGHT * 3 / 2;
-
-  uint8_t* frame_bufs = malloc(frame_bufs_count * frame_buf_size);
-  if (!frame_bufs) {
-    log(ERROR, "Failed to allocate frame buffers");
+  // pinned first, so the arena is populated from the CCD the threads run on
+  struct server_state state;
+  struct arena sizing = { 0 };
+  layout_state(&sizing, &state, cam_count, worker_count, ingest_count, plan.group_count, slot_count);
+  ret = init_arena(&cleanup.arena, sizing.used);
+  if (ret) {
+    perform_cleanup();
+    return ret;
+  }
+  if (!layout_state(&cleanup.arena, &state, cam_count, worker_count, ingest_count, plan.group_count, slot_count)) {
+    log(ERROR, "Startup arena is smaller than its layout");
     perform_cleanup();
     return -ENOMEM;
   }
-  cleanup.frame_bufs = frame_bufs;
 
-  struct ts_frame_buf ts_frame_bufs[frame_bufs_count];
-  for (uint i = 0; i < frame_bufs_count; i++) {
-    size_t offset = i * frame_buf_size;
-    ts_frame_bufs[i].frame_buf = frame_bufs + offset;
+  cam_conf* confs = state.confs;
+  memcpy(confs, rig_conf.cams, cam_count * sizeof(cam_conf));
+
+  int shm_fd = shm_open(
+    FRAMESET_SHM_NAME,
+    O_CREAT | O_RDWR,
+    0666
+  );
+  if (shm_fd == -1) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error creating shared memory: %s",
+      strerror(errno)
+    );
+    log(ERROR, logstr);
+    perform_cleanup();
+    return -errno;
   }
+  cleanup.shm_fd = shm_fd;
 
-  struct producer_q filled_frame_producer_qs[cam_count];
-  struct consumer_q filled_frame_consumer_qs[cam_count];
+  // a segment left over from a previous run keeps its pages wherever
+  // they were first touched, truncating it first drops them
+  ret = ftruncate(shm_fd, 0);
+  if (ret == -1) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error resetting shared memory: %s",
+      strerror(errno)
+    );
+    log(ERROR, logstr);
+    perform_cleanup();
+    return -errno;
+  }
 
-  struct producer_q empty_frame_producer_qs[cam_count];
-  struct consumer_q empty_frame_consumer_qs[cam_count];
+  // each camera gets its own run of the frame pool, sized for the stream it decodes
+  uint64_t pool_size = 0;
+  for (int i = 0; i < cam_count; i++) {
+    state.cam_fps[i] = confs[i].fps;
+    size_t frame_size = (size_t)confs[i].live_width * confs[i].live_height * 3 / 2;
+    pool_size = frameset_align(pool_size, FRAMESET_POOL_ALIGN);
+    pool_size += frameset_frame_stride(frame_size) * FRAME_BUFS_PER_THREAD;
+  }
 
-  void** q_bufs = aligned_alloc(
-    CACHE_LINE_SIZE,
-    sizeof(void*) * frame_bufs_count * 2
+#ifdef CUDA_FRAMESETS
+  // the frame pool lives on the device, so only the header and slots are shared
+  const uint64_t host_pool_size = 0;
+#else
+  const uint64_t host_pool_size = pool_size;
+#endif
+  size_t shm_size = frameset_shm_size(
+    cam_count,
+    slot_count,
+    host_pool_size
+  );
+  ret = ftruncate(
+    shm_fd,
+    shm_size
   );
-  if (q_bufs == NULL) {
-    log(ERROR, "Failed to allocate queue buffers");
+  if (ret == -1) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error creating shared memory: %s",
+      strerror(errno)
+    );
+    log(ERROR, logstr);
     perform_cleanup();
-    return -ENOMEM;
+    return -errno;
   }
-  cleanup.q_bufs = q_bufs;
 
+  void* frameset_buf = mmap(
+    NULL,
+    shm_size,
+    PROT_READ | PROT_WRITE,
+    MAP_SHARED,
+    shm_fd,
+    0
+  );
+  if (frameset_buf == MAP_FAILED) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error mapping shared memory: %s",
+      strerror(errno)
+    );
+    log(ERROR, logstr);
+    perform_cleanup();
+    return -errno;
+  }
+  cleanup.frameset_buf = frameset_buf;
+  cleanup.shm_size = shm_size;
+
+  // the segment may be left over from a previous run, so reset every
+  // slot sequence before consumers can see a valid header
+  memset(frameset_buf, 0, frameset_header_size());
+  struct frameset_shm_header* frameset_hdr = frameset_buf;
+  frameset_hdr->slot_count = slot_count;
+  frameset_hdr->cam_count = cam_count;
+  frameset_hdr->slots_offset = frameset_slots_offset(cam_count);
+  frameset_hdr->slot_size = frameset_slot_size(cam_count);
+  frameset_hdr->pool_offset = frameset_pool_offset(cam_count, slot_count);
+  frameset_hdr->pool_size = host_pool_size;
+  frameset_hdr->server_pid = pid;
+
+  uint64_t cam_pool_offset = 0;
+  for (int i = 0; i < cam_count; i++) {
+    struct frameset_cam* cam = frameset_get_cam(frameset_buf, i);
+    cam->width = confs[i].live_width;
+    cam->height = confs[i].live_height;
+    cam->fps = confs[i].fps;
+    cam->frame_count = FRAME_BUFS_PER_THREAD;
+    cam->frame_size = (size_t)confs[i].live_width * confs[i].live_height * 3 / 2;
+    cam->frame_stride = frameset_frame_stride(cam->frame_size);
+    cam->pool_offset = frameset_align(cam_pool_offset, FRAMESET_POOL_ALIGN);
+    cam_pool_offset = cam->pool_offset + cam->frame_stride * cam->frame_count;
+  }
+#ifdef CUDA_FRAMESETS
+  frameset_hdr->flags = FRAMESET_GPU;
+  ret = init_gpu_pool(
+    pool_size,
+    &cleanup.gpu_pool,
+    frameset_hdr->cuda_ipc_handle
+  );
+  if (ret) {
+    perform_cleanup();
+    return ret;
+  }
+#endif
+  for (uint64_t i = 0; i < slot_count; i++) {
+    struct frameset_slot* slot = frameset_get_slot(frameset_buf, frameset_hdr, i);
+    atomic_store_explicit(&slot->seq, 0, memory_order_relaxed);
+  }
+  atomic_store_explicit(&frameset_hdr->write_seq, 0, memory_order_relaxed);
+  touch_frame_pools(frameset_buf, frameset_hdr, &topology, &plan);
+  frameset_hdr->version = FRAMESET_SHM_VERSION;
+  atomic_thread_fence(memory_order_release);
+  frameset_hdr->magic = FRAMESET_SHM_MAGIC;
+
+  struct telemetry telemetry;
+  ret = init_telemetry(&telemetry, confs, cam_count, pid);
+  cleanup.telemetry = &telemetry;
+  if (ret) {
+    perform_cleanup();
+    return ret;
+  }
+
+  struct cam_ctl cam_ctl;
+  ret = init_cam_ctl(&cam_ctl, state.ctl_cams, confs, cam_count, &telemetry);
+  cleanup.cam_ctl = &cam_ctl;
+  if (ret) {
+    perform_cleanup();
+    return ret;
+  }
+
+  struct producer_q* filled_frame_producer_qs = state.filled_frame_pqs;
+  struct consumer_q* filled_frame_consumer_qs = state.filled_frame_cqs;
+  struct producer_q* empty_frame_producer_qs = state.empty_frame_pqs;
+  struct consumer_q* empty_frame_consumer_qs = state.empty_frame_cqs;
+
+  // the decoders write straight into the shared frame pool
   for (int i = 0; i < cam_count; i++) {
     spsc_queue_init(
       &filled_frame_producer_qs[i],
       &filled_frame_consumer_qs[i],
-      q_bufs + (i * 2 * FRAME_BUFS_PER_THREAD),
+      state.frame_q_bufs + (i * 2 * FRAME_BUFS_PER_THREAD),
       FRAME_BUFS_PER_THREAD
     );
 
     spsc_queue_init(
       &empty_frame_producer_qs[i],
       &empty_frame_consumer_qs[i],
-      q_bufs + ((i * 2 + 1) * FRAME_BUFS_PER_THREAD),
+      state.frame_q_bufs + ((i * 2 + 1) * FRAME_BUFS_PER_THREAD),
       FRAME_BUFS_PER_THREAD
     );
 
+    struct frameset_cam* cam = frameset_get_cam(frameset_buf, i);
     for (int j = 0; j < FRAME_BUFS_PER_THREAD; j++) {
-      spsc_enqueue(
-        &empty_frame_producer_qs[i],
-        &ts_frame_bufs[i * FRAME_BUFS_PER_THREAD + j]
-      );
+      struct ts_frame_buf* buf = &state.frame_bufs[i * FRAME_BUFS_PER_THREAD + j];
+      buf->idx = j;
+#ifdef CUDA_FRAMESETS
+      buf->frame_buf = cleanup.gpu_pool + cam->pool_offset + cam->frame_stride * j;
+#else
+      (void)cam;
+      buf->frame_buf = frameset_pool_frame(frameset_buf, frameset_hdr, i, j);
+#endif
+      spsc_enqueue(&empty_frame_producer_qs[i], buf);
     }
   }
 
-  struct thread_ctx ctxs[cam_count];
-  pthread_t threads[cam_count];
-  cleanup.threads = threads;
+  // encoded packets, framed by the ingest thread and passed to each decoder
+  struct enc_packet* packets = state.packets;
+  struct producer_q* filled_pkt_producer_qs = state.filled_pkt_pqs;
+  struct consumer_q* filled_pkt_consumer_qs = state.filled_pkt_cqs;
+  struct producer_q* empty_pkt_producer_qs = state.empty_pkt_pqs;
+  struct consumer_q* empty_pkt_consumer_qs = state.empty_pkt_cqs;
+  cleanup.packets = packets;
+  cleanup.packet_count = cam_count * PACKETS_PER_CAM;
+
   for (int i = 0; i < cam_count; i++) {
-    ctxs[i].conf = &confs[i];
-    ctxs[i].filled_bufs = &filled_frame_producer_qs[i];
-    ctxs[i].empty_bufs = &empty_frame_consumer_qs[i];
-    ctxs[i].core = i % CORES_PER_CCD;
-    ctxs[i].main_thread = pid;
+    spsc_queue_init(
+      &filled_pkt_producer_qs[i],
+      &filled_pkt_consumer_qs[i],
+      state.pkt_q_bufs + (i * 2 * PACKET_Q_SIZE),
+      PACKET_Q_SIZE
+    );
 
-    ret = pthread_create(
-      &threads[i],
-      NULL,
-      stream_mgr_fn,
-      (void*)&ctxs[i]
+    spsc_queue_init(
+      &empty_pkt_producer_qs[i],
+      &empty_pkt_consumer_qs[i],
+      state.pkt_q_bufs + ((i * 2 + 1) * PACKET_Q_SIZE),
+      PACKET_Q_SIZE
     );
 
+    ret = init_packet_bufs(&packets[i * PACKETS_PER_CAM], PACKETS_PER_CAM, &confs[i]);
     if (ret) {
-      log(ERROR, "Error spawning thread");
       perform_cleanup();
       return ret;
     }
 
-    cleanup.thread_count++;
+    for (int j = 0; j < PACKETS_PER_CAM; j++)
+      spsc_enqueue(&empty_pkt_producer_qs[i], &packets[i * PACKETS_PER_CAM + j]);
   }
 
-  sem_t* consumer_ready = sem_open(
-    SEM_CONSUMER_READY,
-    O_CREAT,
-    0666,
-    0
-  );
-  if (consumer_ready == SEM_FAILED) {
+  // the main thread sleeps on the filled frame queues, the ingest thread
+  // sleeps on the empty packet queues of any camera whose decoder has
+  // fallen behind, the decode workers share a single event in the pool
+  struct spsc_event* queue_evs = state.queue_evs;
+  struct spsc_event* filled_evs = queue_evs;
+  struct spsc_event* empty_pkt_evs = queue_evs + cam_count;
+  for (int i = 0; i < cam_count * 2; i++)
+    queue_evs[i].fd = -1;
+  cleanup.events = queue_evs;
+  cleanup.event_count = cam_count * 2;
+
+  for (int i = 0; i < cam_count * 2; i++) {
+    ret = spsc_event_init(&queue_evs[i]);
+    if (ret) {
+      snprintf(
+        logstr,
+        sizeof(logstr),
+        "Error creating queue eventfd: %s",
+        strerror(-ret)
+      );
+      log(ERROR, logstr);
+      perform_cleanup();
+      return ret;
+    }
+  }
+
+  int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd == -1) {
     snprintf(
       logstr,
       sizeof(logstr),
-      "Error opening semaphore: %s",
+      "Error creating epoll instance: %s",
       strerror(errno)
     );
     log(ERROR, logstr);
     perform_cleanup();
     return -errno;
   }
-  cleanup.consumer_ready = consumer_ready;
+  cleanup.epoll_fd = epoll_fd;
 
-  int shm_fd = shm_open(
-    SHM_NAME,
-    O_CREAT | O_RDWR,
-    0666
-  );
-  if (shm_fd == -1) {
+  // fires when the assembler's oldest pending frameset times out
+  int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (timer_fd == -1) {
     snprintf(
       logstr,
       sizeof(logstr),
-      "Error creating shared memory: %s",
+      "Error creating deadline timer: %s",
       strerror(errno)
     );
     log(ERROR, logstr);
     perform_cleanup();
+    return -errno;
   }
-  cleanup.shm_fd = shm_fd;
+  cleanup.timer_fd = timer_fd;
 
-  size_t shm_size = frame_buf_size * cam_count + sizeof(uint64_t);
-  ret = ftruncate(
-    shm_fd,
-    shm_size
-  );
-  if (ret == -1) {
+  // consumers send the wake signal as they attach and detach
+  int signal_fd = signalfd(-1, &wake_mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (signal_fd == -1) {
     snprintf(
       logstr,
       sizeof(logstr),
-      "Error creating shared memory: %s",
+      "Error creating wake signalfd: %s",
       strerror(errno)
     );
     log(ERROR, logstr);
     perform_cleanup();
+    return -errno;
   }
+  cleanup.signal_fd = signal_fd;
 
-  void* frameset_buf = mmap(
-    NULL,
-    shm_size,
-    PROT_WRITE,
-    MAP_SHARED,
-    shm_fd,
-    0
+  for (int i = 0; i <= cam_count + 1; i++) {
+    struct epoll_event ev = {
+      .events = EPOLLIN,
+      .data.u32 = i // cam_count is the timer, cam_count + 1 the signalfd
+    };
+    ret = epoll_ctl(
+      epoll_fd,
+      EPOLL_CTL_ADD,
+      i < cam_count ? filled_evs[i].fd : i == cam_count ? timer_fd : signal_fd,
+      &ev
+    );
+    if (ret == -1) {
+      snprintf(
+        logstr,
+        sizeof(logstr),
+        "Error adding fd to epoll: %s",
+        strerror(errno)
+      );
+      log(ERROR, logstr);
+      perform_cleanup();
+      return -errno;
+    }
+  }
+
+  struct stream_ctx* decode_streams = state.decode_streams;
+  for (int i = 0; i < cam_count; i++) {
+    decode_streams[i].conf = &confs[i];
+    decode_streams[i].filled_pkts = &filled_pkt_consumer_qs[i];
+    decode_streams[i].empty_pkts = &empty_pkt_producer_qs[i];
+    decode_streams[i].empty_pkt_ev = &empty_pkt_evs[i];
+    decode_streams[i].filled_bufs = &filled_frame_producer_qs[i];
+    decode_streams[i].empty_bufs = &empty_frame_consumer_qs[i];
+    decode_streams[i].filled_ev = &filled_evs[i];
+    decode_streams[i].metrics = telemetry_cam(&telemetry, i);
+  }
+
+  struct decode_pool decode_pool;
+  ret = init_decode_pool(
+    &decode_pool,
+    decode_streams,
+    cam_count,
+    main_thread
   );
-  if (frameset_buf == MAP_FAILED) {
+  cleanup.decode_pool = &decode_pool;
+  if (ret) {
+    perform_cleanup();
+    return ret;
+  }
+
+  // a group's workers park on its own event, see stream_mgr.h
+  struct pool_event* work_evs = state.work_evs;
+  for (uint32_t g = 0; g < plan.group_count; g++)
+    pool_event_init(&work_evs[g]);
+  cleanup.work_evs = work_evs;
+  cleanup.work_ev_count = plan.group_count;
+
+  // written by a worker each time a stream has been fully drained,
+  // then the reports the cameras send, see metrics.h, and their
+  // acknowledgements of control commands, see cam_ctl.h
+  for (int i = 0; i < 3; i++) {
+    struct epoll_event ev = {
+      .events = EPOLLIN,
+      .data.u32 = cam_count + 2 + i
+    };
+    ret = epoll_ctl(
+      epoll_fd,
+      EPOLL_CTL_ADD,
+      i == 0 ? decode_pool.ended_fd : i == 1 ? telemetry.stats_fd : cam_ctl.fd,
+      &ev
+    );
+    if (ret == -1) {
+      snprintf(
+        logstr,
+        sizeof(logstr),
+        "Error adding fd to epoll: %s",
+        strerror(errno)
+      );
+      log(ERROR, logstr);
+      perform_cleanup();
+      return -errno;
+    }
+  }
+
+  struct thread_ctx* ctxs = state.ctxs;
+  pthread_t* threads = state.threads;
+  cleanup.threads = threads;
+  for (uint32_t g = 0, i = 0; g < plan.group_count; g++) {
+    struct placement_group* group = &plan.groups[g];
+    for (uint32_t j = 0; j < group->worker_count; j++, i++) {
+      ctxs[i].pool = &decode_pool;
+      ctxs[i].core = group->worker_cores[j];
+      ctxs[i].first_stream = group->first_cam;
+      ctxs[i].stream_count = group->cam_count;
+      ctxs[i].work_ev = &work_evs[g];
+
+      ret = pthread_create(
+        &threads[i],
+        NULL,
+        stream_mgr_fn,
+        (void*)&ctxs[i]
+      );
+
+      if (ret) {
+        log(ERROR, "Error spawning thread");
+        perform_cleanup();
+        return ret;
+      }
+
+      cleanup.thread_count++;
+    }
+  }
+
+  int ingest_stop_fd = eventfd(0, EFD_CLOEXEC);
+  if (ingest_stop_fd == -1) {
     snprintf(
       logstr,
       sizeof(logstr),
-      "Error mapping shared memory: %s",
+      "Error creating ingest stop eventfd: %s",
       strerror(errno)
     );
     log(ERROR, logstr);
     perform_cleanup();
+    return -errno;
   }
-  cleanup.frameset_buf = frameset_buf;
+  cleanup.ingest_stop_fd = ingest_stop_fd;
 
-  struct timespec ts;
-  clock_gettime(CLOCK_REALTIME, &ts);
-  uint64_t timestamp = (ts.tv_sec + TIMESTAMP_DELAY) * 1000000000ULL + ts.tv_nsec;
-  broadcast_msg(confs, cam_count, (char*)&timestamp, sizeof(timestamp));
+  struct recorder recorder;
+  if (record_dir) {
+    ret = init_recorder(&recorder, record_dir, confs, cam_count);
+    if (ret) {
+      perform_cleanup();
+      return ret;
+    }
+    cleanup.recorder = &recorder;
+  }
 
-  struct ts_frame_buf* current_frames[cam_count];
-  memset(current_frames, 0, sizeof(struct ts_frame_buf*) * cam_count);
+  struct ingest_stream* streams = state.ingest_streams;
+  for (int i = 0; i < cam_count; i++) {
+    streams[i].conf = &confs[i];
+    streams[i].cam = i;
+    streams[i].filled_pkts = &filled_pkt_producer_qs[i];
+    streams[i].empty_pkts = &empty_pkt_consumer_qs[i];
+    streams[i].empty_ev = &empty_pkt_evs[i];
+    streams[i].recorder = cleanup.recorder;
+    streams[i].metrics = telemetry_cam(&telemetry, i);
+    streams[i].live = live;
+    atomic_store_explicit(&streams[i].degraded, false, memory_order_relaxed);
 
-  // reuse ts for our sleep timer to prevent busy waiting
-  ts.tv_sec = 0;
-  ts.tv_nsec = EMPTY_QS_WAIT;
+    // the live stream is decoded and full resolution recorded, see ingest.h,
+    // and a camera only sends what's used
+    streams[i].streams = 0;
+    if (live)
+      streams[i].streams |= STREAM_BIT(confs[i].live_stream);
+    if (record_dir)
+      streams[i].streams |= STREAM_BIT(STREAM_MAIN);
+    streams[i].primary = live ? confs[i].live_stream : STREAM_MAIN;
+    cam_ctl_subscribe(&cam_ctl, i, streams[i].streams);
+  }
 
-  while (running) {
-    // dequeue a full set of timestamped frame buffers from each worker thread
-    bool full_set = true;
-    for(int i = 0; i < cam_count; i++) {
-      if (current_frames[i] != NULL)
-        continue; // already set
+  // a packet wakes a worker of the group decoding its camera
+  for (uint32_t g = 0; g < plan.group_count; g++) {
+    struct placement_group* group = &plan.groups[g];
+    for (uint32_t i = group->first_cam; i < group->first_cam + group->cam_count; i++)
+      streams[i].work_ev = &work_evs[g];
+  }
 
-      current_frames[i] = spsc_dequeue(&filled_frame_consumer_qs[i]);
+  cleanup.ingest_threads = state.ingest_threads;
+  cleanup.ingest_start_fds = state.ingest_start_fds;
+  for (int i = 0; i < ingest_count; i++) {
+    struct placement_group* group = &plan.groups[i];
+    struct ingest_ctx* ingest_ctx = &state.ingest_ctxs[i];
 
-      if (current_frames[i] == NULL) {
-        full_set = false; // queue empty
-        continue;
-      }
+    // unlike the stop event, each thread reads its own start event
+    state.ingest_start_fds[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (state.ingest_start_fds[i] == -1) {
+      snprintf(
+        logstr,
+        sizeof(logstr),
+        "Error creating ingest start eventfd: %s",
+        strerror(errno)
+      );
+      log(ERROR, logstr);
+      perform_cleanup();
+      return -errno;
     }
+    cleanup.ingest_start_count++;
 
-    if (!full_set) { // need a full set to proceed
-      nanosleep(&ts, NULL);
-      continue;
+    ingest_ctx->streams = plan.shared_ingest ? streams : streams + group->first_cam;
+    ingest_ctx->stream_count = plan.shared_ingest ? (uint32_t)cam_count : group->cam_count;
+    ingest_ctx->core = group->ingest_core;
+    ingest_ctx->main_thread = main_thread;
+    ingest_ctx->stop_fd = ingest_stop_fd;
+    ingest_ctx->start_fd = state.ingest_start_fds[i];
+    atomic_init(&ingest_ctx->stopping, false);
+
+    ret = pthread_create(
+      &state.ingest_threads[i],
+      NULL,
+      ingest_fn,
+      (void*)ingest_ctx
+    );
+    if (ret) {
+      log(ERROR, "Error spawning ingest thread");
+      perform_cleanup();
+      return ret;
     }
+    cleanup.ingest_count++;
+  }
+
+  // set up before the cameras are started, it rejects frame rates that don't line up,
+  // each session then moves it onto its own schedule
+  struct assembler assembler;
+  ret = init_assembler(
+    &assembler,
+    cam_count,
+    0,
+    state.cam_fps,
+    FRAMESET_DEADLINE,
+    PARTIAL_FRAMESETS,
+    empty_frame_producer_qs
+  );
+  if (ret) {
+    perform_cleanup();
+    return ret;
+  }
+  cleanup.assembler = &assembler;
+
+  struct rate_ctl rate_ctl;
+
+  struct ts_frame_buf** current_frames = state.current_frames;
+
+  // buffers referenced by each ring slot, held until the slot is reused,
+  // the arena comes zeroed so none are held yet
+  struct ts_frame_buf** published_frames = state.published_frames;
+
+  struct epoll_event* events = state.events;
+  uint64_t armed_deadline = UINT64_MAX;
 
-    // find the max timestamp
-    uint64_t max_timestamp = 0;
-    for (int i = 0; i < cam_count; i++) {
-      if (current_frames[i]->timestamp > max_timestamp)
-        max_timestamp = current_frames[i]->timestamp;
+  /**
+   * A session runs from arming the cameras with a start timestamp
+   * until every camera's stream has ended and been drained. Without -d
+   * the server runs a single session and exits. With -d it stays
+   * resident, running a session whenever a consumer is attached and
+   * stopping the cameras once none are, so the decoders, frame pool
+   * and sockets that take most of startup are only set up once.
+   *
+   * A session starts cam_ctl_lead ahead of being armed, but no less
+   * than SESSION_START_DELAY. The first waits up to CTL_PING_WAIT for
+   * every camera to answer a ping so there's a latency to go on, and
+   * falls back to TIMESTAMP_DELAY if some camera doesn't.
+   */
+  bool session = false;
+  bool stopping = false; // STOP was sent, waiting on the streams to end
+  bool wake = false; // a consumer attached or detached
+  uint64_t session_ts = 0; // the schedule's start, what a camera rejoins on
+  uint64_t next_rejoin = 0;
+  struct timespec idle_ts;
+  clock_gettime(CLOCK_MONOTONIC, &idle_ts);
+  uint64_t idle_since = idle_ts.tv_sec * 1000000000ULL + idle_ts.tv_nsec;
+  uint64_t next_consumer_check = 0;
+  uint64_t ping_deadline = idle_since + CTL_PING_WAIT;
+
+  // the schedule is laid out at the fastest camera's rate, see assembler.h
+  uint16_t rig_fps = 0;
+  for (int i = 0; i < cam_count; i++) {
+    if (confs[i].fps > rig_fps)
+      rig_fps = confs[i].fps;
+  }
+
+  while (running) {
+    struct timespec now_ts;
+    clock_gettime(CLOCK_MONOTONIC, &now_ts);
+    uint64_t now = now_ts.tv_sec * 1000000000ULL + now_ts.tv_nsec;
+
+    bool check_consumers = resident && (wake || now >= next_consumer_check);
+    bool attached = false;
+    if (check_consumers) {
+      attached = consumers_attached(frameset_hdr);
+      next_consumer_check = now + RESIDENT_POLL_MS * 1000000ULL;
+      wake = false;
     }
 
-    // check if all have matching timestamps
-    bool all_equal = true;
-    for (int i = 0; i < cam_count; i++) {
-      if (current_frames[i]->timestamp != max_timestamp) {
-        all_equal = false;
-        spsc_enqueue(&empty_frame_producer_qs[i], current_frames[i]);
-        current_frames[i] = NULL; // get a new timestamped buffer
+    cam_ctl_update(&cam_ctl, now);
+    uint64_t lead = cam_ctl_lead(&cam_ctl);
+
+    if (!session && (!resident || attached) && (lead || now >= ping_deadline)) {
+      struct timespec real_ts;
+      clock_gettime(CLOCK_REALTIME, &real_ts);
+      uint64_t delay = !lead ? TIMESTAMP_DELAY * 1000000000ULL :
+                       lead < SESSION_START_DELAY ? SESSION_START_DELAY : lead;
+      uint64_t timestamp = real_ts.tv_sec * 1000000000ULL + real_ts.tv_nsec + delay;
+
+      // the previous session is fully drained, so nothing is left in flight
+      assembler_reset(&assembler, timestamp);
+      init_rate_ctl(&rate_ctl, state.rate_cams, state.rate_msgs, cam_count, now);
+      atomic_store_explicit(&decode_pool.ended_count, 0, memory_order_relaxed);
+
+      // the listening sockets are open, so a camera connecting first just waits to be accepted
+      for (int i = 0; i < ingest_count; i++) {
+        uint64_t one = 1;
+        atomic_store_explicit(&state.ingest_ctxs[i].stopping, false, memory_order_relaxed);
+        ssize_t len = write(state.ingest_start_fds[i], &one, sizeof(one));
+        (void)len;
       }
+
+      cam_ctl_arm(&cam_ctl, timestamp, rig_fps, UINT64_MAX, now);
+      log_fmt(INFO, "Started session with timestamp %lu, %lu ms ahead", timestamp, delay / 1000000);
+      session_ts = timestamp;
+      metrics_add(&telemetry.hdr->sessions, 1);
+      session = true;
+      stopping = false;
     }
 
-    if (!all_equal)
-      continue;
+    int timeout = RESIDENT_POLL_MS;
+    if (session) {
+      // read first, a stream counts as ended only once its frames are all queued
+      bool ended = atomic_load_explicit(&decode_pool.ended_count, memory_order_acquire) == (uint32_t)cam_count;
 
-    snprintf(
-      logstr,
-      sizeof(logstr),
-      "Received frameset with timestamp %lu",
-      max_timestamp
-    );
-    log(DEBUG, logstr);
+      // hand every decoded frame to the assembler as it arrives,
+      // its skew is measured against this pass, not the decoder
+      bool received = false;
+      for (int i = 0; i < cam_count; i++) {
+        struct metrics_cam* cam_metrics = telemetry_cam(&telemetry, i);
+        struct ts_frame_buf* frame;
+        while ((frame = spsc_dequeue(&filled_frame_consumer_qs[i])) != NULL) {
+          // before the frame is handed over, a late one goes straight back
+          telemetry_exposure(&telemetry, i, frame->timestamp, frame->sensor_ts);
+          uint64_t skew = assembler_add(&assembler, i, frame, now);
+          if (skew == ASSEMBLER_LATE)
+            metrics_add(&cam_metrics->frames_late, 1);
+          else
+            metrics_observe(&cam_metrics->arrival_skew, skew);
+          received = true;
+        }
+      }
 
-    // check if consumer_ready here
-    int consumer_ready_val;
-    sem_getvalue(consumer_ready, &consumer_ready_val);
-    if (consumer_ready_val == 0) { // consumer is waiting on sem
+      // framesets don't wait on a camera whose stream is down, see ingest.h
+      uint64_t degraded = 0;
       for (int i = 0; i < cam_count; i++) {
-        memcpy(
-          frameset_buf + (i * frame_buf_size),
-          current_frames[i]->frame_buf,
-          frame_buf_size
+        if (atomic_load_explicit(&streams[i].degraded, memory_order_relaxed))
+          degraded |= 1ULL << i;
+      }
+      assembler_set_degraded(&assembler, degraded);
+
+      // a camera that lost its connection drops the session, armed with
+      // the same timestamp again it picks up at the current slot of the schedule
+      if (degraded && !stopping && now >= next_rejoin) {
+        cam_ctl_arm(&cam_ctl, session_ts, rig_fps, degraded, now);
+        next_rejoin = now + REJOIN_INTERVAL;
+      }
+
+      // once every stream has ended, nothing pending will be filled in
+      uint64_t assemble_now = ended ? UINT64_MAX : now;
+      uint64_t frameset_ts;
+      uint64_t cam_mask;
+      bool published = false;
+      while (assembler_next(&assembler, assemble_now, current_frames, &frameset_ts, &cam_mask)) {
+        log_fmt(
+          DEBUG,
+          "Received frameset with timestamp %lu, camera mask %lx",
+          frameset_ts,
+          cam_mask
         );
+
+        bool leased = !publish_frameset(
+          frameset_buf,
+          frameset_hdr,
+          current_frames,
+          published_frames,
+          empty_frame_producer_qs,
+          frameset_ts,
+          cam_mask
+        );
+        uint64_t lease_drops = atomic_load_explicit(&frameset_hdr->lease_drops, memory_order_relaxed);
+        if (leased && (lease_drops == 1 || lease_drops % LEASE_DROP_LOG_INTERVAL == 0)) {
+          log_fmt(
+            WARNING,
+            "Dropped frameset with timestamp %lu, its slot is still leased by a consumer, %lu dropped so far",
+            frameset_ts,
+            lease_drops
+          );
+        }
+        if (!leased)
+          metrics_add(&telemetry.hdr->framesets_published, 1);
+        published = true;
+      }
+
+      // the assembler and publish_frameset hand buffers back to the decoders
+      for (uint32_t g = 0; g < plan.group_count; g++)
+        pool_notify(&work_evs[g]);
+
+      if (ended) {
+        log(INFO, "Every stream has ended, session finished");
+        session = false;
+        idle_since = now;
+        if (!resident)
+          break;
+        continue;
       }
-      uint64_t* timestamp_ptr = frameset_buf + (frame_buf_size * cam_count);
-      *timestamp_ptr = max_timestamp;
-      sem_post(consumer_ready);
+
+      // the cameras are winding down, there's nothing left to adapt
+      if (!stopping) {
+        rate_ctl_update(
+          &rate_ctl,
+          confs,
+          decode_streams,
+          filled_pkt_consumer_qs,
+          &assembler,
+          now
+        );
+      }
+      telemetry_sample(&telemetry, &rate_ctl, &assembler, frameset_hdr);
+
+      if (check_consumers && !attached && !stopping) {
+        // every camera stops on the same frame, so the last framesets are whole
+        struct timespec real_ts;
+        clock_gettime(CLOCK_REALTIME, &real_ts);
+        uint64_t stop_ts = lead ? real_ts.tv_sec * 1000000000ULL + real_ts.tv_nsec + lead : 0;
+        log(INFO, "No consumers attached, stopping the cameras");
+        cam_ctl_stop(&cam_ctl, stop_ts, now);
+        stopping = true;
+
+        // a camera degraded now won't rejoin, its ingest thread settles its end
+        for (int i = 0; i < ingest_count; i++)
+          atomic_store_explicit(&state.ingest_ctxs[i].stopping, true, memory_order_relaxed);
+      }
+
+      if (received || published)
+        continue; // keep draining until there's nothing left to do
+
+      uint64_t deadline = assembler_deadline(&assembler);
+      if (deadline != armed_deadline) {
+        struct itimerspec its = { 0 }; // zero disarms the timer
+        if (deadline != UINT64_MAX) {
+          its.it_value.tv_sec = deadline / 1000000000ULL;
+          its.it_value.tv_nsec = deadline % 1000000000ULL;
+        }
+        timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+        armed_deadline = deadline;
+      }
+
+      bool parked = true;
+      for (int i = 0; i < cam_count && parked; i++) {
+        if (!spsc_park(&filled_evs[i], &filled_frame_consumer_qs[i])) {
+          parked = false; // a frame arrived while parking
+          for (int j = 0; j < i; j++)
+            atomic_store_explicit(&filled_evs[j].parked, false, memory_order_relaxed);
+        }
+      }
+      if (!parked)
+        continue;
+
+      // woken for nothing else, the rate controller still runs on schedule
+      int rate_timeout = rate_ctl_timeout(&rate_ctl, now);
+      timeout = !resident || rate_timeout < timeout ? rate_timeout : timeout;
+    } else if (now - idle_since > RESIDENT_IDLE_TIMEOUT * 1000000000ULL) {
+      log(INFO, "No consumer attached for too long, exiting");
+      break;
     }
 
-    // get a new full set
-    for (int i = 0; i < cam_count; i++) {
-      spsc_enqueue(&empty_frame_producer_qs[i], current_frames[i]);
-      current_frames[i] = NULL;
+    int ctl_timeout = cam_ctl_timeout(&cam_ctl, now);
+    if (ctl_timeout < timeout)
+      timeout = ctl_timeout;
+
+    int ready = epoll_wait(epoll_fd, events, cam_count + 5, timeout);
+    for (int i = 0; i < ready; i++) {
+      uint32_t id = events[i].data.u32;
+      if (id == (uint32_t)cam_count) {
+        uint64_t expirations;
+        ssize_t len = read(timer_fd, &expirations, sizeof(expirations));
+        (void)len;
+        armed_deadline = UINT64_MAX; // a fired timer is disarmed
+      } else if (id == (uint32_t)cam_count + 1) {
+        struct signalfd_siginfo info;
+        while (read(signal_fd, &info, sizeof(info)) == sizeof(info))
+          wake = true;
+      } else if (id == (uint32_t)cam_count + 2) {
+        uint64_t count;
+        ssize_t len = read(decode_pool.ended_fd, &count, sizeof(count));
+        (void)len; // the count itself is in the pool
+      } else if (id == (uint32_t)cam_count + 3) {
+        telemetry_recv(&telemetry);
+      } else if (id == (uint32_t)cam_count + 4) {
+        cam_ctl_recv(&cam_ctl);
+      } else {
+        spsc_unpark(&filled_evs[id]);
+      }
     }
+
+    // the rest weren't signaled, so there's nothing to drain
+    for (int i = 0; i < cam_count; i++)
+      atomic_store_explicit(&filled_evs[i].parked, false, memory_order_relaxed);
   }
 
-  // stop the camera devices
-  const char* stop_msg = "STOP";
-  broadcast_msg(confs, cam_count, stop_msg, strlen(stop_msg));
+  // stop the camera devices, there's no one left to repeat it, so it's sent a few times
+  if (session) {
+    struct timespec now_ts;
+    clock_gettime(CLOCK_MONOTONIC, &now_ts);
+    uint64_t now = now_ts.tv_sec * 1000000000ULL + now_ts.tv_nsec;
+    for (int i = 0; i < CTL_LEAD_REPEATS; i++)
+      cam_ctl_stop(&cam_ctl, 0, now);
+  }
 
   perform_cleanup();
   return ret;
@@ -392,35 +1140,354 @@ static void shutdown_handler(int signum) {
   running = 0;
 }
 
+static bool layout_state(
+  struct arena* arena,
+  struct server_state* state,
+  uint32_t cam_count,
+  uint32_t worker_count,
+  uint32_t ingest_count,
+  uint32_t group_count,
+  uint32_t slot_count
+) {
+  /**
+   * Carves the server's per camera state out of the startup arena
+   *
+   * Called once on an arena that's only sizing to find how large it
+   * must be, then again on the mapped arena to fill in the pointers.
+   * Queue structs and their buffers keep the cache line alignment the
+   * stack arrays had.
+   *
+   * Returns:
+   * - bool: false if the arena ran out, always the case while sizing
+   */
+  #define carve(field, count) \
+    state->field = arena_alloc( \
+      arena, \
+      sizeof(*state->field) * (count), \
+      _Alignof(__typeof__(*state->field)) > CACHE_LINE_SIZE ? \
+        _Alignof(__typeof__(*state->field)) : CACHE_LINE_SIZE \
+    )
+
+  carve(confs, cam_count);
+  carve(cam_fps, cam_count);
+  carve(frame_bufs, cam_count * FRAME_BUFS_PER_THREAD);
+  carve(frame_q_bufs, cam_count * FRAME_BUFS_PER_THREAD * 2);
+  carve(filled_frame_pqs, cam_count);
+  carve(filled_frame_cqs, cam_count);
+  carve(empty_frame_pqs, cam_count);
+  carve(empty_frame_cqs, cam_count);
+  carve(packets, cam_count * PACKETS_PER_CAM);
+  carve(pkt_q_bufs, cam_count * PACKET_Q_SIZE * 2);
+  carve(filled_pkt_pqs, cam_count);
+  carve(filled_pkt_cqs, cam_count);
+  carve(empty_pkt_pqs, cam_count);
+  carve(empty_pkt_cqs, cam_count);
+  carve(queue_evs, cam_count * 2);
+  carve(decode_streams, cam_count);
+  carve(ingest_streams, cam_count);
+  carve(ctxs, worker_count);
+  carve(work_evs, group_count);
+  carve(threads, worker_count);
+  carve(ingest_ctxs, ingest_count);
+  carve(ingest_threads, ingest_count);
+  carve(ingest_start_fds, ingest_count);
+  carve(current_frames, cam_count);
+  carve(published_frames, slot_count * cam_count);
+  carve(events, cam_count + 5);
+  carve(rate_cams, cam_count);
+  carve(rate_msgs, cam_count);
+  carve(ctl_cams, cam_count);
+
+  #undef carve
+
+  return arena->base && arena->used <= arena->size;
+}
+
+static void touch_frame_pools(
+  void* shm,
+  const struct frameset_shm_header* hdr,
+  const struct topology* topo,
+  const struct placement* plan
+) {
+  /**
+   * Faults in each camera's frame pool run from its group's L3 domain
+   *
+   * Shared memory pages are placed on the node of the thread that first
+   * touches them, so the main thread moves to each domain in turn and
+   * zeroes the runs of the cameras decoded there, before returning to
+   * its own CPU. A device pool has nothing to touch.
+   */
+#ifdef CUDA_FRAMESETS
+  (void)shm;
+  (void)hdr;
+  (void)topo;
+  (void)plan;
+#else
+  cpu_set_t own;
+  if (sched_getaffinity(0, sizeof(own), &own) == -1)
+    return;
+
+  for (uint32_t g = 0; g < plan->group_count; g++) {
+    const struct placement_group* group = &plan->groups[g];
+    const struct cache_domain* domain = &topo->domains[group->domain];
+    if (sched_setaffinity(0, sizeof(domain->cpus), &domain->cpus) == -1)
+      continue; // still touched, just without the locality
+
+    for (uint32_t i = group->first_cam; i < group->first_cam + group->cam_count; i++) {
+      const struct frameset_cam* cam = frameset_get_cam(shm, i);
+      memset(frameset_pool_frame(shm, hdr, i, 0), 0, cam->frame_stride * cam->frame_count);
+    }
+  }
+
+  sched_setaffinity(0, sizeof(own), &own);
+#endif
+}
+
+static bool slot_leased(struct frameset_shm_header* hdr, uint32_t slot_idx) {
+  /**
+   * Checks whether any live consumer holds a lease on a ring slot
+   *
+   * Only called for the slot about to be reused, and only a consumer
+   * holding that slot is checked for liveness, so a consumer that died
+   * mid lease is reclaimed the first time it would get in the way.
+   */
+  uint64_t bit = 1ULL << slot_idx;
+  for (int i = 0; i < FRAMESET_MAX_CONSUMERS; i++) {
+    struct frameset_consumer* consumer = &hdr->consumers[i];
+    uint32_t pid = atomic_load_explicit(&consumer->pid, memory_order_seq_cst);
+    if (!pid || !(atomic_load_explicit(&consumer->leases, memory_order_seq_cst) & bit))
+      continue;
+
+    if (kill((pid_t)pid, 0) == -1 && errno == ESRCH) {
+      log_fmt(WARNING, "Reclaimed the leases of consumer %u, which exited without releasing them", pid);
+      // its stale leases are ignored once the entry is free, and reset by the next claimant
+      atomic_compare_exchange_strong(&consumer->pid, &pid, 0);
+      continue;
+    }
+
+    return true;
+  }
+
+  return false;
+}
+
+static bool consumers_attached(struct frameset_shm_header* hdr) {
+  /**
+   * Checks whether any live consumer holds an entry in the consumer table
+   *
+   * The entry of a consumer that exited without releasing it is freed,
+   * as slot_leased would once it got in the way.
+   */
+  for (int i = 0; i < FRAMESET_MAX_CONSUMERS; i++) {
+    struct frameset_consumer* consumer = &hdr->consumers[i];
+    uint32_t pid = atomic_load_explicit(&consumer->pid, memory_order_acquire);
+    if (!pid)
+      continue;
+
+    if (kill((pid_t)pid, 0) == -1 && errno == ESRCH) {
+      log_fmt(WARNING, "Freed the entry of consumer %u, which exited without releasing it", pid);
+      atomic_compare_exchange_strong(&consumer->pid, &pid, 0);
+      continue;
+    }
+
+    return true;
+  }
+
+  return false;
+}
+
+static int32_t exposure_offset(const struct ts_frame_buf* frame, uint64_t timestamp) {
+  /**
+   * Returns how far after the frameset's timestamp a frame's exposure
+   * started, saturated to what a slot holds
+   */
+  if (!frame || !frame->sensor_ts)
+    return FRAMESET_NO_OFFSET;
+
+  int64_t offset = (int64_t)(frame->sensor_ts - timestamp);
+  if (offset > INT32_MAX)
+    return INT32_MAX;
+  if (offset <= INT32_MIN)
+    return INT32_MIN + 1;
+  return (int32_t)offset;
+}
+
+static bool publish_frameset(
+  void* shm,
+  struct frameset_shm_header* hdr,
+  struct ts_frame_buf** frames,
+  struct ts_frame_buf** published_frames,
+  struct producer_q* empty_qs,
+  uint64_t timestamp,
+  uint64_t cam_mask
+) {
+  /**
+   * Publishes a frameset into the next slot of the shared memory ring
+   *
+   * No frame data is copied, the slot only records which frame pool
+   * buffer holds each camera's frame, and how far off the frameset's
+   * timestamp its exposure started. The ring never waits on consumers,
+   * the slot for frameset n is simply reused, and a consumer more than
+   * slot_count framesets behind detects this through the slot seqlock
+   * (see frameset_shm.h) and skips ahead.
+   *
+   * The only exception is a slot a consumer still holds a lease on,
+   * which is left intact, and the new frameset is dropped instead with
+   * its buffers handed straight back.
+   *
+   * The buffers of the frameset previously held by the slot are only
+   * returned to their decoder's empty queue after the slot sequence has
+   * been zeroed, so a consumer reading them in place can always tell
+   * whether they were recycled underneath it. The new frameset's buffers
+   * stay out of circulation until this slot comes around again.
+   *
+   * Parameters:
+   * - void* shm: the mapped shared memory segment
+   * - struct frameset_shm_header* hdr: the segment header
+   * - struct ts_frame_buf** frames: one filled buffer per camera, or NULL
+   * - struct ts_frame_buf** published_frames: buffers held per ring slot
+   * - struct producer_q* empty_qs: the per camera empty buffer queues
+   * - uint64_t timestamp: the timestamp shared by the frameset
+   * - uint64_t cam_mask: the cameras present, the rest of frames are NULL
+   *
+   * Returns:
+   * - bool: false if the frameset was dropped because its slot is leased
+   */
+  uint64_t seq = atomic_load_explicit(&hdr->write_seq, memory_order_relaxed);
+  struct frameset_slot* slot = frameset_get_slot(shm, hdr, seq);
+  struct ts_frame_buf** held = published_frames + (seq % hdr->slot_count) * hdr->cam_count;
+
+  // pairs with the consumer setting its lease bit then rereading the sequence
+  uint64_t prev_seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+  atomic_store_explicit(&slot->seq, 0, memory_order_seq_cst);
+  if (slot_leased(hdr, seq % hdr->slot_count)) {
+    atomic_store_explicit(&slot->seq, prev_seq, memory_order_release);
+    for (uint32_t i = 0; i < hdr->cam_count; i++) {
+      if (frames[i])
+        spsc_enqueue(&empty_qs[i], frames[i]);
+    }
+    atomic_fetch_add_explicit(&hdr->lease_drops, 1, memory_order_relaxed);
+    return false;
+  }
+
+  uint32_t* bufs = frameset_slot_bufs(slot);
+  int32_t* offsets = frameset_slot_offsets(slot, hdr->cam_count);
+  for (uint32_t i = 0; i < hdr->cam_count; i++) {
+    if (held[i])
+      spsc_enqueue(&empty_qs[i], held[i]);
+
+    held[i] = frames[i];
+    bufs[i] = frames[i] ? frames[i]->idx : FRAMESET_NO_FRAME;
+    offsets[i] = exposure_offset(frames[i], timestamp);
+  }
+  slot->timestamp = timestamp;
+  slot->cam_mask = cam_mask;
+
+  atomic_store_explicit(&slot->seq, seq + 1, memory_order_release);
+  atomic_store_explicit(&hdr->write_seq, seq + 1, memory_order_release);
+
+  // pairs with a consumer counting itself in waiters before it checks write_seq
+  atomic_fetch_add_explicit(&hdr->notify, 1, memory_order_seq_cst);
+  if (atomic_load_explicit(&hdr->waiters, memory_order_seq_cst))
+    frameset_futex(&hdr->notify, FUTEX_WAKE, INT32_MAX, NULL);
+
+  for (uint32_t i = 0; i < hdr->cam_count; i++) {
+    if (frames[i])
+      TRACE_POINT(TRACE_ASSEMBLED, i, frames[i]->timestamp);
+  }
+
+  return true;
+}
+
 static void perform_cleanup() {
+  // tell attached consumers the segment is going away before anything stops
   if (cleanup.frameset_buf)
-    munmap(cleanup.frameset_buf, cleanup.shm_size);
+    ((struct frameset_shm_header*)cleanup.frameset_buf)->magic = 0;
 
-  if (cleanup.shm_fd >= 0) {
-    close(cleanup.shm_fd);
-    shm_unlink(SHM_NAME);
+  // stop ingest first so nothing is still feeding the decoders
+  // every ingest thread watches the same stop event, none of them reads it
+  if (cleanup.ingest_count) {
+    uint64_t one = 1;
+    ssize_t len = write(cleanup.ingest_stop_fd, &one, sizeof(one));
+    (void)len;
+    for (int i = 0; i < cleanup.ingest_count; i++)
+      pthread_join(cleanup.ingest_threads[i], NULL);
   }
 
-  if (cleanup.consumer_ready) {
-    sem_close(cleanup.consumer_ready);
-    sem_unlink(SEM_CONSUMER_READY);
-  }
+  if (cleanup.ingest_stop_fd >= 0)
+    close(cleanup.ingest_stop_fd);
+
+  for (int i = 0; i < cleanup.ingest_start_count; i++)
+    close(cleanup.ingest_start_fds[i]);
+
+  // ingest is joined, so nothing more will be recorded
+  if (cleanup.recorder)
+    cleanup_recorder(cleanup.recorder);
 
   if (cleanup.threads) {
     for (int i = 0; i < cleanup.thread_count; i++) {
       pthread_kill(cleanup.threads[i], SIGUSR2);
     }
 
+    // a worker the signal lands on just before it sleeps would miss it,
+    // closing the pool event makes sure none of them sleep again
+    for (int i = 0; i < cleanup.work_ev_count; i++)
+      pool_event_close(&cleanup.work_evs[i]);
+
     for (int i = 0; i < cleanup.thread_count; i++) {
       pthread_join(cleanup.threads[i], NULL);
     }
   }
 
-  if (cleanup.q_bufs)
-    free(cleanup.q_bufs);
+  // the decoders write into the frame pool, so it's only unmapped once they're joined
+  if (cleanup.frameset_buf)
+    munmap(cleanup.frameset_buf, cleanup.shm_size);
+
+  if (cleanup.shm_fd >= 0) {
+    close(cleanup.shm_fd);
+    shm_unlink(FRAMESET_SHM_NAME);
+  }
+
+  if (cleanup.cam_ctl)
+    cleanup_cam_ctl(cleanup.cam_ctl);
+
+  // every thread recording into the page is joined above
+  if (cleanup.telemetry)
+    cleanup_telemetry(cleanup.telemetry);
+
+  if (cleanup.assembler)
+    cleanup_assembler(cleanup.assembler);
+
+  if (cleanup.decode_pool)
+    cleanup_decode_pool(cleanup.decode_pool);
+
+  // the stream threads are joined above, so nothing can signal these anymore
+  for (int i = 0; i < cleanup.event_count; i++)
+    spsc_event_cleanup(&cleanup.events[i]);
+
+  if (cleanup.timer_fd >= 0)
+    close(cleanup.timer_fd);
+
+  if (cleanup.signal_fd >= 0)
+    close(cleanup.signal_fd);
+
+  if (cleanup.epoll_fd >= 0)
+    close(cleanup.epoll_fd);
+
+  // the decoders are joined and ingest is stopped, so no packet is in use
+  if (cleanup.packets)
+    cleanup_packet_bufs(cleanup.packets, cleanup.packet_count);
+
+#ifdef CUDA_FRAMESETS
+  // the decoder threads are joined above, so nothing is still copying into the pool
+  cleanup_gpu_pool(cleanup.gpu_pool);
+#endif
+
+  // every traced thread is joined above
+  TRACE_DUMP(TRACE_PATH);
 
-  if (cleanup.frame_bufs)
-    free(cleanup.frame_bufs);
+  // last, the events and thread handles above live in the arena
+  cleanup_arena(&cleanup.arena);
 
   if (cleanup.logging_initialized)
     cleanup_logging();
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <arpa/inet.h>
 #include <errno.h>
 #include <net/if.h>
@@ -13,9 +14,6 @@
 #include "logging.h"
 #include "network.h"
 
-#define ACCEPT_TIMEOUT 10 // 10 sec
-#define RECV_TIMEOUT 1 // 1 sec
-
 static bool is_eth_conn(int sockfd) {
   struct ifreq ifr;
   strncpy(ifr.ifr_name, "eno1", IFNAMSIZ);
@@ -29,7 +27,14 @@ static bool is_eth_conn(int sockfd) {
   return true;
 }
 
-int broadcast_msg(cam_conf* confs, int confs_size, const char* msg, size_t msg_size) {
+static int send_to_cams(
+  cam_conf* confs,
+  int confs_size,
+  const char* msgs,
+  size_t msg_size,
+  size_t stride,
+  bool* eth_conn_out
+) {
   int ret = 0;
   char logstr[128];
 
@@ -46,6 +51,8 @@ int broadcast_msg(cam_conf* confs, int confs_size, const char* msg, size_t msg_s
   }
 
   bool eth_conn = is_eth_conn(sockfd);
+  if (eth_conn_out)
+    *eth_conn_out = eth_conn;
 
   for (int i = 0; i < confs_size; i++) {
     struct sockaddr_in rcvr_addr;
@@ -57,7 +64,7 @@ int broadcast_msg(cam_conf* confs, int confs_size, const char* msg, size_t msg_s
                          confs[i].wifi_ip;
     ret = sendto(
       sockfd,
-      msg,
+      msgs + i * stride,
       msg_size,
       0,
       (struct sockaddr*)&rcvr_addr,
@@ -82,11 +89,30 @@ int broadcast_msg(cam_conf* confs, int confs_size, const char* msg, size_t msg_s
   return ret;
 }
 
+int send_cam_msgs(cam_conf* confs, int confs_size, const void* msgs, size_t msg_size, bool* eth_conn) {
+  /**
+   * Sends each camera a message of its own, over ethernet while the
+   * server's link is up and over wifi otherwise
+   *
+   * Parameters:
+   * - cam_conf* confs: the cameras
+   * - int confs_size: number of cameras
+   * - const void* msgs: confs_size messages back to back, one per camera
+   * - size_t msg_size: bytes per message
+   * - bool* eth_conn: receives whether they were sent over ethernet
+   *
+   * Returns:
+   * - int: non negative on success, or a negative error code
+   */
+  return send_to_cams(confs, confs_size, msgs, msg_size, msg_size, eth_conn);
+}
+
 int setup_stream(cam_conf* conf) {
   int ret = 0;
   char logstr[128];
 
-  int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+  // the ingest thread enforces its own accept and receive timeouts
+  int sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
   if (sockfd < 0) {
     snprintf(
       logstr,
@@ -117,28 +143,6 @@ int setup_stream(cam_conf* conf) {
     return -errno;
   }
 
-  struct timeval accept_timeout = {
-    .tv_sec = ACCEPT_TIMEOUT,
-    .tv_usec = 0
-  };
-  ret = setsockopt(
-    sockfd,
-    SOL_SOCKET,
-    SO_RCVTIMEO,
-    &accept_timeout,
-    sizeof(accept_timeout)
-  );
-  if (ret < 0) {
-    snprintf(
-      logstr,
-      sizeof(logstr),
-      "Error setting accept timeout: %s",
-      strerror(errno)
-    );
-    log(ERROR, logstr);
-    return -errno;
-  }
-
   struct sockaddr_in addr;
   memset(&addr, 0, sizeof(addr));
   addr.sin_family = AF_INET;
@@ -187,42 +191,23 @@ int accept_conn(int sockfd) {
   struct sockaddr_in rcvr_addr;
   socklen_t addr_len = sizeof(rcvr_addr);
 
-  int clientfd = accept(sockfd, (struct sockaddr*)&rcvr_addr, &addr_len);
+  int clientfd = accept4(
+    sockfd,
+    (struct sockaddr*)&rcvr_addr,
+    &addr_len,
+    SOCK_NONBLOCK | SOCK_CLOEXEC
+  );
   if (clientfd < 0) {
-    if (errno == EWOULDBLOCK) {
-      log(ERROR, "Accept connection timed out, no camera connected");
-      return -ETIMEDOUT;
-    }
-    snprintf(
-      logstr,
-      sizeof(logstr),
-      "Error accepting connection: %s",
-      strerror(errno)
-    );
-    log(ERROR, logstr);
-    return -errno;
-  }
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+      return -EAGAIN; // no camera waiting yet
 
-  struct timeval recv_timeout = {
-    .tv_sec = RECV_TIMEOUT,
-    .tv_usec = 0
-  };
-  int ret = setsockopt(
-    clientfd,
-    SOL_SOCKET,
-    SO_RCVTIMEO,
-    &recv_timeout,
-    sizeof(recv_timeout)
-  );
-  if (ret < 0) {
     snprintf(
       logstr,
       sizeof(logstr),
-      "Error setting receive timeout: %s",
+      "Error accepting connection: %s",
       strerror(errno)
     );
     log(ERROR, logstr);
-    close(clientfd);
     return -errno;
   }
 
@@ -230,19 +215,24 @@ int accept_conn(int sockfd) {
 }
 
 ssize_t recv_from_stream(int clientfd, char* buf, size_t size) {
+  /**
+   * Receives whatever is available on a nonblocking stream, up to size
+   *
+   * Returns:
+   * - ssize_t: bytes received, 0 if the client disconnected, -EAGAIN
+   *            if nothing is available, or a negative error code
+   */
   char logstr[128];
 
-  ssize_t bytes = recv(clientfd, buf, size, MSG_WAITALL);
+  ssize_t bytes = recv(clientfd, buf, size, 0);
   if (bytes == 0) {
     log(WARNING, "Client has disconnected");
     return 0;
   } else if (bytes < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+      return -EAGAIN;
     if (errno == EINTR)
       return -EINTR;
-    if (errno == EWOULDBLOCK) {
-      log(WARNING, "Timed out waiting for packet from client");
-      return -ETIMEDOUT;
-    }
 
     snprintf(
       logstr,
@@ -1,5 +1,7 @@
+#define _GNU_SOURCE
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <netinet/in.h>
 #include <stdbool.h>
 #include <stddef.h>
@@ -7,106 +9,22 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <yaml.h>
 
 #include "parse_conf.h"
 #include "logging.h"
+#include "stream_msg.h"
+#include "topology.h"
 
-static FILE* infile = NULL;
-
-int count_cameras(const char* fpath) {
-  /**
-   * Counts the instances of 'rpicam' substring appearing in the file
-   *
-   * If this succeeds, the file is cached and parse_conf will reuse it then clean it up
-   *
-   * Parameters:
-   * - const char* fpath: the file path of the camera conf
-   *
-   * Returns:
-   * - int: either a negative error code, or positive count of cameras
-   */
-  int ret = 0;
-  char logstr[128];
-
-  infile = fopen(fpath, "r");
-  if (!infile) {
-    snprintf(
-      logstr,
-      sizeof(logstr),
-      "Error opening file: %s",
-      strerror(errno)
-    );
-    log(ERROR, logstr);
-    ret = -errno;
-    goto err_cleanup;
-  }
-
-  yaml_parser_t parser;
-  yaml_event_t event;
-
-  ret = yaml_parser_initialize(&parser);
-  if (ret == 0) {
-    log(ERROR, "Error initializing yaml parser");
-    ret = -ENOMEM;
-    goto err_cleanup;
-  }
-  yaml_parser_set_input_file(&parser, infile);
-
-  int count = 0;
-  while (true) {
-    ret = yaml_parser_parse(&parser, &event);
-    if (ret == 0) {
-      log(ERROR, "Error parsing yaml file");
-      ret = -EINVAL;
-      goto err_cleanup;
-    }
-
-    if (event.type == YAML_STREAM_END_EVENT) {
-      if (count == 0) {
-        log(ERROR, "Found no cameras list");
-        ret = -EINVAL;
-        goto err_cleanup;
-      }
-
-      ret = count;
-      goto success_cleanup;
-    }
-
-    if (event.type != YAML_SCALAR_EVENT) {
-      yaml_event_delete(&event);
-      continue;
-    }
-
-    // count the occurences of 'rpicam'
-    if (strncmp((char*)event.data.scalar.value, "rpicam", 6) == 0) {
-      count++;
-    }
-
-    yaml_event_delete(&event);
-  }
-
-  err_cleanup:
-  if (infile) {
-    fclose(infile);
-  }
-
-  success_cleanup:
-  if (infile) {
-    rewind(infile);
-  }
-  yaml_parser_delete(&parser);
-  yaml_event_delete(&event);
-
-  return ret;
-}
+_Static_assert(sizeof(cam_conf) == 40, "cam_conf layout changed, bump RIG_CONF_VERSION");
 
 typedef int (*parser_fn)(const char* str, void* field);
 
 static int parse_str(const char* str, void* field) {
-  bool inval_name = (strcmp((char*)field, "name") == 0) &&
-                    (strlen(str) > CAM_NAME_LEN);
-  if (inval_name) {
+  // only the name is a string, and it must fit with its terminator
+  if (strlen(str) >= CAM_NAME_LEN) {
     return -EINVAL;
   }
 
@@ -128,31 +46,133 @@ static int parse_ipv4(const char* str, void* field) {
   return inet_pton(AF_INET, str, field) > 0 ? 0 : -EINVAL;
 }
 
+static int parse_dim(const char* str, void* field) {
+  // NV12 needs even dimensions, and the decoder rejects anything huge
+  int value = atoi(str);
+  if (value <= 0 || value > 8192 || value % 2)
+    return -EINVAL;
+
+  *(uint16_t*)field = value;
+  return 0;
+}
+
+static int parse_fps(const char* str, void* field) {
+  int value = atoi(str);
+  if (value <= 0 || value > 1000)
+    return -EINVAL;
+
+  *(uint16_t*)field = value;
+  return 0;
+}
+
 struct field_map {
   const char* name;
   size_t offset;
   parser_fn parser;
+  bool required;
 };
 
 static const struct field_map fields[] = {
-  {"name", offsetof(cam_conf, name), parse_str},
-  {"id", offsetof(cam_conf, id), parse_uint8},
-  {"eth_ip", offsetof(cam_conf, eth_ip), parse_ipv4},
-  {"wifi_ip", offsetof(cam_conf, wifi_ip), parse_ipv4},
-  {"tcp_port", offsetof(cam_conf, tcp_port), parse_uint16},
-  {"udp_port", offsetof(cam_conf, udp_port), parse_uint16},
+  {"name", offsetof(cam_conf, name), parse_str, true},
+  {"id", offsetof(cam_conf, id), parse_uint8, true},
+  {"eth_ip", offsetof(cam_conf, eth_ip), parse_ipv4, true},
+  {"wifi_ip", offsetof(cam_conf, wifi_ip), parse_ipv4, true},
+  {"tcp_port", offsetof(cam_conf, tcp_port), parse_uint16, true},
+  {"udp_port", offsetof(cam_conf, udp_port), parse_uint16, true},
+  {"width", offsetof(cam_conf, width), parse_dim, false},
+  {"height", offsetof(cam_conf, height), parse_dim, false},
+  {"fps", offsetof(cam_conf, fps), parse_fps, false},
+  {"preview_width", offsetof(cam_conf, preview_width), parse_dim, false},
+  {"preview_height", offsetof(cam_conf, preview_height), parse_dim, false},
 };
 
-int parse_conf(cam_conf* confs, int count) {
+static void set_defaults(cam_conf* conf) {
+  memset(conf, 0, sizeof(*conf));
+  conf->width = CAM_DEFAULT_WIDTH;
+  conf->height = CAM_DEFAULT_HEIGHT;
+  conf->fps = CAM_DEFAULT_FPS;
+}
+
+static int finish_conf(cam_conf* conf, int idx) {
   /**
-   * Parses the yaml file and populates the array of structs
+   * Settles which of the camera's streams is decoded, once every
+   * field is parsed
+   *
+   * Returns:
+   * - int: 0 on success, or -EINVAL if the preview isn't a smaller copy
+   */
+  if (!conf->preview_width != !conf->preview_height) {
+    log_fmt(ERROR, "Camera conf %d needs both of preview_width and preview_height", idx);
+    return -EINVAL;
+  }
+
+  if (
+    conf->preview_width > conf->width ||
+    conf->preview_height > conf->height
+  ) {
+    log_fmt(ERROR, "Camera conf %d has a preview larger than its frames", idx);
+    return -EINVAL;
+  }
+
+  bool preview = conf->preview_width != 0;
+  conf->live_stream = preview ? STREAM_PREVIEW : STREAM_MAIN;
+  conf->live_width = preview ? conf->preview_width : conf->width;
+  conf->live_height = preview ? conf->preview_height : conf->height;
+  return 0;
+}
+
+static int parse_cores(const char* str, struct rig_placement* placement, const char* key) {
+  /**
+   * Parses one of the placement mapping's CPU lists, see topology.h
+   *
+   * Returns:
+   * - int: 0 on success, or -EINVAL if the list is malformed, or
+   *        names more than one CPU for a single thread
+   */
+  cpu_set_t cpus;
+  int count = parse_cpu_list(str, &cpus);
+  bool single = strcmp(key, "decode_cores") != 0;
+  if (count <= 0 || (single && count != 1)) {
+    log_fmt(ERROR, "Invalid placement CPU list: %s", str);
+    return -EINVAL;
+  }
+
+  int first = 0;
+  while (!CPU_ISSET(first, &cpus))
+    first++;
+
+  if (strcmp(key, "main_core") == 0) {
+    placement->main_core = first;
+  } else if (strcmp(key, "ingest_core") == 0) {
+    placement->ingest_core = first;
+  } else {
+    memset(placement->decode_cores, 0, sizeof(placement->decode_cores));
+    for (int cpu = 0; cpu < RIG_CPU_WORDS * 64; cpu++) {
+      if (CPU_ISSET(cpu, &cpus))
+        placement->decode_cores[cpu / 64] |= 1ULL << (cpu % 64);
+    }
+    placement->decode_core_count = count;
+  }
+
+  return 0;
+}
+
+static int parse_yaml(FILE* infile, struct rig_conf* rig) {
+  /**
+   * Parses the yaml file into the snapshot in a single pass
    *
    * Agnostic to precise ordering of fields, but only finds
-   * those which are mapped in the field_map struct
+   * those which are mapped in the field_map struct. Each camera
+   * is a mapping of its own, finished when the mapping ends, so
+   * the optional fields can be left out, taking the CAM_DEFAULT
+   * values instead, and the cameras are counted as they're
+   * finished. A camera with a preview stream has the preview
+   * decoded, see cam_conf. The placement keys may sit anywhere
+   * outside the cameras, and are left unset when they're missing
    *
    * Parameters:
-   * - cam_conf* confs: an array of cam_conf structs
-   * - int count: the number of cam confs in the array
+   * - FILE* infile: the opened camera conf
+   * - struct rig_conf* rig: receives the cameras and placement
    *
    * Returns:
    * - int: either a negative error code, or 0 on success
@@ -160,28 +180,31 @@ int parse_conf(cam_conf* confs, int count) {
   int ret = 0;
   char logstr[128];
 
-  if (!infile) {
-    log(ERROR, "File not opened, call count_cameras first");
-    ret = -ENODATA;
-    goto cleanup;
-  }
-
   yaml_parser_t parser;
   yaml_event_t event;
+  memset(&event, 0, sizeof(event));
 
   ret = yaml_parser_initialize(&parser);
   if (ret == 0) {
     log(ERROR, "Error initializing yaml parser");
-    ret = -ENOMEM;
-    goto cleanup;
+    return -ENOMEM;
   }
   yaml_parser_set_input_file(&parser, infile);
 
-  int confs_parsed = 0;
-  int fields_parsed = 0;
+  static const char* placement_keys[] = { "main_core", "ingest_core", "decode_cores" };
+  const int placement_total = sizeof(placement_keys)/sizeof(placement_keys[0]);
+
+  uint32_t cam_count = 0;
+  uint32_t fields_parsed = 0; // bit i set once fields[i] is parsed
   const int fields_total = sizeof(fields)/sizeof(fields[0]);
 
-  while (confs_parsed < count) {
+  uint32_t required = 0;
+  for (int i = 0; i < fields_total; i++) {
+    if (fields[i].required)
+      required |= 1u << i;
+  }
+
+  while (true) {
 
     #define try_parse() \
     ret = yaml_parser_parse(&parser, &event); \
@@ -194,16 +217,42 @@ int parse_conf(cam_conf* confs, int count) {
     try_parse()
 
     if (event.type == YAML_STREAM_END_EVENT) {
-      snprintf(
-        logstr,
-        sizeof(logstr),
-        "File ended before parsing expected conf count: %u, parsed: %u",
-        count,
-        confs_parsed
-      );
-      log(ERROR, logstr);
-      ret = -EINVAL;
-      goto cleanup;
+      if (cam_count == 0) {
+        log(ERROR, "Found no cameras list");
+        ret = -EINVAL;
+        goto cleanup;
+      }
+      break;
+    }
+
+    // the end of a mapping holding camera fields is the end of that camera
+    if (event.type == YAML_MAPPING_END_EVENT && fields_parsed) {
+      if ((fields_parsed & required) != required) {
+        for (int i = 0; i < fields_total; i++) {
+          if ((required & ~fields_parsed) & (1u << i)) {
+            snprintf(
+              logstr,
+              sizeof(logstr),
+              "Camera conf %u is missing %s",
+              cam_count,
+              fields[i].name
+            );
+            log(ERROR, logstr);
+            break;
+          }
+        }
+        ret = -EINVAL;
+        goto cleanup;
+      }
+
+      ret = finish_conf(&rig->cams[cam_count], cam_count);
+      if (ret < 0)
+        goto cleanup;
+
+      fields_parsed = 0;
+      cam_count++;
+      yaml_event_delete(&event);
+      continue;
     }
 
     if (event.type != YAML_SCALAR_EVENT) {
@@ -215,15 +264,24 @@ int parse_conf(cam_conf* confs, int count) {
 
     for (int i = 0; i < fields_total; i++) {
       // check if we have a key
-      ret = strcmp(pstr, fields[i].name);
-      if (ret != 0) {
+      if (strcmp(pstr, fields[i].name) != 0)
         continue;
+
+      // the first field of a camera starts it
+      if (!fields_parsed) {
+        if (cam_count == RIG_MAX_CAMS) {
+          log_fmt(ERROR, "At most %d cameras are supported", RIG_MAX_CAMS);
+          ret = -EINVAL;
+          goto cleanup;
+        }
+        set_defaults(&rig->cams[cam_count]);
       }
 
+      yaml_event_delete(&event);
       try_parse() // get the value
-      void* field = (char*)&confs[confs_parsed] + fields[i].offset;
+      void* field = (char*)&rig->cams[cam_count] + fields[i].offset;
 
-      ret = fields[i].parser(pstr, field);
+      ret = event.type == YAML_SCALAR_EVENT ? fields[i].parser(pstr, field) : -EINVAL;
       if (ret < 0) {
         snprintf(
           logstr,
@@ -236,21 +294,173 @@ int parse_conf(cam_conf* confs, int count) {
         goto cleanup;
       }
 
-      if (++fields_parsed == fields_total) {
-        fields_parsed = 0;
-        confs_parsed++;
+      fields_parsed |= 1u << i;
+      goto next_event;
+    }
+
+    for (int i = 0; i < placement_total; i++) {
+      if (strcmp(pstr, placement_keys[i]) != 0)
+        continue;
+
+      yaml_event_delete(&event);
+      try_parse() // get the value
+
+      ret = event.type == YAML_SCALAR_EVENT ?
+        parse_cores(pstr, &rig->placement, placement_keys[i]) : -EINVAL;
+      if (ret < 0) {
+        log_fmt(ERROR, "Failed to parse %s", placement_keys[i]);
+        ret = -EINVAL;
+        goto cleanup;
       }
+      break;
     }
 
+    next_event:
     yaml_event_delete(&event);
   }
 
+  rig->cam_count = cam_count;
+  ret = 0;
+
   cleanup:
-  if (infile) {
-    fclose(infile);
-  }
   yaml_parser_delete(&parser);
   yaml_event_delete(&event);
 
   return ret;
 }
+
+static uint64_t mtime_ns(const struct stat* st) {
+  return (uint64_t)st->st_mtim.tv_sec * 1000000000ULL + st->st_mtim.tv_nsec;
+}
+
+static bool read_snapshot(const char* rig_path, const struct stat* yaml_st, struct rig_conf* rig) {
+  /**
+   * Reads the snapshot a previous start wrote
+   *
+   * Returns:
+   * - bool: true if it's one this build understands, parsed from the
+   *         yaml as it is now
+   */
+  int fd = open(rig_path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return false;
+
+  ssize_t read_size = read(fd, rig, sizeof(*rig));
+  close(fd);
+
+  return read_size == (ssize_t)sizeof(*rig) &&
+         rig_conf_valid(rig) &&
+         rig->yaml_size == (uint64_t)yaml_st->st_size &&
+         rig->yaml_mtime == mtime_ns(yaml_st);
+}
+
+static int write_snapshot(const char* rig_path, const struct rig_conf* rig) {
+  /**
+   * Writes the snapshot, replacing the file at rig_path whole
+   *
+   * The new file is written next to the old one and renamed over it,
+   * so readers only ever map one or the other.
+   *
+   * Returns:
+   * - int: 0 on success, or a negative error code
+   */
+  char dir[256];
+  char tmp_path[256 + 4];
+  snprintf(dir, sizeof(dir), "%s", rig_path);
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", rig_path);
+
+  char* slash = strrchr(dir, '/');
+  if (slash && slash != dir) {
+    *slash = '\0';
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST)
+      return -errno;
+  }
+
+  int err = 0;
+  int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1)
+    return -errno;
+
+  errno = 0;
+  if (write(fd, rig, sizeof(*rig)) != (ssize_t)sizeof(*rig) || fsync(fd) == -1)
+    err = errno ? errno : EIO; // a short write doesn't set errno
+  close(fd);
+
+  if (!err && rename(tmp_path, rig_path) == -1)
+    err = errno;
+
+  if (err) {
+    unlink(tmp_path);
+    return -err;
+  }
+
+  return 0;
+}
+
+int load_rig_conf(const char* yaml_path, const char* rig_path, struct rig_conf* rig) {
+  /**
+   * Loads the rig's cameras and placement, from the snapshot when it's
+   * current and otherwise from the yaml, see parse_conf.h
+   *
+   * Parameters:
+   * - const char* yaml_path: the file path of the camera conf
+   * - const char* rig_path: the file path of the snapshot
+   * - struct rig_conf* rig: receives the snapshot
+   *
+   * Returns:
+   * - int: either a negative error code, or 0 on success
+   */
+  int ret = 0;
+  char logstr[128];
+
+  FILE* infile = fopen(yaml_path, "r");
+  struct stat yaml_st;
+  if (!infile || fstat(fileno(infile), &yaml_st) == -1) {
+    ret = -errno;
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error opening file: %s",
+      strerror(errno)
+    );
+    log(ERROR, logstr);
+    if (infile)
+      fclose(infile);
+    return ret;
+  }
+
+  if (read_snapshot(rig_path, &yaml_st, rig)) {
+    fclose(infile);
+    log_fmt(INFO, "Loaded %u camera confs from %s", rig->cam_count, rig_path);
+    return 0;
+  }
+
+  memset(rig, 0, sizeof(*rig));
+  rig->magic = RIG_CONF_MAGIC;
+  rig->version = RIG_CONF_VERSION;
+  rig->cam_size = sizeof(cam_conf);
+  rig->yaml_size = yaml_st.st_size;
+  rig->yaml_mtime = mtime_ns(&yaml_st);
+  rig->placement.main_core = -1;
+  rig->placement.ingest_core = -1;
+
+  ret = parse_yaml(infile, rig);
+  fclose(infile);
+  if (ret)
+    return ret;
+
+  ret = write_snapshot(rig_path, rig);
+  if (ret) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error writing rig snapshot %s: %s",
+      rig_path,
+      strerror(-ret)
+    );
+    log(WARNING, logstr);
+  }
+
+  log_fmt(INFO, "Parsed %u camera confs from %s", rig->cam_count, yaml_path);
+  return 0;
+}
@@ -0,0 +1,213 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "logging.h"
+#include "network.h"
+#include "rate_ctl.h"
+
+void init_rate_ctl(
+  struct rate_ctl* rc,
+  struct rate_cam* cams,
+  struct rate_msg* msgs,
+  uint32_t cam_count,
+  uint64_t now
+) {
+  /**
+   * Initializes the rate controller with every camera at full quality
+   * and the full frame rate
+   *
+   * Parameters:
+   * - struct rate_ctl* rc: the controller to initialize
+   * - struct rate_cam* cams: cam_count entries of per camera state
+   * - struct rate_msg* msgs: cam_count messages, rebuilt every interval
+   * - uint32_t cam_count: number of cameras
+   * - uint64_t now: the current CLOCK_MONOTONIC time in ns
+   */
+  memset(rc, 0, sizeof(*rc));
+  memset(cams, 0, sizeof(*cams) * cam_count);
+  rc->cams = cams;
+  rc->msgs = msgs;
+  rc->cam_count = cam_count;
+  rc->decimation = 1;
+  rc->next_update = now + RATE_CTL_INTERVAL;
+}
+
+int rate_ctl_timeout(const struct rate_ctl* rc, uint64_t now) {
+  /**
+   * Returns the ms until rate_ctl_update is next due, rounded up,
+   * for use as an epoll_wait timeout
+   */
+  if (now >= rc->next_update)
+    return 0;
+  return (int)((rc->next_update - now + 999999) / 1000000);
+}
+
+static bool step_cam(struct rate_cam* cam, uint32_t floor, bool may_recover) {
+  /**
+   * Moves a camera's quality level a step in whichever direction its
+   * backlog calls for
+   *
+   * Returns:
+   * - bool: true if the camera is behind with no quality left to give
+   */
+  bool behind = cam->depth >= RATE_DEPTH_HIGH || cam->lag >= RATE_LAG_HIGH;
+  bool spare = cam->depth <= RATE_DEPTH_LOW && cam->lag < RATE_LAG_LOW;
+
+  if (cam->level < floor)
+    cam->level = floor;
+
+  if (behind) {
+    cam->healthy = 0;
+    if (cam->level < RATE_MAX_LEVEL) {
+      cam->level++;
+      return false;
+    }
+    return true;
+  }
+
+  if (!spare) {
+    cam->healthy = 0;
+    return false;
+  }
+
+  if (++cam->healthy >= RATE_RECOVER_INTERVALS && may_recover && cam->level > floor) {
+    cam->level--;
+    cam->healthy = 0;
+  }
+  return false;
+}
+
+void rate_ctl_update(
+  struct rate_ctl* rc,
+  cam_conf* confs,
+  struct stream_ctx* streams,
+  struct consumer_q* filled_pkt_qs,
+  struct assembler* as,
+  uint64_t now
+) {
+  /**
+   * Measures every camera's backlog, adjusts its quality level and the
+   * rig's decimation, and sends every camera its feedback
+   *
+   * Does nothing until RATE_CTL_INTERVAL has passed since the last
+   * update, so it can be called on every pass of the main loop.
+   *
+   * A camera's lag is how much older than its capture interval the
+   * frame its decoder is on is, and only counts while the decoder is
+   * making progress or has packets waiting, so a camera that stopped
+   * sending altogether isn't mistaken for one the server can't keep
+   * up with.
+   *
+   * Parameters:
+   * - struct rate_ctl* rc: the controller
+   * - cam_conf* confs: the cameras, for their addresses
+   * - struct stream_ctx* streams: each camera's decode stream
+   * - struct consumer_q* filled_pkt_qs: each camera's queue of packets
+   *                                     waiting on its decoder
+   * - struct assembler* as: told about every change in decimation
+   * - uint64_t now: the current CLOCK_MONOTONIC time in ns
+   */
+  if (now < rc->next_update)
+    return;
+  rc->next_update = now + RATE_CTL_INTERVAL;
+
+  struct timespec real_ts;
+  clock_gettime(CLOCK_REALTIME, &real_ts);
+  uint64_t real_now = real_ts.tv_sec * 1000000000ULL + real_ts.tv_nsec;
+
+  uint32_t floor = rc->wifi ? RATE_WIFI_LEVEL : 0;
+  bool settled = real_now >= rc->effective_ts; // the last decimation has taken effect
+  bool saturated = false;
+  bool all_spare = true;
+  for (uint32_t i = 0; i < rc->cam_count; i++) {
+    struct rate_cam* cam = &rc->cams[i];
+    uint64_t last_ts = atomic_load_explicit(&streams[i].last_ts, memory_order_relaxed);
+
+    cam->depth = spsc_depth(&filled_pkt_qs[i]);
+    bool progressing = last_ts != cam->last_ts || cam->depth > 0;
+    cam->lag = progressing && last_ts && real_now > last_ts ? real_now - last_ts : 0;
+    cam->last_ts = last_ts;
+
+    // the newest capture can be up to an interval old without anything being behind
+    uint64_t interval = (uint64_t)as->cam_period[i] * rc->decimation * as->frame_dur;
+    cam->lag = cam->lag > interval ? cam->lag - interval : 0;
+
+    uint32_t prev_level = cam->level;
+    // the frame rate comes back before quality does
+    if (step_cam(cam, floor, rc->decimation == 1))
+      saturated = true;
+    if (cam->healthy == 0)
+      all_spare = false;
+
+    if (cam->level != prev_level) {
+      log_fmt(
+        INFO,
+        "Camera %s quality level %u -> %u, %u packets queued, %lu ms behind",
+        confs[i].name,
+        prev_level,
+        cam->level,
+        cam->depth,
+        cam->lag / 1000000
+      );
+    }
+  }
+
+  uint32_t decimation = rc->decimation;
+  if (saturated) {
+    rc->healthy = 0;
+    if (settled && decimation < RATE_MAX_DECIMATION)
+      decimation *= 2;
+  } else if (all_spare && ++rc->healthy >= RATE_RECOVER_INTERVALS) {
+    rc->healthy = 0;
+    if (settled && decimation > 1)
+      decimation /= 2;
+  } else if (!all_spare) {
+    rc->healthy = 0;
+  }
+
+  if (decimation != rc->decimation) {
+    // pick an index far enough ahead for every camera to hear of it,
+    // and hand the cameras a timestamp halfway before its slot, so
+    // jitter in their schedules never puts a capture on the wrong side
+    uint64_t lead_idx = (RATE_DECIMATION_LEAD + as->frame_dur - 1) / as->frame_dur;
+    uint64_t from_idx = lead_idx;
+    if (real_now > as->start_ts)
+      from_idx += (real_now - as->start_ts) / as->frame_dur + 1;
+
+    assembler_set_decimation(as, decimation, from_idx);
+    rc->effective_ts = as->start_ts + from_idx * as->frame_dur - as->frame_dur / 2;
+    log_fmt(
+      INFO,
+      "Rig decimation %u -> %u from timestamp %lu",
+      rc->decimation,
+      decimation,
+      rc->effective_ts
+    );
+    rc->decimation = decimation;
+  }
+
+  for (uint32_t i = 0; i < rc->cam_count; i++) {
+    struct rate_msg* msg = &rc->msgs[i];
+    msg->magic = RATE_MSG_MAGIC;
+    msg->version = RATE_MSG_VERSION;
+    msg->level = rc->cams[i].level;
+    msg->decimation = rc->decimation;
+    msg->flags = rc->wifi ? RATE_FLAG_WIFI : 0;
+    msg->effective_ts = rc->effective_ts;
+    msg->queue_depth = rc->cams[i].depth;
+    msg->decode_lag_us = rc->cams[i].lag / 1000;
+  }
+
+  bool eth_conn = true;
+  if (send_cam_msgs(confs, rc->cam_count, rc->msgs, sizeof(struct rate_msg), &eth_conn) < 0)
+    return;
+
+  if (rc->wifi == eth_conn) {
+    rc->wifi = !eth_conn;
+    log(WARNING, rc->wifi ?
+      "Cameras are on wifi, holding quality down" :
+      "Cameras are back on ethernet"
+    );
+  }
+}
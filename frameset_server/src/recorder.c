@@ -0,0 +1,443 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "logging.h"
+#include "recorder.h"
+#include "stream_mgr.h"
+
+#define DROP_LOG_INTERVAL 100 // log the first drop, then every this many
+
+_Static_assert(
+  RECORD_BUF_SIZE >= ENCODED_FRAME_MAX_SIZE + RECORD_ALIGN,
+  "a record buffer must hold the largest packet after the carried tail"
+);
+_Static_assert(RECORD_BUF_SIZE % RECORD_ALIGN == 0, "record buffers must stay aligned");
+
+static uint64_t monotonic_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int open_direct(const char* path, const char* name) {
+  /**
+   * Opens a data file for O_DIRECT writes
+   *
+   * Falls back to the page cache on filesystems without O_DIRECT,
+   * like tmpfs, the aligned writes work either way.
+   *
+   * Returns:
+   * - int: the fd, or a negative error code
+   */
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT | O_CLOEXEC, 0644);
+  if (fd == -1 && errno == EINVAL) {
+    log_fmt(
+      WARNING,
+      "No O_DIRECT for %s, recording cam %s through the page cache",
+      path,
+      name
+    );
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  }
+
+  if (fd == -1) {
+    log_fmt(ERROR, "Error opening %s: %s", path, strerror(errno));
+    return -errno;
+  }
+
+  return fd;
+}
+
+static int write_all(int fd, const void* data, size_t len, off_t offset) {
+  /**
+   * Writes all of len bytes, at offset, or appended if offset is -1
+   *
+   * Returns:
+   * - int: 0 on success, or a negative error code
+   */
+  const uint8_t* bytes = data;
+  while (len > 0) {
+    ssize_t written = offset < 0 ? write(fd, bytes, len) : pwrite(fd, bytes, len, offset);
+    if (written == -1 && errno == EINTR)
+      continue;
+    if (written == -1)
+      return -errno;
+    if (written == 0)
+      return -EIO;
+
+    bytes += written;
+    len -= written;
+    if (offset >= 0)
+      offset += written;
+  }
+
+  return 0;
+}
+
+static void write_buf(struct recorder* rec, struct record_buf* buf) {
+  /**
+   * Writes a buffer's aligned prefix, then the index entries it covers
+   *
+   * The data goes first so the index never points past the end of
+   * what's on disk.
+   */
+  struct record_cam* cam = &rec->cams[buf->cam];
+  if (cam->failed)
+    return;
+
+  int ret = write_all(cam->data_fd, buf->data, buf->write_len, buf->file_offset);
+  if (!ret && buf->idx_write)
+    ret = write_all(cam->idx_fd, buf->idx, sizeof(struct record_idx_entry) * buf->idx_write, -1);
+
+  if (ret) {
+    log_fmt(
+      ERROR,
+      "Error writing recording of cam %s, no longer recording it: %s",
+      cam->name,
+      strerror(-ret)
+    );
+    cam->failed = true;
+  }
+}
+
+static void* writer_fn(void* ptr) {
+  struct recorder* rec = (struct recorder*)ptr;
+
+  while (true) {
+    struct record_buf* buf = spsc_dequeue(&rec->filled_cq);
+    if (!buf) {
+      // ingest is joined before stopping is set, so the queue is final
+      if (atomic_load_explicit(&rec->stopping, memory_order_acquire))
+        break;
+      spsc_wait(&rec->filled_cq, &rec->filled_ev);
+      continue;
+    }
+
+    write_buf(rec, buf);
+    spsc_enqueue(&rec->empty_pq, buf);
+  }
+
+  return NULL;
+}
+
+int init_recorder(struct recorder* rec, const char* dir, cam_conf* confs, uint32_t cam_count) {
+  /**
+   * Creates the recording's files and starts the writer thread
+   *
+   * Parameters:
+   * - struct recorder* rec: the recorder to initialize
+   * - const char* dir: directory for the recording, created if missing,
+   *                    existing files for the same cameras are replaced
+   * - cam_conf* confs: the cameras, in the order ingest numbers them
+   * - uint32_t cam_count: number of cameras
+   *
+   * Returns:
+   * - int: 0 on success, or a negative error code
+   */
+  int ret = 0;
+  char path[PATH_MAX];
+
+  memset(rec, 0, sizeof(*rec));
+  rec->filled_ev.fd = -1;
+  atomic_store_explicit(&rec->stopping, false, memory_order_relaxed);
+
+  rec->cams = calloc(cam_count, sizeof(struct record_cam));
+  if (!rec->cams) {
+    log(ERROR, "Failed to allocate recorder");
+    return -ENOMEM;
+  }
+  rec->cam_count = cam_count;
+  for (uint32_t i = 0; i < cam_count; i++) {
+    rec->cams[i].data_fd = -1;
+    rec->cams[i].idx_fd = -1;
+  }
+
+  if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+    log_fmt(ERROR, "Error creating recording directory %s: %s", dir, strerror(errno));
+    ret = -errno;
+    goto err_cleanup;
+  }
+
+  // one more slot than buffers, rounded up to keep the queues cache line aligned
+  const size_t buf_count = (size_t)cam_count * RECORD_BUFS_PER_CAM;
+  const size_t per_line = CACHE_LINE_SIZE / sizeof(void*);
+  const size_t q_size = (buf_count / per_line + 1) * per_line;
+
+  rec->bufs = calloc(buf_count, sizeof(struct record_buf));
+  rec->buf_data = aligned_alloc(RECORD_ALIGN, RECORD_BUF_SIZE * buf_count);
+  rec->buf_idx = malloc(sizeof(struct record_idx_entry) * RECORD_IDX_PER_BUF * buf_count);
+  rec->q_bufs = aligned_alloc(CACHE_LINE_SIZE, sizeof(void*) * q_size * 2);
+  if (!rec->bufs || !rec->buf_data || !rec->buf_idx || !rec->q_bufs) {
+    log(ERROR, "Failed to allocate recording buffers");
+    ret = -ENOMEM;
+    goto err_cleanup;
+  }
+
+  spsc_queue_init(&rec->filled_pq, &rec->filled_cq, rec->q_bufs, q_size);
+  spsc_queue_init(&rec->empty_pq, &rec->empty_cq, rec->q_bufs + q_size, q_size);
+  for (size_t i = 0; i < buf_count; i++) {
+    rec->bufs[i].data = rec->buf_data + (size_t)RECORD_BUF_SIZE * i;
+    rec->bufs[i].idx = rec->buf_idx + (size_t)RECORD_IDX_PER_BUF * i;
+    spsc_enqueue(&rec->empty_pq, &rec->bufs[i]);
+  }
+
+  for (uint32_t i = 0; i < cam_count; i++) {
+    struct record_cam* cam = &rec->cams[i];
+    strncpy(cam->name, confs[i].name, CAM_NAME_LEN - 1);
+
+    snprintf(path, sizeof(path), "%s/%s%s", dir, cam->name, RECORD_DATA_EXT);
+    cam->data_fd = open_direct(path, cam->name);
+    if (cam->data_fd < 0) {
+      ret = cam->data_fd;
+      goto err_cleanup;
+    }
+
+    snprintf(path, sizeof(path), "%s/%s%s", dir, cam->name, RECORD_IDX_EXT);
+    cam->idx_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (cam->idx_fd == -1) {
+      log_fmt(ERROR, "Error opening %s: %s", path, strerror(errno));
+      ret = -errno;
+      goto err_cleanup;
+    }
+
+    struct record_idx_header header = {
+      .magic = RECORD_IDX_MAGIC,
+      .version = RECORD_IDX_VERSION
+    };
+    strncpy(header.cam_name, cam->name, RECORD_NAME_LEN - 1);
+    ret = write_all(cam->idx_fd, &header, sizeof(header), -1);
+    if (ret) {
+      log_fmt(ERROR, "Error writing %s: %s", path, strerror(-ret));
+      goto err_cleanup;
+    }
+
+    // every camera holds a buffer from here on, see hand_off
+    cam->cur = spsc_dequeue(&rec->empty_cq);
+    cam->cur->cam = i;
+  }
+
+  ret = spsc_event_init(&rec->filled_ev);
+  if (ret) {
+    log_fmt(ERROR, "Error creating recorder eventfd: %s", strerror(-ret));
+    goto err_cleanup;
+  }
+
+  // the server's signals are meant for the threads that handle them
+  sigset_t mask, old_mask;
+  sigfillset(&mask);
+  pthread_sigmask(SIG_SETMASK, &mask, &old_mask);
+  ret = pthread_create(&rec->writer, NULL, writer_fn, rec);
+  pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+  if (ret) {
+    log(ERROR, "Error spawning recording writer thread");
+    ret = -ret;
+    goto err_cleanup;
+  }
+  rec->writer_running = true;
+
+  log_fmt(INFO, "Recording %u cameras to %s", cam_count, dir);
+  return 0;
+
+err_cleanup:
+  cleanup_recorder(rec);
+  return ret;
+}
+
+static bool is_keyframe(const uint8_t* data, uint32_t size) {
+  // the cameras send the SPS and PPS in front of every IDR slice, and
+  // nothing but slices after them, so the first of either decides it
+  for (uint32_t i = 0; i + 3 < size; i++) {
+    if (data[i] || data[i + 1] || data[i + 2] != 1)
+      continue;
+
+    uint8_t type = data[i + 3] & 0x1f;
+    if (type == 5 || type == 7) // IDR slice, SPS
+      return true;
+    if (type == 1) // non IDR slice
+      return false;
+    i += 3;
+  }
+
+  return false;
+}
+
+static int hand_off(struct recorder* rec, struct record_cam* cam, uint64_t now) {
+  /**
+   * Hands the aligned prefix of a camera's buffer to the writer
+   *
+   * The unaligned tail, and the index entries of any packet not
+   * wholly in the prefix, are carried into a fresh buffer.
+   *
+   * Returns:
+   * - int: 0 on success, or -ENOBUFS if no buffer is free
+   */
+  struct record_buf* cur = cam->cur;
+  struct record_buf* next = spsc_dequeue(&rec->empty_cq);
+  if (!next)
+    return -ENOBUFS;
+
+  size_t aligned = cur->len & ~((size_t)RECORD_ALIGN - 1);
+  uint64_t end = cur->file_offset + aligned;
+  uint32_t covered = 0;
+  while (covered < cur->idx_count &&
+         cur->idx[covered].offset + cur->idx[covered].size <= end)
+    covered++;
+
+  next->cam = cur->cam;
+  next->file_offset = end;
+  next->len = cur->len - aligned;
+  memcpy(next->data, cur->data + aligned, next->len);
+  next->idx_count = cur->idx_count - covered;
+  memcpy(next->idx, cur->idx + covered, sizeof(struct record_idx_entry) * next->idx_count);
+
+  cur->write_len = aligned;
+  cur->idx_write = covered;
+  spsc_enqueue(&rec->filled_pq, cur);
+  spsc_notify(&rec->filled_ev);
+
+  cam->cur = next;
+  cam->cur_since = now;
+  return 0;
+}
+
+int recorder_add(struct recorder* rec, uint32_t cam_idx, uint64_t timestamp, const uint8_t* data, uint32_t size) {
+  /**
+   * Appends a packet to a camera's recording
+   *
+   * Only called by the ingest thread. Never blocks on the disk.
+   *
+   * Parameters:
+   * - struct recorder* rec: the recorder
+   * - uint32_t cam_idx: the camera, as numbered in init_recorder
+   * - uint64_t timestamp: the packet's capture timestamp
+   * - const uint8_t* data: the encoded packet
+   * - uint32_t size: its size, at most ENCODED_FRAME_MAX_SIZE
+   *
+   * Returns:
+   * - int: 0 on success, or -ENOBUFS if the packet was dropped
+   */
+  if (size == 0)
+    return 0;
+
+  struct record_cam* cam = &rec->cams[cam_idx];
+  struct record_buf* cur = cam->cur;
+  uint64_t now = monotonic_ns();
+
+  bool full = cur->len + size > RECORD_BUF_SIZE || cur->idx_count == RECORD_IDX_PER_BUF;
+  bool stale = cur->len >= RECORD_ALIGN && now - cam->cur_since >= RECORD_FLUSH_NS;
+  if ((full || stale) && hand_off(rec, cam, now) && full) {
+    if (cam->dropped++ % DROP_LOG_INTERVAL == 0) {
+      log_fmt(
+        WARNING,
+        "Recording of cam %s has fallen behind the disk, %lu packets dropped",
+        cam->name,
+        cam->dropped
+      );
+    }
+    return -ENOBUFS;
+  }
+
+  cur = cam->cur;
+  if (cur->len == 0)
+    cam->cur_since = now;
+
+  cur->idx[cur->idx_count++] = (struct record_idx_entry){
+    .timestamp = timestamp,
+    .offset = cur->file_offset + cur->len,
+    .size = size,
+    .flags = is_keyframe(data, size) ? RECORD_KEYFRAME : 0
+  };
+  memcpy(cur->data + cur->len, data, size);
+  cur->len += size;
+  cam->packets++;
+
+  return 0;
+}
+
+static void finish_cam(struct record_cam* cam) {
+  /**
+   * Writes whatever is left in a camera's buffer and closes its files
+   *
+   * The last write is padded out to the alignment O_DIRECT needs, and
+   * the padding truncated off again afterwards.
+   */
+  struct record_buf* cur = cam->cur;
+  if (cur && !cam->failed && cam->data_fd >= 0 && cam->idx_fd >= 0) {
+    size_t padded = (cur->len + RECORD_ALIGN - 1) & ~((size_t)RECORD_ALIGN - 1);
+    memset(cur->data + cur->len, 0, padded - cur->len);
+
+    uint64_t size = cur->file_offset + cur->len;
+    int ret = write_all(cam->data_fd, cur->data, padded, cur->file_offset);
+    if (!ret && ftruncate(cam->data_fd, size) == -1)
+      ret = -errno;
+    if (!ret && fdatasync(cam->data_fd) == -1)
+      ret = -errno;
+    if (!ret && cur->idx_count)
+      ret = write_all(cam->idx_fd, cur->idx, sizeof(struct record_idx_entry) * cur->idx_count, -1);
+    if (!ret && fdatasync(cam->idx_fd) == -1)
+      ret = -errno;
+
+    if (ret) {
+      log_fmt(ERROR, "Error finishing recording of cam %s: %s", cam->name, strerror(-ret));
+    } else {
+      log_fmt(
+        INFO,
+        "Recorded %lu packets, %lu bytes from cam %s, %lu packets dropped",
+        cam->packets,
+        size,
+        cam->name,
+        cam->dropped
+      );
+    }
+  }
+
+  if (cam->data_fd >= 0)
+    close(cam->data_fd);
+  if (cam->idx_fd >= 0)
+    close(cam->idx_fd);
+  cam->data_fd = -1;
+  cam->idx_fd = -1;
+}
+
+void cleanup_recorder(struct recorder* rec) {
+  /**
+   * Stops the writer, finishes every camera's files, and frees the recorder
+   *
+   * Must only be called once the ingest thread is joined.
+   */
+  if (rec->writer_running) {
+    atomic_store_explicit(&rec->stopping, true, memory_order_release);
+    uint64_t one = 1;
+    ssize_t len = write(rec->filled_ev.fd, &one, sizeof(one));
+    (void)len;
+    pthread_join(rec->writer, NULL);
+    rec->writer_running = false;
+  }
+
+  if (rec->cams) {
+    for (uint32_t i = 0; i < rec->cam_count; i++)
+      finish_cam(&rec->cams[i]);
+    free(rec->cams);
+    rec->cams = NULL;
+  }
+
+  spsc_event_cleanup(&rec->filled_ev);
+
+  free(rec->bufs);
+  free(rec->buf_data);
+  free(rec->buf_idx);
+  free(rec->q_bufs);
+  rec->bufs = NULL;
+  rec->buf_data = NULL;
+  rec->buf_idx = NULL;
+  rec->q_bufs = NULL;
+}
@@ -7,23 +7,372 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <time.h>
 #include <unistd.h>
 
-#include "queue.h"
 #include "spsc_queue.h"
 #include "logging.h"
-#include "network.h"
+#include "ingest.h"
+#include "metrics.h"
 #include "stream_mgr.h"
+#include "trace.h"
+#include "ts_ring.h"
 #include "viddec.h"
 
-#define TS_Q_INIT_SIZE 8
-#define EMPTY_Q_WAIT 10000 // 0.01 ms
-
 static volatile sig_atomic_t running = 1;
 
 static void shutdown_handler(int signum);
 
+static uint64_t monotonic_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int init_decode_pool(
+  struct decode_pool* pool,
+  struct stream_ctx* streams,
+  uint32_t stream_count,
+  pthread_t main_thread
+) {
+  /**
+   * Creates the shared device context and a decoder for every stream
+   *
+   * The streams must already have their queues set, the worker state
+   * is initialized here. Every decoder is created up front so a worker
+   * claiming a stream never pays for it mid stream.
+   *
+   * Parameters:
+   * - struct decode_pool* pool: the pool to initialize
+   * - struct stream_ctx* streams: one per camera
+   * - uint32_t stream_count: number of streams
+   * - pthread_t main_thread: signaled if a worker fails
+   *
+   * Returns:
+   * - int: 0 on success, or a negative error code
+   */
+  memset(pool, 0, sizeof(*pool));
+  pool->streams = streams;
+  pool->stream_count = stream_count;
+  pool->main_thread = main_thread;
+  atomic_store_explicit(&pool->ended_count, 0, memory_order_relaxed);
+  pool->ended_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (pool->ended_fd == -1) {
+    int err = errno;
+    log(ERROR, "Failed to create decode pool eventfd");
+    return -err;
+  }
+
+  for (uint32_t i = 0; i < stream_count; i++) {
+    streams[i].idx = i;
+    atomic_store_explicit(&streams[i].claimed, false, memory_order_relaxed);
+    atomic_store_explicit(&streams[i].ended, false, memory_order_relaxed);
+    atomic_store_explicit(&streams[i].last_ts, 0, memory_order_relaxed);
+    streams[i].decoder_initialized = false;
+    ts_ring_init(&streams[i].timestamps);
+    streams[i].next_pts = 0;
+    streams[i].awaiting_key = true;
+    streams[i].current_buf = NULL;
+  }
+
+  int ret = init_hw_device(&pool->hw_device_ctx);
+  if (ret)
+    return ret;
+
+  for (uint32_t i = 0; i < stream_count; i++) {
+    ret = init_decoder(
+      &streams[i].viddec,
+      pool->hw_device_ctx,
+      streams[i].conf->live_width,
+      streams[i].conf->live_height
+    );
+    if (ret)
+      return ret;
+    streams[i].decoder_initialized = true;
+  }
+
+  return 0;
+}
+
+void cleanup_decode_pool(struct decode_pool* pool) {
+  for (uint32_t i = 0; i < pool->stream_count; i++) {
+    struct stream_ctx* stream = &pool->streams[i];
+    if (stream->decoder_initialized)
+      cleanup_decoder(&stream->viddec);
+  }
+
+  cleanup_hw_device(&pool->hw_device_ctx);
+  if (pool->ended_fd >= 0)
+    close(pool->ended_fd);
+  pool->ended_fd = -1;
+}
+
+static void reset_stream(struct stream_ctx* stream) {
+  /**
+   * Discards everything the stream's decoder holds, so it can start
+   * over at the camera's next keyframe
+   *
+   * Only called by the worker holding the stream's claim, before it's
+   * released, so no other worker sees the stream half reset. The
+   * decoder is reset in place, and the frame buffer the stream holds,
+   * if any, is kept, so nothing is allocated again.
+   */
+  reset_decoder(&stream->viddec);
+  ts_ring_init(&stream->timestamps);
+  stream->next_pts = 0;
+  stream->awaiting_key = true;
+  atomic_store_explicit(&stream->last_ts, 0, memory_order_relaxed);
+}
+
+static void end_stream(struct decode_pool* pool, struct stream_ctx* stream) {
+  /**
+   * Readies a fully drained stream for the camera's next one, and
+   * tells the main thread it has ended
+   */
+  reset_stream(stream);
+  atomic_store_explicit(&stream->ended, false, memory_order_relaxed);
+
+  // every frame is enqueued before the count, which the main thread reads first
+  atomic_fetch_add_explicit(&pool->ended_count, 1, memory_order_release);
+  uint64_t one = 1;
+  ssize_t len = write(pool->ended_fd, &one, sizeof(one));
+  (void)len;
+}
+
+static bool has_frame_buf(struct stream_ctx* stream) {
+  if (!stream->current_buf)
+    stream->current_buf = spsc_dequeue(stream->empty_bufs);
+
+  return stream->current_buf != NULL;
+}
+
+static bool claim_next_stream(struct thread_ctx* ctx, struct stream_ctx** claimed, bool* more) {
+  /**
+   * Claims the runnable stream that is furthest behind among the
+   * worker's streams
+   *
+   * A stream is runnable when it has a packet pending, or has ended
+   * and still has frames to drain, and it is not claimed by another
+   * worker. Streams without a free frame buffer are skipped, their
+   * packets wait until the main thread returns one.
+   *
+   * Parameters:
+   * - struct thread_ctx* ctx: the worker
+   * - struct stream_ctx** claimed: receives the claimed stream
+   * - bool* more: receives whether another stream looked runnable too
+   *
+   * Returns:
+   * - bool: true if a stream was claimed
+   */
+  struct stream_ctx* streams = ctx->pool->streams + ctx->first_stream;
+  uint64_t skipped = 0; // streams found to have no free frame buffer
+  while (true) {
+    struct stream_ctx* best = NULL;
+    uint64_t best_ts = UINT64_MAX;
+    uint32_t runnable = 0;
+
+    for (uint32_t i = 0; i < ctx->stream_count; i++) {
+      struct stream_ctx* stream = &streams[i];
+      if (skipped & (1ULL << i))
+        continue;
+      if (atomic_load_explicit(&stream->claimed, memory_order_relaxed))
+        continue;
+
+      bool ended = atomic_load_explicit(&stream->ended, memory_order_relaxed);
+      if (spsc_empty(stream->filled_pkts) && !ended)
+        continue;
+
+      runnable++;
+      uint64_t ts = atomic_load_explicit(&stream->last_ts, memory_order_relaxed);
+      if (!best || ts < best_ts) {
+        best = stream;
+        best_ts = ts;
+      }
+    }
+
+    if (!best)
+      return false;
+
+    bool expected = false;
+    if (!atomic_compare_exchange_strong_explicit(
+      &best->claimed,
+      &expected,
+      true,
+      memory_order_acquire,
+      memory_order_relaxed
+    ))
+      continue; // another worker got there first, pick again
+
+    // checked again now that its state can't change underneath us
+    bool pending = !spsc_empty(best->filled_pkts) ||
+                   atomic_load_explicit(&best->ended, memory_order_relaxed);
+    if (pending && has_frame_buf(best)) {
+      *claimed = best;
+      *more = runnable > 1;
+      return true;
+    }
+
+    atomic_store_explicit(&best->claimed, false, memory_order_release);
+    skipped |= 1ULL << (best - streams);
+  }
+}
+
+static int drain_frames(struct stream_ctx* stream) {
+  /**
+   * Receives every frame the stream's decoder has ready
+   *
+   * Returns:
+   * - int: 0 when the decoder needs more input or there is no frame
+   *        buffer left, ENODATA once a flushed stream is fully drained,
+   *        or a negative error code
+   */
+  while (has_frame_buf(stream)) {
+    struct ts_frame_buf* current_buf = stream->current_buf;
+    int64_t pts;
+
+#ifdef CUDA_FRAMESETS
+    int ret = recv_frame_gpu(
+      &stream->viddec,
+      current_buf->frame_buf,
+      &pts
+    );
+#else
+    int ret = recv_frame(
+      &stream->viddec,
+      current_buf->frame_buf,
+      &pts
+    );
+#endif
+
+    if (ret == EAGAIN)
+      return 0;
+    if (ret)
+      return ret;
+
+    struct ts_entry entry = { 0 };
+    uint32_t evicted;
+    ret = ts_ring_match(&stream->timestamps, pts, &entry, &evicted);
+    if (evicted) {
+      metrics_add(&stream->metrics->decoder_drops, evicted);
+      log_fmt(
+        WARNING,
+        "Decoder dropped %u frames from cam %s",
+        evicted,
+        stream->conf->name
+      );
+    }
+    if (ret) {
+      log_fmt(
+        WARNING,
+        "Discarding decoded frame with unknown pts %ld from cam %s",
+        (long)pts,
+        stream->conf->name
+      );
+      continue; // the frame buffer is reused for the next frame
+    }
+
+    current_buf->timestamp = entry.timestamp;
+    current_buf->sensor_ts = entry.sensor_ts;
+    metrics_add(&stream->metrics->frames_decoded, 1);
+    TRACE_POINT(TRACE_TRANSFERRED, stream->idx, current_buf->timestamp);
+    spsc_enqueue(stream->filled_bufs, (void*)current_buf);
+    spsc_notify(stream->filled_ev);
+    stream->current_buf = NULL;
+  }
+
+  return 0;
+}
+
+static int service_stream(struct stream_ctx* stream) {
+  /**
+   * Decodes one packet of a claimed stream and receives its frames
+   *
+   * The time from taking the packet to receiving its frames is
+   * recorded in the camera's decode_time, see metrics.h.
+   *
+   * A reset packet from the ingest thread, after the camera's stream
+   * faulted, resets the decoder, which then skips everything up to the
+   * camera's next keyframe, as it does after failing to decode.
+   *
+   * Returns:
+   * - int: 0 on success, ENODATA once the stream has ended and is fully
+   *        drained, or a negative error code
+   */
+  int ret = 0;
+  uint64_t start = 0;
+
+  struct enc_packet* pkt = spsc_dequeue(stream->filled_pkts);
+  if (pkt) {
+    if (pkt->reset) {
+      reset_stream(stream);
+    } else if (stream->awaiting_key && !pkt->end_of_stream && !pkt->keyframe) {
+      metrics_add(&stream->metrics->decoder_drops, 1); // the decoder has nothing to build it on
+    } else if (pkt->end_of_stream) {
+      atomic_store_explicit(&stream->ended, true, memory_order_relaxed);
+      ret = flush_decoder(&stream->viddec);
+    } else {
+      start = monotonic_ns();
+      stream->awaiting_key = false;
+      atomic_store_explicit(&stream->last_ts, pkt->timestamp, memory_order_relaxed);
+      int64_t pts = stream->next_pts++;
+      ret = ts_ring_push(&stream->timestamps, pts, pkt->timestamp, pkt->sensor_ts, 0);
+      if (ret) {
+        log_fmt(
+          ERROR,
+          "Decoder for cam %s is holding more than %d frames",
+          stream->conf->name,
+          TS_RING_SIZE
+        );
+      } else {
+        ret = decode_packet(
+          &stream->viddec,
+          pkt->data,
+          pkt->size,
+          pts
+        );
+      }
+      if (!ret)
+        TRACE_POINT(TRACE_DECODED, stream->idx, pkt->timestamp);
+    }
+
+    // the decoder copies what it needs, so the packet can go straight back
+    spsc_enqueue(stream->empty_pkts, pkt);
+    spsc_notify(stream->empty_pkt_ev);
+
+    if (ret)
+      return ret;
+  }
+
+  ret = drain_frames(stream);
+  if (start)
+    metrics_observe(&stream->metrics->decode_time, monotonic_ns() - start);
+  return ret;
+}
+
+static bool park_pool(struct thread_ctx* ctx, struct stream_ctx** claimed, bool* more, uint32_t* seq) {
+  /**
+   * Parks the worker on the pool event, unless there is work to claim
+   *
+   * The check after parking is a full claim attempt across every one
+   * of the worker's streams, since any of them can give the worker
+   * something to do. Several workers may park at once, a notify wakes
+   * one of them.
+   *
+   * Returns:
+   * - bool: true if parked, with seq set for pool_wait, false if a
+   *         stream was claimed instead
+   */
+  *seq = pool_park(ctx->work_ev);
+
+  if (claim_next_stream(ctx, claimed, more)) {
+    pool_unpark(ctx->work_ev);
+    return false;
+  }
+
+  return true;
+}
+
 void* stream_mgr_fn(void* ptr) {
   int ret = 0;
   char logstr[128];
@@ -35,16 +384,8 @@ void* stream_mgr_fn(void* ptr) {
   sigemptyset(&sa.sa_mask);
   sigaction(SIGUSR2, &sa, NULL);
 
-  int sockfd = -1;
-  int clientfd = -1;
-
   struct thread_ctx* ctx = (struct thread_ctx*)ptr;
-
-  uint8_t* enc_frame_buf = malloc(ENCODED_FRAME_BUF_SIZE);
-  if (!enc_frame_buf) {
-    log(ERROR, "Failed to allocate encoded frame buffer in a thread");
-    goto err_cleanup;
-  }
+  struct decode_pool* pool = ctx->pool;
 
   cpu_set_t cpuset;
   CPU_ZERO(&cpuset);
@@ -64,186 +405,67 @@ void* stream_mgr_fn(void* ptr) {
       strerror(errno)
     );
     log(ERROR, logstr);
-    ret = -errno;
-    goto err_cleanup;
-  }
-
-  queue timestamp_queue;
-  ret = init_queue(
-    &timestamp_queue,
-    sizeof(uint64_t),
-    TS_Q_INIT_SIZE
-  );
-  if (ret)
-    goto err_cleanup;
-
-  decoder viddec;
-  ret = init_decoder(
-    &viddec,
-    DECODED_FRAME_WIDTH,
-    DECODED_FRAME_HEIGHT
-  );
-  if (ret)
-    goto err_cleanup;
-
-  sockfd = setup_stream(ctx->conf);
-  if (sockfd < 0) {
-    ret = -EIO;
-    goto err_cleanup;
-  }
-
-  clientfd = accept_conn(sockfd);
-  if (clientfd < 0) {
-    ret = -EIO;
     goto err_cleanup;
   }
 
-  struct ts_frame_buf* current_buf = (struct ts_frame_buf*)spsc_dequeue(ctx->empty_bufs);
-
-  bool incoming_stream = true;
   while (running) {
-    if (incoming_stream) {
-      uint64_t timestamp = 0;
-      ssize_t pkt_size = recv_from_stream(
-        clientfd,
-        (char*)&timestamp,
-        sizeof(timestamp)
-      );
-
-      if (pkt_size != sizeof(timestamp)) {
-        if (errno == -EINTR)
-          goto shutdown_cleanup;
-
-        snprintf(
-          logstr,
-          sizeof(logstr),
-          "Received unexpected timestamp size %zd from cam %s",
-          pkt_size,
-          ctx->conf->name
-        );
-        log(ERROR, logstr);
-        goto err_cleanup;
-      }
-
-      if (memcmp(&timestamp, "EOSTREAM", 8) == 0) {
-        incoming_stream = false;
-        ret = flush_decoder(&viddec);
-        if (ret)
-          goto shutdown_cleanup;
-
-        continue;
-      }
-
-      ret = enqueue(&timestamp_queue, (void*)&timestamp);
-      if (ret)
-        goto err_cleanup;
-
-      uint32_t frame_size = 0;
-      pkt_size = recv_from_stream(
-        clientfd,
-        (char*)&frame_size,
-        sizeof(frame_size)
-      );
-
-      if (pkt_size != sizeof(frame_size)) {
-        if (errno == -EINTR)
-          goto shutdown_cleanup;
-
-        snprintf(
-          logstr,
-          sizeof(logstr),
-          "Received unexpected frame size %ld from cam %s",
-          pkt_size,
-          ctx->conf->name
-        );
-        log(ERROR, logstr);
-        goto err_cleanup;
-      }
-
-      if (frame_size > ENCODED_FRAME_BUF_SIZE) {
-        snprintf(
-          logstr,
-          sizeof(logstr),
-          "Received frame size that is larger than the allocated buffer of %d bytes: %d",
-          ENCODED_FRAME_BUF_SIZE,
-          frame_size
-        );
-        log(ERROR, logstr);
-        goto err_cleanup;
-      }
-
-      pkt_size = recv_from_stream(
-        clientfd,
-        (char*)enc_frame_buf,
-        frame_size
-      );
-
-      if (pkt_size != frame_size) {
-        if (errno == -EINTR)
-          goto shutdown_cleanup;
-
-        snprintf(
-          logstr,
-          sizeof(logstr),
-          "Received unexpected frame size with %zd bytes from cam %s",
-          pkt_size,
-          ctx->conf->name
-        );
-        log(ERROR, logstr);
-        goto err_cleanup;
-      }
-
-      ret = decode_packet(
-        &viddec,
-        enc_frame_buf,
-        frame_size
-      );
-      if (ret)
-        goto err_cleanup;
+    struct stream_ctx* stream;
+    bool more;
+    uint32_t seq;
+    if (!claim_next_stream(ctx, &stream, &more) && park_pool(ctx, &stream, &more, &seq)) {
+      pool_wait(ctx->work_ev, seq);
+      continue;
     }
 
-    ret = recv_frame(
-      &viddec,
-      current_buf->frame_buf
-    );
-
-    if (ret == EAGAIN) {
-      continue;
+    // one notify wakes one worker, pass on whatever this one can't take
+    if (more)
+      pool_notify(ctx->work_ev);
+
+    ret = service_stream(stream);
+    bool ended = ret == ENODATA;
+    if (ended) // fully drained, nothing more to do
+      end_stream(pool, stream);
+    else if (ret && atomic_load_explicit(&stream->ended, memory_order_relaxed))
+      end_stream(pool, stream); // failed finishing, there's nothing left to pick up
+    else if (ret) // only this stream is affected, it picks up again at its next keyframe
+      reset_stream(stream);
+
+    // still claimed, so the frame buffer it would decode into can be taken
+    bool ready = has_frame_buf(stream);
+    atomic_store_explicit(&stream->claimed, false, memory_order_release);
+
+    // checked after the release, a packet queued while it was claimed
+    // may have woken a worker that found it taken and parked again
+    bool pending = !spsc_empty(stream->filled_pkts) ||
+                   atomic_load_explicit(&stream->ended, memory_order_relaxed);
+    if (ready && pending)
+      pool_notify(ctx->work_ev);
+
+    if (ended) {
+      snprintf(
+        logstr,
+        sizeof(logstr),
+        "Stream from cam %s has ended",
+        stream->conf->name
+      );
+      log(INFO, logstr);
     } else if (ret) {
-      goto err_cleanup;
-    } else {
-      dequeue(&timestamp_queue, (void*)&current_buf->timestamp);
-      spsc_enqueue(ctx->filled_bufs, (void*)current_buf);
-
-      current_buf = (struct ts_frame_buf*)spsc_dequeue(ctx->empty_bufs);
-      if (!current_buf) {
-        log(WARNING, "Frame buffer queue was empty");
-        while (!current_buf && running) {
-          struct timespec ts = {
-            .tv_sec = 0,
-            .tv_nsec = EMPTY_Q_WAIT
-          };
-          nanosleep(&ts, NULL);
-          current_buf = (struct ts_frame_buf*)spsc_dequeue(ctx->empty_bufs);
-        }
-      }
+      snprintf(
+        logstr,
+        sizeof(logstr),
+        "Error decoding stream from cam %s, reset its decoder",
+        stream->conf->name
+      );
+      log(ERROR, logstr);
+      metrics_add(&stream->metrics->decode_errors, 1);
     }
   }
 
+  return NULL;
+
 err_cleanup:
   log(DEBUG, "Notified main thread of error");
-  pthread_kill(ctx->main_thread, SIGTERM);
-
-shutdown_cleanup:
-  if (enc_frame_buf)
-    free(enc_frame_buf);
-  cleanup_decoder(&viddec);
-  cleanup_queue(&timestamp_queue);
-  if (sockfd >= 0)
-    close(sockfd);
-  if (clientfd >= 0)
-    close(clientfd);
-
+  pthread_kill(pool->main_thread, SIGTERM);
   return NULL;
 }
 
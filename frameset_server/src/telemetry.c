@@ -0,0 +1,270 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "logging.h"
+#include "metrics.h"
+#include "telemetry.h"
+
+static int bind_stats_socket() {
+  char logstr[128];
+
+  int sockfd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (sockfd < 0) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error creating camera stats socket: %s",
+      strerror(errno)
+    );
+    log(ERROR, logstr);
+    return -errno;
+  }
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(CAM_STATS_PORT);
+  addr.sin_addr.s_addr = INADDR_ANY;
+
+  if (bind(sockfd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    int err = errno;
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error binding camera stats socket: %s",
+      strerror(err)
+    );
+    log(ERROR, logstr);
+    close(sockfd);
+    return -err;
+  }
+
+  return sockfd;
+}
+
+int init_telemetry(struct telemetry* tm, cam_conf* confs, uint32_t cam_count, pid_t pid) {
+  /**
+   * Creates the metrics page and the socket the cameras report to
+   *
+   * Like the frameset segment, a page left over from a previous run is
+   * truncated and rebuilt, and readers only trust it once the magic is
+   * written, last.
+   *
+   * Parameters:
+   * - struct telemetry* tm: the telemetry to initialize
+   * - cam_conf* confs: the cameras, for their names and stream ports
+   * - uint32_t cam_count: number of cameras
+   * - pid_t pid: the server's pid, published in the header
+   *
+   * Returns:
+   * - int: 0 on success, or a negative error code
+   */
+  char logstr[128];
+
+  memset(tm, 0, sizeof(*tm));
+  tm->shm_fd = -1;
+  tm->stats_fd = -1;
+  tm->confs = confs;
+  tm->cam_count = cam_count;
+  tm->size = metrics_shm_size(cam_count);
+
+  tm->shm_fd = shm_open(METRICS_SHM_NAME, O_CREAT | O_RDWR, 0666);
+  if (tm->shm_fd == -1) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error creating metrics page: %s",
+      strerror(errno)
+    );
+    log(ERROR, logstr);
+    return -errno;
+  }
+
+  if (ftruncate(tm->shm_fd, 0) == -1 || ftruncate(tm->shm_fd, tm->size) == -1) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error sizing metrics page: %s",
+      strerror(errno)
+    );
+    log(ERROR, logstr);
+    return -errno;
+  }
+
+  void* page = mmap(
+    NULL,
+    tm->size,
+    PROT_READ | PROT_WRITE,
+    MAP_SHARED,
+    tm->shm_fd,
+    0
+  );
+  if (page == MAP_FAILED) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error mapping metrics page: %s",
+      strerror(errno)
+    );
+    log(ERROR, logstr);
+    return -errno;
+  }
+  tm->page = page;
+  tm->hdr = page;
+
+  struct timespec real_ts;
+  clock_gettime(CLOCK_REALTIME, &real_ts);
+
+  memset(page, 0, tm->size);
+  tm->hdr->version = METRICS_VERSION;
+  tm->hdr->cam_count = cam_count;
+  tm->hdr->server_pid = pid;
+  tm->hdr->start_ts = real_ts.tv_sec * 1000000000ULL + real_ts.tv_nsec;
+  tm->hdr->decimation = 1;
+  for (uint32_t i = 0; i < cam_count; i++)
+    strncpy(metrics_get_cam(page, i)->name, confs[i].name, METRICS_NAME_LEN - 1);
+
+  int ret = bind_stats_socket();
+  if (ret < 0)
+    return ret;
+  tm->stats_fd = ret;
+
+  atomic_thread_fence(memory_order_release);
+  tm->hdr->magic = METRICS_MAGIC;
+  return 0;
+}
+
+struct metrics_cam* telemetry_cam(struct telemetry* tm, uint32_t cam) {
+  return metrics_get_cam(tm->page, cam);
+}
+
+void telemetry_recv(struct telemetry* tm) {
+  /**
+   * Copies every report waiting on the stats socket into its camera's
+   * entry
+   *
+   * Reports are matched to cameras by the stream port they carry, and
+   * anything that isn't a well formed report from a known camera is
+   * counted and dropped.
+   */
+  struct cam_stats_msg msg;
+  ssize_t len;
+  while ((len = recv(tm->stats_fd, &msg, sizeof(msg), MSG_TRUNC)) >= 0) {
+    if (
+      (size_t)len != sizeof(msg) ||
+      msg.magic != CAM_STATS_MAGIC ||
+      msg.version != CAM_STATS_VERSION
+    ) {
+      metrics_add(&tm->hdr->stats_rejected, 1);
+      continue;
+    }
+
+    uint32_t cam = 0;
+    while (cam < tm->cam_count && tm->confs[cam].tcp_port != msg.tcp_port)
+      cam++;
+    if (cam == tm->cam_count) {
+      log_fmt(DEBUG, "Discarding stats report from unknown stream port %u", msg.tcp_port);
+      metrics_add(&tm->hdr->stats_rejected, 1);
+      continue;
+    }
+
+    struct timespec real_ts;
+    clock_gettime(CLOCK_REALTIME, &real_ts);
+    metrics_write_report(
+      telemetry_cam(tm, cam),
+      &msg,
+      real_ts.tv_sec * 1000000000ULL + real_ts.tv_nsec
+    );
+  }
+}
+
+void telemetry_exposure(struct telemetry* tm, uint32_t cam, uint64_t timestamp, uint64_t sensor_ts) {
+  /**
+   * Records how far after its scheduled time a frame's exposure started
+   *
+   * The camera only starts an exposure at the sensor's next frame
+   * boundary once the capture is queued, so offsets up to a frame
+   * interval are the skew the schedule can't remove. An exposure which
+   * started a whole interval or more late belongs to a later frame in
+   * all but name, and is counted as late.
+   *
+   * Parameters:
+   * - struct telemetry* tm: the telemetry
+   * - uint32_t cam: the camera
+   * - uint64_t timestamp: the frame's scheduled capture time
+   * - uint64_t sensor_ts: when its exposure started, 0 if unknown
+   */
+  if (!sensor_ts)
+    return;
+
+  struct metrics_cam* metrics = telemetry_cam(tm, cam);
+  int64_t offset = (int64_t)(sensor_ts - timestamp);
+  metrics_observe(&metrics->exposure_offset, offset);
+  if (offset >= (int64_t)(1000000000ULL / tm->confs[cam].fps))
+    metrics_add(&metrics->exposures_late, 1);
+}
+
+void telemetry_sample(
+  struct telemetry* tm,
+  const struct rate_ctl* rc,
+  const struct assembler* as,
+  struct frameset_shm_header* frameset_hdr
+) {
+  /**
+   * Copies the gauges and counters kept by other parts of the main
+   * thread into the page
+   *
+   * Cheap enough to call on every pass of the main loop, the rate
+   * controller itself only measures every RATE_CTL_INTERVAL.
+   *
+   * Parameters:
+   * - struct telemetry* tm: the telemetry
+   * - const struct rate_ctl* rc: for each camera's backlog and quality
+   * - const struct assembler* as: for the incomplete framesets
+   * - struct frameset_shm_header* frameset_hdr: for the lease drops
+   */
+  struct metrics_header* hdr = tm->hdr;
+  for (uint32_t i = 0; i < tm->cam_count; i++) {
+    struct metrics_cam* cam = telemetry_cam(tm, i);
+    metrics_store(&cam->pkt_queue_depth, rc->cams[i].depth);
+    metrics_store(&cam->decode_lag_ns, rc->cams[i].lag);
+    metrics_store(&cam->quality_level, rc->cams[i].level);
+    metrics_store(&cam->framesets_missed, as->cam_missed[i]);
+  }
+
+  metrics_store(&hdr->decimation, rc->decimation);
+  metrics_store(&hdr->framesets_partial, as->partial);
+  metrics_store(&hdr->framesets_dropped, as->dropped);
+  metrics_store(
+    &hdr->lease_drops,
+    atomic_load_explicit(&frameset_hdr->lease_drops, memory_order_relaxed)
+  );
+}
+
+void cleanup_telemetry(struct telemetry* tm) {
+  if (tm->page) {
+    tm->hdr->magic = 0; // tells the exporter the server is gone
+    munmap(tm->page, tm->size);
+    tm->page = NULL;
+  }
+
+  if (tm->shm_fd >= 0) {
+    close(tm->shm_fd);
+    shm_unlink(METRICS_SHM_NAME);
+    tm->shm_fd = -1;
+  }
+
+  if (tm->stats_fd >= 0) {
+    close(tm->stats_fd);
+    tm->stats_fd = -1;
+  }
+}
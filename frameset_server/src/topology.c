@@ -0,0 +1,399 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logging.h"
+#include "stream_mgr.h"
+#include "topology.h"
+
+#define SYSFS_CPU "/sys/devices/system/cpu"
+#define SYSFS_NODE "/sys/devices/system/node"
+#define MAX_CACHE_INDEX 16
+
+static int read_sysfs(const char* path, char* buf, size_t len) {
+  FILE* file = fopen(path, "r");
+  if (!file)
+    return -errno;
+
+  size_t read = fread(buf, 1, len - 1, file);
+  fclose(file);
+  buf[read] = '\0';
+
+  // sysfs values end in a newline
+  while (read > 0 && (buf[read - 1] == '\n' || buf[read - 1] == ' '))
+    buf[--read] = '\0';
+
+  return 0;
+}
+
+int parse_cpu_list(const char* str, cpu_set_t* cpus) {
+  /**
+   * Parses a CPU list such as 0-7,16-23, the format sysfs uses
+   *
+   * Returns:
+   * - int: the number of CPUs in the list, or -EINVAL if it's malformed
+   */
+  CPU_ZERO(cpus);
+
+  const char* pos = str;
+  while (*pos) {
+    char* end;
+    long first = strtol(pos, &end, 10);
+    if (end == pos || first < 0 || first >= CPU_SETSIZE)
+      return -EINVAL;
+
+    long last = first;
+    pos = end;
+    if (*pos == '-') {
+      last = strtol(pos + 1, &end, 10);
+      if (end == pos + 1 || last < first || last >= CPU_SETSIZE)
+        return -EINVAL;
+      pos = end;
+    }
+
+    for (long cpu = first; cpu <= last; cpu++)
+      CPU_SET(cpu, cpus);
+
+    if (*pos == ',')
+      pos++;
+    else if (*pos)
+      return -EINVAL;
+  }
+
+  return CPU_COUNT(cpus);
+}
+
+static int read_cpu_list(const char* path, cpu_set_t* cpus) {
+  char buf[1024];
+  int ret = read_sysfs(path, buf, sizeof(buf));
+  if (ret)
+    return ret;
+
+  return parse_cpu_list(buf, cpus);
+}
+
+static bool read_l3(int cpu, cpu_set_t* shared, uint64_t* size) {
+  /**
+   * Finds the CPUs sharing a CPU's L3, and the L3's size
+   *
+   * Returns:
+   * - bool: false if sysfs has no L3 for the CPU
+   */
+  char path[128];
+  char buf[64];
+
+  for (int i = 0; i < MAX_CACHE_INDEX; i++) {
+    snprintf(path, sizeof(path), SYSFS_CPU "/cpu%d/cache/index%d/level", cpu, i);
+    if (read_sysfs(path, buf, sizeof(buf)))
+      return false; // indices are contiguous, so there are no more
+    if (strcmp(buf, "3") != 0)
+      continue;
+
+    snprintf(path, sizeof(path), SYSFS_CPU "/cpu%d/cache/index%d/shared_cpu_list", cpu, i);
+    if (read_cpu_list(path, shared) <= 0)
+      return false;
+
+    // reported in K, as in 32768K
+    *size = 0;
+    snprintf(path, sizeof(path), SYSFS_CPU "/cpu%d/cache/index%d/size", cpu, i);
+    if (read_sysfs(path, buf, sizeof(buf)) == 0) {
+      char* unit;
+      *size = strtoull(buf, &unit, 10);
+      if (*unit == 'K')
+        *size *= 1024;
+      else if (*unit == 'M')
+        *size *= 1024 * 1024;
+    }
+    return true;
+  }
+
+  return false;
+}
+
+static bool primary_thread(int cpu) {
+  // the lowest numbered hardware thread of each core comes first
+  char path[128];
+  cpu_set_t siblings;
+  snprintf(path, sizeof(path), SYSFS_CPU "/cpu%d/topology/thread_siblings_list", cpu);
+  if (read_cpu_list(path, &siblings) <= 0)
+    return true;
+
+  for (int i = 0; i < cpu; i++) {
+    if (CPU_ISSET(i, &siblings))
+      return false;
+  }
+  return true;
+}
+
+static void find_nodes(struct topology* topo) {
+  char path[300];
+  for (uint32_t i = 0; i < topo->domain_count; i++)
+    topo->domains[i].node = -1;
+
+  DIR* dir = opendir(SYSFS_NODE);
+  if (!dir)
+    return;
+
+  struct dirent* entry;
+  while ((entry = readdir(dir)) != NULL) {
+    int node;
+    if (sscanf(entry->d_name, "node%d", &node) != 1)
+      continue;
+
+    cpu_set_t node_cpus;
+    snprintf(path, sizeof(path), SYSFS_NODE "/%s/cpulist", entry->d_name);
+    if (read_cpu_list(path, &node_cpus) <= 0)
+      continue;
+
+    for (uint32_t i = 0; i < topo->domain_count; i++) {
+      struct cache_domain* domain = &topo->domains[i];
+      if (CPU_ISSET(domain->cpu_order[0], &node_cpus))
+        domain->node = node;
+    }
+  }
+
+  closedir(dir);
+}
+
+static int compare_domains(const void* a, const void* b) {
+  const struct cache_domain* da = a;
+  const struct cache_domain* db = b;
+  if (da->l3_size != db->l3_size)
+    return da->l3_size > db->l3_size ? -1 : 1;
+
+  return (int)da->cpu_order[0] - (int)db->cpu_order[0];
+}
+
+int discover_topology(struct topology* topo) {
+  /**
+   * Groups the CPUs the process may run on into L3 domains
+   *
+   * CPUs sysfs has no L3 for are put in a domain of their own kind
+   * together, so an unusual or virtualized machine still gets a plan,
+   * just without any locality.
+   *
+   * Parameters:
+   * - struct topology* topo: receives the domains
+   *
+   * Returns:
+   * - int: 0 on success, or a negative error code
+   */
+  char logstr[128];
+
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error reading process affinity: %s",
+      strerror(errno)
+    );
+    log(ERROR, logstr);
+    return -errno;
+  }
+
+  memset(topo, 0, sizeof(*topo));
+  cpu_set_t domain_shared[TOPO_MAX_DOMAINS];
+  int unknown = -1; // domain holding CPUs without an L3
+
+  // two passes, so every domain lists its cores before their siblings
+  for (int pass = 0; pass < 2; pass++) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (!CPU_ISSET(cpu, &allowed) || primary_thread(cpu) != (pass == 0))
+        continue;
+
+      cpu_set_t shared;
+      uint64_t l3_size = 0;
+      bool has_l3 = read_l3(cpu, &shared, &l3_size);
+
+      int found = has_l3 ? -1 : unknown;
+      for (uint32_t i = 0; has_l3 && i < topo->domain_count; i++) {
+        if (CPU_EQUAL(&shared, &domain_shared[i]) && (int)i != unknown) {
+          found = i;
+          break;
+        }
+      }
+
+      if (found < 0) {
+        if (topo->domain_count == TOPO_MAX_DOMAINS) {
+          log(ERROR, "More L3 domains than the topology can hold");
+          return -E2BIG;
+        }
+
+        found = topo->domain_count++;
+        CPU_ZERO(&topo->domains[found].cpus);
+        topo->domains[found].l3_size = l3_size;
+        if (has_l3)
+          domain_shared[found] = shared;
+        else
+          unknown = found;
+      }
+
+      struct cache_domain* domain = &topo->domains[found];
+      CPU_SET(cpu, &domain->cpus);
+      domain->cpu_order[domain->cpu_count++] = cpu;
+    }
+  }
+
+  if (topo->domain_count == 0) {
+    log(ERROR, "Found no CPUs to run on");
+    return -ENODEV;
+  }
+
+  qsort(topo->domains, topo->domain_count, sizeof(topo->domains[0]), compare_domains);
+  find_nodes(topo);
+  return 0;
+}
+
+void load_placement_conf(const struct rig_placement* rig, struct placement_conf* conf) {
+  /**
+   * Unpacks the placement overrides parse_conf found in the camera conf
+   *
+   * Parameters:
+   * - const struct rig_placement* rig: the snapshot's placement
+   * - struct placement_conf* conf: receives the overrides, unset ones
+   *                                are -1 or empty
+   */
+  conf->main_core = rig->main_core;
+  conf->ingest_core = rig->ingest_core;
+  conf->decode_core_count = rig->decode_core_count;
+
+  CPU_ZERO(&conf->decode_cores);
+  for (int cpu = 0; cpu < RIG_CPU_WORDS * 64 && cpu < CPU_SETSIZE; cpu++) {
+    if (rig->decode_cores[cpu / 64] & (1ULL << (cpu % 64)))
+      CPU_SET(cpu, &conf->decode_cores);
+  }
+}
+
+int plan_placement(
+  const struct topology* topo,
+  const struct placement_conf* conf,
+  uint32_t cam_count,
+  bool shared_ingest,
+  struct placement* plan
+) {
+  /**
+   * Assigns cameras to L3 domains and threads to CPUs
+   *
+   * In each domain the main thread takes the first CPU, then the
+   * ingest thread, then the decode workers, wrapping around a domain
+   * too small to give them a CPU each.
+   *
+   * Parameters:
+   * - const struct topology* topo: the discovered domains
+   * - const struct placement_conf* conf: overrides from the camera conf
+   * - uint32_t cam_count: number of cameras
+   * - bool shared_ingest: one ingest thread for every camera, for when
+   *                       its packets feed a single consumer, like the recorder
+   * - struct placement* plan: receives the plan
+   *
+   * Returns:
+   * - int: 0 on success, or a negative error code
+   */
+  memset(plan, 0, sizeof(*plan));
+  plan->shared_ingest = shared_ingest;
+
+  uint32_t group_count = (cam_count + PLAN_CAMS_PER_GROUP - 1) / PLAN_CAMS_PER_GROUP;
+  if (group_count > topo->domain_count)
+    group_count = topo->domain_count;
+  if (conf->decode_core_count)
+    group_count = 1;
+  plan->group_count = group_count;
+
+  uint32_t first_cam = 0;
+  for (uint32_t g = 0; g < group_count; g++) {
+    struct placement_group* group = &plan->groups[g];
+    const struct cache_domain* domain = &topo->domains[g];
+    group->domain = g;
+    group->first_cam = first_cam;
+    group->cam_count = cam_count / group_count + (g < cam_count % group_count);
+    first_cam += group->cam_count;
+
+    uint32_t next = 0;
+    if (g == 0)
+      plan->main_core = domain->cpu_order[next++ % domain->cpu_count];
+    if (g == 0 || !shared_ingest)
+      group->ingest_core = domain->cpu_order[next++ % domain->cpu_count];
+
+    uint32_t spare = domain->cpu_count > next ? domain->cpu_count - next : 1;
+    uint32_t workers = group->cam_count;
+    if (workers > DECODE_WORKERS)
+      workers = DECODE_WORKERS;
+    if (workers > spare)
+      workers = spare;
+
+    group->worker_count = workers;
+    for (uint32_t i = 0; i < workers; i++)
+      group->worker_cores[i] = domain->cpu_order[(next + i) % domain->cpu_count];
+  }
+
+  if (conf->decode_core_count) {
+    struct placement_group* group = &plan->groups[0];
+    group->worker_count = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE && group->worker_count < PLAN_MAX_WORKERS; cpu++) {
+      if (group->worker_count == cam_count)
+        break;
+      if (CPU_ISSET(cpu, &conf->decode_cores))
+        group->worker_cores[group->worker_count++] = cpu;
+    }
+  }
+  if (conf->main_core >= 0)
+    plan->main_core = conf->main_core;
+  if (conf->ingest_core >= 0)
+    plan->groups[0].ingest_core = conf->ingest_core;
+
+  for (uint32_t g = 0; g < group_count; g++)
+    plan->worker_count += plan->groups[g].worker_count;
+
+  return 0;
+}
+
+void log_placement(const struct topology* topo, const struct placement* plan) {
+  log_fmt(
+    INFO,
+    "Placement: %u L3 domains, %u camera groups, main thread on cpu %u",
+    topo->domain_count,
+    plan->group_count,
+    plan->main_core
+  );
+
+  for (uint32_t g = 0; g < plan->group_count; g++) {
+    const struct placement_group* group = &plan->groups[g];
+    const struct cache_domain* domain = &topo->domains[group->domain];
+
+    char cores[64];
+    size_t len = 0;
+    cores[0] = '\0';
+    for (uint32_t i = 0; i < group->worker_count && len < sizeof(cores); i++) {
+      len += snprintf(
+        cores + len,
+        sizeof(cores) - len,
+        i ? ",%u" : "%u",
+        group->worker_cores[i]
+      );
+    }
+
+    char ingest[16];
+    if (g == 0 || !plan->shared_ingest)
+      snprintf(ingest, sizeof(ingest), "%u", group->ingest_core);
+    else
+      snprintf(ingest, sizeof(ingest), "shared");
+
+    log_fmt(
+      INFO,
+      "Group %u: node %d, %lu KiB L3, cams %u-%u, ingest cpu %s, decode cpus %s",
+      g,
+      domain->node,
+      domain->l3_size / 1024,
+      group->first_cam,
+      group->first_cam + group->cam_count - 1,
+      ingest,
+      cores
+    );
+  }
+}
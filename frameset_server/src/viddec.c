@@ -1,13 +1,71 @@
 #include <libavcodec/avcodec.h>
 #include <libavutil/hwcontext.h>
+#include <libavutil/dict.h>
 #include <libavutil/frame.h>
 #include <string.h>
 
+#ifdef CUDA_FRAMESETS
+#include <cuda_runtime_api.h>
+#include <libavutil/hwcontext_cuda.h>
+#endif
+
 #include "logging.h"
+#include "ts_ring.h"
 #include "viddec.h"
 
+int init_hw_device(struct AVBufferRef** hw_device_ctx) {
+  /**
+   * Creates the CUDA device context shared by every decoder
+   *
+   * A single device context means a single CUDA context for the whole
+   * server, rather than one per camera stream, which saves the memory
+   * and startup time of a context per stream.
+   *
+   * Parameters:
+   * - struct AVBufferRef** hw_device_ctx: receives the device context
+   *
+   * Returns:
+   * - int: 0 on success, or a negative error code
+   */
+  char logstr[128];
+
+  int hw_flags = 0;
+#ifdef CUDA_FRAMESETS
+  // share the runtime API's primary context so the decoded surfaces
+  // can be copied into the cudaMalloc'd frameset pool directly
+  hw_flags = AV_CUDA_USE_PRIMARY_CONTEXT;
+#endif
+
+  int ret = av_hwdevice_ctx_create(
+    hw_device_ctx,
+    AV_HWDEVICE_TYPE_CUDA,
+    NULL,
+    NULL,
+    hw_flags
+  );
+  if (ret < 0) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Failed to create CUDA device: %s",
+      strerror(ret)
+    );
+    log(ERROR, logstr);
+    return ret;
+  }
+
+  return 0;
+}
+
+void cleanup_hw_device(struct AVBufferRef** hw_device_ctx) {
+  if (*hw_device_ctx) {
+    av_buffer_unref(hw_device_ctx);
+  }
+}
+
 int init_decoder(
   decoder* dec,
+  struct AVBufferRef* hw_device_ctx,
   uint32_t width,
   uint32_t height
 ) {
@@ -30,25 +88,7 @@ int init_decoder(
     return -ENOMEM;
   }
 
-  ret = av_hwdevice_ctx_create(
-    &dec->hw_device_ctx,
-    AV_HWDEVICE_TYPE_CUDA,
-    NULL,
-    NULL,
-    0
-  );
-  if (ret < 0) {
-    snprintf(
-      logstr,
-      sizeof(logstr),
-      "Failed to create CUDA device: %s",
-      strerror(ret)
-    );
-    log(ERROR, logstr);
-    goto cleanup;
-  }
-
-  dec->ctx->hw_device_ctx = av_buffer_ref(dec->hw_device_ctx);
+  dec->ctx->hw_device_ctx = av_buffer_ref(hw_device_ctx);
   if (!dec->ctx->hw_device_ctx) {
     log(ERROR, "Failed to reference hw device context");
     goto cleanup;
@@ -59,11 +99,17 @@ int init_decoder(
   dec->ctx->pix_fmt = AV_PIX_FMT_CUDA;
   dec->ctx->pkt_timebase = (AVRational){1, 90000};
 
+  // cuvid allocates 25 decode surfaces per stream by default, far more
+  // than a low latency stream without B frames needs
+  AVDictionary* opts = NULL;
+  av_dict_set_int(&opts, "surfaces", DECODE_SURFACES, 0);
+
   ret = avcodec_open2(
     dec->ctx,
     codec,
-    NULL
+    &opts
   );
+  av_dict_free(&opts);
   if (ret < 0) {
     snprintf(
       logstr,
@@ -91,6 +137,24 @@ int init_decoder(
     goto cleanup;
   }
 
+#ifdef CUDA_FRAMESETS
+  cudaError_t cuda_ret = cudaStreamCreateWithFlags(
+    (cudaStream_t*)&dec->cuda_stream,
+    cudaStreamNonBlocking
+  );
+  if (cuda_ret != cudaSuccess) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Failed to create CUDA stream: %s",
+      cudaGetErrorString(cuda_ret)
+    );
+    log(ERROR, logstr);
+    ret = -ENODEV;
+    goto cleanup;
+  }
+#endif
+
   return 0;
 
   cleanup:
@@ -99,6 +163,12 @@ int init_decoder(
 }
 
 void cleanup_decoder(decoder* dec) {
+#ifdef CUDA_FRAMESETS
+  if (dec->cuda_stream) {
+    cudaStreamDestroy((cudaStream_t)dec->cuda_stream);
+    dec->cuda_stream = NULL;
+  }
+#endif
   if (dec->pkt) {
     av_packet_free(&dec->pkt);
   }
@@ -109,18 +179,25 @@ void cleanup_decoder(decoder* dec) {
     av_frame_free(&dec->hw_frame);
   }
   if (dec->ctx) {
-    avcodec_free_context(&dec->ctx);
-  }
-  if (dec->hw_device_ctx) {
-    av_buffer_unref(&dec->hw_device_ctx);
+    avcodec_free_context(&dec->ctx); // drops its hw device reference
   }
 }
 
-int decode_packet(decoder* dec, uint8_t* data, uint32_t size) {
+int decode_packet(decoder* dec, uint8_t* data, uint32_t size, int64_t pts) {
+  /**
+   * Sends a packet to the decoder, tagged with a pts
+   *
+   * The pts comes back on the frame decoded from the packet, which
+   * is how frames are matched to their packets' timestamps.
+   *
+   * Returns:
+   * - int: 0 on success, or a negative error code
+   */
   char logstr[128];
 
   dec->pkt->data = data;
   dec->pkt->size = size;
+  dec->pkt->pts = pts;
 
   int ret = avcodec_send_packet(dec->ctx, dec->pkt);
   if (ret < 0) {
@@ -139,10 +216,8 @@ int decode_packet(decoder* dec, uint8_t* data, uint32_t size) {
   return 0;
 }
 
-int recv_frame(decoder* dec, uint8_t* out_buf) {
-  int ret = 0;
-
-  ret = avcodec_receive_frame(dec->ctx, dec->hw_frame);
+static int receive_hw_frame(decoder* dec, int64_t* pts) {
+  int ret = avcodec_receive_frame(dec->ctx, dec->hw_frame);
   if (ret == AVERROR(EAGAIN)) {
     return EAGAIN; // need more frames
   } else if (ret == AVERROR_EOF) {
@@ -152,6 +227,15 @@ int recv_frame(decoder* dec, uint8_t* out_buf) {
     return ret;
   }
 
+  *pts = dec->hw_frame->pts == AV_NOPTS_VALUE ? TS_NO_PTS : dec->hw_frame->pts;
+  return 0;
+}
+
+int recv_frame(decoder* dec, uint8_t* out_buf, int64_t* pts) {
+  int ret = receive_hw_frame(dec, pts);
+  if (ret)
+    return ret;
+
   dec->frame->data[0] = out_buf;
   dec->frame->data[1] = out_buf + (dec->width * dec->height);
   dec->frame->linesize[0] = dec->width;
@@ -166,6 +250,83 @@ int recv_frame(decoder* dec, uint8_t* out_buf) {
   return 0;
 }
 
+#ifdef CUDA_FRAMESETS
+int recv_frame_gpu(decoder* dec, uint8_t* dev_buf, int64_t* pts) {
+  /**
+   * Receives a decoded frame and copies it into device memory
+   *
+   * The decoded surface never leaves the GPU, both NV12 planes are
+   * copied device to device into a tightly packed buffer in the
+   * frameset pool, matching the layout recv_frame produces on the host.
+   *
+   * The copy is synchronized before returning, since the frame is
+   * published to consumers in other processes as soon as this returns.
+   *
+   * Returns:
+   * - 0 on success, EAGAIN/ENODATA like recv_frame, or a negative error
+   */
+  char logstr[128];
+
+  int ret = receive_hw_frame(dec, pts);
+  if (ret)
+    return ret;
+
+  cudaStream_t stream = (cudaStream_t)dec->cuda_stream;
+  size_t y_size = (size_t)dec->width * dec->height;
+
+  cudaError_t cuda_ret = cudaMemcpy2DAsync(
+    dev_buf,
+    dec->width,
+    dec->hw_frame->data[0],
+    dec->hw_frame->linesize[0],
+    dec->width,
+    dec->height,
+    cudaMemcpyDeviceToDevice,
+    stream
+  );
+  if (cuda_ret == cudaSuccess) {
+    cuda_ret = cudaMemcpy2DAsync(
+      dev_buf + y_size,
+      dec->width,
+      dec->hw_frame->data[1],
+      dec->hw_frame->linesize[1],
+      dec->width,
+      dec->height / 2,
+      cudaMemcpyDeviceToDevice,
+      stream
+    );
+  }
+  if (cuda_ret == cudaSuccess)
+    cuda_ret = cudaStreamSynchronize(stream);
+
+  if (cuda_ret != cudaSuccess) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error copying frame into the device pool: %s",
+      cudaGetErrorString(cuda_ret)
+    );
+    log(ERROR, logstr);
+    return -EIO;
+  }
+
+  return 0;
+}
+#endif
+
+void reset_decoder(decoder* dec) {
+  /**
+   * Returns a flushed decoder to the state it was opened in, so it
+   * can take another stream
+   *
+   * Much cheaper than closing and reopening it, cuvid only recreates
+   * its parser and decode session, the device context and surfaces
+   * stay as they are. The next stream must start with a keyframe,
+   * like any new stream.
+   */
+  avcodec_flush_buffers(dec->ctx);
+}
+
 int flush_decoder(decoder* dec) {
   int ret = avcodec_send_packet(dec->ctx, NULL);
   if (ret < 0) {
@@ -5,6 +5,7 @@
 #ifndef CAMERAHANDLER_H
 #define CAMERAHANDLER_H
 
+#include <atomic>
 #include <cstdint>
 #include <memory>
 #include <semaphore.h>
@@ -12,43 +13,69 @@
 #include <vector>
 #include <libcamera/libcamera.h>
 #include "config.h"
+#include "metrics.h"
+#include "spsc_ring.h"
+
+constexpr size_t MAX_DMA_BUFFERS = 64; // one bit each in the free mask
+
+struct captured_frame {
+  uint32_t idx; // DMA buffer, returned with release_buffer
+  uint8_t* data;
+  uint8_t* preview; // the same capture at the preview size, nullptr without a preview stream
+  uint64_t timestamp; // scheduled capture time
+  uint64_t sensor_ts; // measured start of exposure, same clock, 0 if the camera didn't report it
+};
 
 class camera_handler_t {
 public:
   camera_handler_t(
     config& config,
-    sem_t& loop_ctl_sem,
-    volatile sig_atomic_t& frame_rdy
+    sem_t& loop_ctl_sem
   );
   ~camera_handler_t();
   camera_handler_t(const camera_handler_t&) = delete;
   camera_handler_t& operator=(const camera_handler_t&) = delete;
   camera_handler_t(camera_handler_t&&) = delete;
   camera_handler_t& operator=(camera_handler_t&&) = delete;
-  void queue_request();
-
-  uint8_t* frame_buffer;
+  bool queue_request(uint64_t timestamp);
+  bool next_frame(captured_frame& frame);
+  void release_buffer(uint32_t idx);
+  void copy_stats(cam_stats_msg& msg) const;
+  bool has_preview() const;
 
 private:
   void init_frame_bytes(config& config);
   void init_camera_manager();
   void init_camera_config(config& config);
-  void init_dma_buffer();
+  void init_dma_buffers(config& config);
   void init_camera_controls(config& config);
+  uint8_t* map_buffer(const libcamera::FrameBuffer& buffer, size_t bytes);
   void request_complete(libcamera::Request* request);
 
   size_t frame_bytes_;
+  size_t preview_bytes_; // 0 without a preview stream
 
   sem_t& loop_ctl_sem;
-  volatile sig_atomic_t& frame_rdy;
 
-  std::unique_ptr<libcamera::Request> request;
+  std::vector<uint8_t*> frame_buffers_;
+  std::vector<uint8_t*> preview_buffers_; // parallel to frame_buffers_, captured by the same request
+  std::vector<uint64_t> timestamps_; // per buffer, written when queued
+  std::vector<uint64_t> sensor_ts_; // per buffer, written when completed
+  std::atomic<uint64_t> free_bufs_; // buffers neither queued nor held by the encoder
+  spsc_ring<uint32_t, MAX_DMA_BUFFERS> completed_;
+
+  // written from request_complete only, see metrics.h
+  uint64_t frames_captured_ = 0;
+  metrics_hist capture_latency_{};
+
+  std::vector<std::unique_ptr<libcamera::Request>> requests_;
   std::unique_ptr<libcamera::CameraManager> cm_;
   std::shared_ptr<libcamera::Camera> camera_;
   std::unique_ptr<libcamera::CameraConfiguration> config_;
   std::unique_ptr<libcamera::FrameBufferAllocator> allocator_;
   std::unique_ptr<libcamera::ControlList> controls_;
   libcamera::Stream* stream_;
+  libcamera::Stream* preview_stream_;
 };
 
 #endif // CAMERAHANDLER_H
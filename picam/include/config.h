@@ -12,13 +12,19 @@ struct config {
   std::string udp_port;
   std::string enc_speed;
   std::string enc_quality;
+  std::string enc_backend;
+  int enc_bitrate;
   int recording_cpu;
+  int encode_cpu;
+  int send_cpu;
   int dma_buffers;
   int frame_width;
   int frame_height;
   int frame_duration_min;
   int frame_duration_max;
   int fps;
+  int preview_width = 0; // optional, 0 for no preview stream
+  int preview_height = 0;
 };
 
 config parse_config(const std::string& filename);
@@ -5,9 +5,16 @@
 #ifndef CONNECTION_H
 #define CONNECTION_H
 
-#include <queue>
+#include <cstdint>
+#include <netinet/in.h>
 #include <string>
+#include <sys/uio.h>
 #include "config.h"
+#include "ctl_msg.h"
+#include "metrics.h"
+#include "stream_msg.h"
+
+constexpr size_t MAX_BATCHED_PKTS = 8;
 
 class connection {
 public:
@@ -17,17 +24,33 @@ public:
 
   int tcpfd;
   int conn_tcp();
-  int stream_pkt(const uint8_t* data, uint32_t size);
+  int stream_pkt(uint8_t stream_id, uint64_t timestamp, uint64_t sensor_ts, uint8_t flags, const uint8_t* data, uint32_t size);
+  int queue_pkt(uint8_t stream_id, uint64_t timestamp, uint64_t sensor_ts, uint8_t flags, const uint8_t* data, uint32_t size);
+  int send_queued();
   int end_stream();
   void discon_tcp();
+  bool resumed();
 
   int udpfd;
   int bind_udp();
-  size_t recv_msg(char* msg_buf, size_t size);
+  ssize_t recv_msg(char* msg_buf, size_t size);
+  int send_stats(const cam_stats_msg& msg);
+
+  int ctlfd;
+  int join_ctl();
+  ssize_t recv_ctl(ctl_arm& cmd, struct sockaddr_in& from);
+  int send_ack(const ctl_msg& msg, uint8_t flags, uint64_t recv_ts, const struct sockaddr_in& to);
 
-  std::queue<uint64_t> frame_timestamps;
 
 private:
+  stream_hdr headers[MAX_BATCHED_PKTS];
+  struct iovec iov[MAX_BATCHED_PKTS * 2];
+  size_t queued_pkts;
+  uint16_t cam_id; // the stream port, see stream_msg.h
+  uint32_t seq; // headers sent, across reconnects so the server sees the gap
+  bool resumed_; // reconnected partway through the stream
+  struct sockaddr_in stats_addr; // the server's CAM_STATS_PORT, set by bind_udp
+
   std::string server_ip;
   std::string tcp_port;
   std::string udp_port;
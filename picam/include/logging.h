@@ -5,8 +5,18 @@
 #ifndef LOGGING_H
 #define LOGGING_H
 
+#include <stdbool.h>
+#include <stdint.h>
+
 #define LOG(lvl, msg) log_msg(lvl, __FILE__, __LINE__, msg)
 
+// formats only when the level is logged, for messages on hot paths
+#define LOG_FMT(lvl, ...) \
+  do { \
+    if (log_enabled(lvl)) \
+      log_msg_fmt(lvl, __FILE__, __LINE__, __VA_ARGS__); \
+  } while (0)
+
 typedef enum log_level {
   INFO,
   DEBUG,
@@ -14,8 +24,19 @@ typedef enum log_level {
   ERROR
 } log_level;
 
+#define LOG_ALL_LEVELS ((1u << INFO) | (1u << DEBUG) | (1u << WARNING) | (1u << ERROR))
+
+extern uint32_t log_level_mask;
+
+static inline bool log_enabled(log_level lvl) {
+  return __atomic_load_n(&log_level_mask, __ATOMIC_RELAXED) & (1u << lvl);
+}
+
 int setup_logging(const char* fpath);
 void cleanup_logging();
+void set_log_level(log_level lvl);
 void log_msg(log_level lvl, const char* file, int line, const char* log_str);
+void log_msg_fmt(log_level lvl, const char* file, int line, const char* fmt, ...)
+  __attribute__((format(printf, 4, 5)));
 
 #endif
@@ -0,0 +1,212 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * Sync health and pipeline telemetry, kept continuously so the rig
+ * can be watched without parsing log text.
+ *
+ * Every camera sends the server a cam_stats_msg on CAM_STATS_PORT
+ * each CAM_STATS_INTERVAL, covering how closely it keeps to the
+ * shared capture schedule. The server keeps a metrics page in shared
+ * memory, METRICS_SHM_NAME, with a metrics_header followed by a
+ * metrics_cam per camera, holding its own counters for the camera
+ * alongside the camera's latest report. toolkit/metrics_exporter
+ * scrapes the page into the Prometheus text format.
+ *
+ * Every counter and histogram has a single writer, which updates it
+ * with a relaxed load and store rather than a read-modify-write, so
+ * recording costs the same as bumping a local and never shares a
+ * locked cache line. Readers load fields one at a time, so a scrape
+ * may catch one field a sample ahead of another, which is harmless for
+ * monitoring. The one exception is a camera's report, copied in whole,
+ * which is guarded by a seqlock, see metrics_read_report.
+ *
+ * Histograms have log2 microsecond buckets. Bucket 0 counts values
+ * under 1 us, bucket i values under 2^i us and at least 2^(i - 1) us,
+ * and the last bucket everything larger. Negative durations, a
+ * realtime clock being slewed under a measurement, land in bucket 0.
+ *
+ * Counters run for the life of the process that writes them, so they
+ * can be scraped as Prometheus counters, a restart shows up as a reset.
+ *
+ * This header is shared by the server, picam and the toolkit, and
+ * the copies must be kept identical, valid as both C and C++.
+ */
+
+#define METRICS_SHM_NAME "/mocap-toolkit_metrics"
+#define METRICS_MAGIC 0x5352544dU // "MTRS"
+#define METRICS_VERSION 5
+#define METRICS_HIST_BUCKETS 24 // the last one starts at about 4 s
+#define METRICS_NAME_LEN 16
+
+#define CAM_STATS_PORT 12400 // UDP, on the server
+#define CAM_STATS_MAGIC 0x54415453U // "STAT"
+#define CAM_STATS_VERSION 1
+#define CAM_STATS_INTERVAL 1000000000ULL // ns between reports
+
+struct metrics_hist {
+  uint64_t count;
+  uint64_t sum_ns;
+  uint64_t buckets[METRICS_HIST_BUCKETS];
+};
+
+/**
+ * Sent raw and little endian, like the rest of the camera messages,
+ * and laid out without padding so it goes on the wire as is. The
+ * camera doesn't know its name, so it's told apart by its stream port,
+ * which is unique across the rig.
+ */
+struct cam_stats_msg {
+  uint32_t magic;
+  uint8_t version;
+  uint8_t reserved;
+  uint16_t tcp_port;
+  uint64_t sent_ts; // CLOCK_REALTIME
+  uint64_t frames_captured;
+  uint64_t schedule_skips; // frames arm_timer skipped, their capture time had already passed
+  uint64_t captures_skipped; // every capture buffer was in use
+  uint64_t frames_dropped; // frame ring full, dropped before encoding
+  uint64_t frames_encoded;
+  uint64_t encoder_stalls; // packet ring full
+  uint64_t pkts_sent;
+  uint64_t pkts_discarded; // sent after the connection was lost
+  struct metrics_hist timer_latency; // scheduled capture to the timer signal
+  struct metrics_hist capture_latency; // scheduled capture to the completed request
+  struct metrics_hist encode_latency; // frame submitted to packet out
+};
+
+struct metrics_cam {
+  char name[METRICS_NAME_LEN];
+
+  // written by the camera's ingest thread
+  uint64_t pkts_received;
+  uint64_t bytes_received;
+  uint64_t ingest_stalls; // the camera's packet pool ran out, its socket stopped being read
+  uint64_t stream_resyncs; // lost sync or missed packets, see stream_msg.h
+  uint64_t pkts_skipped; // dropped while waiting for a keyframe to resync on
+  uint64_t stream_faults; // connection lost or timed out mid session, see ingest.h
+  uint64_t stream_recoveries; // reconnected after a fault and streaming again
+  uint64_t degraded; // gauge, 1 while the camera is masked out of framesets
+
+  // written by whichever decode worker holds the stream
+  uint64_t frames_decoded;
+  uint64_t decoder_drops; // packets the decoder never returned a frame for
+  uint64_t decode_errors; // the decoder was reset in place after failing
+  struct metrics_hist decode_time; // one packet decoded and its frames received
+
+  // written by the main thread
+  uint64_t frames_late; // arrived after their frameset was emitted
+  uint64_t framesets_missed; // published incomplete or dropped without it, while it was expected
+  struct metrics_hist arrival_skew; // after the first frame of the same frameset
+  struct metrics_hist exposure_offset; // measured start of exposure after the scheduled capture
+  uint64_t exposures_late; // started a whole frame interval or more after their scheduled capture
+  uint64_t pkt_queue_depth; // gauges, as of the rate controller's last update
+  uint64_t decode_lag_ns;
+  uint64_t quality_level;
+  struct metrics_hist ctl_rtt; // control group ping to the camera's answer, see ctl_msg.h
+  uint64_t clock_offset_ns; // gauge, signed, how far the camera's clock is ahead of the server's
+
+  // the camera's latest report, copied in by the main thread
+  uint64_t report_seq; // odd while the report is being written
+  uint64_t report_recv_ts; // CLOCK_REALTIME, 0 until the first report
+  struct cam_stats_msg report;
+};
+
+struct metrics_header {
+  uint32_t magic; // written last, zeroed as the server exits
+  uint32_t version;
+  uint32_t cam_count;
+  uint32_t server_pid;
+  uint64_t start_ts; // CLOCK_REALTIME the page was created
+
+  // written by the main thread
+  uint64_t sessions;
+  uint64_t framesets_published;
+  uint64_t framesets_partial; // published with cameras missing
+  uint64_t framesets_dropped; // never completed, or overrun by later frames
+  uint64_t lease_drops; // slot still leased by a consumer, see frameset_shm.h
+  uint64_t decimation;
+  uint64_t stats_rejected; // camera reports that were malformed or from an unknown port
+  uint64_t ctl_repeats; // control commands sent again for cameras yet to acknowledge them
+};
+
+static inline size_t metrics_shm_size(uint32_t cam_count) {
+  return sizeof(struct metrics_header) + sizeof(struct metrics_cam) * cam_count;
+}
+
+static inline struct metrics_cam* metrics_get_cam(void* page, uint32_t cam) {
+  return (struct metrics_cam*)((uint8_t*)page + sizeof(struct metrics_header)) + cam;
+}
+
+static inline uint64_t metrics_load(const uint64_t* field) {
+  return __atomic_load_n(field, __ATOMIC_RELAXED);
+}
+
+static inline void metrics_store(uint64_t* field, uint64_t value) {
+  __atomic_store_n(field, value, __ATOMIC_RELAXED);
+}
+
+static inline void metrics_add(uint64_t* counter, uint64_t n) {
+  // single writer, so no read-modify-write is needed
+  metrics_store(counter, metrics_load(counter) + n);
+}
+
+static inline uint32_t metrics_bucket(uint64_t us) {
+  if (!us)
+    return 0;
+
+  uint32_t bucket = 64 - __builtin_clzll(us);
+  return bucket < METRICS_HIST_BUCKETS ? bucket : METRICS_HIST_BUCKETS - 1;
+}
+
+static inline void metrics_observe(struct metrics_hist* hist, int64_t ns) {
+  uint64_t value = ns > 0 ? (uint64_t)ns : 0;
+  metrics_add(&hist->buckets[metrics_bucket(value / 1000)], 1);
+  metrics_add(&hist->sum_ns, value);
+  metrics_add(&hist->count, 1);
+}
+
+static inline void metrics_hist_copy(struct metrics_hist* dst, const struct metrics_hist* src) {
+  // the count is read first, so it never runs ahead of the buckets
+  dst->count = metrics_load(&src->count);
+  dst->sum_ns = metrics_load(&src->sum_ns);
+  for (int i = 0; i < METRICS_HIST_BUCKETS; i++)
+    dst->buckets[i] = metrics_load(&src->buckets[i]);
+}
+
+static inline void metrics_write_report(struct metrics_cam* cam, const struct cam_stats_msg* report, uint64_t now) {
+  uint64_t seq = metrics_load(&cam->report_seq);
+  metrics_store(&cam->report_seq, seq + 1);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy(&cam->report, report, sizeof(*report));
+  cam->report_recv_ts = now;
+  __atomic_store_n(&cam->report_seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static inline bool metrics_read_report(const struct metrics_cam* cam, struct cam_stats_msg* out, uint64_t* recv_ts) {
+  /**
+   * Copies out a camera's latest report, retrying while the main
+   * thread is halfway through writing one
+   *
+   * Returns:
+   * - bool: false if the camera hasn't reported yet
+   */
+  while (true) {
+    uint64_t seq = __atomic_load_n(&cam->report_seq, __ATOMIC_ACQUIRE);
+    if (seq & 1)
+      continue;
+
+    memcpy(out, &cam->report, sizeof(*out));
+    *recv_ts = cam->report_recv_ts;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (metrics_load(&cam->report_seq) == seq)
+      return seq != 0;
+  }
+}
+
+#endif // METRICS_H
@@ -0,0 +1,189 @@
+// © 2024 Alec Fessler
+// MIT License
+// See LICENSE file in the project root for full license information.
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <atomic>
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <semaphore.h>
+#include <thread>
+#include "camera_handler.h"
+#include "config.h"
+#include "connection.h"
+#include "metrics.h"
+#include "spsc_ring.h"
+#include "stream_msg.h"
+#include "ts_ring.h"
+#include "videnc.h"
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+constexpr size_t FRAME_RING_SIZE = 4;
+constexpr size_t PKT_RING_SIZE = 32;
+constexpr uint64_t ENC_STATS_INTERVAL = 300; // frames between encoder stats logs
+
+/**
+ * Encoding and sending run on threads of their own, so the capture
+ * schedule kept by the main thread never waits on either.
+ *
+ * The main thread hands captured frames to the encode thread through
+ * a frame ring, and the encode thread hands packets to the send
+ * thread through a packet ring. Each stage only blocks on its own
+ * input, so a TCP stall or reconnect backs up the packet ring and
+ * then the frame ring, but the timer keeps firing on schedule.
+ *
+ * Backpressure is resolved where it's cheapest. A full frame ring
+ * drops the raw frame before it's encoded, which the stream never
+ * notices, while a full packet ring stalls the encoder instead, since
+ * dropping an encoded packet would corrupt every frame referencing
+ * it. Both are counted in pipeline_stats.
+ *
+ * Stream control travels through the same rings as the data, so an
+ * end of stream or reset reaches each stage after every frame that
+ * came before it.
+ *
+ * Between streams the encoder is kept warm, flushed in place if it
+ * supports that, or swapped for a spare opened in the background
+ * otherwise, so a new stream never waits on opening a codec.
+ *
+ * The quality level the server asks for, see rate_msg.h, is picked up
+ * by the encode thread before its next frame instead, since it costs
+ * nothing to apply a frame late and should never wait behind a full
+ * frame ring. An encoder that can only take a new level when it's
+ * opened gets a spare at that level, swapped in once it's ready.
+ *
+ * A camera with a preview stream keeps an encoder for each stream,
+ * see stream_msg.h, both fed from the same capture by the encode
+ * thread, and only encodes the streams the server subscribed it to,
+ * picked up the same way as the quality level. A stream that's
+ * unsubscribed is flushed and reset, so it starts from a keyframe
+ * whenever it's subscribed again.
+ */
+
+enum class pipeline_msg {
+  FRAME,
+  END_STREAM, // flush, send what's left, then notify the server
+  RESET, // discard everything in flight and reconnect
+  STOP // flush, send what's left, then exit
+};
+
+struct raw_frame {
+  pipeline_msg type;
+  captured_frame frame;
+  bool held; // the capture buffer has yet to be released
+};
+
+struct enc_pkt {
+  pipeline_msg type;
+  uint8_t stream_id;
+  AVPacket* pkt;
+  uint64_t timestamp;
+  uint64_t sensor_ts;
+  uint8_t flags; // see stream_msg.h
+};
+
+struct pipeline_stats {
+  std::atomic<uint64_t> frames_encoded{0};
+  std::atomic<uint64_t> frames_dropped{0}; // frame ring full
+  std::atomic<uint64_t> captures_skipped{0}; // every capture buffer in use
+  std::atomic<uint64_t> encoder_stalls{0}; // packet ring full
+  std::atomic<uint64_t> encoder_stall_ns{0};
+  std::atomic<uint64_t> pkts_sent{0};
+  std::atomic<uint64_t> pkts_discarded{0}; // sent after the connection was lost
+  std::atomic<uint64_t> send_calls{0};
+  std::atomic<uint64_t> quality_changes{0};
+
+  // written by the encode thread only
+  std::atomic<const char*> enc_backend{"none"};
+  std::atomic<uint64_t> enc_pkts{0};
+  std::atomic<uint64_t> enc_latency_ns{0}; // frame submitted to packet out, summed
+  std::atomic<uint64_t> enc_latency_max_ns{0};
+  metrics_hist enc_latency_hist{}; // see metrics.h, read with metrics_hist_copy
+  std::atomic<uint64_t> enc_cpu_ns{0}; // process cpu time spent encoding, summed
+};
+
+/**
+ * One of the streams the camera encodes. Only touched by the encode
+ * thread.
+ */
+struct enc_stream {
+  uint8_t id; // see stream_msg.h
+  config conf; // the camera's, at this stream's size and bitrate
+  std::unique_ptr<videnc> encoder; // null for a stream the camera can't produce
+  ts_ring pending_frames; // matched to packets by pts
+  int64_t next_pts = 0;
+  uint32_t level = 0; // quality level the encoder is at
+  std::future<std::unique_ptr<videnc>> spare; // opened ahead for encoders that can't reset or change level
+  uint32_t spare_level = 0;
+  bool subscribed = false;
+};
+
+class pipeline {
+public:
+  pipeline(
+    const config& config,
+    connection& conn,
+    camera_handler_t& cam,
+    sem_t& loop_ctl_sem
+  );
+  ~pipeline();
+  pipeline(const pipeline&) = delete;
+  pipeline& operator=(const pipeline&) = delete;
+
+  bool push_frame(const captured_frame& frame);
+  void set_quality(uint32_t level);
+  void set_streams(uint8_t streams);
+  void end_stream();
+  void reset_stream();
+  bool conn_lost();
+  bool failed();
+  void log_stats();
+
+  pipeline_stats stats;
+
+private:
+  void push_msg(pipeline_msg type);
+  void encode_loop();
+  void send_loop();
+  void encode_msg(raw_frame& msg);
+  void encode_frame(enc_stream& stream, const captured_frame& frame, bool keyframe);
+  void drain_encoder(enc_stream& stream);
+  void lose_conn();
+  void log_enc_stats();
+  void open_encoder(enc_stream& stream);
+  void open_spare(enc_stream& stream);
+  void start_spare(enc_stream& stream);
+  static bool spare_ready(const enc_stream& stream);
+  void swap_spare(enc_stream& stream);
+  void restart_encoder(enc_stream& stream);
+  void apply_quality(enc_stream& stream);
+  void apply_streams();
+
+  const config conf;
+  connection& conn;
+  camera_handler_t& cam;
+  sem_t& loop_ctl_sem;
+
+  spsc_ring<raw_frame, FRAME_RING_SIZE> frames;
+  spsc_ring<enc_pkt, PKT_RING_SIZE> pkts;
+
+  // encode thread only
+  enc_stream streams[STREAM_COUNT];
+  AVPacket* scratch_pkt;
+
+  std::atomic<uint32_t> quality_level; // quality level the server asked for
+  std::atomic<uint8_t> streams_wanted; // streams the server subscribed to
+  std::atomic<bool> conn_lost_;
+  std::atomic<bool> failed_;
+  std::atomic<bool> keyframe_wanted_; // the send thread reconnected, the server needs one to resync
+
+  std::thread encode_thread;
+  std::thread send_thread;
+};
+
+#endif // PIPELINE_H
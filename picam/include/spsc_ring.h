@@ -0,0 +1,123 @@
+// © 2024 Alec Fessler
+// MIT License
+// See LICENSE file in the project root for full license information.
+
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <cerrno>
+#include <cstddef>
+#include <semaphore.h>
+#include <stdexcept>
+#include "logging.h"
+
+template <typename T, size_t N>
+class spsc_ring {
+  /**
+   * Fixed size ring of slots passed between exactly one producer
+   * thread and one consumer thread.
+   *
+   * Slots are filled and read in place, so nothing is copied in or
+   * out. Ownership of a slot is carried by a pair of counting
+   * semaphores, one for free slots and one for filled slots, which
+   * also provide the memory ordering between the two sides. Each
+   * index is only ever touched by one side.
+   *
+   * Blocking operations are built on sem_wait, so a thread with
+   * nothing to do sleeps rather than spinning, and sem_post is
+   * async signal safe, so the producer may be a signal handler.
+   *
+   * The consumer may hold several filled slots at once, taken in
+   * order with wait/try_next and given back oldest first with
+   * release, which lets it batch their contents.
+   */
+public:
+  spsc_ring() : head(0), read(0) {
+    if (sem_init(&free_slots, 0, N) < 0) {
+      const char* err = "Failed to initialize ring semaphore";
+      LOG(ERROR, err);
+      throw std::runtime_error(err);
+    }
+    if (sem_init(&filled_slots, 0, 0) < 0) {
+      sem_destroy(&free_slots);
+      const char* err = "Failed to initialize ring semaphore";
+      LOG(ERROR, err);
+      throw std::runtime_error(err);
+    }
+  }
+
+  ~spsc_ring() {
+    sem_destroy(&free_slots);
+    sem_destroy(&filled_slots);
+  }
+
+  spsc_ring(const spsc_ring&) = delete;
+  spsc_ring& operator=(const spsc_ring&) = delete;
+
+  T& at(size_t idx) { return slots[idx]; }
+
+  // producer side
+
+  T* try_claim() {
+    /**
+     * Returns the next free slot, or nullptr if the ring is full
+     */
+    if (sem_trywait(&free_slots) < 0) return nullptr;
+    return &slots[head];
+  }
+
+  T* claim() {
+    /**
+     * Returns the next free slot, blocking until one is released
+     */
+    while (sem_wait(&free_slots) < 0 && errno == EINTR);
+    return &slots[head];
+  }
+
+  void publish() {
+    /**
+     * Hands the claimed slot to the consumer
+     */
+    head = (head + 1) % N;
+    sem_post(&filled_slots);
+  }
+
+  // consumer side
+
+  T* try_next() {
+    /**
+     * Returns the next filled slot, or nullptr if there is none
+     */
+    if (sem_trywait(&filled_slots) < 0) return nullptr;
+    T* slot = &slots[read];
+    read = (read + 1) % N;
+    return slot;
+  }
+
+  T* wait() {
+    /**
+     * Returns the next filled slot, blocking until one is published
+     */
+    while (sem_wait(&filled_slots) < 0 && errno == EINTR);
+    T* slot = &slots[read];
+    read = (read + 1) % N;
+    return slot;
+  }
+
+  void release() {
+    /**
+     * Returns the oldest slot held by the consumer to the producer,
+     * slots must be released in the order they were taken
+     */
+    sem_post(&free_slots);
+  }
+
+private:
+  T slots[N];
+  size_t head; // producer only
+  size_t read; // consumer only
+  sem_t free_slots;
+  sem_t filled_slots;
+};
+
+#endif // SPSC_RING_H
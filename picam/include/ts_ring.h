@@ -0,0 +1,157 @@
+#ifndef TS_RING_H
+#define TS_RING_H
+
+#include <errno.h>
+#include <stdalign.h>
+#include <stdint.h>
+
+#ifndef CACHE_LINE_SIZE
+#define CACHE_LINE_SIZE 64
+#endif
+
+#define TS_RING_SIZE 64 // entries, must be a power of two
+#define TS_REORDER_DEPTH 16 // the H.264 DPB limit, no frame comes out later than this
+#define TS_NO_PTS INT64_MIN // same value as AV_NOPTS_VALUE
+
+/**
+ * Pairs the frames going into a codec with what comes out of it.
+ *
+ * Every frame or packet handed to a codec is tagged with a pts and
+ * its entry pushed here, then whatever the codec hands back is
+ * matched to its entry by the pts it carries, rather than by the
+ * order it comes out in. A codec that drops a frame would otherwise
+ * silently shift every timestamp after it by one, while here the
+ * dropped frame's entry is simply never matched.
+ *
+ * Since no frame can come out more than TS_REORDER_DEPTH frames
+ * behind another, an entry that old when a later one is matched
+ * belongs to a dropped frame. It's evicted, and reported, so the
+ * ring never fills with them. Matching an entry out of order leaves
+ * a hole that the oldest entries are retired past, which covers
+ * encoders emitting packets in decode order.
+ *
+ * The ring is fixed size and never allocates. A push into a full
+ * ring is refused rather than overwriting anything, so a codec
+ * holding more frames than expected is reported where it happens.
+ *
+ * Only meant for a single thread. This header is shared by the
+ * server and picam, and the copies must be kept identical.
+ */
+
+struct ts_entry {
+  int64_t pts; // tag given to the codec, TS_NO_PTS once matched
+  uint64_t timestamp; // scheduled capture timestamp of the frame
+  uint64_t sensor_ts; // when its exposure actually started, 0 if unknown
+  uint64_t submit_ns; // when it went into the codec, if the caller cares
+};
+
+struct ts_ring {
+  alignas(CACHE_LINE_SIZE) uint32_t head; // entries ever pushed
+  uint32_t tail; // entries ever retired
+  struct ts_entry entries[TS_RING_SIZE];
+};
+
+static inline void ts_ring_init(struct ts_ring* r) {
+  r->head = 0;
+  r->tail = 0;
+}
+
+static inline uint32_t ts_ring_count(const struct ts_ring* r) {
+  return r->head - r->tail; // including holes left by matching out of order
+}
+
+static inline int ts_ring_push(
+  struct ts_ring* r,
+  int64_t pts,
+  uint64_t timestamp,
+  uint64_t sensor_ts,
+  uint64_t submit_ns
+) {
+  /**
+   * Records a frame going into the codec
+   *
+   * Returns:
+   * - int: 0 on success, or -ENOBUFS if the ring is full
+   */
+  if (r->head - r->tail == TS_RING_SIZE)
+    return -ENOBUFS;
+
+  struct ts_entry* e = &r->entries[r->head & (TS_RING_SIZE - 1)];
+  e->pts = pts;
+  e->timestamp = timestamp;
+  e->sensor_ts = sensor_ts;
+  e->submit_ns = submit_ns;
+  r->head++;
+
+  return 0;
+}
+
+static inline int ts_ring_pop(struct ts_ring* r, struct ts_entry* out) {
+  /**
+   * Takes the oldest unmatched entry, for output without a pts
+   *
+   * Returns:
+   * - int: 0 on success, or -EAGAIN if the ring is empty
+   */
+  while (r->tail != r->head) {
+    struct ts_entry* e = &r->entries[r->tail++ & (TS_RING_SIZE - 1)];
+    if (e->pts != TS_NO_PTS) {
+      *out = *e;
+      return 0;
+    }
+  }
+
+  return -EAGAIN;
+}
+
+static inline int ts_ring_match(
+  struct ts_ring* r,
+  int64_t pts,
+  struct ts_entry* out,
+  uint32_t* evicted
+) {
+  /**
+   * Takes the entry for the frame the codec handed back
+   *
+   * Output without a pts falls back to the oldest entry.
+   *
+   * Parameters:
+   * - struct ts_ring* r: the ring
+   * - int64_t pts: the pts the codec's output carries, or TS_NO_PTS
+   * - struct ts_entry* out: receives the matched entry
+   * - uint32_t* evicted: receives how many entries were given up for
+   *                      dropped frames, even if nothing matched
+   *
+   * Returns:
+   * - int: 0 on success, or -ENOENT if no entry has this pts
+   */
+  *evicted = 0;
+  if (pts == TS_NO_PTS)
+    return ts_ring_pop(r, out) ? -ENOENT : 0;
+
+  int ret = -ENOENT;
+  for (uint32_t i = r->tail; i != r->head; i++) {
+    struct ts_entry* e = &r->entries[i & (TS_RING_SIZE - 1)];
+    if (e->pts == pts) {
+      *out = *e;
+      e->pts = TS_NO_PTS;
+      ret = 0;
+      break;
+    }
+  }
+
+  // retire matched entries, and, against a matched pts, dropped ones
+  while (r->tail != r->head) {
+    struct ts_entry* e = &r->entries[r->tail & (TS_RING_SIZE - 1)];
+    if (e->pts != TS_NO_PTS) {
+      if (ret || e->pts >= pts - TS_REORDER_DEPTH)
+        break;
+      (*evicted)++;
+    }
+    r->tail++;
+  }
+
+  return ret;
+}
+
+#endif // TS_RING_H
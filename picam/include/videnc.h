@@ -9,28 +9,38 @@
 #include <functional>
 #include <memory>
 #include "config.h"
-#include "connection.h"
 extern "C" {
 #include <libavcodec/avcodec.h>
 }
 
 class videnc {
 public:
-  videnc(const config& config);
+  videnc(const config& config, uint32_t level);
   ~videnc();
 
-  void encode_frame(uint8_t* data);
+  void encode_frame(uint8_t* data, int64_t pts);
+  bool set_quality(uint32_t level);
+  bool can_reset() const;
+  void reset();
+  void request_keyframe();
   void flush();
-  uint8_t* recv_frame(int& size);
+  bool recv_packet(AVPacket* pkt);
+  const char* backend_name() const;
 
 private:
+  bool open_codec(const char* name, const config& config, uint32_t level);
+  double crf(uint32_t level) const;
+  int64_t bitrate(uint32_t level) const;
+
   int width;
   int height;
-  int64_t pts_counter;
+  double base_crf;
+  int64_t base_bitrate;
+  const char* backend;
   const AVCodec* codec;
   AVCodecContext* ctx;
   AVFrame* frame;
-  AVPacket* pkt;
+  bool force_keyframe; // the next frame starts a new stream
 };
 
 #endif
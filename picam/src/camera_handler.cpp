@@ -3,19 +3,23 @@
 #include <semaphore.h>
 #include <stdexcept>
 #include <sys/mman.h>
+#include <time.h>
 
 #include "camera_handler.h"
 #include "config.h"
 #include "logging.h"
+#include "trace.h"
 
 
 camera_handler_t::camera_handler_t(
   config& config,
-  sem_t& loop_ctl_sem,
-  volatile sig_atomic_t& frame_rdy
+  sem_t& loop_ctl_sem
 ) :
+  preview_bytes_(0),
   loop_ctl_sem(loop_ctl_sem),
-  frame_rdy(frame_rdy) {
+  free_bufs_(0),
+  stream_(nullptr),
+  preview_stream_(nullptr) {
   /**
    * Manages camera operations using the libcamera API, providing a high-level interface
    * for frame capture and buffer management. The handler coordinates three key tasks:
@@ -24,13 +28,18 @@ camera_handler_t::camera_handler_t(
    * 2. DMA buffer management for zero-copy frame capture
    * 3. Frame completion notification via callback system
    *
-   * When a frame is captured, libcamera writes directly to a DMA buffer and invokes
-   * our callback. The callback then enqueues the buffer pointer to a lock-free queue
-   * and signals the main loop via semaphore that a new frame is ready for processing.
+   * Each capture is queued into whichever of the DMA buffers is free, and when it's
+   * captured libcamera writes directly to that buffer and invokes our callback. The
+   * callback then enqueues the buffer's index to a lock-free queue and signals the
+   * main loop via semaphore that a new frame is ready for processing. The buffer
+   * stays out of the pool until the encoder is done with it and releases it.
+   *
+   * With PREVIEW_WIDTH and PREVIEW_HEIGHT set, the ISP's second output
+   * is configured at that size, and every request captures into a
+   * buffer of each stream, so a frame always comes with its preview.
    *
    * Parameters:
    *   config:        Camera and frame settings including resolution and buffer counts
-   *   frame_queue:   Lock-free queue for sharing frame buffers with main loop
    *   loop_ctl_sem: Semaphore tracking available frames in the queue
    *
    * The initialization sequence is:
@@ -43,7 +52,7 @@ camera_handler_t::camera_handler_t(
   init_frame_bytes(config);
   init_camera_manager();
   init_camera_config(config);
-  init_dma_buffer();
+  init_dma_buffers(config);
   init_camera_controls(config);
 }
 
@@ -62,6 +71,13 @@ void camera_handler_t::init_frame_bytes(config& config) {
   unsigned int u_plane_bytes = y_plane_bytes / 4;
   unsigned int v_plane_bytes = u_plane_bytes;
   frame_bytes_ = y_plane_bytes + u_plane_bytes + v_plane_bytes;
+
+  if (!config.preview_width != !config.preview_height) {
+    const char* err = "PREVIEW_WIDTH and PREVIEW_HEIGHT must be set together";
+    LOG(ERROR, err);
+    throw std::runtime_error(err);
+  }
+  preview_bytes_ = (size_t)config.preview_width * config.preview_height * 3 / 2;
 }
 
 void camera_handler_t::init_camera_manager() {
@@ -112,6 +128,10 @@ void camera_handler_t::init_camera_config(config& config) {
    * - Frame resolution from config
    * - Number of DMA buffers to allocate
    *
+   * A preview stream is given the viewfinder role, which the ISP
+   * serves from its second, downscaling output, with the same format
+   * and buffer count.
+   *
    * The configuration is validated to ensure the camera supports these settings
    * without requiring adjustments.
    *
@@ -121,7 +141,11 @@ void camera_handler_t::init_camera_config(config& config) {
    * Throws:
    *   std::runtime_error: If configuration is invalid or fails to apply
    */
-  config_ = camera_->generateConfiguration({ libcamera::StreamRole::VideoRecording });
+  std::vector<libcamera::StreamRole> roles = { libcamera::StreamRole::VideoRecording };
+  if (preview_bytes_)
+    roles.push_back(libcamera::StreamRole::Viewfinder);
+
+  config_ = camera_->generateConfiguration(roles);
   if (!config_) {
     const char* err = "Failed to generate camera configuration";
     LOG(ERROR, err);
@@ -131,7 +155,19 @@ void camera_handler_t::init_camera_config(config& config) {
   libcamera::StreamConfiguration& cfg = config_->at(0);
   cfg.pixelFormat = libcamera::formats::YUV420;
   cfg.size = { (unsigned int)config.frame_width, (unsigned int)config.frame_height };
-  cfg.bufferCount = 1;
+  if (config.dma_buffers < 1 || config.dma_buffers > (int)MAX_DMA_BUFFERS) {
+    const char* err = "DMA_BUFFERS must be between 1 and 64";
+    LOG(ERROR, err);
+    throw std::runtime_error(err);
+  }
+  cfg.bufferCount = config.dma_buffers;
+
+  if (preview_bytes_) {
+    libcamera::StreamConfiguration& preview_cfg = config_->at(1);
+    preview_cfg.pixelFormat = libcamera::formats::YUV420;
+    preview_cfg.size = { (unsigned int)config.preview_width, (unsigned int)config.preview_height };
+    preview_cfg.bufferCount = config.dma_buffers;
+  }
 
   if (config_->validate() == libcamera::CameraConfiguration::Invalid) {
     const char* err = "Invalid camera configuration, unable to adjust";
@@ -150,37 +186,104 @@ void camera_handler_t::init_camera_config(config& config) {
   }
 }
 
-void camera_handler_t::init_dma_buffer() {
+void camera_handler_t::init_dma_buffers(config& config) {
+  /**
+   * Allocates and maps the pool of DMA buffers, with a request for each.
+   *
+   * Every request carries its buffer's index as its cookie, so a
+   * completed request identifies the buffer it was captured into.
+   * A preview buffer with the same index rides along on the same
+   * request. Every buffer starts out free.
+   *
+   * Parameters:
+   *   config: Contains the number of DMA buffers
+   *
+   * Throws:
+   *   std::runtime_error: If a buffer can't be allocated, attached to
+   *                       its request, or mapped
+   */
   allocator_ = std::make_unique<libcamera::FrameBufferAllocator>(camera_);
   stream_ = config_->at(0).stream();
-  if (allocator_->allocate(stream_) < 0) {
+  if (allocator_->allocate(stream_) < (int)config.dma_buffers) {
     const char* err = "Failed to allocate buffers";
     LOG(ERROR, err);
     throw std::runtime_error(err);
   }
 
-  const std::unique_ptr<libcamera::FrameBuffer>& buffer = allocator_->buffers(stream_)[0];
-  request = camera_->createRequest();
-  if (!request) {
-    const char* err = "Failed to create request";
-    LOG(ERROR, err);
-    throw std::runtime_error(err);
+  if (preview_bytes_) {
+    preview_stream_ = config_->at(1).stream();
+    if (allocator_->allocate(preview_stream_) < (int)config.dma_buffers) {
+      const char* err = "Failed to allocate preview buffers";
+      LOG(ERROR, err);
+      throw std::runtime_error(err);
+    }
   }
 
-  if (request->addBuffer(stream_, buffer.get()) < 0) {
-    const char* err = "Failed to add buffer to request";
-    LOG(ERROR, err);
-    throw std::runtime_error(err);
+  const auto& buffers = allocator_->buffers(stream_);
+  for (size_t i = 0; i < (size_t)config.dma_buffers; i++) {
+    const std::unique_ptr<libcamera::FrameBuffer>& buffer = buffers[i];
+    std::unique_ptr<libcamera::Request> request = camera_->createRequest(i);
+    if (!request) {
+      const char* err = "Failed to create request";
+      LOG(ERROR, err);
+      throw std::runtime_error(err);
+    }
+
+    if (request->addBuffer(stream_, buffer.get()) < 0) {
+      const char* err = "Failed to add buffer to request";
+      LOG(ERROR, err);
+      throw std::runtime_error(err);
+    }
+
+    frame_buffers_.push_back(map_buffer(*buffer, frame_bytes_));
+
+    if (preview_stream_) {
+      const std::unique_ptr<libcamera::FrameBuffer>& preview = allocator_->buffers(preview_stream_)[i];
+      if (request->addBuffer(preview_stream_, preview.get()) < 0) {
+        const char* err = "Failed to add preview buffer to request";
+        LOG(ERROR, err);
+        throw std::runtime_error(err);
+      }
+      preview_buffers_.push_back(map_buffer(*preview, preview_bytes_));
+    }
+
+    requests_.push_back(std::move(request));
   }
 
-  const libcamera::FrameBuffer::Plane& y_plane = buffer->planes()[0];
-  const libcamera::FrameBuffer::Plane& u_plane = buffer->planes()[1];
-  const libcamera::FrameBuffer::Plane& v_plane = buffer->planes()[2];
+  timestamps_.assign(frame_buffers_.size(), 0);
+  sensor_ts_.assign(frame_buffers_.size(), 0);
+  free_bufs_.store(
+    frame_buffers_.size() == 64 ? UINT64_MAX : (1ULL << frame_buffers_.size()) - 1,
+    std::memory_order_release
+  );
+
+  camera_->requestCompleted.connect(this, &camera_handler_t::request_complete);
+}
 
-  unsigned int y_plane_bytes = frame_bytes_ * 2/3;  // Based on YUV420
+uint8_t* camera_handler_t::map_buffer(const libcamera::FrameBuffer& buffer, size_t bytes) {
+  /**
+   * Maps a YUV420 DMA buffer, whose planes are laid out back to back
+   * at the sizes init_frame_bytes works out.
+   *
+   * Parameters:
+   *   buffer: The buffer to map
+   *   bytes:  The size of all three planes together
+   *
+   * Returns:
+   *   The start of the Y plane
+   *
+   * Throws:
+   *   std::runtime_error: If the planes aren't the expected size or
+   *                       the buffer can't be mapped
+   */
+  unsigned int y_plane_bytes = bytes * 2/3;
   unsigned int u_plane_bytes = y_plane_bytes / 4;
   unsigned int v_plane_bytes = u_plane_bytes;
 
+  const libcamera::FrameBuffer::Plane& y_plane = buffer.planes()[0];
+  const libcamera::FrameBuffer::Plane& u_plane = buffer.planes()[1];
+  const libcamera::FrameBuffer::Plane& v_plane = buffer.planes()[2];
+
   if (y_plane.length != y_plane_bytes || u_plane.length != u_plane_bytes || v_plane.length != v_plane_bytes) {
     const char* err = "Plane size does not match expected size";
     LOG(ERROR, err);
@@ -189,7 +292,7 @@ void camera_handler_t::init_dma_buffer() {
 
   void* data = mmap(
     nullptr,
-    frame_bytes_,
+    bytes,
     PROT_READ | PROT_WRITE,
     MAP_SHARED,
     y_plane.fd.get(),
@@ -208,9 +311,7 @@ void camera_handler_t::init_dma_buffer() {
     throw std::runtime_error(logstr);
   }
 
-  frame_buffer = (uint8_t*)data;
-
-  camera_->requestCompleted.connect(this, &camera_handler_t::request_complete);
+  return (uint8_t*)data;
 }
 
 void camera_handler_t::init_camera_controls(config& config) {
@@ -274,27 +375,150 @@ camera_handler_t::~camera_handler_t() {
    * undefined behavior or resource leaks
    */
   camera_->stop();
-  munmap(frame_buffer, frame_bytes_);
+  for (uint8_t* frame_buffer : frame_buffers_)
+    munmap(frame_buffer, frame_bytes_);
+  for (uint8_t* preview_buffer : preview_buffers_)
+    munmap(preview_buffer, preview_bytes_);
+  requests_.clear();
   allocator_->free(stream_);
+  if (preview_stream_)
+    allocator_->free(preview_stream_);
   allocator_.reset();
   camera_->release();
   camera_.reset();
   cm_->stop();
 }
 
-void camera_handler_t::queue_request() {
-  if (camera_->queueRequest(request.get()) < 0) {
+bool camera_handler_t::queue_request(uint64_t timestamp) {
+  /**
+   * Queues a capture into a free DMA buffer.
+   *
+   * A buffer is out of the pool from the moment it's queued until
+   * the encoder is done with the frame and calls release_buffer,
+   * so a capture never overwrites a frame that hasn't been encoded
+   * yet. Safe to call from a signal handler, the pool is a lock-free
+   * mask.
+   *
+   * Parameters:
+   *   timestamp: The scheduled capture time, returned with the frame
+   *
+   * Returns:
+   *   true if the capture was queued
+   *   false if every buffer is in use and the capture was skipped
+   *
+   * Throws:
+   *   std::runtime_error: If the request can't be queued
+   */
+  uint64_t free = free_bufs_.load(std::memory_order_acquire);
+  uint32_t idx;
+  do {
+    if (!free) return false;
+    idx = __builtin_ctzll(free);
+  } while (!free_bufs_.compare_exchange_weak(
+    free,
+    free & ~(1ULL << idx),
+    std::memory_order_acquire
+  ));
+
+  timestamps_[idx] = timestamp;
+  if (camera_->queueRequest(requests_[idx].get()) < 0) {
     const char* err = "Failed to queue request";
     LOG(ERROR, err);
     throw std::runtime_error(err);
   }
+  return true;
+}
+
+bool camera_handler_t::next_frame(captured_frame& frame) {
+  /**
+   * Takes the next completed capture, if there is one.
+   *
+   * The caller owns the frame's buffer until it calls release_buffer.
+   * Must only be called from one thread.
+   */
+  uint32_t* idx = completed_.try_next();
+  if (!idx) return false;
+
+  frame.idx = *idx;
+  completed_.release();
+  frame.data = frame_buffers_[frame.idx];
+  frame.preview = preview_buffers_.empty() ? nullptr : preview_buffers_[frame.idx];
+  frame.timestamp = timestamps_[frame.idx];
+  frame.sensor_ts = sensor_ts_[frame.idx];
+  return true;
+}
+
+void camera_handler_t::release_buffer(uint32_t idx) {
+  /**
+   * Returns a buffer to the pool, may be called from any thread.
+   */
+  free_bufs_.fetch_or(1ULL << idx, std::memory_order_release);
+}
+
+static uint64_t realtime_now(uint64_t* boot_ns) {
+  /**
+   * Reads CLOCK_REALTIME along with CLOCK_BOOTTIME at the same instant.
+   *
+   * libcamera stamps buffers with CLOCK_BOOTTIME, while the capture
+   * schedule runs on CLOCK_REALTIME, which PTP disciplines. The
+   * difference between the two moves only as PTP slews the realtime
+   * clock, so sampling it on every completion is enough to carry a
+   * sensor timestamp into the schedule's domain. The boottime read
+   * is the midpoint of two taken around the realtime one.
+   *
+   * Parameters:
+   *   boot_ns: Receives CLOCK_BOOTTIME in ns
+   *
+   * Returns:
+   *   CLOCK_REALTIME in ns
+   */
+  struct timespec before, real, after;
+  clock_gettime(CLOCK_BOOTTIME, &before);
+  clock_gettime(CLOCK_REALTIME, &real);
+  clock_gettime(CLOCK_BOOTTIME, &after);
+
+  uint64_t before_ns = (uint64_t)before.tv_sec * 1000000000ULL + before.tv_nsec;
+  uint64_t after_ns = (uint64_t)after.tv_sec * 1000000000ULL + after.tv_nsec;
+  *boot_ns = before_ns + (after_ns - before_ns) / 2;
+  return (uint64_t)real.tv_sec * 1000000000ULL + real.tv_nsec;
 }
 
 void camera_handler_t::request_complete(libcamera::Request* request) {
   if (request->status() == libcamera::Request::RequestCancelled)
     return;
 
+  // read before the reuse, which clears the metadata
+  auto sensor_ts = request->metadata().get(libcamera::controls::SensorTimestamp);
   request->reuse(libcamera::Request::ReuseBuffers);
-  frame_rdy = 1;
+
+  // never full, each buffer is in the ring at most once
+  uint32_t* idx = completed_.try_claim();
+  *idx = request->cookie();
+  TRACE_POINT(TRACE_CAPTURED, TRACE_CAM_UNKNOWN, timestamps_[*idx]);
+
+  // the sensor reports the start of exposure in CLOCK_BOOTTIME
+  uint64_t boot_ns;
+  uint64_t now_ns = realtime_now(&boot_ns);
+  sensor_ts_[*idx] = sensor_ts ? (uint64_t)*sensor_ts + (now_ns - boot_ns) : 0;
+
+  // how far behind its scheduled time the capture finished, readout included
+  metrics_observe(&capture_latency_, (int64_t)(now_ns - timestamps_[*idx]));
+  metrics_add(&frames_captured_, 1);
+
+  completed_.publish();
   sem_post(&loop_ctl_sem);
 }
+
+void camera_handler_t::copy_stats(cam_stats_msg& msg) const {
+  /**
+   * Copies the capture counters into a stats report, see metrics.h.
+   *
+   * Safe to call from any thread while requests are completing.
+   */
+  msg.frames_captured = metrics_load(&frames_captured_);
+  metrics_hist_copy(&msg.capture_latency, &capture_latency_);
+}
+
+bool camera_handler_t::has_preview() const {
+  return preview_stream_ != nullptr;
+}
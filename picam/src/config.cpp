@@ -91,8 +91,16 @@ config parse_config(const std::string& filename) {
         config.enc_speed = value;
       else if (key == "ENC_QUALITY")
         config.enc_quality = value;
+      else if (key == "ENC_BACKEND")
+        config.enc_backend = value;
+      else if (key == "ENC_BITRATE")
+        config.enc_bitrate = std::stoi(value);
       else if (key == "RECORDING_CPU")
         config.recording_cpu = std::stoi(value);
+      else if (key == "ENCODE_CPU")
+        config.encode_cpu = std::stoi(value);
+      else if (key == "SEND_CPU")
+        config.send_cpu = std::stoi(value);
       else if (key == "DMA_BUFFERS")
         config.dma_buffers = std::stoi(value);
       else if (key == "FRAME_WIDTH")
@@ -105,6 +113,10 @@ config parse_config(const std::string& filename) {
         config.frame_duration_max = std::stoi(value);
       else if (key == "FPS")
         config.fps = std::stoi(value);
+      else if (key == "PREVIEW_WIDTH")
+        config.preview_width = std::stoi(value);
+      else if (key == "PREVIEW_HEIGHT")
+        config.preview_height = std::stoi(value);
       else
         throw std::runtime_error("Unknown config key: " + key);
     }
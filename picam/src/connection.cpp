@@ -3,18 +3,19 @@
 // See LICENSE file in the project root for full license information.
 
 #include <arpa/inet.h>
+#include <cstdlib>
 #include <cstring>
 #include <errno.h>
 #include <stdexcept>
 #include <string>
 #include <memory>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include "connection.h"
 #include "logging.h"
 
 static const int MAX_RETRIES = 3;
-static constexpr char END_STREAM[] = "EOSTREAM";
 
 connection::connection()
   noexcept :
@@ -28,6 +29,12 @@ connection::connection()
    */
   tcpfd(-1),
   udpfd(-1),
+  ctlfd(-1),
+  queued_pkts(0),
+  cam_id(0),
+  seq(0),
+  resumed_(false),
+  stats_addr(),
   server_ip("UNSET_SERVER"),
   tcp_port("UNSET_PORT"),
   udp_port("UNSET_PORT") {}
@@ -51,6 +58,12 @@ connection::connection(
    */
   tcpfd(-1),
   udpfd(-1),
+  ctlfd(-1),
+  queued_pkts(0),
+  cam_id((uint16_t)strtoul(config.tcp_port.c_str(), nullptr, 10)),
+  seq(0),
+  resumed_(false),
+  stats_addr(),
   server_ip(config.server_ip),
   tcp_port(config.tcp_port),
   udp_port(config.udp_port) {}
@@ -59,8 +72,8 @@ connection::~connection() noexcept {
   /**
    * Safely closes any open network connections.
    *
-   * Ensures proper cleanup of system resources by closing both TCP
-   * and UDP sockets if they were opened. The file descriptors are
+   * Ensures proper cleanup of system resources by closing the TCP
+   * socket and both UDP sockets if they were opened. The file descriptors are
    * set to -1 after closing to maintain a consistent invalid state,
    * though this is technically unnecessary in a destructor.
    */
@@ -72,6 +85,10 @@ connection::~connection() noexcept {
     close(udpfd);
     udpfd = -1;
   }
+  if (ctlfd >= 0) {
+    close(ctlfd);
+    ctlfd = -1;
+  }
 }
 
 int connection::conn_tcp() {
@@ -146,33 +163,91 @@ int connection::conn_tcp() {
   return 0;
 }
 
-int connection::stream_pkt(const uint8_t* data, uint32_t size) {
-  char logstr[128];
+int connection::stream_pkt(uint8_t stream_id, uint64_t timestamp, uint64_t sensor_ts, uint8_t flags, const uint8_t* data, uint32_t size) {
+  /**
+   * Sends a single encoded packet, along with any already queued.
+   */
+  int ret = queue_pkt(stream_id, timestamp, sensor_ts, flags, data, size);
+  if (ret < 0) return ret;
+  return send_queued();
+}
 
-  uint64_t timestamp = frame_timestamps.front();
-  frame_timestamps.pop();
-  uint64_t pkt_size = size + sizeof(size) + sizeof(timestamp);
-  uint8_t pkt[pkt_size];
+int connection::queue_pkt(uint8_t stream_id, uint64_t timestamp, uint64_t sensor_ts, uint8_t flags, const uint8_t* data, uint32_t size) {
+  /**
+   * Queues an encoded packet to be sent by the next send_queued.
+   *
+   * The packet is framed with a stream_hdr, see stream_msg.h, carrying
+   * the scheduled capture time the server assembles framesets on
+   * and when the exposure actually started. The header is kept in a
+   * small array alongside the queue and the payload referenced in
+   * place, so nothing is copied before the write. The payload must
+   * stay valid until it's sent. Nothing is sent here, so the caller
+   * sees every send's result, and it's up to the caller to send before
+   * MAX_BATCHED_PKTS are queued.
+   *
+   * Parameters:
+   *   stream_id: Which of the camera's streams it belongs to
+   *   timestamp: The scheduled capture time
+   *   sensor_ts: The measured start of exposure, or 0
+   *   flags:     STREAM_KEYFRAME or STREAM_END
+   *   data:      The payload, may be null if size is 0
+   *   size:      The payload size
+   *
+   * Returns:
+   *   0 on success
+   *   -ENOBUFS if MAX_BATCHED_PKTS are already queued
+   */
+  if (queued_pkts == MAX_BATCHED_PKTS)
+    return -ENOBUFS;
+
+  stream_hdr& header = headers[queued_pkts];
+  memset(&header, 0, sizeof(header));
+  header.flags = flags;
+  header.stream_id = stream_id;
+  header.cam_id = cam_id;
+  header.seq = seq++;
+  header.size = size;
+  header.timestamp = timestamp;
+  header.sensor_ts = sensor_ts;
+  stream_hdr_seal(&header);
+
+  iov[queued_pkts * 2] = {
+    .iov_base = &header,
+    .iov_len = sizeof(header)
+  };
+  iov[queued_pkts * 2 + 1] = {
+    .iov_base = const_cast<uint8_t*>(data),
+    .iov_len = size
+  };
+
+  queued_pkts++;
+  return 0;
+}
 
-  memcpy(
-    pkt,
-    (const uint8_t*)&timestamp,
-    sizeof(timestamp)
-  );
-  memcpy(
-    pkt + sizeof(timestamp),
-    (const uint8_t*)&size,
-    sizeof(size)
-  );
-  memcpy(
-    pkt + sizeof(timestamp) + sizeof(size),
-    data,
-    size
-  );
+int connection::send_queued() {
+  /**
+   * Sends every queued packet with as few writev calls as possible.
+   *
+   * Partial writes advance through the iovec array in place rather
+   * than falling back to one write per buffer. A packet cut off by a
+   * disconnect is sent again whole on the new connection, so the server
+   * finds a header where it starts reading, and resumed() reports that
+   * the server will be waiting on a keyframe. The queue is empty on
+   * return whether or not the send succeeded.
+   *
+   * Returns:
+   *   0 on success
+   *   -ECONNRESET if the server couldn't be reconnected to
+   *   -errno on other write failures
+   */
+  char logstr[128];
+
+  int iovcnt = queued_pkts * 2;
+  int next = 0;
+  queued_pkts = 0;
 
   int retries = 0;
-  size_t total_written = 0;
-  while (total_written < pkt_size) {
+  while (next < iovcnt) {
     if (tcpfd < 0) {
       LOG(WARNING, "Not connected to server, trying to connect");
       while (tcpfd < 0) {
@@ -191,12 +266,26 @@ int connection::stream_pkt(const uint8_t* data, uint32_t size) {
           continue;
         }
       }
+
+      // nothing of a packet cut off by the disconnect is any use to the server
+      size_t pkt = next / 2;
+      if (next % 2) {
+        size_t sent = headers[pkt].size - iov[next].iov_len;
+        iov[next].iov_base = (uint8_t*)iov[next].iov_base - sent;
+        iov[next].iov_len = headers[pkt].size;
+      }
+      iov[pkt * 2] = {
+        .iov_base = &headers[pkt],
+        .iov_len = sizeof(stream_hdr)
+      };
+      next = pkt * 2;
+      resumed_ = true;
     }
 
-    ssize_t result = write(
+    ssize_t result = writev(
       tcpfd,
-      pkt + total_written,
-      pkt_size - total_written
+      iov + next,
+      iovcnt - next
     );
 
     if (result < 0) {
@@ -217,66 +306,40 @@ int connection::stream_pkt(const uint8_t* data, uint32_t size) {
       return -errno;
     }
 
-    total_written += result;
+    size_t written = result;
+    while (next < iovcnt && written >= iov[next].iov_len) {
+      written -= iov[next].iov_len;
+      next++;
+    }
+    if (written) {
+      iov[next].iov_base = (uint8_t*)iov[next].iov_base + written;
+      iov[next].iov_len -= written;
+    }
   }
+
   return 0;
 }
 
 int connection::end_stream() {
-  char logstr[128];
-  size_t end_stream_size = sizeof(END_STREAM) - 1;
-
-  int retries = 0;
-  size_t total_written = 0;
-  while (total_written < end_stream_size) {
-    if (tcpfd < 0) {
-      LOG(WARNING, "Not connected to server, trying to connect");
-      while (tcpfd < 0) {
-        int ret = conn_tcp();
-        if (ret < 0) {
-          if (++retries == MAX_RETRIES) {
-            LOG(WARNING, "No more connection retries");
-            return -ECONNRESET;
-          }
-          LOG(WARNING, "Failed to connect, retrying");
-          struct timespec ts {
-            .tv_sec = 0,
-            .tv_nsec = 1000000
-          };
-          nanosleep(&ts, NULL);
-          continue;
-        }
-      }
-    }
-
-    ssize_t result = write(
-      tcpfd,
-      END_STREAM + total_written,
-      end_stream_size - total_written
-    );
-
-    if (result < 0) {
-      if (errno == EINTR) continue;
-      if (errno == EPIPE || errno == ECONNRESET) {
-        LOG(WARNING, "Server disconnected while notifying end of stream");
-        close(tcpfd);
-        tcpfd = -1;
-        continue;
-      }
-      snprintf(
-        logstr,
-        sizeof(logstr),
-        "Error transmitting end of stream packet: %s",
-        strerror(errno)
-      );
-      LOG(ERROR, logstr);
-      return -errno;
-    }
-
-    total_written += result;
-  }
+  /**
+   * Tells the server the stream is over, after any packets still queued.
+   * There's a single end for every stream on the connection.
+   *
+   * Returns:
+   *   the result of send_queued
+   */
+  return stream_pkt(STREAM_MAIN, 0, 0, STREAM_END, nullptr, 0);
+}
 
-  return 0;
+bool connection::resumed() {
+  /**
+   * Returns whether send_queued reconnected partway through the stream
+   * since the last call, in which case the next frame should be a
+   * keyframe, the server discards everything until one arrives.
+   */
+  bool was_resumed = resumed_;
+  resumed_ = false;
+  return was_resumed;
 }
 
 void connection::discon_tcp() {
@@ -298,6 +361,8 @@ int connection::bind_udp() {
    * 1. Socket creation with IPv4 and UDP protocol
    * 2. Port number validation (1-65535)
    * 3. Socket binding with retry on EINTR
+   * 4. Resolving the server's stats port, which send_stats reports
+   *    to over the same socket
    *
    * The method is idempotent - if a socket is already bound, it
    * returns success without creating a new one. This supports
@@ -347,10 +412,18 @@ int connection::bind_udp() {
     return -errno;
   }
 
+  memset(&stats_addr, 0, sizeof(stats_addr));
+  stats_addr.sin_family = AF_INET;
+  stats_addr.sin_port = htons(CAM_STATS_PORT);
+  if (inet_pton(AF_INET, server_ip.c_str(), &stats_addr.sin_addr) <= 0) {
+    LOG(ERROR, "Invalid server IP address");
+    return -EINVAL;
+  }
+
   return 0;
 }
 
-size_t connection::recv_msg(char* msg_buf, size_t size) {
+ssize_t connection::recv_msg(char* msg_buf, size_t size) {
   return recvfrom(
     udpfd,
     msg_buf,
@@ -360,3 +433,163 @@ size_t connection::recv_msg(char* msg_buf, size_t size) {
     NULL
   );
 }
+
+int connection::send_stats(const cam_stats_msg& msg) {
+  /**
+   * Sends a stats report to the server, see metrics.h.
+   *
+   * Never blocks, a report that can't be sent right away is simply
+   * lost, the next one carries the same counters a second later.
+   *
+   * Returns:
+   *   0 on success
+   *   -errno if the report wasn't sent
+   */
+  ssize_t sent = sendto(
+    udpfd,
+    &msg,
+    sizeof(msg),
+    MSG_DONTWAIT,
+    (struct sockaddr*)&stats_addr,
+    sizeof(stats_addr)
+  );
+  return sent < 0 ? -errno : 0;
+}
+
+int connection::join_ctl() {
+  /**
+   * Creates a UDP socket joined to the server's control group.
+   *
+   * Session commands are multicast to every camera at once on
+   * CTL_PORT, see ctl_msg.h, and acknowledged over the same socket
+   * back to wherever they came from. SO_REUSEADDR lets the port be
+   * bound again right away after a restart.
+   *
+   * The method is idempotent - if the socket already exists, it
+   * returns success without creating a new one.
+   *
+   * Returns:
+   *   0 on success
+   *   -errno on system call failures
+   */
+  if (ctlfd >= 0) return 0;
+  char logstr[128];
+
+  ctlfd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (ctlfd < 0) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Failed to create control socket: %s",
+      strerror(errno)
+    );
+    LOG(ERROR, logstr);
+    return -errno;
+  }
+
+  int enable = 1;
+  if (setsockopt(ctlfd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) < 0) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Failed to set control socket options: %s",
+      strerror(errno)
+    );
+    LOG(ERROR, logstr);
+    return -errno;
+  }
+
+  struct sockaddr_in ctl_addr;
+  memset(&ctl_addr, 0, sizeof(ctl_addr));
+  ctl_addr.sin_family = AF_INET;
+  ctl_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  ctl_addr.sin_port = htons(CTL_PORT);
+
+  while (bind(ctlfd, (struct sockaddr*)&ctl_addr, sizeof(ctl_addr)) < 0) {
+    if (errno == EINTR) continue;
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Failed to bind control socket: %s",
+      strerror(errno)
+    );
+    LOG(ERROR, logstr);
+    return -errno;
+  }
+
+  struct ip_mreq mreq;
+  memset(&mreq, 0, sizeof(mreq));
+  inet_pton(AF_INET, CTL_GROUP, &mreq.imr_multiaddr);
+  mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+  if (setsockopt(ctlfd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Failed to join the control group: %s",
+      strerror(errno)
+    );
+    LOG(ERROR, logstr);
+    return -errno;
+  }
+
+  return 0;
+}
+
+ssize_t connection::recv_ctl(ctl_arm& cmd, struct sockaddr_in& from) {
+  /**
+   * Receives one datagram from the control group, if one is waiting.
+   *
+   * Every command fits in a ctl_arm, the largest of them, see ctl_msg.h.
+   *
+   * Returns:
+   *   The datagram's full size, which only matches the command's if
+   *   it's well formed, or -1 once there's nothing left to read
+   */
+  socklen_t from_len = sizeof(from);
+  return recvfrom(
+    ctlfd,
+    &cmd,
+    sizeof(cmd),
+    MSG_DONTWAIT | MSG_TRUNC,
+    (struct sockaddr*)&from,
+    &from_len
+  );
+}
+
+int connection::send_ack(const ctl_msg& msg, uint8_t flags, uint64_t recv_ts, const struct sockaddr_in& to) {
+  /**
+   * Acknowledges a control command to whoever sent it.
+   *
+   * Like send_stats, never blocks, the server repeats the command if
+   * the acknowledgement is lost.
+   *
+   * Parameters:
+   *   msg:     The command being acknowledged
+   *   flags:   See ctl_msg.h, CTL_ACK_REFUSED if it can't be followed
+   *   recv_ts: CLOCK_REALTIME when the command was received
+   *   to:      Where the command came from
+   *
+   * Returns:
+   *   0 on success
+   *   -errno if the acknowledgement wasn't sent
+   */
+  ctl_ack ack{};
+  ack.magic = CTL_ACK_MAGIC;
+  ack.version = CTL_VERSION;
+  ack.cmd = msg.cmd;
+  ack.flags = flags;
+  ack.cam_id = cam_id;
+  ack.seq = msg.seq;
+  ack.echo_ts = msg.timestamp;
+  ack.recv_ts = recv_ts;
+
+  ssize_t sent = sendto(
+    ctlfd,
+    &ack,
+    sizeof(ack),
+    MSG_DONTWAIT,
+    (const struct sockaddr*)&to,
+    sizeof(to)
+  );
+  return sent < 0 ? -errno : 0;
+}
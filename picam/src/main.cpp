@@ -22,16 +22,49 @@
 
 #include "camera_handler.h"
 #include "connection.h"
+#include "ctl_msg.h"
 #include "logging.h"
+#include "metrics.h"
+#include "pipeline.h"
+#include "rate_msg.h"
 #include "sem_init.h"
-#include "videnc.h"
+#include "trace.h"
 
 constexpr uint64_t ns_per_s = 1'000'000'000;
 
 volatile static uint64_t timestamp = 0;
 volatile static sig_atomic_t running = 1;
 volatile static sig_atomic_t stream_end = 0;
-volatile static sig_atomic_t frame_rdy = 0;
+volatile static sig_atomic_t capture_fired = 0;
+volatile static sig_atomic_t capture_skipped = 0;
+volatile static uint64_t capture_ts = 0; // timestamp of the next capture
+volatile static uint64_t stop_ts = 0; // a scheduled CTL_STOP, 0 if none is pending
+volatile static uint64_t stopped_ts = 0; // when the last session was stopped, older ARMs are stale
+volatile static sig_atomic_t streams_received = 0;
+volatile static sig_atomic_t pending_streams = STREAM_BIT(STREAM_MAIN); // see ctl_msg.h
+static uint8_t subscribed = STREAM_BIT(STREAM_MAIN); // written by handle_ctl only
+
+// set before SIGIO is enabled
+static uint16_t cam_fps = 0;
+static uint16_t cam_port = 0; // identifies the camera's subscription
+static uint8_t cam_streams = 0; // the streams the camera can produce
+volatile static sig_atomic_t rate_received = 0;
+static rate_msg pending_rate; // written by io_signal_handler, read with SIGIO blocked
+
+// sync health, see metrics.h, written by capture_signal_handler and arm_timer
+static metrics_hist timer_latency{};
+static uint64_t schedule_skips = 0;
+
+/**
+ * Which frames of the schedule are captured, every decimation'th
+ * from from_ts on, and every prev_decimation'th before it
+ * (see rate_msg.h). Only touched by the main loop.
+ */
+struct decimation_sched {
+  uint32_t decimation = 1;
+  uint32_t prev_decimation = 1;
+  uint64_t from_ts = 0;
+};
 
 static std::unique_ptr<sem_t, sem_deleter> loop_ctl_sem;
 static std::unique_ptr<camera_handler_t> cam;
@@ -41,14 +74,14 @@ inline int init_realtime_scheduling(int recording_cpu);
 inline int init_timer(timer_t* timerid);
 inline int init_signals();
 inline int init_sigio(int fd);
-inline void arm_timer(
+inline void apply_rate(pipeline& pipe, decimation_sched& sched);
+inline void handle_ctl(const ctl_arm& cmd, const struct sockaddr_in& from);
+inline void report_stats(pipeline& pipe, uint16_t tcp_port, uint64_t& next_report);
+inline uint64_t arm_timer(
   timer_t timerid,
   uint64_t frame_duration,
-  uint64_t& frame_counter
-);
-inline int flush_encoder(
-  videnc& encoder,
-  connection& conn
+  uint64_t& frame_counter,
+  const decimation_sched& sched
 );
 
 int main() {
@@ -63,65 +96,110 @@ int main() {
 
     uint64_t frame_counter = 0;
     uint64_t frame_duration = ns_per_s / config.fps;
+    uint16_t tcp_port = std::stoi(config.tcp_port);
+    uint64_t next_report = 0;
+    decimation_sched sched;
     timer_t timerid;
 
     loop_ctl_sem = init_semaphore();
 
     cam = std::make_unique<camera_handler_t>(
       config,
-      *loop_ctl_sem.get(),
-      frame_rdy
+      *loop_ctl_sem.get()
     );
     conn = std::make_unique<connection>(config);
-    auto encoder = std::make_unique<videnc>(config);
+    auto pipe = std::make_unique<pipeline>(
+      config,
+      *conn,
+      *cam,
+      *loop_ctl_sem.get()
+    );
 
     if ((ret = init_realtime_scheduling(config.recording_cpu)) < 0) return ret;
     if ((ret = init_timer(&timerid)) < 0) return ret;
     if ((ret = init_signals()) < 0) return ret;
+    cam_fps = config.fps;
+    cam_port = tcp_port;
+    cam_streams = STREAM_BIT(STREAM_MAIN) | (cam->has_preview() ? STREAM_BIT(STREAM_PREVIEW) : 0);
     if ((ret = conn->bind_udp()) < 0) return ret;
+    if ((ret = conn->join_ctl()) < 0) return ret;
     if ((ret = init_sigio(conn->udpfd)) < 0) return ret;
+    if ((ret = init_sigio(conn->ctlfd)) < 0) return ret;
 
+    // the timer is armed again as soon as it fires, each capture
+    // request records its own timestamp, so any number may be in flight
+    bool armed = false;
     while (running) {
-      if (timestamp) {
-        arm_timer(
+      if (timestamp && !armed) {
+        capture_ts = arm_timer(
           timerid,
           frame_duration,
-          ++frame_counter
+          ++frame_counter,
+          sched
         );
+        armed = true;
+
+        // off the capture path, the next capture is at least a frame away
+        report_stats(*pipe, tcp_port, next_report);
       }
 
       sem_wait(loop_ctl_sem.get());
 
-      if (frame_rdy) {
-        frame_rdy = 0;
-        if (!stream_end) {
-          encoder->encode_frame(cam->frame_buffer);
-          int pkt_size = 0;
-          uint8_t* ptr = encoder->recv_frame(pkt_size);
-          if (ptr) {
-            ret = conn->stream_pkt(ptr, pkt_size);
-            if (ret == -ECONNRESET) {
-              timestamp = 0;
-              frame_counter = 0;
-              stream_end = 0;
-              conn->discon_tcp();
-              encoder = std::make_unique<videnc>(config);
-            }
-          }
-        }
+      if (pipe->failed())
+        throw std::runtime_error("Encode pipeline failed");
+
+      captured_frame frame;
+      while (cam->next_frame(frame)) {
+        if (!timestamp || !pipe->push_frame(frame))
+          cam->release_buffer(frame.idx);
+      }
+
+      if (capture_fired) {
+        capture_fired = 0;
+        armed = false;
+      }
+
+      if (capture_skipped) {
+        capture_skipped = 0;
+        pipe->stats.captures_skipped.fetch_add(1, std::memory_order_relaxed);
+      }
+
+      if (rate_received) {
+        rate_received = 0;
+        apply_rate(*pipe, sched);
+      }
+
+      if (streams_received) {
+        streams_received = 0;
+        pipe->set_streams(pending_streams);
+      }
+
+      // each stream starts over at the full rate and quality
+      if (pipe->conn_lost()) {
+        timestamp = 0;
+        stop_ts = 0;
+        frame_counter = 0;
+        stream_end = 0;
+        armed = false;
+        sched = decimation_sched();
+        pipe->set_quality(0);
+        pipe->reset_stream();
       }
 
       if (stream_end) {
         stream_end = 0;
         frame_counter = 0;
-        ret = flush_encoder(*encoder, *conn);
-        if (ret == 0)
-          conn->end_stream();
-        encoder = std::make_unique<videnc>(config);
+        armed = false;
+        sched = decimation_sched();
+        pipe->set_quality(0);
+        pipe->end_stream();
+        pipe->log_stats();
       }
     }
 
-    flush_encoder(*encoder, *conn);
+    pipe->log_stats();
+    pipe.reset(); // flushes the encoder and sends what's left
+    TRACE_DUMP("picam.trace");
     cleanup_logging();
 
   } catch (const std::exception& e) {
@@ -143,7 +221,28 @@ void capture_signal_handler(int signo, siginfo_t* info, void* context) {
   (void)signo;
   (void)info;
   (void)context;
-  cam->queue_request();
+
+  // the timer runs on CLOCK_MONOTONIC, so this is where PTP slewing
+  // CLOCK_REALTIME between arming and firing shows up
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  uint64_t now_ns = (uint64_t)now.tv_sec * ns_per_s + now.tv_nsec;
+  metrics_observe(&timer_latency, (int64_t)(now_ns - capture_ts));
+
+  // the rig's last capture was the one before, end the stream on the same frame
+  if (stop_ts && capture_ts >= stop_ts) {
+    stop_ts = 0;
+    timestamp = 0;
+    stream_end = 1;
+    capture_fired = 1;
+    sem_post(loop_ctl_sem.get());
+    return;
+  }
+
+  if (!cam->queue_request(capture_ts))
+    capture_skipped = 1;
+  capture_fired = 1;
+  sem_post(loop_ctl_sem.get());
 }
 
 void io_signal_handler(int signo, siginfo_t* info, void* context) {
@@ -151,28 +250,199 @@ void io_signal_handler(int signo, siginfo_t* info, void* context) {
   (void)info;
   (void)context;
 
-  size_t buf_size = 8; // bytes
-  char buf[buf_size];
-  size_t size = conn->recv_msg(buf, buf_size);
+  // SIGIO doesn't say which socket woke us, both are nonblocking,
+  // so drain the control group and then check for rate feedback
+  ctl_arm cmd;
+  struct sockaddr_in from;
+  ssize_t size;
+  while ((size = conn->recv_ctl(cmd, from)) >= 0) {
+    const ctl_msg& msg = cmd.msg;
+    if (
+      (size_t)size < sizeof(msg) ||
+      msg.magic != CTL_MAGIC ||
+      msg.version != CTL_VERSION ||
+      msg.sub_count > CTL_MAX_SUBS ||
+      (size_t)size != sizeof(msg) + msg.sub_count * sizeof(ctl_sub)
+    ) {
+      LOG(ERROR, "Unexpected control message");
+      continue;
+    }
+    handle_ctl(cmd, from);
+  }
 
-  // 8 bytes is our timestamp
-  if (size == 8) {
-      uint64_t network_timestamp;
-      memcpy(&network_timestamp, buf, sizeof(network_timestamp));
-      timestamp = network_timestamp;
-      sem_post(loop_ctl_sem.get());
-      return;
+  char buf[sizeof(rate_msg)];
+  size = conn->recv_msg(buf, sizeof(buf));
+  if (size < 0)
+    return;
+
+  if ((size_t)size == sizeof(rate_msg)) {
+      uint32_t magic;
+      memcpy(&magic, buf, sizeof(magic));
+      if (magic == RATE_MSG_MAGIC) {
+        memcpy(&pending_rate, buf, sizeof(pending_rate));
+        rate_received = 1;
+        sem_post(loop_ctl_sem.get());
+        return;
+      }
   }
 
-  if (size == 4 && strncmp(buf, "STOP", 4) == 0) {
+  LOG(ERROR, "Unexpected udp message size");
+}
+
+inline void handle_ctl(const ctl_arm& cmd, const struct sockaddr_in& from) {
+  /**
+   * Follows a command from the server's control group, see ctl_msg.h,
+   * and acknowledges it
+   *
+   * Every command is repeated until acknowledged, so each one has to
+   * be safe to follow twice. An ARM older than the last STOP is a
+   * repeat of the session that just ended and is ignored, and a STOP
+   * while not capturing has nothing left to stop. The subscription an
+   * ARM carries is picked up by the main loop whenever it changes.
+   *
+   * Called from io_signal_handler().
+   */
+  const ctl_msg& msg = cmd.msg;
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  uint64_t now_ns = (uint64_t)now.tv_sec * ns_per_s + now.tv_nsec;
+  uint8_t flags = 0;
+
+  switch (msg.cmd) {
+    case CTL_ARM: {
+      uint8_t streams = STREAM_BIT(STREAM_MAIN);
+      for (uint8_t i = 0; i < msg.sub_count; i++) {
+        if (cmd.subs[i].cam_id == cam_port)
+          streams = cmd.subs[i].streams;
+      }
+
+      if (!msg.fps || msg.fps % cam_fps || (streams & ~cam_streams)) {
+        flags |= CTL_ACK_REFUSED;
+        break;
+      }
+      if (streams != subscribed) {
+        subscribed = streams;
+        pending_streams = streams;
+        streams_received = 1;
+        sem_post(loop_ctl_sem.get());
+      }
+      if (msg.timestamp > stopped_ts && timestamp != msg.timestamp) {
+        timestamp = msg.timestamp;
+        sem_post(loop_ctl_sem.get());
+      }
+      break;
+    }
+
+    case CTL_STOP:
+      stopped_ts = msg.timestamp > now_ns ? msg.timestamp : now_ns;
+      if (!timestamp)
+        break;
+      if (msg.timestamp > now_ns) {
+        stop_ts = msg.timestamp;
+        break;
+      }
       LOG(INFO, "Received stop signal, ending stream...");
+      stop_ts = 0;
       timestamp = 0;
       stream_end = 1;
       sem_post(loop_ctl_sem.get());
+      break;
+
+    case CTL_PING:
+      break;
+
+    default:
+      LOG(ERROR, "Unknown control command");
       return;
   }
 
-  LOG(ERROR, "Unexpected udp message size");
+  conn->send_ack(msg, flags, now_ns, from);
+}
+
+inline void report_stats(pipeline& pipe, uint16_t tcp_port, uint64_t& next_report) {
+  /**
+   * Sends the server a stats report once CAM_STATS_INTERVAL has
+   * passed since the last one, see metrics.h
+   *
+   * Every counter is only copied, they keep counting for the life of
+   * the process.
+   */
+  struct timespec mono_time, real_time;
+  clock_gettime(CLOCK_MONOTONIC, &mono_time);
+  uint64_t now = (uint64_t)mono_time.tv_sec * ns_per_s + mono_time.tv_nsec;
+  if (now < next_report)
+    return;
+  next_report = now + CAM_STATS_INTERVAL;
+
+  clock_gettime(CLOCK_REALTIME, &real_time);
+
+  cam_stats_msg msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.magic = CAM_STATS_MAGIC;
+  msg.version = CAM_STATS_VERSION;
+  msg.tcp_port = tcp_port;
+  msg.sent_ts = (uint64_t)real_time.tv_sec * ns_per_s + real_time.tv_nsec;
+  msg.schedule_skips = metrics_load(&schedule_skips);
+  msg.captures_skipped = pipe.stats.captures_skipped.load(std::memory_order_relaxed);
+  msg.frames_dropped = pipe.stats.frames_dropped.load(std::memory_order_relaxed);
+  msg.frames_encoded = pipe.stats.frames_encoded.load(std::memory_order_relaxed);
+  msg.encoder_stalls = pipe.stats.encoder_stalls.load(std::memory_order_relaxed);
+  msg.pkts_sent = pipe.stats.pkts_sent.load(std::memory_order_relaxed);
+  msg.pkts_discarded = pipe.stats.pkts_discarded.load(std::memory_order_relaxed);
+  metrics_hist_copy(&msg.timer_latency, &timer_latency);
+  metrics_hist_copy(&msg.encode_latency, &pipe.stats.enc_latency_hist);
+  cam->copy_stats(msg);
+
+  // a lost report costs nothing, the next one has the same counters
+  conn->send_stats(msg);
+}
+
+inline void apply_rate(pipeline& pipe, decimation_sched& sched) {
+  /**
+   * Applies the latest rate feedback from the server
+   *
+   * The message is copied with SIGIO blocked, since the handler may
+   * overwrite it at any time. The server resends its feedback every
+   * interval, so only changes are acted on, and a repeated decimation
+   * keeps its original effective timestamp. One that arrives after its
+   * effective timestamp has passed applies from the next capture.
+   */
+  sigset_t io, prev;
+  sigemptyset(&io);
+  sigaddset(&io, SIGIO);
+  sigprocmask(SIG_BLOCK, &io, &prev);
+  rate_msg msg = pending_rate;
+  sigprocmask(SIG_SETMASK, &prev, nullptr);
+
+  if (msg.version != RATE_MSG_VERSION) {
+    LOG(ERROR, "Unexpected rate message version");
+    return;
+  }
+
+  uint32_t level = msg.level > RATE_MAX_LEVEL ? RATE_MAX_LEVEL : msg.level;
+  pipe.set_quality(level);
+
+  uint32_t decimation = msg.decimation;
+  if (decimation == 0 || decimation > RATE_MAX_DECIMATION || (decimation & (decimation - 1))) {
+    LOG(ERROR, "Invalid decimation in rate message");
+    return;
+  }
+
+  if (decimation == sched.decimation)
+    return;
+
+  sched.prev_decimation = sched.decimation;
+  sched.decimation = decimation;
+  sched.from_ts = msg.effective_ts;
+  LOG_FMT(
+    INFO,
+    "Capturing every %u frames from %lu, %u packets queued at the server, %u ms behind%s",
+    decimation,
+    (unsigned long)msg.effective_ts,
+    msg.queue_depth,
+    msg.decode_lag_us / 1000,
+    msg.flags & RATE_FLAG_WIFI ? ", over wifi" : ""
+  );
 }
 
 void exit_signal_handler(int signo, siginfo_t* info, void* context) {
@@ -273,7 +543,12 @@ inline int init_timer(timer_t* timerid) {
   return 0;
 }
 
-inline void arm_timer(timer_t timerid, uint64_t frame_duration, uint64_t& frame_counter) {
+inline uint64_t arm_timer(
+  timer_t timerid,
+  uint64_t frame_duration,
+  uint64_t& frame_counter,
+  const decimation_sched& sched
+) {
     /**
      * Arms the timer to trigger frame captures at precise timestamps
      *
@@ -295,7 +570,11 @@ inline void arm_timer(timer_t timerid, uint64_t frame_duration, uint64_t& frame_
      *    by adding it to the current monotonic clock value. This maintains
      *    our synchronized timing while protecting against clock adjustments.
      *
-     * 4. We set an absolute (TIMER_ABSTIME) timer for this monotonic target.
+     * 4. While the rig is decimated (see rate_msg.h), the counter is rounded
+     *    up to the next multiple of the decimation, so every camera skips
+     *    the same frames and their captures still line up.
+     *
+     * 5. We set an absolute (TIMER_ABSTIME) timer for this monotonic target.
      *    Using absolute rather than relative timing prevents drift that could
      *    accumulate from processing delays between frames.
      *
@@ -308,6 +587,8 @@ inline void arm_timer(timer_t timerid, uint64_t frame_duration, uint64_t& frame_
      *
      * The timer will emit SIGUSR1 when the target time is reached, triggering
      * capture_signal_handler() to initiate the actual frame capture.
+     *
+     * Returns the real time target, the timestamp of the captured frame.
      */
     struct timespec real_time, mono_time;
     clock_gettime(CLOCK_REALTIME, &real_time);
@@ -317,17 +598,23 @@ inline void arm_timer(timer_t timerid, uint64_t frame_duration, uint64_t& frame_
     uint64_t current_mono_ns = (uint64_t)mono_time.tv_sec * ns_per_s + mono_time.tv_nsec;
 
     uint64_t target = timestamp + frame_duration * frame_counter;
-    uint64_t ns_until_target = target - current_real_ns;
+    int64_t ns_until_target = (int64_t)(target - current_real_ns);
 
     if (ns_until_target <= 0) {
-        uint32_t frames_elapsed = (-ns_until_target / frame_duration) + 1;
-        uint64_t ns_elapsed = frames_elapsed * frame_duration;
-        ns_until_target += ns_elapsed;             // adjust ns_until_target for setting this current timer
+        uint64_t frames_elapsed = (-ns_until_target / frame_duration) + 1;
         frame_counter += frames_elapsed;           // adjust counter so we're caught up for future frames
-        target += frame_duration * frames_elapsed; // adjust the target for the connections timestamp queue
+        metrics_add(&schedule_skips, frames_elapsed);
+    }
+
+    // rounding up under the old decimation can cross into the new one, so check twice
+    for (int i = 0; i < 2; i++) {
+        target = timestamp + frame_duration * frame_counter;
+        uint64_t k = target >= sched.from_ts ? sched.decimation : sched.prev_decimation;
+        frame_counter = (frame_counter + k - 1) / k * k;
     }
 
-    conn->frame_timestamps.push(target);
+    target = timestamp + frame_duration * frame_counter; // the target for the connections timestamp queue
+    ns_until_target = (int64_t)(target - current_real_ns);
 
     uint64_t mono_target_ns = current_mono_ns + ns_until_target;
 
@@ -338,6 +625,7 @@ inline void arm_timer(timer_t timerid, uint64_t frame_duration, uint64_t& frame_
     its.it_interval.tv_nsec = 0;
 
     timer_settime(timerid, TIMER_ABSTIME, &its, NULL);
+    return target;
 }
 
 inline int init_sigio(int fd) {
@@ -345,14 +633,14 @@ inline int init_sigio(int fd) {
    * Binds the udp socket fd to emit SIGIO upon incoming data
    *
    * This enables us to block on the semaphore in the main loop
-   * before the initial timestamp comes in. When it does, the main
+   * before the server arms the camera. When it does, the main
    * loop will be preempted, the timestamp set, and the semaphore
    * incremented so the main loop can unblock and arm the timer
    * (see io_signal_handler(), arm_timer()).
    *
-   * This function also enables us to avoid polling for the "STOP"
-   * message since the SIGIO will be emitted upon receiving any
-   * data on the port assigned to the udp file descriptor.
+   * This function also enables us to avoid polling for STOP or
+   * rate feedback, since the SIGIO will be emitted upon receiving
+   * any data on either the control group or the stream's udp port.
    */
   char logstr[128];
 
@@ -391,11 +679,13 @@ inline int init_signals() {
    *           reaches the assigned timestamp, handled by enqueueing
    *           a capture request with the camera
    *
-   * SIGIO   - emitted whenever data is received on the udp port
-   *           (see connection::bind_udp(), io_signal_handler()).
-   *           If the data is 8 bytes, it's our starting timestamp,
-   *           if it's 4 bytes, it's our "STOP" message, otherwise
-   *           it's unexpected and is a server side bug.
+   * SIGIO   - emitted whenever data is received on the control
+   *           group or the udp port (see connection::join_ctl(),
+   *           connection::bind_udp(), io_signal_handler()). The
+   *           control group carries the server's ARM, STOP and PING
+   *           commands (see ctl_msg.h, handle_ctl()), the udp port
+   *           the server's rate feedback (see rate_msg.h), anything
+   *           else is unexpected and is a server side bug.
    *
    * SIGINT  - emitted by the os to signal for exit
    *
@@ -437,14 +727,3 @@ inline int init_signals() {
 
   return 0;
 }
-
-inline int flush_encoder(videnc& encoder, connection& conn) {
-    encoder.flush();
-    int pkt_size = 0;
-    uint8_t* ptr = nullptr;
-    while ((ptr = encoder.recv_frame(pkt_size)) != nullptr) {
-      int ret = conn.stream_pkt(ptr, pkt_size);
-      if (ret == -ECONNRESET) return ret;
-    }
-    return 0;
-}
@@ -0,0 +1,687 @@
+// © 2024 Alec Fessler
+// MIT License
+// See LICENSE file in the project root for full license information.
+
+#include <chrono>
+#include <cstring>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdexcept>
+#include <time.h>
+
+#include "logging.h"
+#include "pipeline.h"
+#include "trace.h"
+
+static uint64_t monotonic_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1'000'000'000 + ts.tv_nsec;
+}
+
+static uint64_t process_cpu_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return (uint64_t)ts.tv_sec * 1'000'000'000 + ts.tv_nsec;
+}
+
+static void pin_thread(int cpu, const char* name) {
+  /**
+   * Pins the calling thread to a core
+   *
+   * Failing to pin isn't fatal, the thread still works, it just
+   * competes with the others, so this only warns.
+   */
+  cpu_set_t cpuset;
+  CPU_ZERO(&cpuset);
+  CPU_SET(cpu, &cpuset);
+  if (sched_setaffinity(0, sizeof(cpuset), &cpuset) < 0) {
+    char logstr[128];
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Failed to pin %s thread to cpu %d: %s",
+      name,
+      cpu,
+      strerror(errno)
+    );
+    LOG(WARNING, logstr);
+  }
+}
+
+static config stream_config(const config& conf, uint8_t id) {
+  /**
+   * Returns the camera's config as a stream's encoder sees it
+   *
+   * The preview keeps the quality target, and has the bitrate scaled
+   * down with its pixel count.
+   */
+  config stream_conf = conf;
+  if (id == STREAM_PREVIEW) {
+    double scale = (double)conf.preview_width * conf.preview_height /
+      ((double)conf.frame_width * conf.frame_height);
+    stream_conf.frame_width = conf.preview_width;
+    stream_conf.frame_height = conf.preview_height;
+    stream_conf.enc_bitrate = (int)(conf.enc_bitrate * scale);
+  }
+  return stream_conf;
+}
+
+pipeline::pipeline(
+  const config& config,
+  connection& conn,
+  camera_handler_t& cam,
+  sem_t& loop_ctl_sem
+) :
+  conf(config),
+  conn(conn),
+  cam(cam),
+  loop_ctl_sem(loop_ctl_sem),
+  scratch_pkt(nullptr),
+  quality_level(0),
+  streams_wanted(STREAM_BIT(STREAM_MAIN)),
+  conn_lost_(false),
+  failed_(false),
+  keyframe_wanted_(false) {
+  /**
+   * Creates the encoders and starts the encode and send threads.
+   *
+   * Only the main stream is subscribed until the server says
+   * otherwise, the preview's encoder, if the camera has one, is
+   * opened up front all the same.
+   *
+   * Every packet in the packet ring is allocated up front, the
+   * encoder's output is moved into them by reference, so nothing is
+   * allocated or copied per frame.
+   *
+   * The threads are started with every signal blocked, so the
+   * capture timer and control messages are always handled by the
+   * main thread, and never interrupt a write or an encode.
+   *
+   * Parameters:
+   *   config:        Encoder settings and the cores for each thread
+   *   conn:          Connection the send thread streams packets over
+   *   cam:           Camera whose capture buffers frames are read from
+   *   loop_ctl_sem:  Posted to wake the main thread when the connection
+   *                  is lost or a thread fails
+   *
+   * Throws:
+   *   std::runtime_error: If the encoders or packets can't be allocated
+   */
+  for (uint8_t i = 0; i < STREAM_COUNT; i++) {
+    streams[i].id = i;
+    streams[i].conf = stream_config(config, i);
+    if (i == STREAM_MAIN || cam.has_preview())
+      open_encoder(streams[i]);
+  }
+  streams[STREAM_MAIN].subscribed = true;
+
+  scratch_pkt = av_packet_alloc();
+  if (!scratch_pkt) {
+    const char* err = "Could not allocate packet";
+    LOG(ERROR, err);
+    throw std::runtime_error(err);
+  }
+
+  for (size_t i = 0; i < PKT_RING_SIZE; i++) {
+    pkts.at(i).pkt = av_packet_alloc();
+    if (!pkts.at(i).pkt) {
+      for (size_t j = 0; j < i; j++)
+        av_packet_free(&pkts.at(j).pkt);
+      av_packet_free(&scratch_pkt);
+      const char* err = "Could not allocate packet";
+      LOG(ERROR, err);
+      throw std::runtime_error(err);
+    }
+  }
+
+  sigset_t all, prev;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &prev);
+  encode_thread = std::thread(&pipeline::encode_loop, this);
+  send_thread = std::thread(&pipeline::send_loop, this);
+  pthread_sigmask(SIG_SETMASK, &prev, nullptr);
+}
+
+pipeline::~pipeline() {
+  /**
+   * Flushes the encoder, sends what's left and joins both threads.
+   */
+  push_msg(pipeline_msg::STOP);
+  encode_thread.join();
+  send_thread.join();
+
+  for (size_t i = 0; i < PKT_RING_SIZE; i++)
+    av_packet_free(&pkts.at(i).pkt);
+  av_packet_free(&scratch_pkt);
+}
+
+bool pipeline::push_frame(const captured_frame& frame) {
+  /**
+   * Hands a captured frame to the encode thread without blocking.
+   *
+   * Returns:
+   *   true if the frame was queued, the encode thread releases its
+   *   capture buffer once it's encoded
+   *   false if the frame ring is full, the frame is counted as dropped
+   *   and the caller still owns the buffer
+   */
+  raw_frame* slot = frames.try_claim();
+  if (!slot) {
+    stats.frames_dropped.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+
+  slot->type = pipeline_msg::FRAME;
+  slot->frame = frame;
+  slot->held = true;
+  frames.publish();
+  return true;
+}
+
+void pipeline::set_quality(uint32_t level) {
+  quality_level.store(level, std::memory_order_relaxed);
+}
+
+void pipeline::set_streams(uint8_t streams) {
+  /**
+   * Subscribes the camera to the streams set in the mask, see
+   * stream_msg.h, any the camera can't produce are left out.
+   */
+  streams_wanted.store(streams, std::memory_order_relaxed);
+}
+
+void pipeline::end_stream() {
+  push_msg(pipeline_msg::END_STREAM);
+}
+
+void pipeline::reset_stream() {
+  push_msg(pipeline_msg::RESET);
+}
+
+bool pipeline::conn_lost() {
+  /**
+   * Returns whether the send thread lost the connection since the
+   * last call, in which case the caller should stop capturing and
+   * reset the pipeline.
+   */
+  return conn_lost_.exchange(false, std::memory_order_acq_rel);
+}
+
+bool pipeline::failed() {
+  return failed_.load(std::memory_order_acquire);
+}
+
+void pipeline::log_stats() {
+  char logstr[256];
+  snprintf(
+    logstr,
+    sizeof(logstr),
+    "Pipeline stats: %lu frames encoded, %lu dropped, %lu captures skipped, "
+    "%lu encoder stalls (%lu us), %lu packets sent in %lu writes, %lu discarded, "
+    "%lu quality changes",
+    stats.frames_encoded.load(std::memory_order_relaxed),
+    stats.frames_dropped.load(std::memory_order_relaxed),
+    stats.captures_skipped.load(std::memory_order_relaxed),
+    stats.encoder_stalls.load(std::memory_order_relaxed),
+    stats.encoder_stall_ns.load(std::memory_order_relaxed) / 1000,
+    stats.pkts_sent.load(std::memory_order_relaxed),
+    stats.send_calls.load(std::memory_order_relaxed),
+    stats.pkts_discarded.load(std::memory_order_relaxed),
+    stats.quality_changes.load(std::memory_order_relaxed)
+  );
+  LOG(INFO, logstr);
+  log_enc_stats();
+}
+
+void pipeline::log_enc_stats() {
+  /**
+   * Logs the encoder's latency and cpu cost per frame.
+   *
+   * Latency runs from handing a frame to the encoder to receiving
+   * its packet, so it includes any frames the encoder buffers for
+   * lookahead. CPU time is measured for the whole process across
+   * each encode, since libx264 encodes on threads of its own, so it
+   * slightly overstates the cost by including the other threads.
+   */
+  char logstr[256];
+
+  uint64_t frames_encoded = stats.frames_encoded.load(std::memory_order_relaxed);
+  uint64_t enc_pkts = stats.enc_pkts.load(std::memory_order_relaxed);
+  snprintf(
+    logstr,
+    sizeof(logstr),
+    "Encoder stats (%s): latency avg %lu us, max %lu us, cpu %lu us per frame",
+    stats.enc_backend.load(std::memory_order_relaxed),
+    enc_pkts ? stats.enc_latency_ns.load(std::memory_order_relaxed) / enc_pkts / 1000 : 0,
+    stats.enc_latency_max_ns.load(std::memory_order_relaxed) / 1000,
+    frames_encoded ? stats.enc_cpu_ns.load(std::memory_order_relaxed) / frames_encoded / 1000 : 0
+  );
+  LOG(INFO, logstr);
+}
+
+void pipeline::open_encoder(enc_stream& stream) {
+  stream.level = quality_level.load(std::memory_order_relaxed);
+  stream.encoder = std::make_unique<videnc>(stream.conf, stream.level);
+  ts_ring_init(&stream.pending_frames);
+  stream.next_pts = 0;
+  if (stream.id == STREAM_MAIN)
+    stats.enc_backend.store(stream.encoder->backend_name(), std::memory_order_relaxed);
+}
+
+void pipeline::open_spare(enc_stream& stream) {
+  /**
+   * Starts opening the encoder the stream's next run will swap in, for
+   * an encoder that can't be reset in place.
+   */
+  if (!stream.encoder->can_reset())
+    start_spare(stream);
+}
+
+void pipeline::start_spare(enc_stream& stream) {
+  /**
+   * Opens an encoder at the quality level last asked for, on a thread
+   * of its own, to be swapped in once it's ready.
+   *
+   * Called from the encode thread, so the opening thread inherits its
+   * blocked signals.
+   */
+  stream.spare_level = quality_level.load(std::memory_order_relaxed);
+  uint32_t level = stream.spare_level;
+  const config& conf = stream.conf;
+  stream.spare = std::async(std::launch::async, [&conf, level] {
+    return std::make_unique<videnc>(conf, level);
+  });
+}
+
+void pipeline::restart_encoder(enc_stream& stream) {
+  /**
+   * Readies the encoder for a new stream, which starts from a keyframe.
+   *
+   * Throws:
+   *   std::runtime_error: If the spare encoder couldn't be opened
+   */
+  ts_ring_init(&stream.pending_frames);
+  stream.next_pts = 0;
+
+  if (stream.encoder->can_reset()) {
+    stream.encoder->reset();
+    return;
+  }
+
+  if (!stream.spare.valid())
+    open_encoder(stream);
+  else
+    swap_spare(stream);
+  open_spare(stream);
+}
+
+bool pipeline::spare_ready(const enc_stream& stream) {
+  return stream.spare.valid() &&
+    stream.spare.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+}
+
+void pipeline::swap_spare(enc_stream& stream) {
+  /**
+   * Replaces the encoder with the spare, waiting on it if it's still
+   * opening. The spare may be at an older quality level than the one
+   * last asked for, which apply_quality then catches up on.
+   *
+   * Throws:
+   *   std::runtime_error: If the spare encoder couldn't be opened
+   */
+  stream.encoder = stream.spare.get(); // rethrows whatever the constructor threw
+  stream.level = stream.spare_level;
+  if (stream.id == STREAM_MAIN)
+    stats.enc_backend.store(stream.encoder->backend_name(), std::memory_order_relaxed);
+}
+
+void pipeline::apply_quality(enc_stream& stream) {
+  /**
+   * Moves the encoder to the quality level last asked for, if it
+   * isn't there already.
+   *
+   * An encoder that can't change its rate control in place keeps
+   * encoding at its current level while a spare is opened at the new
+   * one in the background, since reopening on the encode thread would
+   * stall every frame behind it, just as the server is asking for
+   * less. Once the spare is ready the stream cuts over to it between
+   * frames, the old encoder flushed so the frames it holds still go
+   * out, and the spare's first frame a keyframe. A spare still opening
+   * at a level that's since been superseded is left to finish, then
+   * replaced with one at the new level.
+   */
+  uint32_t level = quality_level.load(std::memory_order_relaxed);
+  if (level == stream.level)
+    return;
+
+  if (!stream.spare.valid() || stream.spare_level != level) {
+    if (stream.spare.valid() && !spare_ready(stream))
+      return; // abandoning it would block until it's open anyway
+
+    if (stream.encoder->set_quality(level)) {
+      LOG_FMT(INFO, "Stream %u encoder quality level %u -> %u", stream.id, stream.level, level);
+      stats.quality_changes.fetch_add(1, std::memory_order_relaxed);
+      stream.level = level;
+      return;
+    }
+
+    LOG_FMT(INFO, "Stream %u opening an encoder at quality level %u", stream.id, level);
+    start_spare(stream);
+    return;
+  }
+
+  if (!spare_ready(stream))
+    return;
+
+  LOG_FMT(INFO, "Stream %u encoder quality level %u -> %u", stream.id, stream.level, level);
+  stats.quality_changes.fetch_add(1, std::memory_order_relaxed);
+  stream.encoder->flush();
+  drain_encoder(stream);
+  ts_ring_init(&stream.pending_frames);
+  stream.next_pts = 0;
+  swap_spare(stream);
+  open_spare(stream);
+}
+
+void pipeline::apply_streams() {
+  /**
+   * Starts and stops encoding streams to match the subscription last
+   * asked for.
+   *
+   * A stream that's dropped is flushed, so what it holds still goes
+   * out, and reset, so it opens with a keyframe when it's picked up
+   * again.
+   */
+  uint8_t wanted = streams_wanted.load(std::memory_order_relaxed);
+  for (enc_stream& stream : streams) {
+    bool subscribed = stream.encoder && (wanted & STREAM_BIT(stream.id));
+    if (subscribed == stream.subscribed)
+      continue;
+
+    LOG_FMT(INFO, "Stream %u %s", stream.id, subscribed ? "subscribed" : "unsubscribed");
+    if (!subscribed) {
+      stream.encoder->flush();
+      drain_encoder(stream);
+      restart_encoder(stream);
+    }
+    stream.subscribed = subscribed;
+  }
+}
+
+void pipeline::push_msg(pipeline_msg type) {
+  /**
+   * Queues a control message behind every frame already queued,
+   * blocking for a free slot since, unlike a frame, it can't be dropped.
+   */
+  raw_frame* slot = frames.claim();
+  slot->type = type;
+  slot->held = false;
+  frames.publish();
+}
+
+void pipeline::encode_loop() {
+  /**
+   * Encodes frames from the frame ring into the packet ring.
+   *
+   * If the encoder throws, the failure is reported to the main thread
+   * and every following frame is discarded, but control messages are
+   * still forwarded, so the send thread and shutdown never wait on a
+   * thread that's gone.
+   */
+  pin_thread(conf.encode_cpu, "encode");
+  for (enc_stream& stream : streams) {
+    if (stream.encoder)
+      open_spare(stream);
+  }
+
+  while (true) {
+    raw_frame msg = *frames.wait();
+    frames.release();
+
+    if (!failed_.load(std::memory_order_relaxed)) {
+      try {
+        encode_msg(msg);
+      } catch (const std::exception& e) {
+        char logstr[128];
+        snprintf(
+          logstr,
+          sizeof(logstr),
+          "Encode thread failed: %s",
+          e.what()
+        );
+        LOG(ERROR, logstr);
+        failed_.store(true, std::memory_order_release);
+        sem_post(&loop_ctl_sem);
+      }
+    }
+
+    if (msg.held) // not released by encode_msg
+      cam.release_buffer(msg.frame.idx);
+
+    if (msg.type != pipeline_msg::FRAME) {
+      enc_pkt* slot = pkts.claim();
+      slot->type = msg.type;
+      pkts.publish();
+    }
+
+    if (msg.type == pipeline_msg::STOP)
+      return;
+  }
+}
+
+void pipeline::encode_msg(raw_frame& msg) {
+  /**
+   * Handles a single message from the frame ring.
+   *
+   * A frame's capture buffer is released as soon as the encoder has
+   * taken its copy of it, before waiting on space for the packets,
+   * and msg.held is cleared to say so.
+   */
+  switch (msg.type) {
+    case pipeline_msg::FRAME: {
+      apply_streams();
+      uint64_t cpu_start = process_cpu_ns();
+      bool keyframe = keyframe_wanted_.exchange(false, std::memory_order_relaxed);
+      for (enc_stream& stream : streams) {
+        if (stream.subscribed)
+          encode_frame(stream, msg.frame, keyframe);
+      }
+      cam.release_buffer(msg.frame.idx);
+      msg.held = false;
+      for (enc_stream& stream : streams) {
+        if (stream.subscribed)
+          drain_encoder(stream);
+      }
+
+      stats.enc_cpu_ns.fetch_add(process_cpu_ns() - cpu_start, std::memory_order_relaxed);
+      uint64_t frames_encoded = stats.frames_encoded.fetch_add(1, std::memory_order_relaxed) + 1;
+      if (frames_encoded % ENC_STATS_INTERVAL == 0)
+        log_enc_stats();
+      break;
+    }
+
+    case pipeline_msg::END_STREAM:
+    case pipeline_msg::STOP:
+      // an unsubscribed stream was flushed and reset when it was dropped
+      for (enc_stream& stream : streams) {
+        if (!stream.subscribed)
+          continue;
+        stream.encoder->flush();
+        drain_encoder(stream);
+        if (msg.type == pipeline_msg::END_STREAM)
+          restart_encoder(stream);
+      }
+      break;
+
+    case pipeline_msg::RESET:
+      // whatever the encoders hold is discarded
+      for (enc_stream& stream : streams) {
+        if (stream.subscribed)
+          restart_encoder(stream);
+      }
+      break;
+  }
+}
+
+void pipeline::encode_frame(enc_stream& stream, const captured_frame& frame, bool keyframe) {
+  /**
+   * Hands a capture to one stream's encoder, the main stream takes the
+   * frame and the preview its downscaled copy.
+   *
+   * Parameters:
+   *   stream:   The stream to encode
+   *   frame:    The capture
+   *   keyframe: The server is waiting on a keyframe to resync
+   */
+  apply_quality(stream);
+  if (ts_ring_push(
+    &stream.pending_frames,
+    stream.next_pts,
+    frame.timestamp,
+    frame.sensor_ts,
+    monotonic_ns()
+  )) {
+    // the encoder is buffering far more than it should, shed load
+    stats.frames_dropped.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  if (keyframe)
+    stream.encoder->request_keyframe();
+  stream.encoder->encode_frame(stream.id == STREAM_MAIN ? frame.data : frame.preview, stream.next_pts++);
+}
+
+void pipeline::drain_encoder(enc_stream& stream) {
+  /**
+   * Moves every packet the stream's encoder has ready into the packet
+   * ring, stalling while it's full rather than dropping a packet.
+   */
+  while (stream.encoder->recv_packet(scratch_pkt)) {
+    ts_entry frame;
+    uint32_t evicted;
+    int ret = ts_ring_match(&stream.pending_frames, scratch_pkt->pts, &frame, &evicted);
+    if (evicted)
+      LOG_FMT(WARNING, "Encoder dropped %u frames", evicted);
+    if (ret) {
+      LOG_FMT(WARNING, "Discarding packet with unknown pts %ld", (long)scratch_pkt->pts);
+      av_packet_unref(scratch_pkt);
+      continue;
+    }
+
+    uint64_t latency = monotonic_ns() - frame.submit_ns;
+    stats.enc_pkts.fetch_add(1, std::memory_order_relaxed);
+    stats.enc_latency_ns.fetch_add(latency, std::memory_order_relaxed);
+    if (latency > stats.enc_latency_max_ns.load(std::memory_order_relaxed))
+      stats.enc_latency_max_ns.store(latency, std::memory_order_relaxed);
+    metrics_observe(&stats.enc_latency_hist, latency);
+
+    enc_pkt* slot = pkts.try_claim();
+    if (!slot) {
+      stats.encoder_stalls.fetch_add(1, std::memory_order_relaxed);
+      uint64_t start = monotonic_ns();
+      slot = pkts.claim();
+      stats.encoder_stall_ns.fetch_add(monotonic_ns() - start, std::memory_order_relaxed);
+    }
+
+    slot->type = pipeline_msg::FRAME;
+    slot->stream_id = stream.id;
+    slot->timestamp = frame.timestamp;
+    slot->sensor_ts = frame.sensor_ts;
+    slot->flags = scratch_pkt->flags & AV_PKT_FLAG_KEY ? STREAM_KEYFRAME : 0;
+    av_packet_move_ref(slot->pkt, scratch_pkt);
+    TRACE_POINT(TRACE_ENCODED, TRACE_CAM_UNKNOWN, frame.timestamp);
+    pkts.publish();
+  }
+}
+
+void pipeline::lose_conn() {
+  conn_lost_.store(true, std::memory_order_release);
+  sem_post(&loop_ctl_sem);
+}
+
+void pipeline::send_loop() {
+  /**
+   * Sends packets from the packet ring.
+   *
+   * Whatever is in the ring, up to MAX_BATCHED_PKTS, is sent with a
+   * single writev, so a backlog built up during a stall drains in a
+   * few syscalls. Once the connection is lost every packet is
+   * discarded until the reset the main thread queues in response
+   * comes through, since the server can't use a stream with a gap.
+   */
+  pin_thread(conf.send_cpu, "send");
+
+  bool discarding = false;
+  enc_pkt* held[MAX_BATCHED_PKTS];
+  while (true) {
+    size_t held_count = 0;
+    size_t queued = 0;
+    pipeline_msg ctl = pipeline_msg::FRAME;
+
+    enc_pkt* slot = pkts.wait();
+    while (slot) {
+      held[held_count++] = slot;
+      if (slot->type != pipeline_msg::FRAME) {
+        ctl = slot->type;
+        break;
+      }
+
+      if (!discarding) {
+        // can't fail, the batch is capped at the queue's size below
+        conn.queue_pkt(slot->stream_id, slot->timestamp, slot->sensor_ts, slot->flags, slot->pkt->data, slot->pkt->size);
+        queued++;
+      } else {
+        stats.pkts_discarded.fetch_add(1, std::memory_order_relaxed);
+      }
+
+      if (held_count == MAX_BATCHED_PKTS) break;
+      slot = pkts.try_next();
+    }
+
+    if (queued) {
+      stats.send_calls.fetch_add(1, std::memory_order_relaxed);
+      int ret = conn.send_queued();
+      if (conn.resumed())
+        keyframe_wanted_.store(true, std::memory_order_relaxed);
+      if (ret == -ECONNRESET) {
+        stats.pkts_discarded.fetch_add(queued, std::memory_order_relaxed);
+        discarding = true;
+        lose_conn();
+      } else if (ret == 0) {
+        stats.pkts_sent.fetch_add(queued, std::memory_order_relaxed);
+        for (size_t i = 0; i < queued; i++)
+          TRACE_POINT(TRACE_SENT, TRACE_CAM_UNKNOWN, held[i]->timestamp);
+      }
+    }
+
+    for (size_t i = 0; i < held_count; i++) {
+      if (held[i]->type == pipeline_msg::FRAME)
+        av_packet_unref(held[i]->pkt);
+      pkts.release();
+    }
+
+    switch (ctl) {
+      case pipeline_msg::FRAME:
+        break;
+
+      case pipeline_msg::END_STREAM:
+        if (!discarding && conn.end_stream() == -ECONNRESET) {
+          discarding = true;
+          lose_conn();
+        }
+        // the server may be resident, the next stream gets a connection of its own
+        conn.discon_tcp();
+        break;
+
+      case pipeline_msg::RESET:
+        conn.discon_tcp();
+        discarding = false;
+        break;
+
+      case pipeline_msg::STOP:
+        return;
+    }
+  }
+}
@@ -2,72 +2,66 @@
 // MIT License
 // See LICENSE file in the project root for full license information.
 
+#include <cmath>
+#include <cstring>
 #include <functional>
 #include <stdexcept>
 #include <string>
 
 #include "logging.h"
+#include "rate_msg.h"
 #include "videnc.h"
+extern "C" {
+#include <libavutil/opt.h>
+}
 
-videnc::videnc(const config& config)
+videnc::videnc(const config& config, uint32_t level)
   : width(config.frame_width),
     height(config.frame_height),
-    pts_counter(0) {
+    base_crf(std::stod(config.enc_quality)),
+    base_bitrate(config.enc_bitrate),
+    backend(nullptr),
+    codec(nullptr),
+    ctx(nullptr),
+    force_keyframe(false) {
   /**
    * Initializes an H.264 video encoder using libavcodec.
    *
    * Creates a complete encoding pipeline with these steps:
-   * 1. Locates the x264 encoder
-   * 2. Allocates and configures encoding context
-   * 3. Sets up frame format for YUV420 input
-   * 4. Initializes encoder with quality/speed settings
+   * 1. Opens the encoder backend selected by ENC_BACKEND
+   * 2. Sets up frame format for YUV420 input
    *
-   * The encoder is configured for streaming:
-   * - YUV420 pixel format matches camera output
-   * - Time base and framerate from config ensure proper timing
-   * - CRF (Constant Rate Factor) for quality-based bitrate
-   * - Preset controls encoding speed/compression tradeoff
+   * Two backends are supported:
+   * - libx264: software encoding, CRF (Constant Rate Factor) for
+   *   quality-based bitrate and a preset for the speed/compression
+   *   tradeoff
+   * - h264_v4l2m2m: the SoC's hardware encoder through V4L2 memory
+   *   to memory, at a constant ENC_BITRATE. Not every Pi has one,
+   *   the Pi 5 doesn't, so if it can't be opened libx264 is used
+   *   instead
    *
    * Parameters:
    *   config: Contains resolution, framerate, and encoding settings
+   *   level:  Quality steps below the configured settings, see rate_msg.h
    *
    * Throws:
    *   std::runtime_error: On any initialization failure, with cleanup
    *                      of previously allocated resources
    */
-  codec = avcodec_find_encoder_by_name("libx264");
-  if (!codec) {
-    const char* err = "Could not find libx264 encoder";
-    LOG(ERROR, err);
-    throw std::runtime_error(err);
-  }
-
-  ctx = avcodec_alloc_context3(codec);
-  if (!ctx) {
-    const char* err = "Could not allocate encoder context";
+  if (config.enc_backend == "h264_v4l2m2m") {
+    if (!open_codec("h264_v4l2m2m", config, level))
+      LOG(WARNING, "Hardware encoder unavailable, falling back to libx264");
+  } else if (config.enc_backend != "libx264") {
+    const char* err = "Unknown encoder backend";
     LOG(ERROR, err);
     throw std::runtime_error(err);
   }
 
-  ctx->width = width;
-  ctx->height = height;
-  ctx->time_base = AVRational{1, config.fps};
-  ctx->framerate = AVRational{config.fps, 1};
-  ctx->pix_fmt = AV_PIX_FMT_YUV420P;
-  ctx->codec_type = AVMEDIA_TYPE_VIDEO;
-
-  AVDictionary *opts = NULL;
-  av_dict_set(&opts, "preset", config.enc_speed.c_str(), 0);
-  av_dict_set(&opts, "crf", config.enc_quality.c_str(), 0);
-
-  if (avcodec_open2(ctx, codec, &opts) < 0) {
-    av_dict_free(&opts);
-    avcodec_free_context(&ctx);
+  if (!ctx && !open_codec("libx264", config, level)) {
     const char* err = "Could not open codec";
     LOG(ERROR, err);
     throw std::runtime_error(err);
   }
-  av_dict_free(&opts);
 
   frame = av_frame_alloc();
   if (!frame) {
@@ -88,15 +82,134 @@ videnc::videnc(const config& config)
     LOG(ERROR, err);
     throw std::runtime_error(err);
   }
+}
 
-  pkt = av_packet_alloc();
-  if (!pkt) {
-    av_frame_free(&frame);
-    avcodec_free_context(&ctx);
-    const char* err = "Could not allocate packet";
+bool videnc::open_codec(const char* name, const config& config, uint32_t level) {
+  /**
+   * Opens an encoder backend by its libavcodec name.
+   *
+   * Both backends share the stream settings, only the rate control
+   * options differ, libx264 takes a quality target while the V4L2
+   * encoder only supports a bitrate.
+   *
+   * Returns:
+   *   true if the encoder was opened
+   *   false if it's unavailable, with the context freed
+   */
+  char logstr[128];
+
+  codec = avcodec_find_encoder_by_name(name);
+  if (!codec) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Could not find %s encoder",
+      name
+    );
+    LOG(ERROR, logstr);
+    return false;
+  }
+
+  ctx = avcodec_alloc_context3(codec);
+  if (!ctx) {
+    const char* err = "Could not allocate encoder context";
     LOG(ERROR, err);
     throw std::runtime_error(err);
   }
+
+  ctx->width = width;
+  ctx->height = height;
+  ctx->time_base = AVRational{1, config.fps};
+  ctx->framerate = AVRational{config.fps, 1};
+  ctx->pix_fmt = AV_PIX_FMT_YUV420P;
+  ctx->codec_type = AVMEDIA_TYPE_VIDEO;
+
+  AVDictionary *opts = NULL;
+  if (strcmp(name, "libx264") == 0) {
+    av_dict_set(&opts, "preset", config.enc_speed.c_str(), 0);
+    av_dict_set(&opts, "crf", std::to_string(crf(level)).c_str(), 0);
+  } else {
+    ctx->bit_rate = bitrate(level);
+  }
+
+  if (avcodec_open2(ctx, codec, &opts) < 0) {
+    av_dict_free(&opts);
+    avcodec_free_context(&ctx);
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Could not open %s encoder",
+      name
+    );
+    LOG(ERROR, logstr);
+    return false;
+  }
+  av_dict_free(&opts);
+
+  backend = name;
+  snprintf(
+    logstr,
+    sizeof(logstr),
+    "Opened %s encoder",
+    name
+  );
+  LOG(INFO, logstr);
+  return true;
+}
+
+double videnc::crf(uint32_t level) const {
+  return base_crf + level * RATE_CRF_STEP;
+}
+
+int64_t videnc::bitrate(uint32_t level) const {
+  // the same factor the CRF steps would cost, 6 CRF halves the bitrate
+  return (int64_t)(base_bitrate * std::exp2(-(double)(level * RATE_CRF_STEP) / 6.0));
+}
+
+bool videnc::set_quality(uint32_t level) {
+  /**
+   * Moves the encoder to a quality level without restarting it.
+   *
+   * libx264 picks up a new CRF on its next frame, reconfiguring in
+   * place, so the stream carries on without a keyframe. The V4L2
+   * encoder only takes its bitrate when it's opened.
+   *
+   * Returns:
+   *   true if the new level is in effect from the next frame
+   *   false if the encoder has to be reopened for it
+   */
+  if (strcmp(backend, "libx264") != 0)
+    return false;
+
+  if (av_opt_set_double(ctx->priv_data, "crf", crf(level), 0) < 0) {
+    LOG(WARNING, "Could not change the CRF in place");
+    return false;
+  }
+  return true;
+}
+
+bool videnc::can_reset() const {
+  return codec->capabilities & AV_CODEC_CAP_ENCODER_FLUSH;
+}
+
+void videnc::reset() {
+  /**
+   * Readies a flushed and drained encoder for a new stream in place,
+   * without closing and reopening it.
+   *
+   * Only valid if can_reset(). The next frame is forced to a keyframe,
+   * since nothing the server decodes next can reference the last stream.
+   */
+  avcodec_flush_buffers(ctx);
+  force_keyframe = true;
+}
+
+void videnc::request_keyframe() {
+  force_keyframe = true;
+}
+
+const char* videnc::backend_name() const {
+  return backend;
 }
 
 videnc::~videnc() {
@@ -104,19 +217,17 @@ videnc::~videnc() {
    * Releases encoder resources in correct order.
    *
    * Cleanup sequence:
-   * 1. Free packet buffer
-   * 2. Free frame buffer
-   * 3. Free encoder context
+   * 1. Free frame buffer
+   * 2. Free encoder context
    *
    * Note: Each step checks for null before freeing,
    * allowing partial cleanup if constructor fails
    */
-  if (pkt) av_packet_free(&pkt);
   if (frame) av_frame_free(&frame);
   if (ctx) avcodec_free_context(&ctx);
 }
 
-void videnc::encode_frame(uint8_t* data) {
+void videnc::encode_frame(uint8_t* data, int64_t pts) {
   const int y_size = width * height;
   const int uv_size = y_size / 4;
 
@@ -130,7 +241,9 @@ void videnc::encode_frame(uint8_t* data) {
   frame->data[1] = data + y_size;
   frame->data[2] = data + y_size + uv_size;
 
-  frame->pts = pts_counter++;
+  frame->pts = pts;
+  frame->pict_type = force_keyframe ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+  force_keyframe = false;
 
   if (avcodec_send_frame(ctx, frame) < 0) {
     const char* err = "Error sending frame for encoding";
@@ -148,15 +261,24 @@ void videnc::flush() {
   }
 }
 
-uint8_t* videnc::recv_frame(int& size) {
+bool videnc::recv_packet(AVPacket* pkt) {
+  /**
+   * Receives the next encoded packet into pkt, if one is ready.
+   *
+   * The packet is handed over by reference, so the caller owns its
+   * data until it unrefs it, and can keep several in flight.
+   *
+   * Returns:
+   *   true if a packet was received
+   *   false if the encoder needs more input or is fully flushed
+   */
   int ret = avcodec_receive_packet(ctx, pkt);
-  if (ret == AVERROR(EAGAIN)) return nullptr; // no packets available yet
-  if (ret == AVERROR_EOF) return nullptr; // no more packets
+  if (ret == AVERROR(EAGAIN)) return false; // no packets available yet
+  if (ret == AVERROR_EOF) return false; // no more packets
   if (ret < 0) {
     const char* err = "Error receiving packet";
     LOG(ERROR, err);
     throw std::runtime_error(err);
   }
-  size = pkt->size;
-  return pkt->data;
+  return true;
 }
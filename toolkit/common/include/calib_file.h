@@ -0,0 +1,84 @@
+#ifndef CALIB_FILE_H
+#define CALIB_FILE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * On disk layout of a rig's calibration, written by lens_calibration
+ * and stereo_calibration and memory mapped by anything that needs it.
+ *
+ * The file is a calib_header followed by num_cameras calib_camera
+ * entries, indexed like the server numbers the cameras, so entry i
+ * describes frames[i] from a StreamController or SessionReader. It's
+ * read in place, every field is naturally aligned and little endian.
+ *
+ * Extrinsics map points from the rig frame, which is camera 0's, into
+ * each camera's frame, p_cam = rotation * p_rig + translation, with the
+ * translation in meters.
+ *
+ * Files are only ever replaced whole, by renaming a new one over the
+ * old, so a tool that has the file mapped keeps seeing a consistent
+ * calibration until it maps the file again.
+ */
+
+#define CALIB_MAGIC 0x4249434dU // "MCIB"
+#define CALIB_VERSION 1
+#define CALIB_PATH "/etc/mocap-toolkit/calibration.bin"
+
+#define CALIB_INTRINSICS 1 // camera_matrix and dist_coeffs are set
+#define CALIB_EXTRINSICS 2 // rotation and translation are set
+
+struct calib_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t num_cameras;
+  uint32_t reserved;
+  uint64_t timestamp; // of the last write, unix ns
+};
+
+struct calib_camera {
+  uint32_t width;
+  uint32_t height;
+  uint32_t flags;
+  uint32_t views; // accepted views of the intrinsics solve
+  float intrinsics_rms; // pixels
+  float extrinsics_rms; // pixels
+  double camera_matrix[9]; // row major
+  double dist_coeffs[5]; // k1 k2 p1 p2 k3
+  double rotation[9]; // row major
+  double translation[3];
+};
+
+/**
+ * A read only mapping of a calibration file.
+ */
+
+class CalibrationFile {
+private:
+  int fd;
+  void* map;
+  size_t map_size;
+  const calib_header* header;
+  const calib_camera* cams;
+
+public:
+  CalibrationFile(const std::string& path = CALIB_PATH);
+  ~CalibrationFile();
+
+  size_t num_cameras() const;
+  const calib_camera& camera(size_t idx) const;
+  uint64_t timestamp() const;
+
+  static std::vector<calib_camera> load(const std::string& path, size_t num_cameras);
+  static void save(const std::string& path, const std::vector<calib_camera>& cams);
+
+  CalibrationFile(const CalibrationFile&) = delete;
+  CalibrationFile& operator=(const CalibrationFile&) = delete;
+  CalibrationFile(CalibrationFile&&) = delete;
+  CalibrationFile& operator=(CalibrationFile&&) = delete;
+};
+
+#endif // CALIB_FILE_H
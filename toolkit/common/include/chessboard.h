@@ -0,0 +1,29 @@
+#ifndef CHESSBOARD_H
+#define CHESSBOARD_H
+
+#include <opencv2/core.hpp>
+#include <vector>
+
+// inner corners of assets/chessboard_pattern.png, 10 x 7 squares
+#define BOARD_COLS 9
+#define BOARD_ROWS 6
+
+#define DETECT_WIDTH 640 // frames are downscaled toward this width for detection
+#define SUBPIX_WINDOW 5 // half size, in full resolution pixels
+
+/**
+ * Finds the calibration board in NV12 frames from the server.
+ *
+ * Detection runs on a box downscaled copy of the frame, around
+ * DETECT_WIDTH wide, where findChessboardCorners is an order of
+ * magnitude cheaper, and the corners it finds are refined with
+ * cornerSubPix on the full resolution luma plane, which NV12 frames
+ * carry as is.
+ *
+ * Corners come back row by row, BOARD_COLS per row.
+ */
+
+bool detect_chessboard(const cv::Mat& nv12, std::vector<cv::Point2f>* corners);
+std::vector<cv::Point3f> chessboard_points(double square_size);
+
+#endif // CHESSBOARD_H
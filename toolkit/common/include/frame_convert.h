@@ -0,0 +1,48 @@
+#ifndef FRAME_CONVERT_H
+#define FRAME_CONVERT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <opencv2/core.hpp>
+
+/**
+ * Converts NV12 frames from the server into the formats consumers
+ * actually work in, in a single pass per frame instead of a cvtColor
+ * followed by a resize.
+ *
+ * Each output row is built from the rows of the source it covers
+ * while they're still in cache: the luma rows are box filtered down
+ * to the output width, the chroma row is resampled to match, and the
+ * color conversion runs over those, writing the output row once. The
+ * row kernels are vectorized with AVX2 or NEON, picked at runtime
+ * from what the CPU supports, with a scalar fallback that gives the
+ * same results bit for bit.
+ *
+ * Color conversion uses BT.601 limited range, like OpenCV's NV12
+ * conversions, in 6 bit fixed point.
+ *
+ * A frameset's cameras are converted in parallel, on OpenCV's thread
+ * pool.
+ */
+
+enum class PixelFormat {
+  NV12, // as shared by the server, (h * 3/2) x w CV_8UC1
+  GRAY, // h x w CV_8UC1, the luma plane
+  BGR, // h x w CV_8UC3
+  RGB, // h x w CV_8UC3
+  BGR_PLANAR_F32, // (3 * h) x w CV_32FC1, one plane per channel, scaled to [0, 1]
+  RGB_PLANAR_F32 // (3 * h) x w CV_32FC1, one plane per channel, scaled to [0, 1]
+};
+
+struct FrameFormat {
+  PixelFormat pixels = PixelFormat::NV12;
+  uint32_t downscale = 1; // 1, 2 or 4, box filtered, NV12 only at 1
+};
+
+bool frame_format_valid(const FrameFormat& format);
+cv::Size converted_size(cv::Size size, const FrameFormat& format);
+void convert_frame(const cv::Mat& nv12, cv::Mat& out, const FrameFormat& format);
+void convert_frames(const cv::Mat* nv12, size_t count, cv::Mat* out, const FrameFormat& format);
+const char* frame_kernels();
+
+#endif // FRAME_CONVERT_H
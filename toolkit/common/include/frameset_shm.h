@@ -0,0 +1,253 @@
+#ifndef FRAMESET_SHM_H
+#define FRAMESET_SHM_H
+
+#include <linux/futex.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __cplusplus
+#include <atomic>
+#define SHM_ATOMIC(type) std::atomic<type>
+#define SHM_ALIGNAS(n) alignas(n)
+#else
+#include <stdalign.h>
+#include <stdatomic.h>
+#define SHM_ATOMIC(type) _Atomic type
+#define SHM_ALIGNAS(n) alignas(n)
+#endif
+
+/**
+ * Shared memory layout for handing framesets from the server
+ * to consumers. This header is shared between the server and
+ * the toolkit, so it must stay valid as both C and C++.
+ *
+ * The segment holds four regions:
+ *
+ * 1. A header describing the layout
+ *
+ * 2. A table of cam_count frameset_cam entries, each camera's
+ *    resolution and frame rate, and where its frames sit in the pool.
+ *    Cameras needn't share a resolution or a frame rate.
+ *
+ * 3. A ring of slot_count frameset slots. The server publishes
+ *    framesets in order, frameset n goes into slot n % slot_count,
+ *    so a consumer can fall behind by up to slot_count framesets
+ *    before the server starts overwriting the ones it hasn't read.
+ *    The depth is picked when the server starts, FRAMESET_SLOTS
+ *    unless it's told otherwise, so consumers take it from the header.
+ *    A slot holds no pixel data, only the timestamp and the index
+ *    of each camera's buffer in its part of the frame pool, followed
+ *    by each camera's exposure offset. The timestamp is the scheduled
+ *    capture time the frameset was assembled on, while the offsets
+ *    are how far after it each camera's exposure actually started, as
+ *    measured by its sensor, for consumers that compensate for the
+ *    skew between cameras. The offset is FRAMESET_NO_OFFSET for a
+ *    camera that's missing or didn't report it. A
+ *    frameset may be partial, cameras missing from it are left out
+ *    of cam_mask and have the index FRAMESET_NO_FRAME. A camera
+ *    running at a fraction of the fastest camera's rate is only
+ *    part of every fps_max / fps frameset, and missing from the rest.
+ *
+ * 4. The frame pool, pool_size bytes split into one run per camera
+ *    of frame_count buffers of frame_stride bytes. The decoders
+ *    write into these directly, so publishing a frameset never
+ *    copies a frame, and consumers can read the frames in place.
+ *
+ * Each slot carries a sequence number which works as a seqlock:
+ * the server zeroes it before reusing the slot and stores n + 1
+ * once the slot describes frameset n. The buffers a slot points
+ * to are only handed back to the decoders after its sequence has
+ * been zeroed, so a consumer which reads the sequence, reads the
+ * frames, then reads the sequence again knows the frames were
+ * intact if both reads match n + 1.
+ *
+ * write_seq in the header is the number of framesets published,
+ * so write_seq - (consumer cursor) is how far behind a consumer is.
+ *
+ * Up to FRAMESET_MAX_CONSUMERS consumer processes can attach at once,
+ * each claiming an entry in the header's consumer table by storing
+ * its pid, and reading from its own cursor. A
+ * consumer leases frameset n by setting bit n % slot_count in its
+ * entry's leases, then checking the slot still holds sequence n + 1.
+ * The server zeroes a slot's sequence before checking whether any
+ * consumer leases it, both sides with sequentially consistent
+ * operations, so either the consumer sees the zero and gives up the
+ * lease, or the server sees the bit. A leased slot is never reused:
+ * the server restores its sequence and drops the frameset it was
+ * about to publish instead, counting it in lease_drops. Leases held
+ * by a consumer that died are reclaimed once the server finds its
+ * pid gone, which frees its entry. A consumer claiming an entry
+ * resets its leases before taking any.
+ *
+ * After every publish the server bumps notify, and wakes it as a
+ * futex if any consumer is counted in waiters. A consumer counts
+ * itself in waiters before reading notify and write_seq, so a publish
+ * can't slip between its check and its sleep unnoticed.
+ *
+ * server_pid is the running server, the magic is zeroed again when it
+ * shuts down, so consumers can tell a live segment from a stale one.
+ *
+ * A server started resident (-d) outlives its consumers, and only
+ * streams while at least one is attached, starting the cameras when
+ * the first claims an entry and stopping them once the last is gone.
+ * A consumer sends server_pid FRAMESET_WAKE_SIGNAL after claiming or
+ * releasing its entry, so the server notices without waiting on its
+ * next poll of the table.
+ *
+ * When FRAMESET_GPU is set in flags the frame pool lives in device
+ * memory instead (a server built with CUDA_FRAMESETS). The host pool
+ * region is then empty, and consumers open the device pool through
+ * cuda_ipc_handle, indexing it exactly like the host pool, with
+ * the same per camera offsets.
+ */
+
+#define FRAMESET_SHM_NAME "/mocap-toolkit_frameset"
+#define FRAMESET_SHM_MAGIC 0x4d48535041434f4dULL // "MOCAPSHM"
+#define FRAMESET_SHM_VERSION 7
+#define FRAMESET_SLOTS 8 // the default slot_count
+#define FRAMESET_MAX_SLOTS 64 // one lease bit per slot
+#define FRAMESET_MAX_CONSUMERS 16
+#define FRAMESET_WAKE_SIGNAL SIGUSR1
+#define FRAMESET_ALIGN 64
+#define FRAMESET_POOL_ALIGN 4096
+#define FRAMESET_IPC_HANDLE_SIZE 64 // sizeof(cudaIpcMemHandle_t)
+
+#define FRAMESET_GPU (1u << 0)
+
+#define FRAMESET_NO_FRAME UINT32_MAX // pool index of a camera missing from a frameset
+#define FRAMESET_NO_OFFSET INT32_MIN // exposure offset of a camera missing or unmeasured
+
+struct frameset_consumer {
+  SHM_ALIGNAS(FRAMESET_ALIGN) SHM_ATOMIC(uint32_t) pid; // 0 while the entry is free
+  SHM_ATOMIC(uint64_t) cursor; // next frameset the consumer reads
+  SHM_ATOMIC(uint64_t) leases; // bit n % slot_count set while frameset n is leased
+};
+
+struct frameset_cam {
+  uint32_t width;
+  uint32_t height;
+  uint32_t fps;
+  uint32_t frame_count;
+  uint64_t frame_size; // NV12, width * height * 3 / 2
+  uint64_t frame_stride;
+  uint64_t pool_offset; // of the camera's first buffer, from the start of the pool
+};
+
+struct frameset_shm_header {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t slot_count;
+  uint32_t cam_count;
+  uint32_t reserved;
+  uint64_t slots_offset;
+  uint64_t slot_size;
+  uint64_t pool_offset;
+  uint64_t pool_size;
+  uint32_t flags;
+  uint32_t server_pid;
+  uint8_t cuda_ipc_handle[FRAMESET_IPC_HANDLE_SIZE];
+  SHM_ALIGNAS(FRAMESET_ALIGN) SHM_ATOMIC(uint64_t) write_seq;
+  SHM_ATOMIC(uint32_t) notify; // futex, bumped after every publish
+  SHM_ATOMIC(uint32_t) waiters; // consumers asleep on notify
+  SHM_ATOMIC(uint64_t) lease_drops;
+  struct frameset_consumer consumers[FRAMESET_MAX_CONSUMERS];
+};
+
+struct frameset_slot {
+  SHM_ATOMIC(uint64_t) seq;
+  uint64_t timestamp;
+  uint64_t cam_mask; // bit i set if camera i is present
+  // followed by cam_count uint32_t frame pool indices,
+  // then cam_count int32_t exposure offsets in ns
+};
+
+static inline size_t frameset_align(size_t size, size_t align) {
+  return (size + align - 1) & ~(align - 1);
+}
+
+static inline size_t frameset_header_size(void) {
+  return frameset_align(sizeof(struct frameset_shm_header), FRAMESET_ALIGN);
+}
+
+static inline size_t frameset_slots_offset(uint32_t cam_count) {
+  return frameset_header_size() + frameset_align(
+    sizeof(struct frameset_cam) * cam_count,
+    FRAMESET_ALIGN
+  );
+}
+
+static inline size_t frameset_slot_size(uint32_t cam_count) {
+  return frameset_align(
+    sizeof(struct frameset_slot) + (sizeof(uint32_t) + sizeof(int32_t)) * cam_count,
+    FRAMESET_ALIGN
+  );
+}
+
+static inline size_t frameset_frame_stride(size_t frame_size) {
+  return frameset_align(frame_size, FRAMESET_ALIGN);
+}
+
+static inline size_t frameset_pool_offset(uint32_t cam_count, uint32_t slot_count) {
+  return frameset_align(
+    frameset_slots_offset(cam_count) + frameset_slot_size(cam_count) * slot_count,
+    FRAMESET_POOL_ALIGN
+  );
+}
+
+static inline size_t frameset_shm_size(
+  uint32_t cam_count,
+  uint32_t slot_count,
+  size_t host_pool_size
+) {
+  return frameset_pool_offset(cam_count, slot_count) + host_pool_size;
+}
+
+static inline struct frameset_cam* frameset_get_cam(void* shm, uint32_t cam) {
+  return (struct frameset_cam*)((uint8_t*)shm + frameset_header_size()) + cam;
+}
+
+static inline struct frameset_slot* frameset_get_slot(
+  void* shm,
+  const struct frameset_shm_header* hdr,
+  uint64_t seq
+) {
+  return (struct frameset_slot*)(
+    (uint8_t*)shm +
+    hdr->slots_offset +
+    hdr->slot_size * (seq % hdr->slot_count)
+  );
+}
+
+static inline uint32_t* frameset_slot_bufs(struct frameset_slot* slot) {
+  return (uint32_t*)(slot + 1);
+}
+
+static inline int32_t* frameset_slot_offsets(struct frameset_slot* slot, uint32_t cam_count) {
+  return (int32_t*)(frameset_slot_bufs(slot) + cam_count);
+}
+
+static inline long frameset_futex(
+  SHM_ATOMIC(uint32_t)* addr,
+  int op,
+  uint32_t val,
+  const struct timespec* timeout
+) {
+  // shared, not FUTEX_PRIVATE_FLAG, since the waiters are other processes
+  return syscall(SYS_futex, (uint32_t*)(void*)addr, op, val, timeout, NULL, 0);
+}
+
+static inline uint8_t* frameset_pool_frame(
+  void* shm,
+  const struct frameset_shm_header* hdr,
+  uint32_t cam,
+  uint32_t idx
+) {
+  const struct frameset_cam* info = frameset_get_cam(shm, cam);
+  return (uint8_t*)shm + hdr->pool_offset + info->pool_offset + info->frame_stride * idx;
+}
+
+#endif // FRAMESET_SHM_H
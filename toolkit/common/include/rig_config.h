@@ -0,0 +1,40 @@
+#ifndef RIG_CONFIG_H
+#define RIG_CONFIG_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "rig_conf.h"
+
+/**
+ * A read only mapping of the rig snapshot the server parses cams.yaml
+ * into, see rig_conf.h, so the tools know the cameras and their stream
+ * parameters without parsing the yaml themselves.
+ *
+ * Cameras are indexed like the server numbers them, so camera(i)
+ * describes frames[i] from a StreamController or SessionReader.
+ */
+
+class RigConfig {
+private:
+  int fd;
+  void* map;
+  size_t map_size;
+  const rig_conf* rig;
+
+public:
+  RigConfig(const std::string& path = RIG_CONF_PATH);
+  ~RigConfig();
+
+  size_t num_cameras() const;
+  const cam_conf& camera(size_t idx) const;
+  bool stale(const std::string& yaml_path = RIG_CONF_YAML) const;
+
+  RigConfig(const RigConfig&) = delete;
+  RigConfig& operator=(const RigConfig&) = delete;
+  RigConfig(RigConfig&&) = delete;
+  RigConfig& operator=(RigConfig&&) = delete;
+};
+
+#endif // RIG_CONFIG_H
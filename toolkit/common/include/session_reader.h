@@ -0,0 +1,120 @@
+#ifndef SESSION_READER_H
+#define SESSION_READER_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <opencv2/core.hpp>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "frame_convert.h"
+#include "recording.h"
+
+#define SESSION_DECODE_AHEAD 4 // decoded frames buffered per camera
+
+struct AVCodecContext;
+struct AVFrame;
+struct AVPacket;
+
+/**
+ * Reads framesets back from a recording made with the server's -r
+ * option, see recording.h, in place of a StreamController.
+ *
+ * Each camera is decoded by its own worker thread, which stays up to
+ * SESSION_DECODE_AHEAD frames ahead of the consumer, so a frameset
+ * costs the slowest camera's decode rather than the sum of them, and
+ * reading runs as fast as the cores allow instead of at the capture
+ * rate.
+ *
+ * Frames are grouped into framesets by timestamp, a camera is part of
+ * a frameset if its frame is within half a frame interval of the
+ * earliest one, and missing from it otherwise, exactly like a partial
+ * frameset from the server. Frames are NV12 at the recorded resolution,
+ * laid out like the server's.
+ *
+ * seek() and set_range() use each camera's index to start decoding
+ * at the last keyframe before the target, and decode forward from
+ * there, discarding frames before the target without handing them
+ * back, so jumping anywhere in hours of footage only decodes up to
+ * one GOP per camera.
+ */
+
+class SessionReader {
+private:
+  struct Camera {
+    std::string name;
+    int data_fd = -1;
+    const uint8_t* data = nullptr;
+    size_t data_size = 0;
+    int idx_fd = -1;
+    void* idx_map = nullptr;
+    size_t idx_map_size = 0;
+    const record_idx_entry* idx = nullptr;
+    size_t idx_count = 0;
+
+    // owned by the worker
+    AVCodecContext* ctx = nullptr;
+    AVPacket* pkt = nullptr;
+    AVFrame* frame = nullptr;
+    std::vector<uint8_t> pkt_buf;
+    size_t next_pkt = 0;
+    bool flushing = false;
+
+    // shared with the consumer, under mutex
+    std::thread worker;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<std::pair<uint64_t, cv::Mat>> ready;
+    bool seek_pending = false;
+    uint64_t seek_target = 0;
+    uint64_t skip_before = 0; // frames older than the seek target
+    bool eof = false;
+    bool stop = false;
+    std::string error;
+  };
+
+  size_t frame_width;
+  size_t frame_height;
+  size_t num_cameras;
+  uint64_t frame_dur;
+  uint64_t range_end;
+  uint64_t cam_mask;
+  std::vector<std::unique_ptr<Camera>> cams;
+
+  void open_camera(Camera& cam, const std::string& dir);
+  void open_decoder(Camera& cam);
+  void close_camera(Camera& cam);
+  void worker_fn(Camera& cam);
+  bool decode_step(Camera& cam);
+  cv::Mat to_nv12(const AVFrame* frame) const;
+  bool head(Camera& cam, uint64_t* timestamp);
+
+public:
+  SessionReader(
+    const std::string& dir,
+    size_t frame_width,
+    size_t frame_height,
+    size_t num_cameras
+  );
+  ~SessionReader();
+
+  bool recv_frameset(cv::Mat* frames, uint64_t* timestamp, const FrameFormat& format = FrameFormat());
+  void seek(uint64_t timestamp);
+  void set_range(uint64_t start, uint64_t end);
+  uint64_t first_timestamp() const;
+  uint64_t last_timestamp() const;
+  uint64_t last_cam_mask() const;
+
+  SessionReader(const SessionReader&) = delete;
+  SessionReader& operator=(const SessionReader&) = delete;
+  SessionReader(SessionReader&&) = delete;
+  SessionReader& operator=(SessionReader&&) = delete;
+};
+
+#endif // SESSION_READER_H
@@ -2,13 +2,42 @@
 #define STREAM_CONTROLLER_H
 
 #include <cstddef>
+#include <cstdint>
 #include <opencv2/core.hpp>
-#include <semaphore.h>
+#ifdef CUDA_FRAMESETS
+#include <opencv2/core/cuda.hpp>
+#endif
 #include <sys/types.h>
+#include <vector>
+
+#include "frame_convert.h"
+#include "frameset_shm.h"
 
-#define SHM_NAME "/mocap-toolkit_frameset"
-#define SEM_NAME "/mocap-toolkit_consumer_ready"
 #define SERVER_EXE "/usr/local/bin/mocap-toolkit-server"
+#define SERVER_START_TIMEOUT 10 // seconds for a launched server to share its segment
+#define SERVER_POLL_MS 100 // how often a waiting consumer checks the server is still up
+
+/**
+ * A frameset leased with StreamController::acquire(), held until it's
+ * passed to release(). The frames are views straight into the server's
+ * frame pool, which the server won't recycle while the lease is held.
+ * Exactly one of frames and gpu_frames is filled, depending on whether
+ * the server shares frames in host or device memory.
+ *
+ * timestamp is the scheduled capture time the frameset was assembled
+ * on, exposure_offsets how far after it, in ns, each camera's exposure
+ * was measured to start, FRAMESET_NO_OFFSET where that isn't known.
+ */
+struct Frameset {
+  uint64_t seq;
+  uint64_t timestamp;
+  uint64_t cam_mask;
+  std::vector<int32_t> exposure_offsets;
+  std::vector<cv::Mat> frames;
+#ifdef CUDA_FRAMESETS
+  std::vector<cv::cuda::GpuMat> gpu_frames;
+#endif
+};
 
 class StreamController {
 private:
@@ -16,10 +45,27 @@ private:
   size_t frame_height;
   size_t num_cameras;
   pid_t server_pid_;
-  sem_t* frameset_ctl_sem;
   int shm_fd;
   size_t shm_size;
   void* frameset_buf;
+  frameset_shm_header* frameset_hdr;
+  frameset_consumer* consumer;
+  uint64_t read_cursor;
+  uint64_t dropped;
+  uint64_t cam_mask;
+  std::vector<int32_t> offsets; // of the last frameset read
+  uint8_t* gpu_pool;
+
+  bool attach_segment();
+  void launch_server();
+  void claim_consumer();
+  void wait_frameset();
+  frameset_slot* next_frameset(uint64_t* seq);
+  void map_frames(frameset_slot* slot, cv::Mat* frames);
+  void read_offsets(frameset_slot* slot, std::vector<int32_t>& out) const;
+#ifdef CUDA_FRAMESETS
+  void open_gpu_pool();
+#endif
 
 public:
   StreamController(
@@ -29,7 +75,21 @@ public:
   );
   ~StreamController();
 
-  void recv_frameset(cv::Mat* frames, uint64_t* timestamp);
+  void acquire(Frameset* frameset);
+  void release(Frameset* frameset);
+  void recv_frameset(cv::Mat* frames, uint64_t* timestamp, const FrameFormat& format = FrameFormat());
+  uint64_t recv_frameset_view(cv::Mat* frames, uint64_t* timestamp);
+#ifdef CUDA_FRAMESETS
+  uint64_t recv_frameset_gpu(cv::cuda::GpuMat* frames, uint64_t* timestamp);
+#endif
+  bool frameset_valid(uint64_t seq) const;
+  uint64_t frames_behind() const;
+  uint64_t dropped_framesets() const;
+  uint64_t last_cam_mask() const;
+  int32_t last_exposure_offset(size_t cam) const;
+  bool launched_server() const;
+  cv::Size frame_size(size_t cam) const;
+  uint32_t frame_rate(size_t cam) const;
 
   StreamController(const StreamController&) = delete;
   StreamController& operator=(const StreamController&) = delete;
@@ -0,0 +1,73 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+/**
+ * Opt in per frame latency tracing, built with make TRACE=1.
+ *
+ * Every stage a frame passes through, from the camera to the
+ * consumer, records a trace point keyed by the frame's scheduled
+ * capture timestamp, which every component already carries. Points
+ * are stamped with CLOCK_REALTIME, which PTP keeps in step across
+ * the cameras and the server, so points from different machines can
+ * be joined into one timeline per frame, and glass to consumer
+ * latency is simply the consumer's point minus the capture timestamp.
+ *
+ * Each thread records into a ring of its own, so recording is a
+ * handful of stores with no locking or shared cache lines. A ring
+ * that wraps keeps the most recent TRACE_RING_SIZE points. At exit
+ * each process dumps every ring into one binary file, a
+ * trace_file_header followed by rec_count trace_recs, which
+ * toolkit/trace_report joins and summarizes.
+ *
+ * Without TRACE the macros compile to nothing.
+ *
+ * This header is shared by the server, picam and the toolkit, and
+ * the copies must be kept identical.
+ */
+
+#define TRACE_MAGIC "MTRC"
+#define TRACE_VERSION 1
+#define TRACE_RING_SIZE 65536 // points per thread, must be a power of two
+#define TRACE_MAX_THREADS 64
+#define TRACE_CAM_UNKNOWN UINT16_MAX // picam doesn't know its server side index
+
+enum trace_stage {
+  TRACE_CAPTURED, // picam, capture request completed
+  TRACE_ENCODED, // picam, packet out of the encoder
+  TRACE_SENT, // picam, packet written to the socket
+  TRACE_RECEIVED, // server, packet parsed off the socket
+  TRACE_DECODED, // server, packet sent to the decoder
+  TRACE_TRANSFERRED, // server, decoded frame in the frame pool
+  TRACE_ASSEMBLED, // server, frameset published
+  TRACE_CONSUMED, // toolkit, frameset received
+  TRACE_STAGES
+};
+
+struct trace_rec {
+  uint64_t frame_ts; // scheduled capture timestamp of the frame
+  uint64_t ns; // CLOCK_REALTIME when the stage completed
+  uint16_t stage;
+  uint16_t cam;
+  uint32_t tid;
+};
+
+struct trace_file_header {
+  char magic[4];
+  uint32_t version;
+  uint64_t rec_count;
+};
+
+#ifdef TRACE
+void trace_point(enum trace_stage stage, uint16_t cam, uint64_t frame_ts);
+int trace_dump(const char* path);
+#define TRACE_POINT(stage, cam, frame_ts) trace_point(stage, cam, frame_ts)
+#define TRACE_DUMP(path) trace_dump(path)
+#else
+// unevaluated, only keeps arguments that exist for tracing from being unused
+#define TRACE_POINT(stage, cam, frame_ts) ((void)sizeof(stage), (void)sizeof(cam), (void)sizeof(frame_ts))
+#define TRACE_DUMP(path) ((void)sizeof(path))
+#endif
+
+#endif // TRACE_H
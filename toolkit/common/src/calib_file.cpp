@@ -0,0 +1,182 @@
+#include <algorithm>
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "calib_file.h"
+#include "logging.h"
+
+static_assert(sizeof(calib_header) == 24, "calib_header layout changed");
+static_assert(sizeof(calib_camera) == 232, "calib_camera layout changed");
+
+CalibrationFile::CalibrationFile(const std::string& path) :
+  fd(-1),
+  map(nullptr),
+  map_size(0),
+  header(nullptr),
+  cams(nullptr)
+{
+  /**
+   * Maps a calibration file
+   *
+   * Parameters:
+   *   path: The calibration file
+   *
+   * Throws:
+   *   std::runtime_error: If the file can't be mapped, or isn't a
+   *                       calibration file this reader understands
+   */
+  char logstr[128];
+
+  fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) == -1) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error opening calibration %s: %s",
+      path.c_str(),
+      strerror(errno)
+    );
+    LOG(ERROR, logstr);
+    if (fd != -1)
+      close(fd);
+    throw std::runtime_error(logstr);
+  }
+
+  map_size = st.st_size;
+  if (map_size >= sizeof(calib_header)) {
+    map = mmap(nullptr, map_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+      map = nullptr;
+  }
+
+  header = static_cast<const calib_header*>(map);
+  if (!header ||
+      header->magic != CALIB_MAGIC ||
+      header->version != CALIB_VERSION ||
+      map_size < sizeof(calib_header) + header->num_cameras * sizeof(calib_camera)) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "%s is not a calibration file this reader understands",
+      path.c_str()
+    );
+    LOG(ERROR, logstr);
+    if (map)
+      munmap(map, map_size);
+    close(fd);
+    throw std::runtime_error(logstr);
+  }
+
+  cams = reinterpret_cast<const calib_camera*>(
+    static_cast<const uint8_t*>(map) + sizeof(calib_header)
+  );
+}
+
+CalibrationFile::~CalibrationFile() {
+  munmap(map, map_size);
+  close(fd);
+}
+
+size_t CalibrationFile::num_cameras() const {
+  return header->num_cameras;
+}
+
+const calib_camera& CalibrationFile::camera(size_t idx) const {
+  return cams[idx];
+}
+
+uint64_t CalibrationFile::timestamp() const {
+  return header->timestamp;
+}
+
+std::vector<calib_camera> CalibrationFile::load(const std::string& path, size_t num_cameras) {
+  /**
+   * Copies out a calibration to update it, so a tool that calibrates
+   * one thing keeps what the others calibrated
+   *
+   * Parameters:
+   *   path: The calibration file
+   *   num_cameras: Entries to return, cameras the file doesn't have
+   *                come back zeroed, with no flags set
+   *
+   * Returns:
+   *   The entries, all zeroed if there's no usable file at path yet
+   */
+  std::vector<calib_camera> entries(num_cameras);
+  memset(entries.data(), 0, num_cameras * sizeof(calib_camera));
+
+  if (access(path.c_str(), F_OK) == -1)
+    return entries;
+
+  try {
+    CalibrationFile file(path);
+    size_t count = std::min(num_cameras, file.num_cameras());
+    memcpy(entries.data(), &file.camera(0), count * sizeof(calib_camera));
+  } catch (const std::runtime_error&) {
+    LOG(WARNING, "Replacing unreadable calibration file");
+  }
+
+  return entries;
+}
+
+void CalibrationFile::save(const std::string& path, const std::vector<calib_camera>& cams) {
+  /**
+   * Writes a calibration, replacing the file at path whole
+   *
+   * The new file is written next to the old one and renamed over it,
+   * so readers only ever map one or the other.
+   *
+   * Throws:
+   *   std::runtime_error: If the file can't be written
+   */
+  char logstr[128];
+
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+
+  calib_header header;
+  memset(&header, 0, sizeof(header));
+  header.magic = CALIB_MAGIC;
+  header.version = CALIB_VERSION;
+  header.num_cameras = cams.size();
+  header.timestamp = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+  std::string tmp_path = path + ".tmp";
+  size_t cams_size = cams.size() * sizeof(calib_camera);
+  int err = 0;
+
+  int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    err = errno;
+  } else {
+    errno = 0;
+    if (write(fd, &header, sizeof(header)) != (ssize_t)sizeof(header) ||
+        write(fd, cams.data(), cams_size) != (ssize_t)cams_size ||
+        fsync(fd) == -1)
+      err = errno ? errno : EIO; // a short write doesn't set errno
+    close(fd);
+  }
+
+  if (!err && rename(tmp_path.c_str(), path.c_str()) == -1)
+    err = errno;
+
+  if (err) {
+    unlink(tmp_path.c_str());
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error writing calibration %s: %s",
+      path.c_str(),
+      strerror(err)
+    );
+    LOG(ERROR, logstr);
+    throw std::runtime_error(logstr);
+  }
+}
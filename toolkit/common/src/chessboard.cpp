@@ -0,0 +1,70 @@
+#include <cstdint>
+#include <opencv2/calib3d.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include "chessboard.h"
+#include "frame_convert.h"
+
+bool detect_chessboard(const cv::Mat& nv12, std::vector<cv::Point2f>* corners) {
+  /**
+   * Finds the board's inner corners in an NV12 frame
+   *
+   * Parameters:
+   *   nv12: The frame
+   *   corners: The corners, in full resolution pixels
+   *
+   * Returns:
+   *   Whether the whole board was found
+   */
+  int height = nv12.rows * 2 / 3;
+
+  uint32_t scale = 1;
+  if (nv12.cols >= DETECT_WIDTH * 4)
+    scale = 4;
+  else if (nv12.cols >= DETECT_WIDTH * 2)
+    scale = 2;
+
+  FrameFormat format;
+  format.pixels = PixelFormat::GRAY;
+  format.downscale = scale;
+
+  cv::Mat small;
+  convert_frame(nv12, small, format);
+
+  int flags = cv::CALIB_CB_ADAPTIVE_THRESH | cv::CALIB_CB_NORMALIZE_IMAGE | cv::CALIB_CB_FAST_CHECK;
+  if (!cv::findChessboardCorners(small, cv::Size(BOARD_COLS, BOARD_ROWS), *corners, flags))
+    return false;
+
+  // a downscaled pixel covers scale x scale full resolution pixels
+  float offset = (scale - 1) / 2.0f;
+  for (cv::Point2f& corner : *corners) {
+    corner.x = corner.x * scale + offset;
+    corner.y = corner.y * scale + offset;
+  }
+
+  cv::cornerSubPix(
+    nv12.rowRange(0, height),
+    *corners,
+    cv::Size(SUBPIX_WINDOW, SUBPIX_WINDOW),
+    cv::Size(-1, -1),
+    cv::TermCriteria(cv::TermCriteria::EPS + cv::TermCriteria::COUNT, 30, 0.01)
+  );
+
+  return true;
+}
+
+std::vector<cv::Point3f> chessboard_points(double square_size) {
+  /**
+   * The board's inner corners in its own frame, in the order
+   * detect_chessboard finds them, on the z = 0 plane
+   *
+   * Parameters:
+   *   square_size: The side of a square, in whatever unit the points
+   *                should be in
+   */
+  std::vector<cv::Point3f> points;
+  for (int row = 0; row < BOARD_ROWS; row++)
+    for (int col = 0; col < BOARD_COLS; col++)
+      points.emplace_back(col * square_size, row * square_size, 0.0f);
+  return points;
+}
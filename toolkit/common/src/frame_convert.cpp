@@ -0,0 +1,473 @@
+#include <cstring>
+#include <opencv2/core.hpp>
+#include <stdexcept>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FRAME_KERNELS_AVX2
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define FRAME_KERNELS_NEON
+#endif
+
+#include "frame_convert.h"
+#include "logging.h"
+
+// BT.601 limited range, 6 bit fixed point, luma is scaled at 16 bits
+// as (y * 0x0101 * YUV_YG) >> 16, where 6 bits alone would be off by 2
+#define YUV_YG 18997 // 1.164
+#define YUV_YB 1192 // 16 * 1.164
+#define YUV_RV 102 // 1.596
+#define YUV_GV 52 // 0.813
+#define YUV_GU 25 // 0.391
+#define YUV_BU 129 // 2.018
+#define YUV_ROUND 32
+
+/**
+ * The row kernels, one set per instruction set. Each vector kernel
+ * hands whatever is left of its row past the last full vector to
+ * the scalar one, so they all agree on every pixel.
+ *
+ * The fixed point color conversion saturates at 16 bits in the
+ * vector kernels, which only ever happens for a blue channel that
+ * clamps to 255 either way.
+ */
+struct RowKernels {
+  // box filters scale x scale blocks of src, rows stride apart, into out_w pixels
+  void (*box_row)(const uint8_t* src, size_t stride, uint8_t* dst, int out_w, int scale);
+  // converts n pixels of y, u and v into planar r, g and b
+  void (*yuv_row)(
+    const uint8_t* y,
+    const uint8_t* u,
+    const uint8_t* v,
+    uint8_t* r,
+    uint8_t* g,
+    uint8_t* b,
+    int n
+  );
+  // interleaves three planes of n pixels
+  void (*pack_row)(const uint8_t* c0, const uint8_t* c1, const uint8_t* c2, uint8_t* dst, int n);
+  // scales n pixels to [0, 1]
+  void (*float_row)(const uint8_t* src, float* dst, int n);
+  const char* name;
+};
+
+static inline uint8_t clamp_u8(int x) {
+  return x < 0 ? 0 : x > 255 ? 255 : x;
+}
+
+static void box_tail(const uint8_t* src, size_t stride, uint8_t* dst, int from, int out_w, int scale) {
+  int area = scale * scale;
+  for (int x = from; x < out_w; x++) {
+    int sum = 0;
+    for (int j = 0; j < scale; j++) {
+      for (int i = 0; i < scale; i++)
+        sum += src[j * stride + x * scale + i];
+    }
+    dst[x] = (sum + area / 2) / area;
+  }
+}
+
+static void yuv_tail(
+  const uint8_t* y,
+  const uint8_t* u,
+  const uint8_t* v,
+  uint8_t* r,
+  uint8_t* g,
+  uint8_t* b,
+  int from,
+  int n
+) {
+  for (int x = from; x < n; x++) {
+    int yy = (int)(((uint32_t)y[x] * 0x0101 * YUV_YG) >> 16) - YUV_YB;
+    int du = u[x] - 128;
+    int dv = v[x] - 128;
+    r[x] = clamp_u8((yy + YUV_RV * dv + YUV_ROUND) >> 6);
+    g[x] = clamp_u8((yy - YUV_GV * dv - YUV_GU * du + YUV_ROUND) >> 6);
+    b[x] = clamp_u8((yy + YUV_BU * du + YUV_ROUND) >> 6);
+  }
+}
+
+static void float_tail(const uint8_t* src, float* dst, int from, int n) {
+  for (int x = from; x < n; x++)
+    dst[x] = src[x] * (1.0f / 255);
+}
+
+static void box_row_scalar(const uint8_t* src, size_t stride, uint8_t* dst, int out_w, int scale) {
+  box_tail(src, stride, dst, 0, out_w, scale);
+}
+
+static void yuv_row_scalar(
+  const uint8_t* y,
+  const uint8_t* u,
+  const uint8_t* v,
+  uint8_t* r,
+  uint8_t* g,
+  uint8_t* b,
+  int n
+) {
+  yuv_tail(y, u, v, r, g, b, 0, n);
+}
+
+static void pack_row_scalar(const uint8_t* c0, const uint8_t* c1, const uint8_t* c2, uint8_t* dst, int n) {
+  for (int x = 0; x < n; x++) {
+    dst[x * 3] = c0[x];
+    dst[x * 3 + 1] = c1[x];
+    dst[x * 3 + 2] = c2[x];
+  }
+}
+
+static void float_row_scalar(const uint8_t* src, float* dst, int n) {
+  float_tail(src, dst, 0, n);
+}
+
+#ifdef FRAME_KERNELS_AVX2
+__attribute__((target("avx2")))
+static inline void store_u8x16(uint8_t* dst, __m256i v) {
+  // packs 16 words in order, the 256 bit pack would interleave the lanes
+  __m128i packed = _mm_packus_epi16(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+  _mm_storeu_si128((__m128i*)dst, packed);
+}
+
+__attribute__((target("avx2")))
+static void box_row_avx2(const uint8_t* src, size_t stride, uint8_t* dst, int out_w, int scale) {
+  const __m256i ones = _mm256_set1_epi8(1);
+  int x = 0;
+  if (scale == 2) {
+    const __m256i round = _mm256_set1_epi16(2);
+    for (; x + 16 <= out_w; x += 16) {
+      const uint8_t* p = src + x * 2;
+      __m256i a = _mm256_maddubs_epi16(_mm256_loadu_si256((const __m256i*)p), ones);
+      __m256i b = _mm256_maddubs_epi16(_mm256_loadu_si256((const __m256i*)(p + stride)), ones);
+      __m256i sum = _mm256_add_epi16(_mm256_add_epi16(a, b), round);
+      store_u8x16(dst + x, _mm256_srli_epi16(sum, 2));
+    }
+  } else if (scale == 4) {
+    const __m256i ones16 = _mm256_set1_epi16(1);
+    const __m256i round = _mm256_set1_epi32(8);
+    for (; x + 8 <= out_w; x += 8) {
+      const uint8_t* p = src + x * 4;
+      __m256i pairs = _mm256_setzero_si256();
+      for (int j = 0; j < 4; j++) {
+        __m256i row = _mm256_loadu_si256((const __m256i*)(p + j * stride));
+        pairs = _mm256_add_epi16(pairs, _mm256_maddubs_epi16(row, ones));
+      }
+      __m256i sum = _mm256_add_epi32(_mm256_madd_epi16(pairs, ones16), round);
+      sum = _mm256_srli_epi32(sum, 4);
+      __m128i words = _mm_packs_epi32(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+      _mm_storel_epi64((__m128i*)(dst + x), _mm_packus_epi16(words, words));
+    }
+  }
+  box_tail(src, stride, dst, x, out_w, scale);
+}
+
+__attribute__((target("avx2")))
+static void yuv_row_avx2(
+  const uint8_t* y,
+  const uint8_t* u,
+  const uint8_t* v,
+  uint8_t* r,
+  uint8_t* g,
+  uint8_t* b,
+  int n
+) {
+  const __m256i c128 = _mm256_set1_epi16(128);
+  const __m256i kyg = _mm256_set1_epi16(YUV_YG);
+  const __m256i kyb = _mm256_set1_epi16(YUV_YB);
+  const __m256i krv = _mm256_set1_epi16(YUV_RV);
+  const __m256i kgv = _mm256_set1_epi16(YUV_GV);
+  const __m256i kgu = _mm256_set1_epi16(YUV_GU);
+  const __m256i kbu = _mm256_set1_epi16(YUV_BU);
+  const __m256i round = _mm256_set1_epi16(YUV_ROUND);
+  int x = 0;
+  for (; x + 16 <= n; x += 16) {
+    __m256i yv = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(y + x)));
+    __m256i du = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(u + x))), c128);
+    __m256i dv = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(v + x))), c128);
+    __m256i yy = _mm256_mulhi_epu16(_mm256_or_si256(yv, _mm256_slli_epi16(yv, 8)), kyg);
+    yy = _mm256_sub_epi16(yy, kyb);
+
+    __m256i rr = _mm256_adds_epi16(yy, _mm256_mullo_epi16(dv, krv));
+    __m256i gg = _mm256_subs_epi16(yy, _mm256_mullo_epi16(dv, kgv));
+    gg = _mm256_subs_epi16(gg, _mm256_mullo_epi16(du, kgu));
+    __m256i bb = _mm256_adds_epi16(yy, _mm256_mullo_epi16(du, kbu));
+
+    store_u8x16(r + x, _mm256_srai_epi16(_mm256_adds_epi16(rr, round), 6));
+    store_u8x16(g + x, _mm256_srai_epi16(_mm256_adds_epi16(gg, round), 6));
+    store_u8x16(b + x, _mm256_srai_epi16(_mm256_adds_epi16(bb, round), 6));
+  }
+  yuv_tail(y, u, v, r, g, b, x, n);
+}
+
+__attribute__((target("avx2")))
+static void float_row_avx2(const uint8_t* src, float* dst, int n) {
+  const __m256 k = _mm256_set1_ps(1.0f / 255);
+  int x = 0;
+  for (; x + 8 <= n; x += 8) {
+    __m256i v = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(src + x)));
+    _mm256_storeu_ps(dst + x, _mm256_mul_ps(_mm256_cvtepi32_ps(v), k));
+  }
+  float_tail(src, dst, x, n);
+}
+#endif
+
+#ifdef FRAME_KERNELS_NEON
+static void box_row_neon(const uint8_t* src, size_t stride, uint8_t* dst, int out_w, int scale) {
+  int x = 0;
+  if (scale == 2) {
+    for (; x + 8 <= out_w; x += 8) {
+      const uint8_t* p = src + x * 2;
+      uint16x8_t sum = vaddq_u16(vpaddlq_u8(vld1q_u8(p)), vpaddlq_u8(vld1q_u8(p + stride)));
+      vst1_u8(dst + x, vrshrn_n_u16(sum, 2));
+    }
+  } else if (scale == 4) {
+    for (; x + 8 <= out_w; x += 8) {
+      const uint8_t* p = src + x * 4;
+      uint16x8_t lo = vdupq_n_u16(0);
+      uint16x8_t hi = vdupq_n_u16(0);
+      for (int j = 0; j < 4; j++) {
+        lo = vaddq_u16(lo, vpaddlq_u8(vld1q_u8(p + j * stride)));
+        hi = vaddq_u16(hi, vpaddlq_u8(vld1q_u8(p + j * stride + 16)));
+      }
+      uint16x4_t a = vrshrn_n_u32(vpaddlq_u16(lo), 4);
+      uint16x4_t b = vrshrn_n_u32(vpaddlq_u16(hi), 4);
+      vst1_u8(dst + x, vmovn_u16(vcombine_u16(a, b)));
+    }
+  }
+  box_tail(src, stride, dst, x, out_w, scale);
+}
+
+static void yuv_row_neon(
+  const uint8_t* y,
+  const uint8_t* u,
+  const uint8_t* v,
+  uint8_t* r,
+  uint8_t* g,
+  uint8_t* b,
+  int n
+) {
+  const uint16x4_t kyg = vdup_n_u16(YUV_YG);
+  const int16x8_t kyb = vdupq_n_s16(YUV_YB);
+  const int16x8_t c128 = vdupq_n_s16(128);
+  const int16x8_t round = vdupq_n_s16(YUV_ROUND);
+  int x = 0;
+  for (; x + 8 <= n; x += 8) {
+    uint16x8_t yv = vmovl_u8(vld1_u8(y + x));
+    yv = vorrq_u16(yv, vshlq_n_u16(yv, 8));
+    int16x8_t du = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vld1_u8(u + x))), c128);
+    int16x8_t dv = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vld1_u8(v + x))), c128);
+    uint16x8_t yw = vcombine_u16(
+      vshrn_n_u32(vmull_u16(vget_low_u16(yv), kyg), 16),
+      vshrn_n_u32(vmull_u16(vget_high_u16(yv), kyg), 16)
+    );
+    int16x8_t yy = vsubq_s16(vreinterpretq_s16_u16(yw), kyb);
+
+    int16x8_t rr = vqaddq_s16(yy, vmulq_n_s16(dv, YUV_RV));
+    int16x8_t gg = vqsubq_s16(yy, vmulq_n_s16(dv, YUV_GV));
+    gg = vqsubq_s16(gg, vmulq_n_s16(du, YUV_GU));
+    int16x8_t bb = vqaddq_s16(yy, vmulq_n_s16(du, YUV_BU));
+
+    vst1_u8(r + x, vqmovun_s16(vshrq_n_s16(vqaddq_s16(rr, round), 6)));
+    vst1_u8(g + x, vqmovun_s16(vshrq_n_s16(vqaddq_s16(gg, round), 6)));
+    vst1_u8(b + x, vqmovun_s16(vshrq_n_s16(vqaddq_s16(bb, round), 6)));
+  }
+  yuv_tail(y, u, v, r, g, b, x, n);
+}
+
+static void pack_row_neon(const uint8_t* c0, const uint8_t* c1, const uint8_t* c2, uint8_t* dst, int n) {
+  int x = 0;
+  for (; x + 16 <= n; x += 16) {
+    uint8x16x3_t px = { { vld1q_u8(c0 + x), vld1q_u8(c1 + x), vld1q_u8(c2 + x) } };
+    vst3q_u8(dst + x * 3, px);
+  }
+  pack_row_scalar(c0 + x, c1 + x, c2 + x, dst + x * 3, n - x);
+}
+
+static void float_row_neon(const uint8_t* src, float* dst, int n) {
+  const float k = 1.0f / 255;
+  int x = 0;
+  for (; x + 8 <= n; x += 8) {
+    uint16x8_t w = vmovl_u8(vld1_u8(src + x));
+    vst1q_f32(dst + x, vmulq_n_f32(vcvtq_f32_u32(vmovl_u16(vget_low_u16(w))), k));
+    vst1q_f32(dst + x + 4, vmulq_n_f32(vcvtq_f32_u32(vmovl_u16(vget_high_u16(w))), k));
+  }
+  float_tail(src, dst, x, n);
+}
+#endif
+
+static RowKernels select_kernels() {
+#ifdef FRAME_KERNELS_AVX2
+  // the interleave gains little from AVX2 without a three way shuffle, so it stays scalar
+  if (__builtin_cpu_supports("avx2"))
+    return { box_row_avx2, yuv_row_avx2, pack_row_scalar, float_row_avx2, "avx2" };
+#endif
+#ifdef FRAME_KERNELS_NEON
+  return { box_row_neon, yuv_row_neon, pack_row_neon, float_row_neon, "neon" };
+#endif
+  return { box_row_scalar, yuv_row_scalar, pack_row_scalar, float_row_scalar, "scalar" };
+}
+
+static const RowKernels& kernels() {
+  static const RowKernels selected = select_kernels();
+  return selected;
+}
+
+const char* frame_kernels() {
+  /**
+   * Returns the instruction set the conversions run with, for logging
+   */
+  return kernels().name;
+}
+
+bool frame_format_valid(const FrameFormat& format) {
+  bool scale_valid = format.downscale == 1 || format.downscale == 2 || format.downscale == 4;
+  return scale_valid && (format.pixels != PixelFormat::NV12 || format.downscale == 1);
+}
+
+cv::Size converted_size(cv::Size size, const FrameFormat& format) {
+  /**
+   * Returns the resolution a frame of the given size is converted to,
+   * any pixels short of a full block at the right and bottom edges
+   * are left out
+   */
+  return cv::Size(size.width / format.downscale, size.height / format.downscale);
+}
+
+static void chroma_row(const uint8_t* uv, size_t stride, uint8_t* u, uint8_t* v, int out_w, int scale) {
+  /**
+   * Resamples an interleaved chroma row to one sample per output pixel,
+   * chroma being at half the luma resolution in both directions
+   */
+  if (scale == 1) {
+    for (int x = 0; x < out_w; x++) {
+      u[x] = uv[x & ~1];
+      v[x] = uv[(x & ~1) + 1];
+    }
+  } else if (scale == 2) {
+    for (int x = 0; x < out_w; x++) {
+      u[x] = uv[x * 2];
+      v[x] = uv[x * 2 + 1];
+    }
+  } else {
+    for (int x = 0; x < out_w; x++) {
+      const uint8_t* p = uv + x * 4;
+      u[x] = (p[0] + p[2] + p[stride] + p[stride + 2] + 2) >> 2;
+      v[x] = (p[1] + p[3] + p[stride + 1] + p[stride + 3] + 2) >> 2;
+    }
+  }
+}
+
+void convert_frame(const cv::Mat& nv12, cv::Mat& out, const FrameFormat& format) {
+  /**
+   * Converts a single NV12 frame, (h * 3/2) x w CV_8UC1, into out
+   *
+   * out is only reallocated if it doesn't already have the converted
+   * size and type, so passing the same Mats frame after frame converts
+   * into the same buffers. An empty frame, a camera missing from a
+   * partial frameset, gives an empty Mat.
+   *
+   * Throws:
+   *   std::runtime_error: If the format isn't one of the supported combinations
+   */
+  if (!frame_format_valid(format)) {
+    const char* err = "Unsupported frame format, downscale must be 1, 2 or 4, and 1 for NV12";
+    LOG(ERROR, err);
+    throw std::runtime_error(err);
+  }
+
+  if (nv12.empty()) {
+    out = cv::Mat();
+    return;
+  }
+
+  if (format.pixels == PixelFormat::NV12) {
+    out = nv12.clone();
+    return;
+  }
+
+  const RowKernels& k = kernels();
+  const int scale = format.downscale;
+  const int width = nv12.cols;
+  const int height = nv12.rows * 2 / 3;
+  const cv::Size size = converted_size(cv::Size(width, height), format);
+  const size_t stride = nv12.step;
+  const uint8_t* luma = nv12.ptr<uint8_t>(0);
+  const uint8_t* chroma = luma + height * stride;
+
+  if (format.pixels == PixelFormat::GRAY) {
+    out.create(size.height, size.width, CV_8UC1);
+    for (int oy = 0; oy < size.height; oy++) {
+      const uint8_t* src = luma + oy * scale * stride;
+      uint8_t* dst = out.ptr<uint8_t>(oy);
+      if (scale == 1)
+        memcpy(dst, src, size.width);
+      else
+        k.box_row(src, stride, dst, size.width, scale);
+    }
+    return;
+  }
+
+  bool planar = format.pixels == PixelFormat::BGR_PLANAR_F32 ||
+                format.pixels == PixelFormat::RGB_PLANAR_F32;
+  bool rgb = format.pixels == PixelFormat::RGB ||
+             format.pixels == PixelFormat::RGB_PLANAR_F32;
+  if (planar)
+    out.create(size.height * 3, size.width, CV_32FC1);
+  else
+    out.create(size.height, size.width, CV_8UC3);
+
+  // a handful of rows, reused by every frame this thread converts
+  static thread_local std::vector<uint8_t> rows;
+  rows.resize(size.width * 6);
+  uint8_t* y_row = rows.data();
+  uint8_t* u_row = y_row + size.width;
+  uint8_t* v_row = u_row + size.width;
+  uint8_t* r_row = v_row + size.width;
+  uint8_t* g_row = r_row + size.width;
+  uint8_t* b_row = g_row + size.width;
+  const uint8_t* c0 = rgb ? r_row : b_row;
+  const uint8_t* c2 = rgb ? b_row : r_row;
+
+  for (int oy = 0; oy < size.height; oy++) {
+    const uint8_t* src = luma + oy * scale * stride;
+    const uint8_t* y = src;
+    if (scale > 1) {
+      k.box_row(src, stride, y_row, size.width, scale);
+      y = y_row;
+    }
+
+    // scale 1 rows share a chroma row in pairs, scale 4 rows cover two each
+    int chroma_y = scale == 1 ? oy / 2 : oy * scale / 2;
+    chroma_row(chroma + chroma_y * stride, stride, u_row, v_row, size.width, scale);
+    k.yuv_row(y, u_row, v_row, r_row, g_row, b_row, size.width);
+
+    if (planar) {
+      k.float_row(c0, out.ptr<float>(oy), size.width);
+      k.float_row(g_row, out.ptr<float>(size.height + oy), size.width);
+      k.float_row(c2, out.ptr<float>(size.height * 2 + oy), size.width);
+    } else {
+      k.pack_row(c0, g_row, c2, out.ptr<uint8_t>(oy), size.width);
+    }
+  }
+}
+
+void convert_frames(const cv::Mat* nv12, size_t count, cv::Mat* out, const FrameFormat& format) {
+  /**
+   * Converts a frameset, one camera per task on OpenCV's thread pool
+   *
+   * nv12 and out must not overlap.
+   *
+   * Throws:
+   *   std::runtime_error: If the format isn't one of the supported combinations
+   */
+  if (!frame_format_valid(format)) {
+    const char* err = "Unsupported frame format, downscale must be 1, 2 or 4, and 1 for NV12";
+    LOG(ERROR, err);
+    throw std::runtime_error(err);
+  }
+
+  cv::parallel_for_(cv::Range(0, (int)count), [&](const cv::Range& range) {
+    for (int i = range.start; i < range.end; i++)
+      convert_frame(nv12[i], out[i], format);
+  });
+}
@@ -0,0 +1,104 @@
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "logging.h"
+#include "rig_config.h"
+
+static_assert(sizeof(cam_conf) == 40, "cam_conf layout changed, bump RIG_CONF_VERSION");
+
+RigConfig::RigConfig(const std::string& path) :
+  fd(-1),
+  map(nullptr),
+  map_size(0),
+  rig(nullptr)
+{
+  /**
+   * Maps the rig snapshot
+   *
+   * A snapshot older than cams.yaml is still mapped, the server only
+   * refreshes it when it next starts, but it's logged, see stale().
+   *
+   * Parameters:
+   *   path: The snapshot
+   *
+   * Throws:
+   *   std::runtime_error: If the snapshot can't be mapped, or isn't one
+   *                       this reader understands
+   */
+  char logstr[128];
+
+  fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) == -1) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error opening rig snapshot %s, has the server run yet: %s",
+      path.c_str(),
+      strerror(errno)
+    );
+    LOG(ERROR, logstr);
+    if (fd != -1)
+      close(fd);
+    throw std::runtime_error(logstr);
+  }
+
+  map_size = st.st_size;
+  if (map_size == sizeof(rig_conf)) {
+    map = mmap(nullptr, map_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+      map = nullptr;
+  }
+
+  rig = static_cast<const rig_conf*>(map);
+  if (!rig || !rig_conf_valid(rig)) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "%s is not a rig snapshot this reader understands",
+      path.c_str()
+    );
+    LOG(ERROR, logstr);
+    if (map)
+      munmap(map, map_size);
+    close(fd);
+    throw std::runtime_error(logstr);
+  }
+
+  if (stale())
+    LOG(WARNING, "Rig snapshot is older than cams.yaml, restart the server to refresh it");
+}
+
+RigConfig::~RigConfig() {
+  munmap(map, map_size);
+  close(fd);
+}
+
+size_t RigConfig::num_cameras() const {
+  return rig->cam_count;
+}
+
+const cam_conf& RigConfig::camera(size_t idx) const {
+  return rig->cams[idx];
+}
+
+bool RigConfig::stale(const std::string& yaml_path) const {
+  /**
+   * Checks the snapshot against the yaml it was parsed from
+   *
+   * Returns:
+   *   true if the yaml has changed since, false if it's the same or
+   *   can't be found, in which case the snapshot is all there is
+   */
+  struct stat st;
+  if (stat(yaml_path.c_str(), &st) == -1)
+    return false;
+
+  uint64_t mtime = (uint64_t)st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec;
+  return rig->yaml_size != (uint64_t)st.st_size || rig->yaml_mtime != mtime;
+}
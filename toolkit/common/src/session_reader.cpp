@@ -0,0 +1,578 @@
+#include <algorithm>
+#include <cstring>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <opencv2/core.hpp>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+#include "logging.h"
+#include "session_reader.h"
+
+#define DEFAULT_FRAME_DUR 33333333ULL // 30 fps, when the index is too short to tell
+#define FRAME_DUR_SAMPLES 64
+
+static const size_t idx_offset = sizeof(record_idx_header);
+
+SessionReader::SessionReader(
+  const std::string& dir,
+  size_t frame_width,
+  size_t frame_height,
+  size_t num_cameras
+) :
+  frame_width(frame_width),
+  frame_height(frame_height),
+  num_cameras(num_cameras),
+  frame_dur(DEFAULT_FRAME_DUR),
+  range_end(UINT64_MAX),
+  cam_mask(0)
+{
+  /**
+   * Opens every camera's recording in dir and starts decoding from the beginning
+   *
+   * Cameras are ordered by name, which is the order the server numbers
+   * them in, so frames[i] is the same camera whether it comes from here
+   * or a StreamController.
+   *
+   * Parameters:
+   *   dir: The recording directory
+   *   frame_width: Expected width of the recorded frames, 0 for any
+   *   frame_height: Expected height of the recorded frames, 0 for any
+   *   num_cameras: Expected number of cameras in the recording
+   *
+   * Throws:
+   *   std::runtime_error: If the recording can't be opened, or doesn't
+   *                       have the expected number of cameras
+   */
+  char logstr[128];
+
+  DIR* dirp = opendir(dir.c_str());
+  if (!dirp) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error opening recording %s: %s",
+      dir.c_str(),
+      strerror(errno)
+    );
+    LOG(ERROR, logstr);
+    throw std::runtime_error(logstr);
+  }
+
+  const size_t ext_len = strlen(RECORD_IDX_EXT);
+  std::vector<std::string> names;
+  struct dirent* entry;
+  while ((entry = readdir(dirp)) != nullptr) {
+    std::string file = entry->d_name;
+    if (file.size() > ext_len && file.compare(file.size() - ext_len, ext_len, RECORD_IDX_EXT) == 0)
+      names.push_back(file.substr(0, file.size() - ext_len));
+  }
+  closedir(dirp);
+  std::sort(names.begin(), names.end());
+
+  if (names.size() != num_cameras) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Recording has %zu cameras, expected %zu",
+      names.size(),
+      num_cameras
+    );
+    LOG(ERROR, logstr);
+    throw std::runtime_error(logstr);
+  }
+
+  try {
+    for (const std::string& name : names) {
+      cams.push_back(std::make_unique<Camera>());
+      cams.back()->name = name;
+      open_camera(*cams.back(), dir);
+    }
+  } catch (...) {
+    for (auto& cam : cams)
+      close_camera(*cam);
+    throw;
+  }
+
+  // the cameras share a capture schedule, so any one of them gives the interval
+  const Camera& first = *cams[0];
+  size_t samples = std::min<size_t>(first.idx_count, FRAME_DUR_SAMPLES + 1);
+  if (samples > 2) {
+    std::vector<uint64_t> deltas;
+    for (size_t i = 1; i < samples; i++)
+      deltas.push_back(first.idx[i].timestamp - first.idx[i - 1].timestamp);
+    std::nth_element(deltas.begin(), deltas.begin() + deltas.size() / 2, deltas.end());
+    if (deltas[deltas.size() / 2] > 0)
+      frame_dur = deltas[deltas.size() / 2];
+  }
+
+  for (auto& cam : cams) {
+    cam->seek_pending = true;
+    cam->seek_target = 0;
+    cam->worker = std::thread(&SessionReader::worker_fn, this, std::ref(*cam));
+  }
+}
+
+SessionReader::~SessionReader() {
+  for (auto& cam : cams)
+    close_camera(*cam);
+}
+
+void SessionReader::open_camera(Camera& cam, const std::string& dir) {
+  /**
+   * Maps a camera's data and index files, and opens its decoder
+   *
+   * Throws:
+   *   std::runtime_error: If either file can't be mapped, or the index
+   *                       isn't a recording index
+   */
+  char logstr[128];
+
+  std::string idx_path = dir + "/" + cam.name + RECORD_IDX_EXT;
+  std::string data_path = dir + "/" + cam.name + RECORD_DATA_EXT;
+
+  cam.idx_fd = open(idx_path.c_str(), O_RDONLY | O_CLOEXEC);
+  cam.data_fd = open(data_path.c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat idx_stat;
+  struct stat data_stat;
+  if (cam.idx_fd == -1 || cam.data_fd == -1 ||
+      fstat(cam.idx_fd, &idx_stat) == -1 ||
+      fstat(cam.data_fd, &data_stat) == -1) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error opening recording of cam %s: %s",
+      cam.name.c_str(),
+      strerror(errno)
+    );
+    LOG(ERROR, logstr);
+    throw std::runtime_error(logstr);
+  }
+
+  cam.idx_map_size = idx_stat.st_size;
+  if (cam.idx_map_size >= idx_offset) {
+    cam.idx_map = mmap(nullptr, cam.idx_map_size, PROT_READ, MAP_PRIVATE, cam.idx_fd, 0);
+    if (cam.idx_map == MAP_FAILED)
+      cam.idx_map = nullptr;
+  }
+
+  const record_idx_header* header = static_cast<const record_idx_header*>(cam.idx_map);
+  if (!header || header->magic != RECORD_IDX_MAGIC || header->version != RECORD_IDX_VERSION) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "%s is not a recording index this reader understands",
+      idx_path.c_str()
+    );
+    LOG(ERROR, logstr);
+    throw std::runtime_error(logstr);
+  }
+
+  // a torn last entry, from a recording cut short, is left out
+  cam.idx = reinterpret_cast<const record_idx_entry*>(
+    static_cast<const uint8_t*>(cam.idx_map) + idx_offset
+  );
+  cam.idx_count = (cam.idx_map_size - idx_offset) / sizeof(record_idx_entry);
+
+  cam.data_size = data_stat.st_size;
+  while (cam.idx_count > 0 &&
+         cam.idx[cam.idx_count - 1].offset + cam.idx[cam.idx_count - 1].size > cam.data_size)
+    cam.idx_count--;
+
+  if (cam.data_size > 0) {
+    void* data = mmap(nullptr, cam.data_size, PROT_READ, MAP_PRIVATE, cam.data_fd, 0);
+    if (data == MAP_FAILED) {
+      snprintf(
+        logstr,
+        sizeof(logstr),
+        "Error mapping %s: %s",
+        data_path.c_str(),
+        strerror(errno)
+      );
+      LOG(ERROR, logstr);
+      throw std::runtime_error(logstr);
+    }
+    cam.data = static_cast<const uint8_t*>(data);
+  }
+
+  open_decoder(cam);
+}
+
+void SessionReader::open_decoder(Camera& cam) {
+  /**
+   * Opens a software H.264 decoder for a camera
+   *
+   * Each decoder runs single threaded, the reader gets its parallelism
+   * from decoding every camera at once instead.
+   *
+   * Throws:
+   *   std::runtime_error: If the decoder can't be opened
+   */
+  const AVCodec* codec = avcodec_find_decoder(AV_CODEC_ID_H264);
+  if (codec)
+    cam.ctx = avcodec_alloc_context3(codec);
+  if (cam.ctx) {
+    cam.ctx->thread_count = 1;
+    if (avcodec_open2(cam.ctx, codec, nullptr) < 0)
+      avcodec_free_context(&cam.ctx);
+  }
+  cam.pkt = av_packet_alloc();
+  cam.frame = av_frame_alloc();
+
+  if (!cam.ctx || !cam.pkt || !cam.frame) {
+    const char* err = "Could not open H.264 decoder";
+    LOG(ERROR, err);
+    throw std::runtime_error(err);
+  }
+}
+
+void SessionReader::close_camera(Camera& cam) {
+  if (cam.worker.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(cam.mutex);
+      cam.stop = true;
+    }
+    cam.cv.notify_all();
+    cam.worker.join();
+  }
+
+  if (cam.frame)
+    av_frame_free(&cam.frame);
+  if (cam.pkt)
+    av_packet_free(&cam.pkt);
+  if (cam.ctx)
+    avcodec_free_context(&cam.ctx);
+
+  if (cam.data)
+    munmap(const_cast<uint8_t*>(cam.data), cam.data_size);
+  if (cam.idx_map)
+    munmap(cam.idx_map, cam.idx_map_size);
+  if (cam.data_fd >= 0)
+    close(cam.data_fd);
+  if (cam.idx_fd >= 0)
+    close(cam.idx_fd);
+
+  cam.data = nullptr;
+  cam.idx_map = nullptr;
+  cam.data_fd = -1;
+  cam.idx_fd = -1;
+}
+
+void SessionReader::worker_fn(Camera& cam) {
+  /**
+   * Decodes a camera ahead of the consumer until it's stopped
+   *
+   * A pending seek is taken up here rather than in seek(), so the
+   * decoder is only ever touched by this thread.
+   */
+  std::unique_lock<std::mutex> lock(cam.mutex);
+  while (true) {
+    cam.cv.wait(lock, [&] {
+      return cam.stop || cam.seek_pending ||
+             (!cam.eof && cam.ready.size() < SESSION_DECODE_AHEAD);
+    });
+    if (cam.stop)
+      return;
+
+    if (cam.seek_pending) {
+      uint64_t target = cam.seek_target;
+      const record_idx_entry* at = std::lower_bound(
+        cam.idx,
+        cam.idx + cam.idx_count,
+        target,
+        [](const record_idx_entry& e, uint64_t ts) { return e.timestamp < ts; }
+      );
+
+      // a frame can only be decoded from the keyframe before it
+      size_t k = at - cam.idx;
+      if (k < cam.idx_count) {
+        while (k > 0 && !(cam.idx[k].flags & RECORD_KEYFRAME))
+          k--;
+      }
+
+      avcodec_flush_buffers(cam.ctx);
+      cam.next_pkt = k;
+      cam.flushing = false;
+      cam.skip_before = target;
+      cam.ready.clear();
+      cam.eof = false;
+      cam.error.clear();
+      cam.seek_pending = false;
+      cam.cv.notify_all();
+    }
+
+    lock.unlock();
+    bool more = false;
+    std::string error;
+    try {
+      more = decode_step(cam);
+    } catch (const std::exception& e) {
+      error = e.what();
+    }
+    lock.lock();
+
+    if (!more) {
+      cam.eof = true;
+      cam.error = error;
+      cam.cv.notify_all();
+    }
+  }
+}
+
+bool SessionReader::decode_step(Camera& cam) {
+  /**
+   * Feeds the decoder until it produces a frame, and queues the frame
+   *
+   * Returns:
+   *   false once the decoder is fully drained at the end of the recording
+   *
+   * Throws:
+   *   std::runtime_error: If the decoder fails, or the recording isn't
+   *                       at the expected resolution
+   */
+  char logstr[128];
+  char averr[AV_ERROR_MAX_STRING_SIZE];
+
+  while (true) {
+    int ret = avcodec_receive_frame(cam.ctx, cam.frame);
+    if (ret == 0) {
+      int64_t pts = cam.frame->pts;
+      if (pts < 0 || (size_t)pts >= cam.idx_count) {
+        av_frame_unref(cam.frame);
+        continue; // not one of ours, nothing to time it by
+      }
+
+      uint64_t timestamp = cam.idx[pts].timestamp;
+      cv::Mat mat;
+      if (timestamp >= cam.skip_before)
+        mat = to_nv12(cam.frame);
+      av_frame_unref(cam.frame);
+      if (mat.empty())
+        continue; // decoded up to the seek target, not handed back
+
+      std::lock_guard<std::mutex> lock(cam.mutex);
+      if (!cam.seek_pending) { // otherwise it's from before the seek
+        cam.ready.emplace_back(timestamp, mat);
+        cam.cv.notify_all();
+      }
+      return true;
+    }
+
+    if (ret == AVERROR_EOF)
+      return false;
+
+    if (ret != AVERROR(EAGAIN)) {
+      av_strerror(ret, averr, sizeof(averr));
+      snprintf(logstr, sizeof(logstr), "Error decoding cam %s: %s", cam.name.c_str(), averr);
+      LOG(ERROR, logstr);
+      throw std::runtime_error(logstr);
+    }
+
+    if (cam.next_pkt == cam.idx_count) {
+      if (cam.flushing)
+        return false;
+      avcodec_send_packet(cam.ctx, nullptr);
+      cam.flushing = true;
+      continue;
+    }
+
+    // copied out of the mapping for the padding the decoder reads past the end into
+    const record_idx_entry& e = cam.idx[cam.next_pkt];
+    cam.pkt_buf.resize(e.size + AV_INPUT_BUFFER_PADDING_SIZE);
+    memcpy(cam.pkt_buf.data(), cam.data + e.offset, e.size);
+    memset(cam.pkt_buf.data() + e.size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+
+    cam.pkt->data = cam.pkt_buf.data();
+    cam.pkt->size = e.size;
+    cam.pkt->pts = cam.next_pkt;
+    cam.pkt->flags = e.flags & RECORD_KEYFRAME ? AV_PKT_FLAG_KEY : 0;
+    ret = avcodec_send_packet(cam.ctx, cam.pkt);
+    cam.next_pkt++;
+    if (ret < 0 && ret != AVERROR_INVALIDDATA) {
+      av_strerror(ret, averr, sizeof(averr));
+      snprintf(logstr, sizeof(logstr), "Error decoding cam %s: %s", cam.name.c_str(), averr);
+      LOG(ERROR, logstr);
+      throw std::runtime_error(logstr);
+    }
+    // a corrupt packet only costs its frame, the decoder conceals the rest
+  }
+}
+
+cv::Mat SessionReader::to_nv12(const AVFrame* frame) const {
+  /**
+   * Copies a decoded YUV 4:2:0 frame into an NV12 Mat laid out like the server's
+   *
+   * Throws:
+   *   std::runtime_error: If the frame isn't planar 4:2:0 at the expected size
+   */
+  bool yuv420 = frame->format == AV_PIX_FMT_YUV420P || frame->format == AV_PIX_FMT_YUVJ420P;
+  size_t width = frame->width;
+  size_t height = frame->height;
+  bool expected_size = (frame_width == 0 || width == frame_width) &&
+                       (frame_height == 0 || height == frame_height);
+  if (!yuv420 || !expected_size) {
+    const char* err = "Recorded frames don't match the expected format or resolution";
+    LOG(ERROR, err);
+    throw std::runtime_error(err);
+  }
+
+  cv::Mat nv12(height * 3/2, width, CV_8UC1);
+  for (size_t y = 0; y < height; y++)
+    memcpy(nv12.ptr<uint8_t>(y), frame->data[0] + y * frame->linesize[0], width);
+
+  for (size_t y = 0; y < height / 2; y++) {
+    uint8_t* uv = nv12.ptr<uint8_t>(height + y);
+    const uint8_t* u = frame->data[1] + y * frame->linesize[1];
+    const uint8_t* v = frame->data[2] + y * frame->linesize[2];
+    for (size_t x = 0; x < width / 2; x++) {
+      uv[x * 2] = u[x];
+      uv[x * 2 + 1] = v[x];
+    }
+  }
+
+  return nv12;
+}
+
+bool SessionReader::head(Camera& cam, uint64_t* timestamp) {
+  /**
+   * Waits for a camera's next frame
+   *
+   * Returns:
+   *   false if the camera has no frames left
+   *
+   * Throws:
+   *   std::runtime_error: If the camera's decoder failed
+   */
+  std::unique_lock<std::mutex> lock(cam.mutex);
+  cam.cv.wait(lock, [&] {
+    return !cam.ready.empty() || (cam.eof && !cam.seek_pending);
+  });
+
+  if (cam.ready.empty() && !cam.error.empty())
+    throw std::runtime_error(cam.error);
+  if (cam.ready.empty())
+    return false;
+
+  *timestamp = cam.ready.front().first;
+  return true;
+}
+
+bool SessionReader::recv_frameset(
+  cv::Mat* frames,
+  uint64_t* timestamp,
+  const FrameFormat& format
+) {
+  /**
+   * Returns the next frameset in the recording
+   *
+   * Any format other than NV12 is converted from the decoded frames,
+   * every camera in parallel, see frame_convert.h.
+   *
+   * Cameras missing from the frameset are returned as empty Mats,
+   * last_cam_mask() has a bit set for each camera that is present.
+   *
+   * Returns:
+   *   false once the recording, or the range given to set_range(), is over
+   *
+   * Throws:
+   *   std::runtime_error: If a camera's decoder failed, or the format isn't supported
+   */
+  if (!frame_format_valid(format)) {
+    const char* err = "Unsupported frame format";
+    LOG(ERROR, err);
+    throw std::runtime_error(err);
+  }
+
+  std::vector<uint64_t> heads(num_cameras);
+  std::vector<bool> present(num_cameras);
+  uint64_t earliest = UINT64_MAX;
+  for (size_t i = 0; i < num_cameras; i++) {
+    present[i] = head(*cams[i], &heads[i]);
+    if (present[i])
+      earliest = std::min(earliest, heads[i]);
+  }
+
+  if (earliest == UINT64_MAX || earliest > range_end)
+    return false;
+
+  bool convert = format.pixels != PixelFormat::NV12;
+  std::vector<cv::Mat> decoded(convert ? num_cameras : 0);
+  cv::Mat* taken = convert ? decoded.data() : frames;
+
+  cam_mask = 0;
+  for (size_t i = 0; i < num_cameras; i++) {
+    Camera& cam = *cams[i];
+    if (!present[i] || heads[i] > earliest + frame_dur / 2) {
+      taken[i] = cv::Mat();
+      continue;
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(cam.mutex);
+      taken[i] = std::move(cam.ready.front().second);
+      cam.ready.pop_front();
+    }
+    cam.cv.notify_all();
+    cam_mask |= 1ULL << i;
+  }
+
+  if (convert)
+    convert_frames(decoded.data(), num_cameras, frames, format);
+
+  *timestamp = earliest;
+  return true;
+}
+
+void SessionReader::seek(uint64_t timestamp) {
+  /**
+   * Moves to the first frameset at or after timestamp, until the end of the recording
+   *
+   * Returns without waiting, each camera repositions itself in the
+   * background and the next recv_frameset() waits for them.
+   */
+  set_range(timestamp, UINT64_MAX);
+}
+
+void SessionReader::set_range(uint64_t start, uint64_t end) {
+  /**
+   * Limits reading to the framesets from start to end inclusive, and moves to start
+   */
+  for (auto& cam : cams) {
+    {
+      std::lock_guard<std::mutex> lock(cam->mutex);
+      cam->seek_pending = true;
+      cam->seek_target = start;
+      cam->ready.clear();
+    }
+    cam->cv.notify_all();
+  }
+  range_end = end;
+}
+
+uint64_t SessionReader::first_timestamp() const {
+  uint64_t first = UINT64_MAX;
+  for (const auto& cam : cams) {
+    if (cam->idx_count)
+      first = std::min(first, cam->idx[0].timestamp);
+  }
+  return first;
+}
+
+uint64_t SessionReader::last_timestamp() const {
+  uint64_t last = 0;
+  for (const auto& cam : cams) {
+    if (cam->idx_count)
+      last = std::max(last, cam->idx[cam->idx_count - 1].timestamp);
+  }
+  return last;
+}
+
+uint64_t SessionReader::last_cam_mask() const {
+  return cam_mask;
+}
@@ -3,16 +3,30 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <opencv2/core.hpp>
-#include <semaphore.h>
 #include <stdexcept>
 #include <string.h>
 #include <system_error>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
+#ifdef CUDA_FRAMESETS
+#include <cuda_runtime_api.h>
+#endif
 
 #include "logging.h"
 #include "stream_controller.h"
+#include "trace.h"
+
+#define TRACE_PATH "consumer.trace"
+
+static void trace_consumed(uint64_t cam_mask, size_t num_cameras, uint64_t timestamp) {
+  for (size_t i = 0; i < num_cameras; i++) {
+    if (cam_mask & (1ULL << i))
+      TRACE_POINT(TRACE_CONSUMED, i, timestamp);
+  }
+}
 
 StreamController::StreamController(
   size_t frame_width,
@@ -23,14 +37,72 @@ StreamController::StreamController(
   frame_height(frame_height),
   num_cameras(num_cameras),
   server_pid_(0),
-  frameset_ctl_sem(nullptr),
   shm_fd(-1),
-  frameset_buf(nullptr)
+  shm_size(0),
+  frameset_buf(nullptr),
+  frameset_hdr(nullptr),
+  consumer(nullptr),
+  read_cursor(0),
+  dropped(0),
+  cam_mask(0),
+  gpu_pool(nullptr)
 {
+  /**
+   * Attaches to the running server, or launches one if there isn't any
+   *
+   * frame_width and frame_height are the resolution every camera is
+   * expected to share, or 0 to accept whatever each camera's resolution
+   * is, see frame_size().
+   *
+   * Several controllers, in this process or others, can attach to the
+   * same server, each reading framesets independently from its own
+   * cursor. A launched server is resident, it starts the cameras while
+   * any controller is attached and stops them once the last one is
+   * destroyed, but keeps running with its decoders warm, so the next
+   * controller's stream starts within a few frames rather than after a
+   * full server startup. It exits by itself once it's gone unused for
+   * a while.
+   *
+   * Throws:
+   *   std::runtime_error: If the server can't be launched, doesn't share
+   *                       its segment in time, the segment doesn't match
+   *                       the stream parameters, or too many consumers
+   *                       are attached already
+   */
+  if (!attach_segment()) {
+    launch_server();
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (!attach_segment()) {
+      int status;
+      if (waitpid(server_pid_, &status, WNOHANG) == server_pid_) {
+        server_pid_ = 0;
+        const char* err = "Server exited before sharing any framesets";
+        LOG(ERROR, err);
+        throw std::runtime_error(err);
+      }
+
+      struct timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      if (now.tv_sec - start.tv_sec > SERVER_START_TIMEOUT) {
+        const char* err = "Timed out waiting for the server to share its segment";
+        LOG(ERROR, err);
+        throw std::runtime_error(err);
+      }
+      usleep(SERVER_POLL_MS * 1000);
+    }
+  }
+
+  claim_consumer();
+}
+
+void StreamController::launch_server() {
   char logstr[128];
 
   server_pid_ = fork();
   if (server_pid_ == -1) {
+    server_pid_ = 0;
     snprintf(
       logstr,
       sizeof(logstr),
@@ -42,114 +114,554 @@ StreamController::StreamController(
   }
 
   if (server_pid_ == 0) {
-    execl(SERVER_EXE, SERVER_EXE, nullptr);
+    // the server outlives this process, so it mustn't share its session's signals
+    setsid();
+    execl(SERVER_EXE, SERVER_EXE, "-d", nullptr);
     _exit(errno);
   }
+}
 
-  frameset_ctl_sem = sem_open(
-    SEM_NAME,
-    O_CREAT,
-    0666,
-    0
-  );
-  if (frameset_ctl_sem == SEM_FAILED) {
-    snprintf(
-      logstr,
-      sizeof(logstr),
-      "Error opening semaphore: %s",
-      strerror(errno)
+bool StreamController::attach_segment() {
+  /**
+   * Maps the frameset segment if a live server is sharing one
+   *
+   * The server owns the layout of the segment (see frameset_shm.h), and
+   * only sets the magic once the layout is final, so a segment without
+   * it, or left behind by a server that's gone, isn't attached to. The
+   * header is checked against the stream parameters this controller was
+   * constructed with.
+   *
+   * Returns:
+   *   false if there's no live segment yet
+   *
+   * Throws:
+   *   std::runtime_error: If the live segment doesn't match the expected layout
+   */
+  int fd = shm_open(FRAMESET_SHM_NAME, O_RDWR, 0);
+  if (fd == -1)
+    return false;
+
+  struct stat shm_stat;
+  void* buf = MAP_FAILED;
+  if (fstat(fd, &shm_stat) == 0 && (size_t)shm_stat.st_size >= frameset_header_size())
+    buf = mmap(NULL, shm_stat.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (buf == MAP_FAILED) {
+    close(fd);
+    return false;
+  }
+
+  frameset_shm_header* hdr = static_cast<frameset_shm_header*>(buf);
+  bool live = hdr->magic == FRAMESET_SHM_MAGIC &&
+              hdr->server_pid != 0 &&
+              (kill(hdr->server_pid, 0) == 0 || errno == EPERM);
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if (!live) {
+    munmap(buf, shm_stat.st_size);
+    close(fd);
+    return false;
+  }
+
+  shm_fd = fd;
+  shm_size = shm_stat.st_size;
+  frameset_buf = buf;
+  frameset_hdr = hdr;
+
+  bool valid_header =
+    frameset_hdr->version == FRAMESET_SHM_VERSION &&
+    frameset_hdr->cam_count == num_cameras &&
+    frameset_hdr->slot_count > 0 &&
+    frameset_hdr->slot_count <= FRAMESET_MAX_SLOTS &&
+    frameset_hdr->slots_offset == frameset_slots_offset(frameset_hdr->cam_count) &&
+    shm_size >= frameset_shm_size(
+      frameset_hdr->cam_count,
+      frameset_hdr->slot_count,
+      frameset_hdr->pool_size
     );
-    LOG(ERROR, logstr);
-    throw std::runtime_error(logstr);
+  for (size_t i = 0; valid_header && i < num_cameras; i++) {
+    const frameset_cam* cam = frameset_get_cam(frameset_buf, i);
+    valid_header =
+      (frame_width == 0 || cam->width == frame_width) &&
+      (frame_height == 0 || cam->height == frame_height) &&
+      cam->frame_size >= (uint64_t)cam->width * cam->height * 3 / 2 &&
+      cam->frame_stride >= cam->frame_size &&
+      (frameset_hdr->flags & FRAMESET_GPU ||
+       cam->pool_offset + cam->frame_stride * cam->frame_count <= frameset_hdr->pool_size);
+  }
+  if (!valid_header) {
+    const char* err = "Frameset shared memory does not match the expected layout";
+    LOG(ERROR, err);
+    throw std::runtime_error(err);
   }
 
-  shm_fd = shm_open(
-    SHM_NAME,
-    O_CREAT | O_RDWR,
-    0666
-  );
-  if (shm_fd == -1) {
-    snprintf(
-      logstr,
-      sizeof(logstr),
-      "Error creating shared memory: %s",
-      strerror(errno)
+#ifdef CUDA_FRAMESETS
+  if (frameset_hdr->flags & FRAMESET_GPU)
+    open_gpu_pool();
+#endif
+
+  return true;
+}
+
+void StreamController::claim_consumer() {
+  /**
+   * Claims a free entry in the segment's consumer table
+   *
+   * An entry whose process has exited is as good as free, so a consumer
+   * that crashed doesn't hold its entry forever.
+   *
+   * Throws:
+   *   std::runtime_error: If every entry is held by a live consumer
+   */
+  uint32_t self = getpid();
+  for (int i = 0; i < FRAMESET_MAX_CONSUMERS; i++) {
+    frameset_consumer* entry = &frameset_hdr->consumers[i];
+    uint32_t pid = entry->pid.load(std::memory_order_acquire);
+    bool free = pid == 0 || (kill(pid, 0) == -1 && errno == ESRCH);
+    if (!free || !entry->pid.compare_exchange_strong(pid, self))
+      continue;
+
+    // start from the newest frameset rather than replaying the whole ring
+    uint64_t write_seq = frameset_hdr->write_seq.load(std::memory_order_acquire);
+    read_cursor = write_seq > 0 ? write_seq - 1 : 0;
+    entry->leases.store(0, std::memory_order_seq_cst);
+    entry->cursor.store(read_cursor, std::memory_order_relaxed);
+    consumer = entry;
+
+    // a resident server starts streaming as soon as it notices
+    kill(frameset_hdr->server_pid, FRAMESET_WAKE_SIGNAL);
+    return;
+  }
+
+  const char* err = "Too many consumers attached to the server";
+  LOG(ERROR, err);
+  throw std::runtime_error(err);
+}
+
+StreamController::~StreamController() {
+  if (consumer) {
+    consumer->leases.store(0, std::memory_order_release);
+    consumer->pid.store(0, std::memory_order_release);
+    kill(frameset_hdr->server_pid, FRAMESET_WAKE_SIGNAL);
+  }
+
+  // the server stays resident, this only reaps it if it has already exited
+  if (server_pid_ > 0)
+    waitpid(server_pid_, nullptr, WNOHANG);
+
+  TRACE_DUMP(TRACE_PATH);
+
+#ifdef CUDA_FRAMESETS
+  if (gpu_pool != nullptr)
+    cudaIpcCloseMemHandle(gpu_pool);
+#endif
+
+  if (frameset_buf != nullptr)
+    munmap(frameset_buf, shm_size);
+
+  if (shm_fd > -1)
+    close(shm_fd);
+}
+
+void StreamController::wait_frameset() {
+  /**
+   * Sleeps until the server publishes past the read cursor
+   *
+   * Wakes every SERVER_POLL_MS regardless, to check the server is still
+   * running, since a server that died can't wake anyone.
+   *
+   * Throws:
+   *   std::runtime_error: If the server has stopped
+   */
+  frameset_hdr->waiters.fetch_add(1, std::memory_order_seq_cst);
+  uint32_t notify = frameset_hdr->notify.load(std::memory_order_seq_cst);
+  long ret = 0;
+  if (frameset_hdr->write_seq.load(std::memory_order_acquire) <= read_cursor) {
+    struct timespec timeout = { 0, SERVER_POLL_MS * 1000000L };
+    ret = frameset_futex(&frameset_hdr->notify, FUTEX_WAIT, notify, &timeout);
+  }
+  int futex_err = errno;
+  frameset_hdr->waiters.fetch_sub(1, std::memory_order_relaxed);
+
+  bool gone = frameset_hdr->magic != FRAMESET_SHM_MAGIC ||
+              (ret == -1 && futex_err == ETIMEDOUT &&
+               kill(frameset_hdr->server_pid, 0) == -1 && errno == ESRCH);
+  if (gone) {
+    const char* err = "Server stopped sharing framesets";
+    LOG(ERROR, err);
+    throw std::runtime_error(err);
+  }
+}
+
+frameset_slot* StreamController::next_frameset(uint64_t* seq) {
+  /**
+   * Finds the next unread frameset in the shared memory ring
+   *
+   * Framesets are read in order from the controller's cursor. If the
+   * consumer has fallen more than slot_count framesets behind, the
+   * oldest ones have already been reused, so the cursor skips to the
+   * oldest frameset still in the ring and the skipped framesets are
+   * counted in dropped_framesets().
+   *
+   * Sleeps only when every published frameset has been read, so a
+   * consumer which is behind drains the ring without sleeping.
+   *
+   * Returns:
+   *   The slot holding the frameset, with its sequence stored in seq
+   */
+  while (true) {
+    uint64_t write_seq = frameset_hdr->write_seq.load(std::memory_order_acquire);
+    if (read_cursor >= write_seq) {
+      wait_frameset();
+      continue;
+    }
+
+    uint64_t slot_count = frameset_hdr->slot_count;
+    if (write_seq - read_cursor > slot_count) {
+      dropped += write_seq - slot_count - read_cursor;
+      read_cursor = write_seq - slot_count;
+    }
+
+    frameset_slot* slot = frameset_get_slot(
+      frameset_buf,
+      frameset_hdr,
+      read_cursor
     );
-    LOG(ERROR, logstr);
-    throw std::runtime_error(logstr);
+
+    if (slot->seq.load(std::memory_order_acquire) != read_cursor + 1)
+      continue; // reused since write_seq was read, recompute the lag
+
+    *seq = read_cursor++;
+    consumer->cursor.store(read_cursor, std::memory_order_relaxed);
+    return slot;
   }
+}
 
-  shm_size = frame_width * frame_height * 3 / 2 * num_cameras + sizeof(uint64_t);
+void StreamController::map_frames(frameset_slot* slot, cv::Mat* frames) {
+  if (frameset_hdr->flags & FRAMESET_GPU) {
+    const char* err = "Server is sharing frames in device memory, use recv_frameset_gpu";
+    LOG(ERROR, err);
+    throw std::runtime_error(err);
+  }
 
-  int ret = ftruncate(
-    shm_fd,
-    shm_size
-  );
-  if (ret == -1) {
-    snprintf(
-      logstr,
-      sizeof(logstr),
-      "Error resizing shared memory: %s",
-      strerror(errno)
+  const uint32_t* bufs = frameset_slot_bufs(slot);
+  for (size_t i = 0; i < num_cameras; i++) {
+    if (bufs[i] == FRAMESET_NO_FRAME) {
+      frames[i] = cv::Mat();
+      continue;
+    }
+
+    const frameset_cam* cam = frameset_get_cam(frameset_buf, i);
+    frames[i] = cv::Mat(
+      cam->height * 3/2,
+      cam->width,
+      CV_8UC1,
+      frameset_pool_frame(frameset_buf, frameset_hdr, i, bufs[i])
     );
-    LOG(ERROR, logstr);
-    throw std::runtime_error(logstr);
   }
+}
+
+void StreamController::read_offsets(frameset_slot* slot, std::vector<int32_t>& out) const {
+  const int32_t* slot_offsets = frameset_slot_offsets(slot, frameset_hdr->cam_count);
+  out.assign(slot_offsets, slot_offsets + num_cameras);
+}
+
+#ifdef CUDA_FRAMESETS
+void StreamController::open_gpu_pool() {
+  /**
+   * Opens the server's device frame pool through the header's IPC handle
+   *
+   * Throws:
+   *   std::runtime_error: If the handle can't be opened in this process
+   */
+  char logstr[128];
+
+  cudaIpcMemHandle_t handle;
+  static_assert(
+    sizeof(handle) == FRAMESET_IPC_HANDLE_SIZE,
+    "cudaIpcMemHandle_t no longer matches FRAMESET_IPC_HANDLE_SIZE"
+  );
+  memcpy(&handle, frameset_hdr->cuda_ipc_handle, sizeof(handle));
 
-  frameset_buf = mmap(
-    NULL,
-    shm_size,
-    PROT_READ,
-    MAP_SHARED,
-    shm_fd,
-    0
+  void* dev_ptr = nullptr;
+  cudaError_t ret = cudaIpcOpenMemHandle(
+    &dev_ptr,
+    handle,
+    cudaIpcMemLazyEnablePeerAccess
   );
-  if (frameset_buf == MAP_FAILED) {
+  if (ret != cudaSuccess) {
     snprintf(
       logstr,
       sizeof(logstr),
-      "Error mapping shared memory: %s",
-      strerror(errno)
+      "Error opening device frame pool: %s",
+      cudaGetErrorString(ret)
     );
     LOG(ERROR, logstr);
     throw std::runtime_error(logstr);
   }
+  gpu_pool = static_cast<uint8_t*>(dev_ptr);
 }
 
-StreamController::~StreamController() {
-  if (server_pid_ > 0)
-    kill(server_pid_, SIGTERM);
+uint64_t StreamController::recv_frameset_gpu(
+  cv::cuda::GpuMat* frames,
+  uint64_t* timestamp
+) {
+  /**
+   * Maps the next unread frameset in device memory without copying
+   *
+   * Only valid against a server built with CUDA_FRAMESETS. The GpuMats
+   * point straight into the server's device frame pool and follow the
+   * same lifetime rules as recv_frameset_view(), so results should be
+   * checked with frameset_valid() before they're trusted.
+   *
+   * Returns:
+   *   The frameset sequence, to be passed to frameset_valid()
+   *
+   * Throws:
+   *   std::runtime_error: If the server is sharing host frames
+   */
+  uint64_t seq;
+  frameset_slot* slot = next_frameset(&seq);
 
-  if (frameset_buf != nullptr)
-    munmap(frameset_buf, shm_size);
+  if (!gpu_pool) {
+    const char* err = "Server is not sharing frames in device memory";
+    LOG(ERROR, err);
+    throw std::runtime_error(err);
+  }
 
-  if (shm_fd > -1) {
-    close(shm_fd);
-    shm_unlink(SHM_NAME);
+  const uint32_t* bufs = frameset_slot_bufs(slot);
+  for (size_t i = 0; i < num_cameras; i++) {
+    if (bufs[i] == FRAMESET_NO_FRAME) {
+      frames[i] = cv::cuda::GpuMat();
+      continue;
+    }
+
+    const frameset_cam* cam = frameset_get_cam(frameset_buf, i);
+    frames[i] = cv::cuda::GpuMat(
+      cam->height * 3/2,
+      cam->width,
+      CV_8UC1,
+      gpu_pool + cam->pool_offset + cam->frame_stride * bufs[i]
+    );
   }
+  *timestamp = slot->timestamp;
+  cam_mask = slot->cam_mask;
+  read_offsets(slot, offsets);
+  trace_consumed(cam_mask, num_cameras, *timestamp);
+
+  return seq;
+}
+#endif
 
-  if (frameset_ctl_sem != nullptr) {
-    sem_close(frameset_ctl_sem);
-    sem_unlink(SEM_NAME);
+void StreamController::acquire(Frameset* frameset) {
+  /**
+   * Leases the next unread frameset, mapping its frames in place
+   *
+   * The server won't recycle the frameset's buffers until it's passed
+   * to release(), so the frames stay intact however long they're used
+   * for, with no need to check frameset_valid(). A lease blocks the
+   * server from reusing its ring slot, and every frameset published
+   * while it's slot_count framesets old is dropped, so leases should be
+   * released within a few frame intervals. Any number of leases can be
+   * held at once.
+   *
+   * If the server reuses the slot between this finding the frameset and
+   * leasing it, the frameset is counted as dropped and the next one is
+   * leased instead.
+   */
+#ifndef CUDA_FRAMESETS
+  // checked up front, map_frames throwing would leave the lease held
+  if (frameset_hdr->flags & FRAMESET_GPU) {
+    const char* err = "Server is sharing frames in device memory, rebuild with CUDA_FRAMESETS";
+    LOG(ERROR, err);
+    throw std::runtime_error(err);
+  }
+#endif
+
+  while (true) {
+    uint64_t seq;
+    frameset_slot* slot = next_frameset(&seq);
+
+    // pairs with the server zeroing the sequence then checking the leases
+    uint64_t bit = 1ULL << (seq % frameset_hdr->slot_count);
+    consumer->leases.fetch_or(bit, std::memory_order_seq_cst);
+    if (slot->seq.load(std::memory_order_seq_cst) != seq + 1) {
+      consumer->leases.fetch_and(~bit, std::memory_order_relaxed);
+      dropped++;
+      continue;
+    }
+
+    frameset->seq = seq;
+    frameset->timestamp = slot->timestamp;
+    frameset->cam_mask = slot->cam_mask;
+    read_offsets(slot, frameset->exposure_offsets);
+#ifdef CUDA_FRAMESETS
+    if (frameset_hdr->flags & FRAMESET_GPU) {
+      frameset->gpu_frames.resize(num_cameras);
+      const uint32_t* bufs = frameset_slot_bufs(slot);
+      for (size_t i = 0; i < num_cameras; i++) {
+        if (bufs[i] == FRAMESET_NO_FRAME) {
+          frameset->gpu_frames[i] = cv::cuda::GpuMat();
+          continue;
+        }
+
+        const frameset_cam* cam = frameset_get_cam(frameset_buf, i);
+        frameset->gpu_frames[i] = cv::cuda::GpuMat(
+          cam->height * 3/2,
+          cam->width,
+          CV_8UC1,
+          gpu_pool + cam->pool_offset + cam->frame_stride * bufs[i]
+        );
+      }
+      frameset->frames.clear();
+    } else
+#endif
+    {
+      frameset->frames.resize(num_cameras);
+      map_frames(slot, frameset->frames.data());
+    }
+
+    cam_mask = frameset->cam_mask;
+    offsets = frameset->exposure_offsets;
+    trace_consumed(cam_mask, num_cameras, frameset->timestamp);
+    return;
   }
 }
 
-void StreamController::recv_frameset(cv::Mat* frames, uint64_t* timestamp) {
-  sem_wait(frameset_ctl_sem);
+void StreamController::release(Frameset* frameset) {
+  /**
+   * Ends a lease taken with acquire(), after which its frames must not be used
+   */
+  frameset->frames.clear();
+#ifdef CUDA_FRAMESETS
+  frameset->gpu_frames.clear();
+#endif
+  uint64_t bit = 1ULL << (frameset->seq % frameset_hdr->slot_count);
+  consumer->leases.fetch_and(~bit, std::memory_order_release);
+}
 
-  size_t frame_size = frame_width * frame_height * 3 / 2;
-  for(size_t i = 0; i < num_cameras; i++) {
-    size_t offset = i * frame_size;
-    uint8_t* frame = static_cast<uint8_t*>(frameset_buf) + offset;
+void StreamController::recv_frameset(
+  cv::Mat* frames,
+  uint64_t* timestamp,
+  const FrameFormat& format
+) {
+  /**
+   * Copies the next unread frameset out of the shared memory ring
+   *
+   * Frames are leased for just as long as it takes to copy them out
+   * of the frame pool, so they stay valid no matter how far behind the
+   * consumer falls. Any format other than NV12 is converted straight
+   * out of the pool in that same pass, every camera in parallel, see
+   * frame_convert.h, and frames already of the converted size and
+   * type are reused.
+   *
+   * Cameras missing from a partial frameset are returned as empty Mats,
+   * last_cam_mask() has a bit set for each camera that is present.
+   *
+   * Throws:
+   *   std::runtime_error: If the format isn't supported
+   */
+  if (!frame_format_valid(format)) {
+    const char* err = "Unsupported frame format";
+    LOG(ERROR, err);
+    throw std::runtime_error(err);
+  }
 
-    frames[i] = cv::Mat(
-      frame_height * 3/2,
-      frame_width,
-      CV_8UC1,
-      frame
-    ).clone();
+  Frameset frameset;
+  acquire(&frameset);
+  if (frameset.frames.size() != num_cameras) {
+    release(&frameset);
+    const char* err = "Server is sharing frames in device memory, use recv_frameset_gpu";
+    LOG(ERROR, err);
+    throw std::runtime_error(err);
+  }
+
+  if (format.pixels == PixelFormat::NV12) {
+    for (size_t i = 0; i < num_cameras; i++)
+      frames[i] = frameset.frames[i].clone();
+  } else {
+    convert_frames(frameset.frames.data(), num_cameras, frames, format);
   }
+  *timestamp = frameset.timestamp;
+  release(&frameset);
+}
+
+uint64_t StreamController::recv_frameset_view(cv::Mat* frames, uint64_t* timestamp) {
+  /**
+   * Maps the next unread frameset in place without copying
+   *
+   * The returned Mats point straight into the server's frame pool. The
+   * buffers stay intact until the server reuses the frameset's ring slot,
+   * which happens once the consumer is slot_count framesets behind, so
+   * anything computed from a view should be checked with frameset_valid()
+   * before it's trusted. The Mats must not be written to.
+   *
+   * Returns:
+   *   The frameset sequence, to be passed to frameset_valid()
+   */
+  uint64_t seq;
+  frameset_slot* slot = next_frameset(&seq);
+
+  map_frames(slot, frames);
+  *timestamp = slot->timestamp;
+  cam_mask = slot->cam_mask;
+  read_offsets(slot, offsets);
+  trace_consumed(cam_mask, num_cameras, *timestamp);
+
+  return seq;
+}
+
+bool StreamController::frameset_valid(uint64_t seq) const {
+  std::atomic_thread_fence(std::memory_order_acquire);
+  const frameset_slot* slot = frameset_get_slot(frameset_buf, frameset_hdr, seq);
+  return slot->seq.load(std::memory_order_relaxed) == seq + 1;
+}
+
+uint64_t StreamController::frames_behind() const {
+  if (!frameset_hdr)
+    return 0;
+
+  uint64_t write_seq = frameset_hdr->write_seq.load(std::memory_order_acquire);
+  return write_seq > read_cursor ? write_seq - read_cursor : 0;
+}
+
+uint64_t StreamController::dropped_framesets() const {
+  return dropped;
+}
+
+uint64_t StreamController::last_cam_mask() const {
+  return cam_mask;
+}
+
+int32_t StreamController::last_exposure_offset(size_t cam) const {
+  /**
+   * Returns how far after the last frameset's timestamp, in ns, a
+   * camera's exposure started, or FRAMESET_NO_OFFSET if the camera was
+   * missing or didn't measure it. Compensating for these offsets
+   * removes the sub-frame skew between cameras that the shared capture
+   * schedule leaves.
+   */
+  if (cam >= offsets.size())
+    return FRAMESET_NO_OFFSET;
+  return offsets[cam];
+}
+
+bool StreamController::launched_server() const {
+  return server_pid_ > 0;
+}
+
+cv::Size StreamController::frame_size(size_t cam) const {
+  /**
+   * Returns a camera's resolution, its NV12 frames are
+   * width x height * 3/2 single channel Mats
+   */
+  const frameset_cam* info = frameset_get_cam(frameset_buf, cam);
+  return cv::Size(info->width, info->height);
+}
 
-  uint8_t* timestamp_ptr = static_cast<uint8_t*>(frameset_buf) + (frame_size * num_cameras);
-  *timestamp = *reinterpret_cast<uint64_t*>(timestamp_ptr);
+uint32_t StreamController::frame_rate(size_t cam) const {
+  /**
+   * Returns a camera's frame rate. A camera slower than the fastest
+   * one is only part of every fastest / frame_rate(cam) frameset, and
+   * empty in the rest
+   */
+  return frameset_get_cam(frameset_buf, cam)->fps;
 }
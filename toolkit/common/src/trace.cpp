@@ -0,0 +1,153 @@
+#ifdef TRACE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+/**
+ * Shared by the server, picam and the toolkit, compiled as C or C++,
+ * and the copies must be kept identical.
+ */
+
+struct trace_ring {
+  uint64_t head; // points ever recorded, only written by the owning thread
+  uint32_t tid;
+  struct trace_rec recs[TRACE_RING_SIZE];
+};
+
+static struct trace_ring* rings[TRACE_MAX_THREADS];
+static uint32_t ring_count = 0;
+
+static __thread struct trace_ring* thread_ring = NULL;
+static __thread int thread_untraced = 0; // every ring was taken
+
+static struct trace_ring* register_ring() {
+  uint32_t idx = __atomic_fetch_add(&ring_count, 1, __ATOMIC_RELAXED);
+  if (idx >= TRACE_MAX_THREADS) {
+    thread_untraced = 1;
+    return NULL;
+  }
+
+  struct trace_ring* ring = (struct trace_ring*)calloc(1, sizeof(struct trace_ring));
+  if (!ring) {
+    thread_untraced = 1;
+    return NULL;
+  }
+
+  ring->tid = (uint32_t)syscall(SYS_gettid);
+  __atomic_store_n(&rings[idx], ring, __ATOMIC_RELEASE);
+  return ring;
+}
+
+void trace_point(enum trace_stage stage, uint16_t cam, uint64_t frame_ts) {
+  /**
+   * Records that a frame completed a stage
+   *
+   * The first point a thread records allocates its ring, so threads
+   * that never trace cost nothing.
+   *
+   * Parameters:
+   * - enum trace_stage stage: the stage completed
+   * - uint16_t cam: the camera's index, or TRACE_CAM_UNKNOWN
+   * - uint64_t frame_ts: the frame's scheduled capture timestamp
+   */
+  struct trace_ring* ring = thread_ring;
+  if (!ring) {
+    if (thread_untraced)
+      return;
+    ring = thread_ring = register_ring();
+    if (!ring)
+      return;
+  }
+
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+
+  uint64_t head = ring->head;
+  struct trace_rec* rec = &ring->recs[head & (TRACE_RING_SIZE - 1)];
+  rec->frame_ts = frame_ts;
+  rec->ns = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+  rec->stage = (uint16_t)stage;
+  rec->cam = cam;
+  rec->tid = ring->tid;
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static int write_all(int fd, const void* data, size_t size) {
+  const uint8_t* bytes = (const uint8_t*)data;
+  while (size) {
+    ssize_t written = write(fd, bytes, size);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      return -errno;
+    }
+    bytes += written;
+    size -= written;
+  }
+  return 0;
+}
+
+int trace_dump(const char* path) {
+  /**
+   * Writes every thread's points to a trace file
+   *
+   * Meant to be called once at exit, after the traced threads have
+   * stopped, a ring still being written to may have its oldest points
+   * overwritten while it's dumped.
+   *
+   * Parameters:
+   * - const char* path: the file to write, truncated if it exists
+   *
+   * Returns:
+   * - int: 0 on success, or a negative error code
+   */
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0664);
+  if (fd < 0)
+    return -errno;
+
+  uint32_t count = __atomic_load_n(&ring_count, __ATOMIC_ACQUIRE);
+  if (count > TRACE_MAX_THREADS)
+    count = TRACE_MAX_THREADS;
+
+  // heads are read once, so the header agrees with what's written
+  uint64_t heads[TRACE_MAX_THREADS];
+  struct trace_file_header header;
+  memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+  header.version = TRACE_VERSION;
+  header.rec_count = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    struct trace_ring* ring = __atomic_load_n(&rings[i], __ATOMIC_ACQUIRE);
+    heads[i] = ring ? __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) : 0;
+    header.rec_count += heads[i] < TRACE_RING_SIZE ? heads[i] : TRACE_RING_SIZE;
+  }
+
+  int ret = write_all(fd, &header, sizeof(header));
+  for (uint32_t i = 0; i < count && !ret; i++) {
+    struct trace_ring* ring = __atomic_load_n(&rings[i], __ATOMIC_ACQUIRE);
+    if (!ring)
+      continue;
+
+    // oldest point first, in at most two runs when the ring has wrapped
+    uint64_t head = heads[i];
+    uint64_t start = head < TRACE_RING_SIZE ? 0 : head - TRACE_RING_SIZE;
+    size_t first = start & (TRACE_RING_SIZE - 1);
+    size_t len = head - start;
+    size_t run = len < TRACE_RING_SIZE - first ? len : TRACE_RING_SIZE - first;
+
+    ret = write_all(fd, &ring->recs[first], run * sizeof(struct trace_rec));
+    if (!ret && len > run)
+      ret = write_all(fd, ring->recs, (len - run) * sizeof(struct trace_rec));
+  }
+
+  close(fd);
+  return ret;
+}
+
+#endif // TRACE
@@ -0,0 +1,112 @@
+#ifndef CALIB_ENGINE_H
+#define CALIB_ENGINE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <opencv2/core.hpp>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define DETECT_THREADS_PER_CAM 2
+#define MIN_POSE_CHANGE 0.04 // mean corner shift from every accepted view, over the frame width
+#define MIN_SOLVE_VIEWS 10 // accepted views before a camera is first calibrated
+#define SOLVE_EVERY 5 // new views between solves after that
+
+/**
+ * Intrinsics of one camera, as of its latest solve.
+ */
+struct CameraIntrinsics {
+  cv::Mat camera_matrix; // 3 x 3 CV_64F
+  cv::Mat dist_coeffs; // k1 k2 p1 p2 k3, CV_64F
+  double rms; // reprojection error of the solve, in pixels
+  size_t views; // accepted views the solve used
+};
+
+/**
+ * Captures chessboard views from every camera of a rig and calibrates
+ * each camera's lens from them while the board is still being waved
+ * around, so the operator can watch the error converge and stop once
+ * it's good enough.
+ *
+ * Every camera has its own few detection threads and a single frame
+ * mailbox. submit() replaces whatever frame is still waiting in it, so
+ * a camera whose detection can't keep up with the stream only ever
+ * works on its newest frame instead of falling further behind.
+ *
+ * Boards are found with detect_chessboard, see chessboard.h.
+ *
+ * Most frames of a slowly moving board are near duplicates, which
+ * only slow the solve down and bias it toward one pose, so a view is
+ * only accepted if its corners moved at least MIN_POSE_CHANGE of the
+ * frame width on average from every view accepted before it.
+ *
+ * A solver thread recalibrates a camera every SOLVE_EVERY accepted
+ * views, once it has MIN_SOLVE_VIEWS, seeding each solve with the
+ * previous one.
+ */
+
+class CalibrationEngine {
+private:
+  struct View {
+    std::vector<cv::Point2f> corners;
+    uint64_t timestamp;
+  };
+
+  struct Camera {
+    size_t idx = 0;
+    cv::Size frame_size;
+    std::vector<std::thread> workers;
+
+    // under mutex
+    std::mutex mutex;
+    std::condition_variable cond;
+    cv::Mat pending; // NV12, the newest frame not yet taken
+    uint64_t pending_ts = 0;
+    std::vector<View> views;
+    size_t solved_views = 0; // views when the last solve started
+    bool has_intrinsics = false;
+    CameraIntrinsics intrinsics;
+    uint64_t frames = 0;
+    uint64_t superseded = 0; // replaced in the mailbox before a worker took them
+    uint64_t detected = 0;
+  };
+
+  size_t num_cameras;
+  std::vector<cv::Point3f> board_points;
+  std::vector<std::unique_ptr<Camera>> cams;
+  std::atomic<bool> stop;
+
+  // taken after a camera's mutex, never before it
+  std::thread solver;
+  std::mutex solver_mutex;
+  std::condition_variable solver_cv;
+  bool solve_requested;
+
+  void worker_fn(Camera& cam);
+  bool novel(const Camera& cam, const std::vector<cv::Point2f>& corners) const;
+  void solver_fn();
+  bool solve_due(const Camera& cam) const;
+  void solve(Camera& cam, bool force);
+
+public:
+  CalibrationEngine(size_t num_cameras);
+  ~CalibrationEngine();
+
+  void submit(const cv::Mat* frames, uint64_t timestamp, bool wait = false);
+  bool intrinsics(size_t cam, CameraIntrinsics* out);
+  size_t accepted_views(size_t cam);
+  void solve_now();
+  void log_progress();
+
+  CalibrationEngine(const CalibrationEngine&) = delete;
+  CalibrationEngine& operator=(const CalibrationEngine&) = delete;
+  CalibrationEngine(CalibrationEngine&&) = delete;
+  CalibrationEngine& operator=(CalibrationEngine&&) = delete;
+};
+
+#endif // CALIB_ENGINE_H
@@ -0,0 +1,329 @@
+#include <algorithm>
+#include <cmath>
+#include <exception>
+#include <opencv2/calib3d.hpp>
+
+#include "calib_engine.h"
+#include "chessboard.h"
+#include "logging.h"
+
+CalibrationEngine::CalibrationEngine(size_t num_cameras) :
+  num_cameras(num_cameras),
+  stop(false),
+  solve_requested(false) {
+  // in units of squares, the intrinsics don't depend on the square size
+  board_points = chessboard_points(1.0);
+
+  for (size_t i = 0; i < num_cameras; i++) {
+    cams.push_back(std::make_unique<Camera>());
+    cams.back()->idx = i;
+  }
+
+  for (auto& cam : cams)
+    for (int t = 0; t < DETECT_THREADS_PER_CAM; t++)
+      cam->workers.emplace_back(&CalibrationEngine::worker_fn, this, std::ref(*cam));
+
+  solver = std::thread(&CalibrationEngine::solver_fn, this);
+}
+
+CalibrationEngine::~CalibrationEngine() {
+  stop = true;
+
+  for (auto& cam : cams) {
+    {
+      std::lock_guard<std::mutex> lock(cam->mutex);
+    }
+    cam->cond.notify_all();
+    for (auto& worker : cam->workers)
+      worker.join();
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(solver_mutex);
+  }
+  solver_cv.notify_all();
+  solver.join();
+}
+
+void CalibrationEngine::submit(const cv::Mat* frames, uint64_t timestamp, bool wait) {
+  /**
+   * Hands a frameset to the cameras' detection threads.
+   *
+   * The frames are shared rather than copied, so the caller must not
+   * write into them afterwards. Assigning new Mats to the array, as
+   * recv_frameset does, is fine.
+   *
+   * Parameters:
+   *   frames: An array of num_cameras NV12 frames, empty frames are
+   *           skipped
+   *   timestamp: The frameset's timestamp
+   *   wait: Blocks until each camera has taken its previous frame
+   *         instead of replacing it, for recordings, where every frame
+   *         can be looked at
+   */
+  for (size_t i = 0; i < num_cameras; i++) {
+    if (frames[i].empty())
+      continue;
+
+    Camera& cam = *cams[i];
+    std::unique_lock<std::mutex> lock(cam.mutex);
+
+    if (wait)
+      cam.cond.wait(lock, [&] { return cam.pending.empty() || stop; });
+
+    if (!cam.pending.empty())
+      cam.superseded++;
+
+    if (cam.frame_size.width == 0)
+      cam.frame_size = cv::Size(frames[i].cols, frames[i].rows * 2 / 3);
+
+    cam.pending = frames[i];
+    cam.pending_ts = timestamp;
+    cam.frames++;
+
+    lock.unlock();
+    cam.cond.notify_all();
+  }
+}
+
+void CalibrationEngine::worker_fn(Camera& cam) {
+  std::unique_lock<std::mutex> lock(cam.mutex);
+
+  while (true) {
+    cam.cond.wait(lock, [&] { return stop || !cam.pending.empty(); });
+    if (stop)
+      return;
+
+    cv::Mat frame = cam.pending;
+    uint64_t timestamp = cam.pending_ts;
+    cam.pending.release();
+    lock.unlock();
+    cam.cond.notify_all(); // a waiting submit can hand over its next frame
+
+    std::vector<cv::Point2f> corners;
+    bool found = false;
+    try {
+      found = detect_chessboard(frame, &corners);
+    } catch (const std::exception& e) {
+      LOG_FMT(
+        ERROR,
+        "Chessboard detection failed on camera %zu: %s",
+        cam.idx,
+        e.what()
+      );
+    }
+
+    lock.lock();
+    if (!found)
+      continue;
+
+    cam.detected++;
+    if (!novel(cam, corners))
+      continue;
+
+    cam.views.push_back({std::move(corners), timestamp});
+
+    if (solve_due(cam)) {
+      {
+        std::lock_guard<std::mutex> solver_lock(solver_mutex);
+        solve_requested = true;
+      }
+      solver_cv.notify_one();
+    }
+  }
+}
+
+bool CalibrationEngine::novel(const Camera& cam, const std::vector<cv::Point2f>& corners) const {
+  /**
+   * Whether a view's corners moved far enough from every accepted view.
+   *
+   * findChessboardCorners may order the corners of a board turned half
+   * way around from either end, so each view is compared in both orders
+   * and the closer one counts. Called under the camera's mutex.
+   */
+  double min_shift = MIN_POSE_CHANGE * cam.frame_size.width;
+  size_t n = corners.size();
+
+  for (const View& view : cam.views) {
+    double forward = 0.0;
+    double reversed = 0.0;
+
+    for (size_t i = 0; i < n; i++) {
+      const cv::Point2f& a = corners[i];
+      const cv::Point2f& b = view.corners[i];
+      const cv::Point2f& c = view.corners[n - 1 - i];
+      forward += std::hypot(a.x - b.x, a.y - b.y);
+      reversed += std::hypot(a.x - c.x, a.y - c.y);
+    }
+
+    if (std::min(forward, reversed) / n < min_shift)
+      return false;
+  }
+
+  return true;
+}
+
+bool CalibrationEngine::solve_due(const Camera& cam) const {
+  // called under the camera's mutex
+  return cam.views.size() >= MIN_SOLVE_VIEWS &&
+    cam.views.size() >= cam.solved_views + SOLVE_EVERY;
+}
+
+void CalibrationEngine::solver_fn() {
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(solver_mutex);
+      solver_cv.wait(lock, [&] { return stop || solve_requested; });
+      if (stop)
+        return;
+      solve_requested = false;
+    }
+
+    for (auto& cam : cams) {
+      if (stop)
+        return;
+      solve(*cam, false);
+    }
+  }
+}
+
+void CalibrationEngine::solve(Camera& cam, bool force) {
+  /**
+   * Calibrates a camera from its accepted views, seeded with its
+   * previous solve if it has one.
+   *
+   * Parameters:
+   *   cam: The camera
+   *   force: Solves if the current intrinsics are missing any views,
+   *          instead of waiting for SOLVE_EVERY of them, even if the
+   *          solver thread is already working on them, so the result
+   *          is there when this returns
+   */
+  std::vector<std::vector<cv::Point2f>> image_points;
+  cv::Mat camera_matrix;
+  cv::Mat dist_coeffs;
+  int flags = 0;
+
+  {
+    std::lock_guard<std::mutex> lock(cam.mutex);
+
+    bool due = force ?
+      cam.views.size() >= MIN_SOLVE_VIEWS &&
+        (!cam.has_intrinsics || cam.intrinsics.views < cam.views.size()) :
+      solve_due(cam);
+    if (!due)
+      return;
+
+    for (const View& view : cam.views)
+      image_points.push_back(view.corners);
+    cam.solved_views = cam.views.size();
+
+    if (cam.has_intrinsics) {
+      camera_matrix = cam.intrinsics.camera_matrix.clone();
+      dist_coeffs = cam.intrinsics.dist_coeffs.clone();
+      flags |= cv::CALIB_USE_INTRINSIC_GUESS;
+    }
+  }
+
+  std::vector<std::vector<cv::Point3f>> object_points(image_points.size(), board_points);
+  std::vector<cv::Mat> rvecs;
+  std::vector<cv::Mat> tvecs;
+  double rms = 0.0;
+
+  try {
+    rms = cv::calibrateCamera(
+      object_points,
+      image_points,
+      cam.frame_size,
+      camera_matrix,
+      dist_coeffs,
+      rvecs,
+      tvecs,
+      flags
+    );
+  } catch (const std::exception& e) {
+    LOG_FMT(
+      ERROR,
+      "Calibrating camera %zu failed: %s",
+      cam.idx,
+      e.what()
+    );
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(cam.mutex);
+
+    // solve_now can race the solver thread, keep whichever used more views
+    if (cam.has_intrinsics && cam.intrinsics.views > image_points.size())
+      return;
+
+    cam.intrinsics.camera_matrix = camera_matrix;
+    cam.intrinsics.dist_coeffs = dist_coeffs;
+    cam.intrinsics.rms = rms;
+    cam.intrinsics.views = image_points.size();
+    cam.has_intrinsics = true;
+  }
+
+  LOG_FMT(
+    INFO,
+    "Camera %zu calibrated from %zu views, rms %.3f px, fx %.1f fy %.1f cx %.1f cy %.1f",
+    cam.idx,
+    image_points.size(),
+    rms,
+    camera_matrix.at<double>(0, 0),
+    camera_matrix.at<double>(1, 1),
+    camera_matrix.at<double>(0, 2),
+    camera_matrix.at<double>(1, 2)
+  );
+}
+
+void CalibrationEngine::solve_now() {
+  /**
+   * Solves every camera whose intrinsics are missing any of its views,
+   * on the calling thread, for a final result once capture is over.
+   */
+  for (auto& cam : cams)
+    solve(*cam, true);
+}
+
+bool CalibrationEngine::intrinsics(size_t cam, CameraIntrinsics* out) {
+  /**
+   * Copies out a camera's latest intrinsics.
+   *
+   * Returns:
+   *   False if the camera hasn't been calibrated yet
+   */
+  Camera& c = *cams[cam];
+  std::lock_guard<std::mutex> lock(c.mutex);
+  if (!c.has_intrinsics)
+    return false;
+
+  out->camera_matrix = c.intrinsics.camera_matrix.clone();
+  out->dist_coeffs = c.intrinsics.dist_coeffs.clone();
+  out->rms = c.intrinsics.rms;
+  out->views = c.intrinsics.views;
+  return true;
+}
+
+size_t CalibrationEngine::accepted_views(size_t cam) {
+  Camera& c = *cams[cam];
+  std::lock_guard<std::mutex> lock(c.mutex);
+  return c.views.size();
+}
+
+void CalibrationEngine::log_progress() {
+  for (auto& cam : cams) {
+    std::lock_guard<std::mutex> lock(cam->mutex);
+    LOG_FMT(
+      INFO,
+      "Camera %zu: %lu frames, %lu superseded, %lu detections, %zu views, rms %.3f px",
+      cam->idx,
+      cam->frames,
+      cam->superseded,
+      cam->detected,
+      cam->views.size(),
+      cam->has_intrinsics ? cam->intrinsics.rms : 0.0
+    );
+  }
+}
@@ -1,15 +1,99 @@
 #include <errno.h>
 #include <iostream>
 #include <opencv2/core.hpp>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
 
+#include "calib_engine.h"
+#include "calib_file.h"
 #include "logging.h"
+#include "rig_config.h"
+#include "session_reader.h"
 #include "stream_controller.h"
 
 #define LOG_PATH "/var/log/mocap-toolkit/lens_calibration.log"
 
-int main() {
+#define TARGET_VIEWS 40 // accepted views per camera before capture stops
+#define PROGRESS_INTERVAL_NS 2000000000ull
+
+static volatile sig_atomic_t running = 1;
+
+static void stop_handler(int signum) {
+  (void)signum;
+  running = 0;
+}
+
+static uint64_t monotonic_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static bool enough_views(CalibrationEngine& engine, size_t num_cameras) {
+  for (size_t i = 0; i < num_cameras; i++) {
+    if (engine.accepted_views(i) < TARGET_VIEWS)
+      return false;
+  }
+  return true;
+}
+
+static void save(CalibrationEngine& engine, const std::vector<cv::Size>& sizes) {
+  /**
+   * Prints each camera's final intrinsics and writes them into the
+   * rig's calibration file, keeping what it has for cameras that
+   * weren't calibrated this time
+   *
+   * Parameters:
+   *   engine: The solved engine
+   *   sizes: Each camera's resolution the views were taken at
+   */
+  std::vector<calib_camera> calib = CalibrationFile::load(CALIB_PATH, sizes.size());
+  bool updated = false;
+
+  for (size_t i = 0; i < sizes.size(); i++) {
+    CameraIntrinsics intr;
+    if (!engine.intrinsics(i, &intr)) {
+      LOG_FMT(
+        WARNING,
+        "Camera %zu not calibrated, only %zu views accepted",
+        i,
+        engine.accepted_views(i)
+      );
+      std::cout << "Camera " << i << ": not enough views\n";
+      continue;
+    }
+
+    LOG_FMT(
+      INFO,
+      "Camera %zu final intrinsics from %zu views, rms %.3f px",
+      i,
+      intr.views,
+      intr.rms
+    );
+    std::cout << "Camera " << i << ": " << intr.views << " views, rms " << intr.rms << " px\n"
+              << "  camera matrix " << intr.camera_matrix << "\n"
+              << "  distortion " << intr.dist_coeffs << "\n";
+
+    calib_camera& cam = calib[i];
+    cam.width = sizes[i].width;
+    cam.height = sizes[i].height;
+    cam.flags = CALIB_INTRINSICS; // extrinsics solved against the old intrinsics no longer hold
+    cam.views = intr.views;
+    cam.intrinsics_rms = intr.rms;
+    cam.extrinsics_rms = 0.0f;
+    memcpy(cam.camera_matrix, intr.camera_matrix.ptr<double>(), sizeof(cam.camera_matrix));
+    memcpy(cam.dist_coeffs, intr.dist_coeffs.ptr<double>(), sizeof(cam.dist_coeffs));
+    updated = true;
+  }
+
+  if (updated)
+    CalibrationFile::save(CALIB_PATH, calib);
+}
+
+int main(int argc, char* argv[]) {
   int ret = 0;
-  char logstr[128];
 
   ret = setup_logging(LOG_PATH);
   if (ret) {
@@ -17,26 +101,75 @@ int main() {
     return -errno;
   }
 
-  StreamController stream_ctlr = StreamController(
-    1280,
-    720,
-    3
-  );
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = stop_handler;
+  sigaction(SIGINT, &sa, nullptr);
+  sigaction(SIGTERM, &sa, nullptr);
 
-  cv::Mat frames[3];
+  // lens_calibration <recording_dir> reads a recording instead of the live cameras
+  bool recorded = argc > 1;
+
+  // recordings hold the main stream, the live framesets the stream
+  // the server decodes, which is the preview on cameras that have one
+  RigConfig rig;
+  size_t num_cameras = rig.num_cameras();
+  std::vector<cv::Size> sizes;
+  for (size_t i = 0; i < num_cameras; i++) {
+    const cam_conf& conf = rig.camera(i);
+    sizes.emplace_back(
+      recorded ? conf.width : conf.live_width,
+      recorded ? conf.height : conf.live_height
+    );
+  }
+
+  std::vector<cv::Mat> frames(num_cameras);
   uint64_t timestamp;
-  uint32_t counter = 0;
-  while(counter++ < 10) {
-    stream_ctlr.recv_frameset(frames, &timestamp);
-    snprintf(
-      logstr,
-      sizeof(logstr),
-      "Received frameset with timestamp %lu",
-      timestamp
+  uint64_t last_progress = monotonic_ns();
+
+  CalibrationEngine engine(num_cameras);
+
+  // 0 accepts each camera's own resolution, they needn't share one
+  if (recorded) {
+    SessionReader reader = SessionReader(
+      argv[1],
+      0,
+      0,
+      num_cameras
+    );
+
+    while (running && !enough_views(engine, num_cameras) && reader.recv_frameset(frames.data(), &timestamp)) {
+      engine.submit(frames.data(), timestamp, true);
+
+      uint64_t now = monotonic_ns();
+      if (now - last_progress >= PROGRESS_INTERVAL_NS) {
+        engine.log_progress();
+        last_progress = now;
+      }
+    }
+  } else {
+    StreamController stream_ctlr = StreamController(
+      0,
+      0,
+      num_cameras
     );
-    LOG(DEBUG, logstr);
+
+    while (running && !enough_views(engine, num_cameras)) {
+      stream_ctlr.recv_frameset(frames.data(), &timestamp);
+      engine.submit(frames.data(), timestamp);
+
+      uint64_t now = monotonic_ns();
+      if (now - last_progress >= PROGRESS_INTERVAL_NS) {
+        engine.log_progress();
+        last_progress = now;
+      }
+    }
   }
 
+  engine.log_progress();
+  engine.solve_now();
+  save(engine, sizes);
+
   cleanup_logging();
   return 0;
 }
@@ -0,0 +1,396 @@
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#include "metrics.h"
+
+/**
+ * Scrapes the server's metrics page, see metrics.h, into the
+ * Prometheus text format.
+ *
+ * Usage: metrics_exporter [-i seconds] [-o path]
+ *
+ * Every interval the page is read and written to path, by default
+ * into node_exporter's textfile collector directory, through a
+ * temporary file renamed into place so node_exporter never reads half
+ * a scrape. With -o - a single scrape is printed to stdout instead.
+ *
+ * The page is opened again whenever the server restarts, and while no
+ * server is running only mocap_server_up 0 is written.
+ */
+
+#define DEFAULT_OUT_PATH "/var/lib/node_exporter/textfile_collector/mocap.prom"
+#define DEFAULT_INTERVAL 5 // seconds
+
+static volatile sig_atomic_t running = 1;
+
+static void stop_handler(int signum) {
+  (void)signum;
+  running = 0;
+}
+
+static uint64_t realtime_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+class MetricsPage {
+public:
+  ~MetricsPage() {
+    close_page();
+  }
+
+  bool open_page() {
+    /**
+     * Maps the server's page, if there's a live one.
+     *
+     * Returns:
+     *   False if no server has published a page, or the server that
+     *   did has since exited
+     */
+    if (page && valid())
+      return true;
+    close_page();
+
+    int fd = shm_open(METRICS_SHM_NAME, O_RDONLY, 0);
+    if (fd == -1)
+      return false;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(metrics_header)) {
+      close(fd);
+      return false;
+    }
+
+    void* mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED)
+      return false;
+
+    page = mapped;
+    size = st.st_size;
+    if (!valid()) {
+      close_page();
+      return false;
+    }
+    return true;
+  }
+
+  const metrics_header* header() const {
+    return static_cast<const metrics_header*>(page);
+  }
+
+  const metrics_cam* cam(uint32_t i) const {
+    return metrics_get_cam(page, i);
+  }
+
+private:
+  void* page = nullptr;
+  size_t size = 0;
+
+  bool valid() const {
+    // the page is rebuilt from scratch by each server, so an old mapping goes stale
+    const metrics_header* hdr = header();
+    return __atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) == METRICS_MAGIC &&
+      hdr->version == METRICS_VERSION &&
+      metrics_shm_size(hdr->cam_count) <= size &&
+      kill((pid_t)hdr->server_pid, 0) == 0;
+  }
+
+  void close_page() {
+    if (page)
+      munmap(page, size);
+    page = nullptr;
+    size = 0;
+  }
+};
+
+class Writer {
+public:
+  std::ostringstream out;
+
+  Writer() {
+    out.precision(15); // counters stay exact well past what a session reaches
+  }
+
+  void family(const char* name, const char* type, const char* help) {
+    out << "# HELP " << name << " " << help << "\n"
+        << "# TYPE " << name << " " << type << "\n";
+  }
+
+  void value(const char* name, const std::string& labels, double v) {
+    out << name << labels << " " << v << "\n";
+  }
+
+  void hist(const char* name, const std::string& cam, const metrics_hist& hist) {
+    // buckets are cumulative in the text format, the last one is +Inf
+    uint64_t cumulative = 0;
+    for (int i = 0; i < METRICS_HIST_BUCKETS - 1; i++) {
+      cumulative += hist.buckets[i];
+      out << name << "_bucket{cam=\"" << cam << "\",le=\"" << (double)(1ull << i) * 1e-6 << "\"} "
+          << cumulative << "\n";
+    }
+    out << name << "_bucket{cam=\"" << cam << "\",le=\"+Inf\"} " << hist.count << "\n"
+        << name << "_sum{cam=\"" << cam << "\"} " << hist.sum_ns * 1e-9 << "\n"
+        << name << "_count{cam=\"" << cam << "\"} " << hist.count << "\n";
+  }
+};
+
+struct CamSnapshot {
+  std::string name;
+  metrics_cam server; // the report is copied separately, under its seqlock
+  bool reported;
+  cam_stats_msg report;
+  uint64_t report_recv_ts;
+};
+
+static void snapshot_cam(const metrics_cam* src, CamSnapshot& snap) {
+  char name[METRICS_NAME_LEN + 1] = { 0 };
+  memcpy(name, src->name, METRICS_NAME_LEN);
+  snap.name = name;
+
+  metrics_cam& dst = snap.server;
+  dst.pkts_received = metrics_load(&src->pkts_received);
+  dst.bytes_received = metrics_load(&src->bytes_received);
+  dst.ingest_stalls = metrics_load(&src->ingest_stalls);
+  dst.stream_resyncs = metrics_load(&src->stream_resyncs);
+  dst.pkts_skipped = metrics_load(&src->pkts_skipped);
+  dst.stream_faults = metrics_load(&src->stream_faults);
+  dst.stream_recoveries = metrics_load(&src->stream_recoveries);
+  dst.degraded = metrics_load(&src->degraded);
+  dst.frames_decoded = metrics_load(&src->frames_decoded);
+  dst.decoder_drops = metrics_load(&src->decoder_drops);
+  dst.decode_errors = metrics_load(&src->decode_errors);
+  metrics_hist_copy(&dst.decode_time, &src->decode_time);
+  dst.frames_late = metrics_load(&src->frames_late);
+  dst.framesets_missed = metrics_load(&src->framesets_missed);
+  metrics_hist_copy(&dst.arrival_skew, &src->arrival_skew);
+  metrics_hist_copy(&dst.exposure_offset, &src->exposure_offset);
+  dst.exposures_late = metrics_load(&src->exposures_late);
+  dst.pkt_queue_depth = metrics_load(&src->pkt_queue_depth);
+  dst.decode_lag_ns = metrics_load(&src->decode_lag_ns);
+  dst.quality_level = metrics_load(&src->quality_level);
+  metrics_hist_copy(&dst.ctl_rtt, &src->ctl_rtt);
+  dst.clock_offset_ns = metrics_load(&src->clock_offset_ns);
+
+  snap.reported = metrics_read_report(src, &snap.report, &snap.report_recv_ts);
+}
+
+static std::string scrape(MetricsPage& page) {
+  /**
+   * Reads the page into the text format.
+   *
+   * Every field is loaded once up front, so a family's samples across
+   * cameras all come from the same pass.
+   */
+  Writer w;
+
+  w.family("mocap_server_up", "gauge", "Whether a server is publishing metrics");
+  if (!page.open_page()) {
+    w.value("mocap_server_up", "", 0);
+    return w.out.str();
+  }
+  w.value("mocap_server_up", "", 1);
+
+  const metrics_header* hdr = page.header();
+  std::vector<CamSnapshot> cams(hdr->cam_count);
+  for (uint32_t i = 0; i < hdr->cam_count; i++)
+    snapshot_cam(page.cam(i), cams[i]);
+
+  struct Global {
+    const char* name;
+    const char* type;
+    const char* help;
+    const uint64_t* field;
+  };
+  const Global globals[] = {
+    { "mocap_sessions_total", "counter", "Sessions started", &hdr->sessions },
+    { "mocap_framesets_published_total", "counter", "Framesets published to consumers", &hdr->framesets_published },
+    { "mocap_framesets_partial_total", "counter", "Framesets published with cameras missing", &hdr->framesets_partial },
+    { "mocap_framesets_dropped_total", "counter", "Framesets that were never completed", &hdr->framesets_dropped },
+    { "mocap_lease_drops_total", "counter", "Framesets dropped because a consumer still leased their slot", &hdr->lease_drops },
+    { "mocap_decimation", "gauge", "The rig's capture decimation", &hdr->decimation },
+    { "mocap_camera_reports_rejected_total", "counter", "Camera stats reports that were malformed or from an unknown camera", &hdr->stats_rejected },
+    { "mocap_control_repeats_total", "counter", "Control commands sent again for cameras yet to acknowledge them", &hdr->ctl_repeats },
+  };
+
+  w.family("mocap_server_start_time_seconds", "gauge", "When the server created the metrics page");
+  w.value("mocap_server_start_time_seconds", "", hdr->start_ts * 1e-9);
+  for (const Global& g : globals) {
+    w.family(g.name, g.type, g.help);
+    w.value(g.name, "", metrics_load(g.field));
+  }
+
+  auto per_cam = [&](const char* name, const char* type, const char* help, std::function<double(const CamSnapshot&)> get) {
+    w.family(name, type, help);
+    for (const CamSnapshot& cam : cams)
+      w.value(name, "{cam=\"" + cam.name + "\"}", get(cam));
+  };
+  auto per_cam_hist = [&](const char* name, const char* help, std::function<const metrics_hist&(const CamSnapshot&)> get) {
+    w.family(name, "histogram", help);
+    for (const CamSnapshot& cam : cams)
+      w.hist(name, cam.name, get(cam));
+  };
+
+  per_cam("mocap_packets_received_total", "counter", "Encoded packets received from the camera",
+    [](const CamSnapshot& c) { return (double)c.server.pkts_received; });
+  per_cam("mocap_received_bytes_total", "counter", "Encoded bytes received from the camera",
+    [](const CamSnapshot& c) { return (double)c.server.bytes_received; });
+  per_cam("mocap_ingest_stalls_total", "counter", "Times the camera's socket stopped being read for lack of packet buffers",
+    [](const CamSnapshot& c) { return (double)c.server.ingest_stalls; });
+  per_cam("mocap_stream_resyncs_total", "counter", "Times the camera's stream lost sync or missed packets",
+    [](const CamSnapshot& c) { return (double)c.server.stream_resyncs; });
+  per_cam("mocap_packets_skipped_total", "counter", "Packets dropped while waiting for a keyframe to resync on",
+    [](const CamSnapshot& c) { return (double)c.server.pkts_skipped; });
+  per_cam("mocap_stream_faults_total", "counter", "Times the camera's connection was lost or timed out mid session",
+    [](const CamSnapshot& c) { return (double)c.server.stream_faults; });
+  per_cam("mocap_stream_recoveries_total", "counter", "Times the camera reconnected after a fault and streamed again",
+    [](const CamSnapshot& c) { return (double)c.server.stream_recoveries; });
+  per_cam("mocap_camera_degraded", "gauge", "1 while the camera is masked out of framesets after a fault",
+    [](const CamSnapshot& c) { return (double)c.server.degraded; });
+  per_cam("mocap_frames_decoded_total", "counter", "Frames decoded",
+    [](const CamSnapshot& c) { return (double)c.server.frames_decoded; });
+  per_cam("mocap_decoder_drops_total", "counter", "Packets the decoder never returned a frame for",
+    [](const CamSnapshot& c) { return (double)c.server.decoder_drops; });
+  per_cam("mocap_decode_errors_total", "counter", "Times the camera's decoder failed and was reset in place",
+    [](const CamSnapshot& c) { return (double)c.server.decode_errors; });
+  per_cam("mocap_frames_late_total", "counter", "Frames that arrived after their frameset was emitted",
+    [](const CamSnapshot& c) { return (double)c.server.frames_late; });
+  per_cam("mocap_exposures_late_total", "counter", "Exposures that started a frame interval or more after their scheduled capture",
+    [](const CamSnapshot& c) { return (double)c.server.exposures_late; });
+  per_cam("mocap_framesets_missed_total", "counter", "Incomplete framesets the camera was expected in",
+    [](const CamSnapshot& c) { return (double)c.server.framesets_missed; });
+  per_cam("mocap_packet_queue_depth", "gauge", "Packets waiting on the camera's decoder",
+    [](const CamSnapshot& c) { return (double)c.server.pkt_queue_depth; });
+  per_cam("mocap_decode_lag_seconds", "gauge", "How far the camera's decoder is behind its captures",
+    [](const CamSnapshot& c) { return c.server.decode_lag_ns * 1e-9; });
+  per_cam("mocap_quality_level", "gauge", "Steps the camera is eased off its configured quality",
+    [](const CamSnapshot& c) { return (double)c.server.quality_level; });
+  per_cam("mocap_camera_clock_offset_seconds", "gauge", "How far the camera's clock is ahead of the server's, from control pings",
+    [](const CamSnapshot& c) { return (int64_t)c.server.clock_offset_ns * 1e-9; });
+  per_cam_hist("mocap_control_rtt_seconds", "Round trip of a control ping to the camera",
+    [](const CamSnapshot& c) -> const metrics_hist& { return c.server.ctl_rtt; });
+  per_cam_hist("mocap_decode_seconds", "Time to decode a packet and receive its frames",
+    [](const CamSnapshot& c) -> const metrics_hist& { return c.server.decode_time; });
+  per_cam_hist("mocap_arrival_skew_seconds", "Frame arrival after the first frame of the same frameset",
+    [](const CamSnapshot& c) -> const metrics_hist& { return c.server.arrival_skew; });
+  per_cam_hist("mocap_exposure_offset_seconds", "Measured start of exposure after the scheduled capture",
+    [](const CamSnapshot& c) -> const metrics_hist& { return c.server.exposure_offset; });
+
+  // the rest come from the cameras' own reports
+  std::vector<CamSnapshot> reported_cams;
+  for (const CamSnapshot& cam : cams) {
+    if (cam.reported)
+      reported_cams.push_back(cam);
+  }
+  cams.swap(reported_cams);
+
+  uint64_t now = realtime_ns();
+  per_cam("mocap_camera_report_age_seconds", "gauge", "Time since the camera's last stats report",
+    [now](const CamSnapshot& c) { return (int64_t)(now - c.report_recv_ts) * 1e-9; });
+  per_cam("mocap_camera_report_delay_seconds", "gauge",
+    "Server receive time minus camera send time of the last report, network delay plus clock offset between the two",
+    [](const CamSnapshot& c) { return (int64_t)(c.report_recv_ts - c.report.sent_ts) * 1e-9; });
+  per_cam("mocap_camera_frames_captured_total", "counter", "Capture requests the camera completed",
+    [](const CamSnapshot& c) { return (double)c.report.frames_captured; });
+  per_cam("mocap_camera_schedule_skips_total", "counter", "Scheduled frames skipped because their capture time had passed",
+    [](const CamSnapshot& c) { return (double)c.report.schedule_skips; });
+  per_cam("mocap_camera_captures_skipped_total", "counter", "Captures skipped with every capture buffer in use",
+    [](const CamSnapshot& c) { return (double)c.report.captures_skipped; });
+  per_cam("mocap_camera_frames_dropped_total", "counter", "Frames dropped before encoding, the frame ring was full",
+    [](const CamSnapshot& c) { return (double)c.report.frames_dropped; });
+  per_cam("mocap_camera_frames_encoded_total", "counter", "Frames encoded",
+    [](const CamSnapshot& c) { return (double)c.report.frames_encoded; });
+  per_cam("mocap_camera_encoder_stalls_total", "counter", "Times the encoder waited on a full packet ring",
+    [](const CamSnapshot& c) { return (double)c.report.encoder_stalls; });
+  per_cam("mocap_camera_packets_sent_total", "counter", "Packets sent to the server",
+    [](const CamSnapshot& c) { return (double)c.report.pkts_sent; });
+  per_cam("mocap_camera_packets_discarded_total", "counter", "Packets discarded after the connection was lost",
+    [](const CamSnapshot& c) { return (double)c.report.pkts_discarded; });
+  per_cam_hist("mocap_camera_timer_latency_seconds", "Capture timer signal after the scheduled capture time",
+    [](const CamSnapshot& c) -> const metrics_hist& { return c.report.timer_latency; });
+  per_cam_hist("mocap_camera_capture_latency_seconds", "Capture request completion after the scheduled capture time",
+    [](const CamSnapshot& c) -> const metrics_hist& { return c.report.capture_latency; });
+  per_cam_hist("mocap_camera_encode_seconds", "Frame submitted to the encoder to its packet",
+    [](const CamSnapshot& c) -> const metrics_hist& { return c.report.encode_latency; });
+
+  return w.out.str();
+}
+
+static bool write_file(const std::string& path, const std::string& text) {
+  // renamed into place, so the collector never reads a partial file
+  std::string tmp = path + ".tmp";
+  {
+    std::ofstream file(tmp, std::ios::trunc);
+    file << text;
+    if (!file) {
+      std::cerr << "Could not write " << tmp << ": " << strerror(errno) << "\n";
+      return false;
+    }
+  }
+
+  if (rename(tmp.c_str(), path.c_str()) == -1) {
+    std::cerr << "Could not replace " << path << ": " << strerror(errno) << "\n";
+    return false;
+  }
+  return true;
+}
+
+int main(int argc, char* argv[]) {
+  std::string out_path = DEFAULT_OUT_PATH;
+  int interval = DEFAULT_INTERVAL;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "i:o:")) != -1) {
+    switch (opt) {
+      case 'i':
+        interval = atoi(optarg);
+        break;
+      case 'o':
+        out_path = optarg;
+        break;
+      default:
+        std::cerr << "Usage: " << argv[0] << " [-i seconds] [-o path | -o -]\n";
+        return EXIT_FAILURE;
+    }
+  }
+  if (interval <= 0) {
+    std::cerr << "-i needs a positive number of seconds\n";
+    return EXIT_FAILURE;
+  }
+
+  MetricsPage page;
+  if (out_path == "-") {
+    std::cout << scrape(page);
+    return 0;
+  }
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = stop_handler;
+  sigaction(SIGINT, &sa, nullptr);
+  sigaction(SIGTERM, &sa, nullptr);
+
+  while (running) {
+    if (!write_file(out_path, scrape(page)))
+      return EXIT_FAILURE;
+    sleep(interval);
+  }
+
+  return 0;
+}
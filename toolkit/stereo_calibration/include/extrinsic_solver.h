@@ -0,0 +1,138 @@
+#ifndef EXTRINSIC_SOLVER_H
+#define EXTRINSIC_SOLVER_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <opencv2/core.hpp>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "calib_file.h"
+
+#define MIN_FRAMESET_GAP_NS 100000000ULL // between accepted framesets, near duplicates add nothing
+#define ITERATIONS_PER_BATCH 2 // while capturing, after each batch of new framesets
+#define MAX_FINAL_ITERATIONS 100
+#define CONVERGED_CHANGE 1e-6 // relative cost change the final solve stops at
+#define HUBER_PX 2.0 // residuals beyond this are downweighted
+
+struct CameraPose {
+  double rotation[9]; // row major, rig frame to camera frame
+  double translation[3]; // meters
+};
+
+/**
+ * Solves a rig's extrinsics, every camera's pose relative to camera 0,
+ * from chessboard corners seen by several cameras at once, while
+ * framesets are still coming in.
+ *
+ * This is a bundle adjustment over two kinds of poses, one per camera
+ * and one per accepted frameset for where the board was at that
+ * timestamp, minimizing reprojection error with Levenberg-Marquardt.
+ * Intrinsics are held fixed, as solved by lens_calibration, so
+ * corners are undistorted once on the way in and the residuals are
+ * taken on the normalized image plane, scaled by the focal length to
+ * stay in pixels.
+ *
+ * Board poses outnumber cameras by orders of magnitude, but each only
+ * touches the cameras that saw it, so every iteration eliminates them
+ * with the Schur complement: a board's 6 x 6 block is inverted on its
+ * own and folded into the cameras that saw it, which leaves a reduced
+ * system over the camera poses only, 6 (N - 1) wide. That system only
+ * couples cameras that saw the board together, its blocks are kept
+ * per edge of that camera pair graph, and once it's solved the board
+ * updates follow from back substitution, frameset by frameset. An
+ * iteration costs one pass over the observations plus a solve on the
+ * order of the camera count cubed, however long the session.
+ *
+ * The solution is incremental. A new frameset's board pose starts from
+ * a PnP solve in a camera that's already placed, and a camera starts
+ * from the first frameset it shares with a placed one, so cameras join
+ * the solve as the board works its way around the rig, and a few
+ * iterations after each batch, warm started from the last solution,
+ * keep it converged as framesets arrive.
+ *
+ * Framesets are handed over with add_frameset from the capture loop
+ * and solved on a thread of the solver's own.
+ */
+
+class ExtrinsicSolver {
+private:
+  struct Pose {
+    double r[9];
+    double t[3];
+  };
+
+  struct Observation {
+    uint32_t cam;
+    std::vector<cv::Point2d> points; // undistorted, normalized image plane
+  };
+
+  struct Frameset {
+    uint64_t timestamp;
+    std::vector<Observation> obs;
+    bool posed = false;
+    Pose board; // board frame to rig frame
+  };
+
+  struct Camera {
+    cv::Mat camera_matrix;
+    cv::Mat dist_coeffs;
+    double focal; // residuals are scaled by it, to be in pixels
+    bool posed = false;
+    Pose pose; // rig frame to camera frame
+  };
+
+  size_t num_cameras;
+  std::vector<cv::Point3f> board_points;
+  uint64_t last_timestamp;
+
+  // owned by the solver thread, or by finish() once it's joined
+  std::vector<Camera> cams;
+  std::vector<Frameset> framesets;
+  std::vector<int32_t> free_idx; // camera to its block in the reduced system, -1 if held fixed
+  std::vector<int32_t> pair_idx; // camera pair to its block, -1 if they never saw the board together
+  std::vector<std::pair<uint32_t, uint32_t>> pairs;
+  double lambda;
+
+  std::thread solver;
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::deque<Frameset> incoming; // under mutex
+  bool stop; // under mutex
+  std::vector<CameraPose> poses; // under mutex, published after each batch
+  std::vector<bool> placed; // under mutex
+  double rms; // under mutex
+  size_t accepted; // under mutex
+
+  void solver_fn();
+  void integrate(std::deque<Frameset>& batch);
+  bool place_board(Frameset& fs);
+  void place_cameras(const Frameset& fs);
+  bool pnp(const Observation& obs, Pose* board_in_cam) const;
+  void index_cameras();
+  double cost(const std::vector<Pose>& cam_poses, const std::vector<Pose>& board_poses, double* sq_sum, size_t* points) const;
+  double iterate();
+  void publish();
+
+public:
+  ExtrinsicSolver(const std::vector<calib_camera>& intrinsics, double square_size);
+  ~ExtrinsicSolver();
+
+  bool wants_frameset(uint64_t timestamp) const;
+  bool add_frameset(uint64_t timestamp, const std::vector<std::vector<cv::Point2f>>& corners);
+  void finish();
+  bool pose(size_t cam, CameraPose* out);
+  double reprojection_rms();
+  void log_progress();
+
+  ExtrinsicSolver(const ExtrinsicSolver&) = delete;
+  ExtrinsicSolver& operator=(const ExtrinsicSolver&) = delete;
+  ExtrinsicSolver(ExtrinsicSolver&&) = delete;
+  ExtrinsicSolver& operator=(ExtrinsicSolver&&) = delete;
+};
+
+#endif // EXTRINSIC_SOLVER_H
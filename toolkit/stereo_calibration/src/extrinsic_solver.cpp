@@ -0,0 +1,809 @@
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstring>
+#include <opencv2/calib3d.hpp>
+#include <stdexcept>
+
+#include "chessboard.h"
+#include "extrinsic_solver.h"
+#include "logging.h"
+
+#define LAMBDA_INIT 1e-3
+#define LAMBDA_MIN 1e-9
+#define LAMBDA_MAX 1e9
+#define BEHIND_CAMERA_PX 1000.0 // residual charged for a point that lands behind a camera
+
+typedef std::array<double, 36> Block; // 6 x 6, row major, rotation then translation
+
+static void mat3_mul(const double* a, const double* b, double* out) {
+  for (int i = 0; i < 3; i++)
+    for (int j = 0; j < 3; j++)
+      out[i * 3 + j] = a[i * 3] * b[j] + a[i * 3 + 1] * b[3 + j] + a[i * 3 + 2] * b[6 + j];
+}
+
+static void mat3_vec(const double* a, const double* v, double* out) {
+  for (int i = 0; i < 3; i++)
+    out[i] = a[i * 3] * v[0] + a[i * 3 + 1] * v[1] + a[i * 3 + 2] * v[2];
+}
+
+static void so3_exp(const double* w, double* r) {
+  // Rodrigues' formula, with its series near zero
+  double theta2 = w[0] * w[0] + w[1] * w[1] + w[2] * w[2];
+  double theta = std::sqrt(theta2);
+  double a = theta < 1e-8 ? 1.0 - theta2 / 6.0 : std::sin(theta) / theta;
+  double b = theta < 1e-8 ? 0.5 - theta2 / 24.0 : (1.0 - std::cos(theta)) / theta2;
+
+  r[0] = 1.0 - b * (w[1] * w[1] + w[2] * w[2]);
+  r[1] = -a * w[2] + b * w[0] * w[1];
+  r[2] = a * w[1] + b * w[0] * w[2];
+  r[3] = a * w[2] + b * w[0] * w[1];
+  r[4] = 1.0 - b * (w[0] * w[0] + w[2] * w[2]);
+  r[5] = -a * w[0] + b * w[1] * w[2];
+  r[6] = -a * w[1] + b * w[0] * w[2];
+  r[7] = a * w[0] + b * w[1] * w[2];
+  r[8] = 1.0 - b * (w[0] * w[0] + w[1] * w[1]);
+}
+
+template <typename P>
+static void transform(const P& pose, const double* x, double* out) {
+  mat3_vec(pose.r, x, out);
+  out[0] += pose.t[0];
+  out[1] += pose.t[1];
+  out[2] += pose.t[2];
+}
+
+template <typename P>
+static void compose(const P& a, const P& b, P* out) {
+  // a after b
+  mat3_mul(a.r, b.r, out->r);
+  transform(a, b.t, out->t);
+}
+
+template <typename P>
+static void invert(const P& a, P* out) {
+  for (int i = 0; i < 3; i++)
+    for (int j = 0; j < 3; j++)
+      out->r[i * 3 + j] = a.r[j * 3 + i];
+  mat3_vec(out->r, a.t, out->t);
+  out->t[0] = -out->t[0];
+  out->t[1] = -out->t[1];
+  out->t[2] = -out->t[2];
+}
+
+template <typename P>
+static void apply_update(const P& pose, const double* delta, P* out) {
+  // left multiplied, so the jacobians are taken at the identity
+  double dr[9];
+  so3_exp(delta, dr);
+  mat3_mul(dr, pose.r, out->r);
+  mat3_vec(dr, pose.t, out->t);
+  out->t[0] += delta[3];
+  out->t[1] += delta[4];
+  out->t[2] += delta[5];
+}
+
+static double huber(double n) {
+  return n <= HUBER_PX ? 0.5 * n * n : HUBER_PX * (n - 0.5 * HUBER_PX);
+}
+
+static bool cholesky(double* a, size_t n) {
+  /**
+   * Factors a symmetric positive definite row major matrix in place
+   * into its lower triangle
+   *
+   * Returns:
+   *   False if the matrix isn't positive definite
+   */
+  for (size_t j = 0; j < n; j++) {
+    double d = a[j * n + j];
+    for (size_t k = 0; k < j; k++)
+      d -= a[j * n + k] * a[j * n + k];
+    if (d <= 0.0)
+      return false;
+    d = std::sqrt(d);
+    a[j * n + j] = d;
+
+    for (size_t i = j + 1; i < n; i++) {
+      double s = a[i * n + j];
+      for (size_t k = 0; k < j; k++)
+        s -= a[i * n + k] * a[j * n + k];
+      a[i * n + j] = s / d;
+    }
+  }
+  return true;
+}
+
+static void cholesky_solve(const double* l, size_t n, double* b) {
+  for (size_t i = 0; i < n; i++) {
+    for (size_t k = 0; k < i; k++)
+      b[i] -= l[i * n + k] * b[k];
+    b[i] /= l[i * n + i];
+  }
+  for (size_t i = n; i-- > 0;) {
+    for (size_t k = i + 1; k < n; k++)
+      b[i] -= l[k * n + i] * b[k];
+    b[i] /= l[i * n + i];
+  }
+}
+
+static bool invert6(const Block& a, Block* out) {
+  Block l = a;
+  if (!cholesky(l.data(), 6))
+    return false;
+  for (int j = 0; j < 6; j++) {
+    double col[6] = {0.0, 0.0, 0.0, 0.0, 0.0, 0.0};
+    col[j] = 1.0;
+    cholesky_solve(l.data(), 6, col);
+    for (int i = 0; i < 6; i++)
+      (*out)[i * 6 + j] = col[i];
+  }
+  return true;
+}
+
+static void point_jacobian(const double* p, const double* proj, double* j) {
+  /**
+   * Jacobian of a projected point, 2 x 3 proj, against a left
+   * perturbation of the pose that produced point p, 2 x 6
+   *
+   * Rotating p by a small w moves it by w x p = -[p]x w, and the
+   * translation moves it one to one.
+   */
+  for (int row = 0; row < 2; row++) {
+    const double* pr = proj + row * 3;
+    double* jr = j + row * 6;
+    jr[0] = pr[1] * -p[2] + pr[2] * p[1];
+    jr[1] = pr[0] * p[2] + pr[2] * -p[0];
+    jr[2] = pr[0] * -p[1] + pr[1] * p[0];
+    jr[3] = pr[0];
+    jr[4] = pr[1];
+    jr[5] = pr[2];
+  }
+}
+
+static void add_jtj(const double* a, const double* b, double w, double* out) {
+  // out += w * a^T b, a and b 2 x 6
+  for (int i = 0; i < 6; i++)
+    for (int j = 0; j < 6; j++)
+      out[i * 6 + j] += w * (a[i] * b[j] + a[6 + i] * b[6 + j]);
+}
+
+static void add_jtr(const double* a, const double* r, double w, double* out) {
+  for (int i = 0; i < 6; i++)
+    out[i] += w * (a[i] * r[0] + a[6 + i] * r[1]);
+}
+
+ExtrinsicSolver::ExtrinsicSolver(const std::vector<calib_camera>& intrinsics, double square_size) :
+  num_cameras(intrinsics.size()),
+  board_points(chessboard_points(square_size)),
+  last_timestamp(0),
+  lambda(LAMBDA_INIT),
+  stop(false),
+  rms(0.0),
+  accepted(0)
+{
+  /**
+   * Starts a solve for a rig
+   *
+   * Parameters:
+   *   intrinsics: Every camera's entry from the calibration file
+   *   square_size: The side of a board square, in meters
+   *
+   * Throws:
+   *   std::runtime_error: If a camera has no intrinsics yet
+   */
+  char logstr[128];
+
+  cams.resize(num_cameras);
+  for (size_t i = 0; i < num_cameras; i++) {
+    const calib_camera& entry = intrinsics[i];
+    if (!(entry.flags & CALIB_INTRINSICS)) {
+      snprintf(
+        logstr,
+        sizeof(logstr),
+        "Camera %zu has no intrinsics, run lens_calibration first",
+        i
+      );
+      LOG(ERROR, logstr);
+      throw std::runtime_error(logstr);
+    }
+
+    Camera& cam = cams[i];
+    cam.camera_matrix = cv::Mat(3, 3, CV_64F, const_cast<double*>(entry.camera_matrix)).clone();
+    cam.dist_coeffs = cv::Mat(1, 5, CV_64F, const_cast<double*>(entry.dist_coeffs)).clone();
+    cam.focal = 0.5 * (entry.camera_matrix[0] + entry.camera_matrix[4]);
+  }
+
+  // camera 0 is the rig frame
+  Camera& ref = cams[0];
+  ref.posed = true;
+  memset(&ref.pose, 0, sizeof(ref.pose));
+  ref.pose.r[0] = ref.pose.r[4] = ref.pose.r[8] = 1.0;
+
+  poses.resize(num_cameras);
+  placed.assign(num_cameras, false);
+  publish();
+
+  solver = std::thread(&ExtrinsicSolver::solver_fn, this);
+}
+
+ExtrinsicSolver::~ExtrinsicSolver() {
+  if (!solver.joinable())
+    return;
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stop = true;
+  }
+  cv.notify_all();
+  solver.join();
+}
+
+bool ExtrinsicSolver::wants_frameset(uint64_t timestamp) const {
+  /**
+   * Whether a frameset is far enough from the last accepted one to be
+   * worth detecting the board in
+   */
+  // unsigned, a seek backwards wraps around and is wanted
+  return !last_timestamp || timestamp - last_timestamp >= MIN_FRAMESET_GAP_NS;
+}
+
+bool ExtrinsicSolver::add_frameset(uint64_t timestamp, const std::vector<std::vector<cv::Point2f>>& corners) {
+  /**
+   * Hands over the board corners found in a frameset, from one thread
+   *
+   * Parameters:
+   *   timestamp: The frameset's timestamp
+   *   corners: Per camera, the corners detect_chessboard found, empty
+   *            for cameras that didn't see the board
+   *
+   * Returns:
+   *   Whether the frameset was accepted, it needs at least two cameras
+   *   that saw the board, and to be far enough from the last one
+   */
+  size_t seen = 0;
+  for (size_t i = 0; i < num_cameras; i++)
+    seen += corners[i].size() == board_points.size();
+  if (seen < 2)
+    return false;
+
+  if (!wants_frameset(timestamp))
+    return false;
+  last_timestamp = timestamp;
+
+  Frameset fs;
+  fs.timestamp = timestamp;
+
+  // intrinsics never change once constructed, reading them here is safe
+  for (size_t i = 0; i < num_cameras; i++) {
+    if (corners[i].size() != board_points.size())
+      continue;
+
+    Observation obs;
+    obs.cam = i;
+    std::vector<cv::Point2f> normalized;
+    cv::undistortPoints(corners[i], normalized, cams[i].camera_matrix, cams[i].dist_coeffs);
+    obs.points.assign(normalized.begin(), normalized.end());
+    fs.obs.push_back(std::move(obs));
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    incoming.push_back(std::move(fs));
+    accepted++;
+  }
+  cv.notify_one();
+  return true;
+}
+
+void ExtrinsicSolver::solver_fn() {
+  while (true) {
+    std::deque<Frameset> batch;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      cv.wait(lock, [&] { return stop || !incoming.empty(); });
+      if (stop)
+        return;
+      batch.swap(incoming);
+    }
+
+    integrate(batch);
+
+    for (int i = 0; i < ITERATIONS_PER_BATCH; i++) {
+      if (iterate() < 0.0)
+        break;
+    }
+
+    publish();
+  }
+}
+
+void ExtrinsicSolver::finish() {
+  /**
+   * Stops the solver thread, folds in whatever it hadn't got to, and
+   * iterates until the solution stops improving
+   */
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stop = true;
+  }
+  cv.notify_all();
+  solver.join();
+
+  integrate(incoming);
+
+  for (int i = 0; i < MAX_FINAL_ITERATIONS; i++) {
+    double change = iterate();
+    if (change < 0.0)
+      break;
+    // a rejected step only raises lambda, keep going until one lands
+    if (change > 0.0 && change < CONVERGED_CHANGE)
+      break;
+  }
+
+  publish();
+}
+
+void ExtrinsicSolver::integrate(std::deque<Frameset>& batch) {
+  /**
+   * Adds new framesets to the solve, placing their boards, and any
+   * cameras they connect to the placed ones
+   *
+   * A frameset whose cameras aren't placed yet waits until a later
+   * frameset places one of them, so each pass over the unplaced ones
+   * repeats until it places nothing new.
+   */
+  for (Frameset& fs : batch)
+    framesets.push_back(std::move(fs));
+  batch.clear();
+
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (Frameset& fs : framesets) {
+      if (fs.posed || !place_board(fs))
+        continue;
+      place_cameras(fs);
+      changed = true;
+    }
+  }
+}
+
+bool ExtrinsicSolver::pnp(const Observation& obs, Pose* board_in_cam) const {
+  std::vector<cv::Point2f> points(obs.points.begin(), obs.points.end());
+  cv::Mat rvec;
+  cv::Mat tvec;
+  if (!cv::solvePnP(board_points, points, cv::Mat::eye(3, 3, CV_64F), cv::Mat(), rvec, tvec))
+    return false;
+
+  cv::Mat r;
+  cv::Rodrigues(rvec, r);
+  memcpy(board_in_cam->r, r.ptr<double>(), sizeof(board_in_cam->r));
+  memcpy(board_in_cam->t, tvec.ptr<double>(), sizeof(board_in_cam->t));
+  return board_in_cam->t[2] > 0.0;
+}
+
+bool ExtrinsicSolver::place_board(Frameset& fs) {
+  for (const Observation& obs : fs.obs) {
+    const Camera& cam = cams[obs.cam];
+    Pose board_in_cam;
+    if (!cam.posed || !pnp(obs, &board_in_cam))
+      continue;
+
+    Pose cam_to_rig;
+    invert(cam.pose, &cam_to_rig);
+    compose(cam_to_rig, board_in_cam, &fs.board);
+    fs.posed = true;
+    return true;
+  }
+  return false;
+}
+
+void ExtrinsicSolver::place_cameras(const Frameset& fs) {
+  Pose rig_to_board;
+  invert(fs.board, &rig_to_board);
+
+  for (const Observation& obs : fs.obs) {
+    Camera& cam = cams[obs.cam];
+    Pose board_in_cam;
+    if (cam.posed || !pnp(obs, &board_in_cam))
+      continue;
+
+    compose(board_in_cam, rig_to_board, &cam.pose);
+    cam.posed = true;
+    LOG_FMT(
+      INFO,
+      "Camera %u placed from frameset %lu",
+      obs.cam,
+      fs.timestamp
+    );
+  }
+}
+
+void ExtrinsicSolver::index_cameras() {
+  /**
+   * Numbers the cameras being solved for, every placed one that saw a
+   * placed board but camera 0, which fixes the gauge, and builds the
+   * camera pair graph from the framesets they saw the board together in
+   */
+  std::vector<char> seen(num_cameras, 0);
+  for (const Frameset& fs : framesets) {
+    if (!fs.posed)
+      continue;
+    for (const Observation& obs : fs.obs)
+      seen[obs.cam] = 1;
+  }
+
+  free_idx.assign(num_cameras, -1);
+  int32_t next = 0;
+  for (size_t i = 1; i < num_cameras; i++) {
+    if (cams[i].posed && seen[i])
+      free_idx[i] = next++;
+  }
+
+  pair_idx.assign(num_cameras * num_cameras, -1);
+  pairs.clear();
+  for (const Frameset& fs : framesets) {
+    if (!fs.posed)
+      continue;
+    for (const Observation& a : fs.obs) {
+      for (const Observation& b : fs.obs) {
+        if (free_idx[a.cam] < 0 || free_idx[b.cam] < 0 || a.cam >= b.cam)
+          continue;
+        int32_t& idx = pair_idx[a.cam * num_cameras + b.cam];
+        if (idx < 0) {
+          idx = pairs.size();
+          pairs.emplace_back(a.cam, b.cam);
+        }
+      }
+    }
+  }
+}
+
+double ExtrinsicSolver::cost(
+  const std::vector<Pose>& cam_poses,
+  const std::vector<Pose>& board_poses,
+  double* sq_sum,
+  size_t* points
+) const {
+  /**
+   * Robust cost of a candidate solution, over every placed frameset
+   * and camera
+   *
+   * Parameters:
+   *   cam_poses: Per camera
+   *   board_poses: Per frameset
+   *   sq_sum: Sum of the squared residuals, in pixels
+   *   points: Residuals summed
+   */
+  double total = 0.0;
+  *sq_sum = 0.0;
+  *points = 0;
+
+  for (size_t k = 0; k < framesets.size(); k++) {
+    const Frameset& fs = framesets[k];
+    if (!fs.posed)
+      continue;
+
+    for (const Observation& obs : fs.obs) {
+      const Camera& cam = cams[obs.cam];
+      if (!cam.posed)
+        continue;
+
+      for (size_t i = 0; i < board_points.size(); i++) {
+        double x[3] = {board_points[i].x, board_points[i].y, board_points[i].z};
+        double q[3];
+        double p[3];
+        transform(board_poses[k], x, q);
+        transform(cam_poses[obs.cam], q, p);
+
+        double n = BEHIND_CAMERA_PX;
+        if (p[2] > 1e-6) {
+          double rx = cam.focal * (p[0] / p[2] - obs.points[i].x);
+          double ry = cam.focal * (p[1] / p[2] - obs.points[i].y);
+          n = std::sqrt(rx * rx + ry * ry);
+        }
+
+        total += huber(n);
+        *sq_sum += n * n;
+        (*points)++;
+      }
+    }
+  }
+
+  return total;
+}
+
+double ExtrinsicSolver::iterate() {
+  /**
+   * One Levenberg-Marquardt step, with the board poses eliminated
+   * through the Schur complement
+   *
+   * The normal equations are
+   *
+   *   | U   W | | dc |     | gc |
+   *   | W^T V | | db | = - | gb |
+   *
+   * with V block diagonal, one 6 x 6 block per frameset, so
+   *
+   *   (U - W V^-1 W^T) dc = -(gc - W V^-1 gb)
+   *   db = V^-1 (-gb - W^T dc)
+   *
+   * where every frameset adds W_a V^-1 W_b^T to the blocks of each
+   * pair of cameras a, b that saw it, and nothing anywhere else.
+   *
+   * Returns:
+   *   The relative cost reduction of the step, 0 if it was rejected,
+   *   negative if there's nothing to solve
+   */
+  index_cameras();
+
+  size_t m = 0;
+  for (int32_t idx : free_idx)
+    m += idx >= 0;
+  size_t n = 6 * m;
+
+  std::vector<Block> u(m, Block{});
+  std::vector<Block> diag(m, Block{}); // the Schur complement's share of the diagonal blocks
+  std::vector<Block> edges(pairs.size(), Block{});
+  std::vector<double> rhs(n, 0.0);
+
+  // kept for back substitution
+  std::vector<Block> v_inv(framesets.size());
+  std::vector<std::array<double, 6>> gb(framesets.size());
+  std::vector<std::vector<Block>> w(framesets.size());
+  std::vector<char> solved(framesets.size(), 0);
+
+  double old_cost = 0.0;
+
+  for (size_t k = 0; k < framesets.size(); k++) {
+    const Frameset& fs = framesets[k];
+    if (!fs.posed)
+      continue;
+
+    Block v{};
+    std::array<double, 6>& g = gb[k];
+    g.fill(0.0);
+    w[k].assign(fs.obs.size(), Block{});
+
+    for (size_t o = 0; o < fs.obs.size(); o++) {
+      const Observation& obs = fs.obs[o];
+      const Camera& cam = cams[obs.cam];
+      if (!cam.posed)
+        continue;
+      int32_t fi = free_idx[obs.cam];
+
+      for (size_t i = 0; i < board_points.size(); i++) {
+        double x[3] = {board_points[i].x, board_points[i].y, board_points[i].z};
+        double q[3];
+        double p[3];
+        transform(fs.board, x, q);
+        transform(cam.pose, q, p);
+
+        if (p[2] <= 1e-6) {
+          old_cost += huber(BEHIND_CAMERA_PX);
+          continue;
+        }
+
+        double inv_z = 1.0 / p[2];
+        double px = p[0] * inv_z;
+        double py = p[1] * inv_z;
+        double r[2] = {
+          cam.focal * (px - obs.points[i].x),
+          cam.focal * (py - obs.points[i].y)
+        };
+        double norm = std::sqrt(r[0] * r[0] + r[1] * r[1]);
+        double weight = norm <= HUBER_PX ? 1.0 : HUBER_PX / norm;
+        old_cost += huber(norm);
+
+        double proj[6] = {
+          cam.focal * inv_z, 0.0, -cam.focal * px * inv_z,
+          0.0, cam.focal * inv_z, -cam.focal * py * inv_z
+        };
+
+        // the board moves q in the rig frame, which reaches the image through the camera's rotation
+        double proj_rig[6];
+        for (int row = 0; row < 2; row++)
+          for (int col = 0; col < 3; col++)
+            proj_rig[row * 3 + col] =
+              proj[row * 3] * cam.pose.r[col] +
+              proj[row * 3 + 1] * cam.pose.r[3 + col] +
+              proj[row * 3 + 2] * cam.pose.r[6 + col];
+
+        double jb[12];
+        point_jacobian(q, proj_rig, jb);
+        add_jtj(jb, jb, weight, v.data());
+        add_jtr(jb, r, weight, g.data());
+
+        if (fi < 0)
+          continue;
+
+        double jc[12];
+        point_jacobian(p, proj, jc);
+        add_jtj(jc, jc, weight, u[fi].data());
+        add_jtr(jc, r, weight, &rhs[fi * 6]);
+        add_jtj(jc, jb, weight, w[k][o].data());
+      }
+    }
+
+    for (int d = 0; d < 6; d++)
+      v[d * 6 + d] *= 1.0 + lambda;
+    if (!invert6(v, &v_inv[k]))
+      continue;
+    solved[k] = 1;
+
+    // fold this board into the cameras that saw it
+    for (size_t a = 0; a < fs.obs.size(); a++) {
+      uint32_t cam_a = fs.obs[a].cam;
+      int32_t fa = free_idx[cam_a];
+      if (fa < 0)
+        continue;
+
+      Block t{}; // W_a V^-1
+      for (int i = 0; i < 6; i++)
+        for (int j = 0; j < 6; j++)
+          for (int l = 0; l < 6; l++)
+            t[i * 6 + j] += w[k][a][i * 6 + l] * v_inv[k][l * 6 + j];
+
+      for (int i = 0; i < 6; i++)
+        for (int l = 0; l < 6; l++)
+          rhs[fa * 6 + i] -= t[i * 6 + l] * g[l];
+
+      for (size_t b = 0; b < fs.obs.size(); b++) {
+        uint32_t cam_b = fs.obs[b].cam;
+        int32_t fb = free_idx[cam_b];
+        if (fb < 0 || cam_b < cam_a)
+          continue;
+
+        Block& dst = cam_a == cam_b ? diag[fa] : edges[pair_idx[cam_a * num_cameras + cam_b]];
+        for (int i = 0; i < 6; i++)
+          for (int j = 0; j < 6; j++)
+            for (int l = 0; l < 6; l++)
+              dst[i * 6 + j] -= t[i * 6 + l] * w[k][b][j * 6 + l];
+      }
+    }
+  }
+
+  if (old_cost == 0.0)
+    return -1.0;
+
+  // the reduced camera system, assembled from the pair graph
+  std::vector<double> dc(n, 0.0);
+  if (m > 0) {
+    std::vector<double> s(n * n, 0.0);
+    for (size_t a = 0; a < m; a++) {
+      for (int i = 0; i < 6; i++) {
+        for (int j = 0; j < 6; j++) {
+          double uij = u[a][i * 6 + j];
+          if (i == j)
+            uij *= 1.0 + lambda;
+          s[(a * 6 + i) * n + a * 6 + j] = uij + diag[a][i * 6 + j];
+        }
+      }
+    }
+    for (size_t e = 0; e < pairs.size(); e++) {
+      size_t a = free_idx[pairs[e].first];
+      size_t b = free_idx[pairs[e].second];
+      for (int i = 0; i < 6; i++) {
+        for (int j = 0; j < 6; j++) {
+          s[(a * 6 + i) * n + b * 6 + j] = edges[e][i * 6 + j];
+          s[(b * 6 + j) * n + a * 6 + i] = edges[e][i * 6 + j];
+        }
+      }
+    }
+
+    if (!cholesky(s.data(), n)) {
+      lambda = std::min(lambda * 10.0, LAMBDA_MAX);
+      return 0.0;
+    }
+    for (size_t i = 0; i < n; i++)
+      dc[i] = -rhs[i];
+    cholesky_solve(s.data(), n, dc.data());
+  }
+
+  std::vector<Pose> cam_poses(num_cameras);
+  for (size_t i = 0; i < num_cameras; i++) {
+    int32_t fi = free_idx[i];
+    if (fi < 0)
+      cam_poses[i] = cams[i].pose;
+    else
+      apply_update(cams[i].pose, &dc[fi * 6], &cam_poses[i]);
+  }
+
+  std::vector<Pose> board_poses(framesets.size());
+  for (size_t k = 0; k < framesets.size(); k++) {
+    const Frameset& fs = framesets[k];
+    board_poses[k] = fs.board;
+    if (!solved[k])
+      continue;
+
+    // db = V^-1 (-gb - W^T dc)
+    double b[6];
+    for (int i = 0; i < 6; i++)
+      b[i] = -gb[k][i];
+    for (size_t o = 0; o < fs.obs.size(); o++) {
+      int32_t fi = free_idx[fs.obs[o].cam];
+      if (fi < 0)
+        continue;
+      for (int i = 0; i < 6; i++)
+        for (int l = 0; l < 6; l++)
+          b[i] -= w[k][o][l * 6 + i] * dc[fi * 6 + l];
+    }
+
+    double db[6] = {0.0, 0.0, 0.0, 0.0, 0.0, 0.0};
+    for (int i = 0; i < 6; i++)
+      for (int l = 0; l < 6; l++)
+        db[i] += v_inv[k][i * 6 + l] * b[l];
+    apply_update(fs.board, db, &board_poses[k]);
+  }
+
+  double sq_sum = 0.0;
+  size_t points = 0;
+  double new_cost = cost(cam_poses, board_poses, &sq_sum, &points);
+  if (new_cost >= old_cost) {
+    lambda = std::min(lambda * 10.0, LAMBDA_MAX);
+    return 0.0;
+  }
+
+  for (size_t i = 0; i < num_cameras; i++)
+    cams[i].pose = cam_poses[i];
+  for (size_t k = 0; k < framesets.size(); k++)
+    framesets[k].board = board_poses[k];
+  lambda = std::max(lambda / 10.0, LAMBDA_MIN);
+
+  return (old_cost - new_cost) / old_cost;
+}
+
+void ExtrinsicSolver::publish() {
+  // the costs are computed outside the lock, add_frameset shouldn't wait on them
+  std::vector<Pose> cam_poses;
+  std::vector<Pose> board_poses;
+  for (const Camera& cam : cams)
+    cam_poses.push_back(cam.pose);
+  for (const Frameset& fs : framesets)
+    board_poses.push_back(fs.board);
+
+  double sq_sum = 0.0;
+  size_t points = 0;
+  cost(cam_poses, board_poses, &sq_sum, &points);
+
+  std::lock_guard<std::mutex> lock(mutex);
+  for (size_t i = 0; i < num_cameras; i++) {
+    memcpy(poses[i].rotation, cams[i].pose.r, sizeof(poses[i].rotation));
+    memcpy(poses[i].translation, cams[i].pose.t, sizeof(poses[i].translation));
+    placed[i] = cams[i].posed;
+  }
+  rms = points ? std::sqrt(sq_sum / points) : 0.0;
+}
+
+bool ExtrinsicSolver::pose(size_t cam, CameraPose* out) {
+  /**
+   * Copies out a camera's pose as of the last published solve
+   *
+   * Returns:
+   *   False if the camera hasn't been placed yet
+   */
+  std::lock_guard<std::mutex> lock(mutex);
+  if (!placed[cam])
+    return false;
+  *out = poses[cam];
+  return true;
+}
+
+double ExtrinsicSolver::reprojection_rms() {
+  std::lock_guard<std::mutex> lock(mutex);
+  return rms;
+}
+
+void ExtrinsicSolver::log_progress() {
+  std::lock_guard<std::mutex> lock(mutex);
+  size_t count = std::count(placed.begin(), placed.end(), true);
+  LOG_FMT(
+    INFO,
+    "Extrinsics: %zu framesets, %zu of %zu cameras placed, rms %.3f px",
+    accepted,
+    count,
+    num_cameras,
+    rms
+  );
+}
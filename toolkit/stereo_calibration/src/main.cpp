@@ -0,0 +1,196 @@
+#include <errno.h>
+#include <iostream>
+#include <opencv2/core.hpp>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#include "calib_file.h"
+#include "chessboard.h"
+#include "extrinsic_solver.h"
+#include "logging.h"
+#include "rig_config.h"
+#include "session_reader.h"
+#include "stream_controller.h"
+
+#define LOG_PATH "/var/log/mocap-toolkit/stereo_calibration.log"
+
+#define DEFAULT_SQUARE_MM 25.0
+#define PROGRESS_INTERVAL_NS 2000000000ull
+
+static volatile sig_atomic_t running = 1;
+
+static void stop_handler(int signum) {
+  (void)signum;
+  running = 0;
+}
+
+static uint64_t monotonic_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void detect(const cv::Mat* frames, std::vector<std::vector<cv::Point2f>>& corners) {
+  // every camera's board in parallel, the slowest one sets the pace
+  cv::parallel_for_(cv::Range(0, (int)corners.size()), [&](const cv::Range& range) {
+    for (int i = range.start; i < range.end; i++) {
+      corners[i].clear();
+      if (!frames[i].empty() && !detect_chessboard(frames[i], &corners[i]))
+        corners[i].clear();
+    }
+  });
+}
+
+static void save(ExtrinsicSolver& solver, std::vector<calib_camera>& calib) {
+  /**
+   * Prints each camera's pose and writes the placed ones into the
+   * rig's calibration file
+   */
+  double rms = solver.reprojection_rms();
+  LOG_FMT(INFO, "Final extrinsics rms %.3f px", rms);
+  std::cout << "Reprojection rms " << rms << " px\n";
+
+  for (size_t i = 0; i < calib.size(); i++) {
+    CameraPose pose;
+    calib_camera& cam = calib[i];
+    if (!solver.pose(i, &pose)) {
+      LOG_FMT(WARNING, "Camera %zu never shared a view of the board with a placed camera", i);
+      std::cout << "Camera " << i << ": not placed\n";
+      cam.flags &= ~CALIB_EXTRINSICS;
+      continue;
+    }
+
+    std::cout << "Camera " << i << ": translation "
+              << pose.translation[0] << " "
+              << pose.translation[1] << " "
+              << pose.translation[2] << " m\n";
+
+    memcpy(cam.rotation, pose.rotation, sizeof(cam.rotation));
+    memcpy(cam.translation, pose.translation, sizeof(cam.translation));
+    cam.extrinsics_rms = rms;
+    cam.flags |= CALIB_EXTRINSICS;
+  }
+
+  CalibrationFile::save(CALIB_PATH, calib);
+}
+
+int main(int argc, char* argv[]) {
+  int ret = 0;
+
+  // -s <mm> is the side of a printed board square,
+  // stereo_calibration <recording_dir> reads a recording instead of the live cameras
+  double square_mm = DEFAULT_SQUARE_MM;
+  int opt;
+  while ((opt = getopt(argc, argv, "s:")) != -1) {
+    switch (opt) {
+      case 's':
+        square_mm = atof(optarg);
+        break;
+      default:
+        std::cout << "Usage: " << argv[0] << " [-s square_mm] [recording_dir]\n";
+        return -EINVAL;
+    }
+  }
+  if (square_mm <= 0.0) {
+    std::cout << "-s needs a positive square size in millimeters\n";
+    return -EINVAL;
+  }
+  const char* recording = optind < argc ? argv[optind] : nullptr;
+
+  ret = setup_logging(LOG_PATH);
+  if (ret) {
+    std::cout << "Error opening log file: " << strerror(errno) << "\n";
+    return -errno;
+  }
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = stop_handler;
+  sigaction(SIGINT, &sa, nullptr);
+  sigaction(SIGTERM, &sa, nullptr);
+
+  RigConfig rig;
+  size_t num_cameras = rig.num_cameras();
+
+  std::vector<calib_camera> calib = CalibrationFile::load(CALIB_PATH, num_cameras);
+  ExtrinsicSolver solver(calib, square_mm / 1000.0);
+
+  // recordings hold the main stream, the live framesets the stream
+  // the server decodes, and the intrinsics only hold at the resolution
+  // they were solved at
+  for (size_t i = 0; i < num_cameras; i++) {
+    const cam_conf& conf = rig.camera(i);
+    uint32_t width = recording ? conf.width : conf.live_width;
+    uint32_t height = recording ? conf.height : conf.live_height;
+    if ((calib[i].flags & CALIB_INTRINSICS) && (calib[i].width != width || calib[i].height != height)) {
+      LOG_FMT(
+        WARNING,
+        "Camera %zu intrinsics are for %ux%u frames, not %ux%u",
+        i,
+        calib[i].width,
+        calib[i].height,
+        width,
+        height
+      );
+    }
+  }
+
+  std::vector<cv::Mat> frames(num_cameras);
+  std::vector<std::vector<cv::Point2f>> corners(num_cameras);
+  uint64_t timestamp;
+  uint64_t last_progress = monotonic_ns();
+
+  if (recording) {
+    SessionReader reader = SessionReader(
+      recording,
+      0,
+      0,
+      num_cameras
+    );
+
+    while (running && reader.recv_frameset(frames.data(), &timestamp)) {
+      if (!solver.wants_frameset(timestamp))
+        continue;
+      detect(frames.data(), corners);
+      solver.add_frameset(timestamp, corners);
+
+      uint64_t now = monotonic_ns();
+      if (now - last_progress >= PROGRESS_INTERVAL_NS) {
+        solver.log_progress();
+        last_progress = now;
+      }
+    }
+  } else {
+    StreamController stream_ctlr = StreamController(
+      0,
+      0,
+      num_cameras
+    );
+
+    // runs until interrupted, once the logged rms stops improving
+    while (running) {
+      stream_ctlr.recv_frameset(frames.data(), &timestamp);
+      if (!solver.wants_frameset(timestamp))
+        continue;
+      detect(frames.data(), corners);
+      solver.add_frameset(timestamp, corners);
+
+      uint64_t now = monotonic_ns();
+      if (now - last_progress >= PROGRESS_INTERVAL_NS) {
+        solver.log_progress();
+        last_progress = now;
+      }
+    }
+  }
+
+  solver.finish();
+  solver.log_progress();
+  save(solver, calib);
+
+  cleanup_logging();
+  return 0;
+}
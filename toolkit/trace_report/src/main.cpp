@@ -0,0 +1,189 @@
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "trace.h"
+
+/**
+ * Summarizes trace files dumped by builds made with TRACE=1.
+ *
+ * Usage: trace_report [--chrome out.json] [<cam>:]<trace file>...
+ *
+ * The server and consumer traces know each camera's index, picam
+ * traces don't, so each picam trace is given as index:path, with
+ * the index of the camera in cams.yaml.
+ *
+ * For every camera and stage, the latency from the frame's scheduled
+ * capture timestamp to the stage completing is reported at p50, p99
+ * and p99.9, so the TRACE_CONSUMED row is the glass to consumer
+ * latency. With --chrome the points are also written as a Chrome
+ * trace, loadable in chrome://tracing or Perfetto, with a process
+ * per camera and a thread per traced thread.
+ */
+
+static const char* stage_names[TRACE_STAGES] = {
+  "captured",
+  "encoded",
+  "sent",
+  "received",
+  "decoded",
+  "transferred",
+  "assembled",
+  "consumed"
+};
+
+static bool load_trace(
+  const std::string& path,
+  int cam_override,
+  std::vector<trace_rec>& recs
+) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    std::cerr << "Could not open " << path << "\n";
+    return false;
+  }
+
+  trace_file_header header;
+  file.read(reinterpret_cast<char*>(&header), sizeof(header));
+  if (!file || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0) {
+    std::cerr << path << " is not a trace file\n";
+    return false;
+  }
+  if (header.version != TRACE_VERSION) {
+    std::cerr << path << " has trace version " << header.version
+              << ", expected " << TRACE_VERSION << "\n";
+    return false;
+  }
+
+  size_t start = recs.size();
+  recs.resize(start + header.rec_count);
+  file.read(
+    reinterpret_cast<char*>(recs.data() + start),
+    header.rec_count * sizeof(trace_rec)
+  );
+  if (!file) {
+    std::cerr << path << " is truncated\n";
+    return false;
+  }
+
+  for (size_t i = start; i < recs.size(); i++) {
+    if (cam_override >= 0)
+      recs[i].cam = cam_override;
+    else if (recs[i].cam == TRACE_CAM_UNKNOWN) {
+      std::cerr << path << " has points without a camera, pass it as <cam>:" << path << "\n";
+      return false;
+    }
+  }
+
+  return true;
+}
+
+static uint64_t percentile(const std::vector<uint64_t>& sorted, double p) {
+  size_t idx = (size_t)(p * (sorted.size() - 1) + 0.5);
+  return sorted[idx];
+}
+
+static bool write_chrome_trace(const std::string& path, const std::vector<trace_rec>& recs) {
+  std::ofstream out(path);
+  if (!out)
+    return false;
+
+  out << "{\"traceEvents\":[\n";
+  for (size_t i = 0; i < recs.size(); i++) {
+    const trace_rec& rec = recs[i];
+    char event[256];
+    snprintf(
+      event,
+      sizeof(event),
+      "{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":%u,\"tid\":%u,"
+      "\"args\":{\"frame_ts\":%lu,\"latency_us\":%.3f}}%s\n",
+      stage_names[rec.stage],
+      rec.ns / 1000.0,
+      rec.cam,
+      rec.tid,
+      rec.frame_ts,
+      ((int64_t)rec.ns - (int64_t)rec.frame_ts) / 1000.0,
+      i + 1 < recs.size() ? "," : ""
+    );
+    out << event;
+  }
+  out << "]}\n";
+
+  return (bool)out;
+}
+
+int main(int argc, char** argv) {
+  std::vector<trace_rec> recs;
+  std::string chrome_path;
+
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--chrome") {
+      if (++i == argc) {
+        std::cerr << "--chrome needs an output path\n";
+        return EXIT_FAILURE;
+      }
+      chrome_path = argv[i];
+      continue;
+    }
+
+    int cam = -1;
+    size_t sep = arg.find(':');
+    if (sep != std::string::npos && sep > 0 &&
+        arg.find_first_not_of("0123456789") == sep) {
+      cam = std::stoi(arg.substr(0, sep));
+      arg = arg.substr(sep + 1);
+    }
+
+    if (!load_trace(arg, cam, recs))
+      return EXIT_FAILURE;
+  }
+
+  if (recs.empty()) {
+    std::cerr << "Usage: trace_report [--chrome out.json] [<cam>:]<trace file>...\n";
+    return EXIT_FAILURE;
+  }
+
+  // latencies from the scheduled capture, per camera and stage
+  std::map<uint16_t, std::array<std::vector<uint64_t>, TRACE_STAGES>> latencies;
+  for (const trace_rec& rec : recs) {
+    if (rec.stage >= TRACE_STAGES || rec.ns < rec.frame_ts)
+      continue; // clocks out of step, or a corrupt point
+    latencies[rec.cam][rec.stage].push_back(rec.ns - rec.frame_ts);
+  }
+
+  for (auto& [cam, stages] : latencies) {
+    printf("cam %u\n", cam);
+    printf("  %-12s %10s %10s %10s %10s\n", "stage", "frames", "p50 us", "p99 us", "p99.9 us");
+    for (int stage = 0; stage < TRACE_STAGES; stage++) {
+      std::vector<uint64_t>& samples = stages[stage];
+      if (samples.empty())
+        continue;
+
+      std::sort(samples.begin(), samples.end());
+      printf(
+        "  %-12s %10zu %10.1f %10.1f %10.1f\n",
+        stage_names[stage],
+        samples.size(),
+        percentile(samples, 0.5) / 1000.0,
+        percentile(samples, 0.99) / 1000.0,
+        percentile(samples, 0.999) / 1000.0
+      );
+    }
+  }
+
+  if (!chrome_path.empty() && !write_chrome_trace(chrome_path, recs)) {
+    std::cerr << "Could not write " << chrome_path << "\n";
+    return EXIT_FAILURE;
+  }
+
+  return 0;
+}